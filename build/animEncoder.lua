@@ -0,0 +1,297 @@
+--[[**
+Encodes a sequence of frames into the animation format played by
+[bitmap.anim](../modules/bitmap/anim.lua). Used by build.lua for the
+`animations` of a module, for example:
+
+	{ path = "modules/bapple/bapple.lua", native = "modules/bapple/bapple.c",
+		animations = { { path = "modules/bapple/bapple.pbm", name = "bapple_anim", frameInterval = 80 } } },
+
+generates a C file defining `const unsigned char bapple_anim[]` and
+`const int bapple_anim_size`, which the module's native code can wrap in a
+MemBuf.
+
+The frames are read from a single file containing one binary PBM (for one bit
+per pixel animations) or PPM (for RGB565) image after another, which is what
+for example `ffmpeg -i video.mp4 -f image2pipe -vcodec pbm out.pbm` produces.
+In PBMs black is the foreground colour.
+
+Each frame after the first is encoded as the difference from the one before.
+The rows which changed are grouped into bands, each as narrow as it can be, and
+bands are merged until there are few enough to map exactly onto a bitmap's
+invalidated region. Within each band, unchanged pixels are skipped and changed
+ones are run-length encoded, falling back to literal pixels where runs don't
+pay for themselves.
+
+Note this module is also loaded by testing/animTests.lua, under bitmaphost.
+]]
+
+local misc
+if not pcall(function() misc = require("misc") end) then
+	misc = require("modules/misc")
+end
+_ENV = misc.fixupEnvIfRunByHostLua(_ENV)
+
+OneBit = 0
+FiveSixFive = 1
+
+local KMagic = "ANIM"
+local KMaxRects = 4 -- Must match KMaxDirtyRects in bitmap.h
+-- Also as per bitmap.c, roughly what an extra rect costs to blit, in pixels
+local KBlitOverheadPixels = 64
+
+local OpSkip = 0
+local OpFill = 1
+local OpLiteral = 2
+local OpFillOne = 3
+
+local function min(a, b) if a < b then return a else return b end end
+local function max(a, b) if a > b then return a else return b end end
+
+local function rgb565(r, g, b, maxval)
+	if maxval ~= 255 then
+		r, g, b = r * 255 // maxval, g * 255 // maxval, b * 255 // maxval
+	end
+	return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)
+end
+
+--[[**
+Parses a string of one or more concatenated binary PBMs or PPMs. Returns an
+array of frames, each an array of `width * height` pixel values row by row,
+with the array also having `width`, `height` and `format` members.
+]]
+function parseNetpbm(data)
+	local pos = 1
+	local function token()
+		while true do
+			pos = data:find("%S", pos) or #data + 1
+			if data:sub(pos, pos) ~= "#" then break end
+			pos = (data:find("\n", pos) or #data) + 1
+		end
+		local tok = data:match("^%S+", pos)
+		assert(tok, "Truncated Netpbm header")
+		pos = pos + #tok
+		return tok
+	end
+
+	local frames = {}
+	while data:find("^%s*P", pos) do
+		local magic = token()
+		local w, h = tonumber(token()), tonumber(token())
+		local format = (magic == "P4") and OneBit or FiveSixFive
+		assert(magic == "P4" or magic == "P6", "Only binary PBMs and PPMs are supported, not "..magic)
+		local maxval = (format == FiveSixFive) and tonumber(token())
+		assert(not maxval or maxval < 256, "16-bit PPMs aren't supported")
+		pos = pos + 1 -- Single whitespace char before the raster
+
+		if #frames == 0 then
+			frames.width, frames.height, frames.format = w, h, format
+		end
+		assert(w == frames.width and h == frames.height and format == frames.format,
+			"All frames must be the same size and type")
+		local frame = {}
+		if format == OneBit then
+			local stride = (w + 7) // 8
+			assert(pos + stride * h - 1 <= #data, "Truncated PBM")
+			for y = 0, h - 1 do
+				local row = pos + y * stride
+				for x = 0, w - 1 do
+					local byte = data:byte(row + (x >> 3))
+					frame[#frame + 1] = (byte >> (7 - (x & 7))) & 1
+				end
+			end
+			pos = pos + stride * h
+		else
+			assert(pos + w * h * 3 - 1 <= #data, "Truncated PPM")
+			for i = pos, pos + w * h * 3 - 1, 3 do
+				local r, g, b = data:byte(i, i + 2)
+				frame[#frame + 1] = rgb565(r, g, b, maxval)
+			end
+			pos = pos + w * h * 3
+		end
+		frames[#frames + 1] = frame
+	end
+	assert(#frames > 0, "No frames found")
+	return frames
+end
+
+--[[**
+Like `parseNetpbm()` but reads from the file at `path`.
+]]
+function readNetpbm(path)
+	local f = assert(io.open(path, "rb"))
+	local data = f:read("a")
+	f:close()
+	return parseNetpbm(data)
+end
+
+local function area(r)
+	return (r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1)
+end
+
+local function union(a, b)
+	return { x0 = min(a.x0, b.x0), x1 = max(a.x1, b.x1), y0 = min(a.y0, b.y0), y1 = max(a.y1, b.y1) }
+end
+
+-- Returns disjoint rects which between them cover every pixel that differs
+local function changedRects(prev, frame, w, h)
+	local bands = {}
+	for y = 0, h - 1 do
+		local x0, x1
+		for x = 0, w - 1 do
+			local i = y * w + x + 1
+			if prev[i] ~= frame[i] then
+				x0 = x0 or x
+				x1 = x
+			end
+		end
+		if x0 then
+			local last = bands[#bands]
+			if last and last.y1 == y - 1 then
+				bands[#bands] = union(last, { x0 = x0, x1 = x1, y0 = y, y1 = y })
+			else
+				bands[#bands + 1] = { x0 = x0, x1 = x1, y0 = y, y1 = y }
+			end
+		end
+	end
+
+	-- Only merge neighbours, so the merged band can't overlap any others
+	while #bands > 1 do
+		local best, bestCost
+		for i = 1, #bands - 1 do
+			local a, b = bands[i], bands[i + 1]
+			local cost = area(union(a, b)) - area(a) - area(b) - KBlitOverheadPixels
+			if not bestCost or cost < bestCost then
+				best, bestCost = i, cost
+			end
+		end
+		if #bands <= KMaxRects and bestCost > 0 then break end
+		bands[best] = union(bands[best], bands[best + 1])
+		table.remove(bands, best + 1)
+	end
+	return bands
+end
+
+local function uleb128(n)
+	local bytes = {}
+	repeat
+		local byte = n & 0x7F
+		n = n >> 7
+		bytes[#bytes + 1] = (n > 0) and (byte | 0x80) or byte
+	until n == 0
+	return string.char(table.unpack(bytes))
+end
+
+local function addOp(out, op, n)
+	if n < 64 then
+		out[#out + 1] = string.char((op << 6) | n)
+	else
+		out[#out + 1] = string.char(op << 6)..uleb128(n)
+	end
+end
+
+local function encodeRect(out, prev, frame, w, r, oneBit)
+	local vals, changed = {}, {}
+	for y = r.y0, r.y1 do
+		for x = r.x0, r.x1 do
+			local i = y * w + x + 1
+			vals[#vals + 1] = frame[i]
+			changed[#changed + 1] = (prev == nil) or (prev[i] ~= frame[i])
+		end
+	end
+	local n = #vals
+
+	-- How far the skippable and same-colour runs go from each pixel
+	local skipRun, fillRun = { [n + 1] = 0 }, { [n + 1] = 0 }
+	for i = n, 1, -1 do
+		skipRun[i] = changed[i] and 0 or skipRun[i + 1] + 1
+		fillRun[i] = (vals[i + 1] == vals[i]) and fillRun[i + 1] + 1 or 1
+	end
+	-- Shorter runs than this are cheaper as part of a literal
+	local minRun = oneBit and 16 or 2
+
+	local i = 1
+	while i <= n do
+		if skipRun[i] >= minRun and skipRun[i] >= fillRun[i] then
+			addOp(out, OpSkip, skipRun[i])
+			i = i + skipRun[i]
+		elseif fillRun[i] >= minRun then
+			local len = fillRun[i]
+			if not oneBit then
+				addOp(out, OpFill, len)
+				out[#out + 1] = string.pack(">I2", vals[i])
+			else
+				addOp(out, vals[i] == 1 and OpFillOne or OpFill, len)
+			end
+			i = i + len
+		else
+			local j = i + 1
+			while j <= n and skipRun[j] < minRun and fillRun[j] < minRun do
+				j = j + 1
+			end
+			addOp(out, OpLiteral, j - i)
+			if oneBit then
+				for k = i, j - 1, 8 do
+					local byte = 0
+					for bit = 0, min(7, j - 1 - k) do
+						byte = byte | (vals[k + bit] << bit)
+					end
+					out[#out + 1] = string.char(byte)
+				end
+			else
+				for k = i, j - 1 do
+					out[#out + 1] = string.pack(">I2", vals[k])
+				end
+			end
+			i = j
+		end
+	end
+end
+
+--[[**
+Encodes `frames` (as returned by `parseNetpbm()`) and returns the result as a
+string. `frameInterval` is in milliseconds.
+]]
+function encode(frames, frameInterval)
+	local w, h = frames.width, frames.height
+	local oneBit = (frames.format == OneBit)
+	assert(#frames < 0x10000, "Too many frames")
+	local out = { string.pack("<c4I2I2I2I2Bxxx", KMagic, w, h, #frames, frameInterval, frames.format) }
+	local prev
+	for _, frame in ipairs(frames) do
+		local rects
+		if prev then
+			rects = changedRects(prev, frame, w, h)
+		else
+			rects = { { x0 = 0, x1 = w - 1, y0 = 0, y1 = h - 1 } }
+		end
+		out[#out + 1] = string.char(#rects)
+		for _, r in ipairs(rects) do
+			out[#out + 1] = string.pack("<I2I2I2I2", r.x0, r.y0, r.x1 - r.x0 + 1, r.y1 - r.y0 + 1)
+			encodeRect(out, prev, frame, w, r, oneBit)
+		end
+		prev = frame
+	end
+	return table.concat(out)
+end
+
+--[[**
+Writes `data` to the file `outPath` as a C array called `name`, along with an
+int `<name>_size`.
+]]
+function writeCSource(data, name, srcPath, outPath)
+	local f = assert(io.open(outPath, "w"))
+	f:write("// Autogenerated by build/animEncoder.lua from "..srcPath.."\n")
+	f:write("const unsigned char "..name.."[] = {\n")
+	for i = 1, #data, 16 do
+		local line = {}
+		for j = i, min(i + 15, #data) do
+			line[#line + 1] = string.format("0x%02X,", data:byte(j))
+		end
+		f:write("\t"..table.concat(line, " ").."\n")
+	end
+	f:write("};\n")
+	f:write("const int "..name.."_size = sizeof("..name..");\n")
+	f:close()
+end
+
+return _ENV
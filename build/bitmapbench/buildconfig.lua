@@ -0,0 +1,26 @@
+-- Host build of the bitmap drawing code plus a benchmark, see testing/bitmapBench.c
+config = {
+	-- userinc goes last so we only pick up lupi/*.h from it and not its libc
+	platOpts = "-O2 -idirafter "..build.qrp("userinc"),
+	machine = { "host" },
+
+	fullyHosted = true,
+	userInclude = "hostuser.h",
+
+	sources = {
+		-- This includes modules/bitmap/bitmap.c
+		{ path = "testing/bitmapBench.c", user = true },
+		{ path = "testing/fakeScreen.c", user = true, copts = { "-D_GNU_SOURCE" } },
+	},
+}
+
+function config.link(stage, config, opts)
+	local quotedObjs = {}
+	for i, obj in ipairs(opts.objs) do
+		quotedObjs[i] = build.qrp(obj)
+	end
+	local out = build.qrp("bin/bitmapbench")
+	local cmd = string.format("gcc -no-pie -o %s %s -lpthread", out, build.join(quotedObjs))
+	local ok = build.exec(cmd)
+	if not ok then error("Link failed!") end
+end
@@ -0,0 +1,44 @@
+#ifndef LUPI_BUILD_HOSTUSER_H
+#define LUPI_BUILD_HOSTUSER_H
+
+// Enough of userinc/stddef.h to compile user code against the host's libc
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef int64_t int64;
+
+typedef uint8_t byte;
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef unsigned int uint;
+typedef uint64_t uint64;
+typedef uintptr_t uintptr;
+
+#define ASSERT_COMPILE(x) extern int __compiler_assert(int[(x)?1:-1])
+#define FOURCC(str) ((str[0]<<24)|(str[1]<<16)|(str[2]<<8)|(str[3]))
+
+#define likely(x)				__builtin_expect(!!(x), 1)
+#define unlikely(x)				__builtin_expect(!!(x), 0)
+
+#define ASSERTL(cond, args...) \
+	do { if (!(cond)) { luaL_error(L, "Assertion failure: " #cond args); } } while(0)
+
+#define PRINTL(args...) \
+	do { \
+		int printPos = lua_gettop(L) + 1; \
+		lua_pushfstring(L, args); \
+		lua_getglobal(L, "print"); \
+		lua_insert(L, printPos); \
+		lua_call(L, 1, 0); \
+	} while(0)
+
+#define min(x,y)				((x) < (y) ? (x) : (y))
+#define max(x,y)				((x) > (y) ? (x) : (y))
+
+#endif // LUPI_BUILD_HOSTUSER_H
@@ -0,0 +1,38 @@
+-- Host build of the bitmap module and its Lua bindings, running scripts against
+-- a fake screen driver. See testing/bitmapHost.c
+config = {
+	-- userinc goes last so we only pick up lupi/*.h from it and not its libc
+	platOpts = "-O2 -DLUACONF_FULL_FAT_STDIO -idirafter "..build.qrp("userinc"),
+	machine = { "host" },
+
+	fullyHosted = true,
+	userInclude = "../bitmapbench/hostuser.h",
+
+	sources = {
+		{ path = "testing/bitmapHost.c", user = true },
+		{ path = "testing/fakeScreen.c", user = true, copts = { "-D_GNU_SOURCE" } },
+		{ path = "modules/bitmap/bitmap.c", user = true },
+		{ path = "modules/bitmap/bitmap_lua.c", user = true },
+		{ path = "modules/membuf/membuf.c", user = true },
+		{ path = "modules/profiler/profiler.c", user = true },
+		{ path = "usersrc/int64.c", user = true },
+		{ path = "usersrc/uklua.c", user = true },
+		-- As per luac, so that constants parse the same as on device
+		{ path = "usersrc/strtol.c", user = true },
+	},
+
+	malloc = true,
+	lua = true,
+}
+
+function config.link(stage, config, opts)
+	local quotedObjs = {}
+	for i, obj in ipairs(opts.objs) do
+		quotedObjs[i] = build.qrp(obj)
+	end
+	-- fakeScreen.c needs everything to be below 4GB, so no PIE
+	local out = build.qrp("bin/"..config.name)
+	local cmd = string.format("gcc -no-pie -o %s %s -lpthread -lm", out, build.join(quotedObjs))
+	local ok = build.exec(cmd)
+	if not ok then error("Link failed!") end
+end
@@ -0,0 +1,7 @@
+-- As per bitmaphost, but with all the bitmap module's fast paths turned off so
+-- that everything is drawn a pixel at a time. testing/bitmapGolden.lua must
+-- give the same results under both.
+
+assert(loadfile(build.baseDir.."build/bitmaphost/buildconfig.lua", nil, _ENV))()
+
+config.platOpts = config.platOpts.." -DBITMAP_PER_PIXEL"
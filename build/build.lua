@@ -48,19 +48,26 @@ luaModules = {
 	{ path = "modules/int64.lua", native = "usersrc/int64.c" },
 	{ path = "modules/runloop.lua", native = "usersrc/runloop.c" },
 	{ path = "modules/ipc.lua", native = "usersrc/ipc.c" },
+	{ path = "modules/mailbox.lua", native = "usersrc/mailbox.c" },
 	{ path = "modules/timerserver/init.lua" },
 	{ path = "modules/timerserver/server.lua", native = "modules/timerserver/timers.c" },
 	{ path = "modules/timerserver/local.lua", native = true },
 	"modules/symbolParser.lua",
 	{ path = "modules/bitmap/bitmap.lua", native = "modules/bitmap/bitmap_lua.c" },
 	{ path = "modules/bitmap/transform.lua" },
+	{ path = "modules/bitmap/anim.lua" },
 	{ path = "modules/input/input.lua", native = "modules/input/input.c" },
+	{ path = "modules/compositor/init.lua" },
+	{ path = "modules/compositor/server.lua" },
+	{ path = "modules/profiler/profiler.lua", native = "modules/profiler/profiler.c" },
+	"modules/top.lua",
 	"modules/passwordManager/textui.lua",
 	"modules/passwordManager/gui.lua",
 	"modules/passwordManager/keychain.lua",
 	{ path = "modules/passwordManager/uicontrols.lua", strip = false },
 	{ path = "modules/passwordManager/window.lua", strip = false },
-	{ path = "modules/bapple/bapple.lua", native = "modules/bapple/bapple.c" },
+	{ path = "modules/bapple/bapple.lua", native = "modules/bapple/bapple.c",
+		animations = { { path = "modules/bapple/bapple.pbm", name = "bapple_anim", frameInterval = 80 } } },
 	{ path = "modules/tetris/tetris.lua", native = "modules/tetris/tetris.c", strip = nil },
 	{ path = "modules/flash/flash.lua", native = "modules/flash/flash.c" },
 	"modules/luazero.lua",
@@ -102,7 +109,7 @@ mallocSource = {
 		-- "-DNO_MALLOC_STATS=1", -- Avoids fprintf dep
 		"-DMALLOC_INSPECT_ALL=1",
 		"-DMALLOC_FAILURE_ACTION=", -- no errno
-		"-DUSE_LOCKS=1",
+		"-DUSE_LOCKS=2", -- Using lupi/sync.h, see usersrc/malloc.c
 	},
 	enabled = useMalloc,
 }
@@ -137,6 +144,8 @@ kernelSources = {
 	"k/ringbuf.c",
 	"k/uart_common.c",
 	"k/driver_common.c",
+	"k/trace.c",
+	"k/profiler.c",
 	{ path = "usersrc/memcpy_arm.S", user = true, enabled = armOnly },
 	{ path = "usersrc/memcmp_arm.S", user = true, enabled = armOnly },
 	{ path = "usersrc/memcpy_thumb2.c", user = true, enabled = armv7mOnly },
@@ -147,6 +156,7 @@ kernelSources = {
 	{ path = "modules/bitmap/bitmap.c", user = true, enabled = modulesPresent },
 	{ path = "usersrc/ulua.c", user = true, enabled = uluaPresent },
 	{ path = "usersrc/uexec.c", user = true },
+	{ path = "usersrc/sync.c", user = true },
 	mallocSource,
 	{ path = "usersrc/uluaHeap.c", user = true, enabled = useUluaHeap },
 	{ path = "usersrc/kluaHeap.c", user = true, enabled = kluaPresent },
@@ -161,6 +171,14 @@ bootMenuModules = {
 	"modules/bitmap/tests.lua",
 	{ path = "modules/test/memTests.lua", native = "testing/memTests.c" },
 	"modules/test/emptyModule.lua",
+	"modules/test/pingpong.lua",
+	"modules/test/pingserver.lua",
+	{ path = "modules/test/syncTests.lua", native = "testing/syncTests.c" },
+	"modules/test/mailboxTests.lua",
+	"modules/test/busy.lua",
+	"modules/test/profilerTests.lua",
+	"modules/test/latencyTests.lua",
+	"modules/test/compositorTests.lua",
 }
 
 if _VERSION ~= "Lua 5.3" then
@@ -798,6 +816,10 @@ function build_kernel()
 			if type(module) == "table" and type(module.native) == "string" then
 				table.insert(sources, { path = module.native, user = true, copts = module.copts })
 			end
+			-- And the animations they embed
+			for _, anim in ipairs(type(module) == "table" and module.animations or {}) do
+				table.insert(sources, { path = generateAnimationSource(anim), user = true })
+			end
 		end
 	end
 	if debugSchedulingEntryPoint then
@@ -949,6 +971,20 @@ function addBootMenuSources(sources, modules)
 	end
 end
 
+-- Encodes the frames of anim into a C file, see build/animEncoder.lua
+function generateAnimationSource(anim)
+	local encoder = require("build/animEncoder")
+	local frames = encoder.readNetpbm(baseDir..anim.path)
+	local data = encoder.encode(frames, anim.frameInterval)
+	local outName = objForSrc(anim.path, ".anim.c")
+	mkdir(removeLastPathComponent(outName))
+	encoder.writeCSource(data, anim.name, anim.path, baseDir..outName)
+	if verbose then
+		print(string.format("Encoded %d frames of %s into %d bytes", #frames, anim.path, #data))
+	end
+	return outName
+end
+
 function generateLuaModulesSource()
 	local dirs = calculateUniqueDirsFromSources("bin/obj-"..config.name.."/", luaModules)
 	for dir, _ in pairs(dirs) do
@@ -1146,11 +1182,22 @@ syntaxText = [[
     Supported targets:
         clean   Removes all built products.
         pi      Build for the Raspberry Pi.
+        pifb    Build for the Raspberry Pi, displaying on HDMI rather than
+                on a PiTFT.
         tilda   Build for the TiLDA MkE 0.33
         hosted  Build a subset of the code as a native executable (unsupported,
                 often in a state of brokenness).
         luac    Builds the luac compiler, must have been run to use the
                 --modules option.
+        bitmapbench
+                Builds bin/bitmapbench, a host benchmark of the bitmap
+                drawing primitives.
+        bitmaphost
+                Builds bin/bitmaphost, which runs Lua scripts using the bitmap
+                module against a fake screen. See testing/bitmapHost.c.
+        bitmaphostref
+                As bitmaphost, but builds bin/bitmaphostref with the bitmap
+                module drawing everything a pixel at a time.
         doc     Generates the HTML documentation.
 ]]
 
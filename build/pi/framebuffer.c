@@ -0,0 +1,246 @@
+// The GPU's framebuffer, ie whatever is plugged into the HDMI (or composite)
+// output. It's allocated at boot by asking the VideoCore firmware via the
+// mailbox property interface, and from then on it's just memory.
+
+#include <k.h>
+#include ARCH_HEADER
+#include <mmu.h>
+#include <pageAllocator.h>
+#include <exec.h>
+#include <err.h>
+
+// Used when the firmware doesn't know what's attached (QEMU reports 0x0)
+#define DEFAULT_WIDTH	640
+#define DEFAULT_HEIGHT	480
+// The buffer can start anywhere in the first section of KFramebufferBase
+#define MAX_BUFFER_SIZE	(KFramebufferMaxSize - 0x00100000)
+
+// See https://github.com/raspberrypi/firmware/wiki/Mailboxes
+#define MBOX0_READ				(KPeripheralBase + 0xB880)
+#define MBOX0_STATUS			(KPeripheralBase + 0xB898)
+#define MBOX1_WRITE				(KPeripheralBase + 0xB8A0)
+#define MBOX1_STATUS			(KPeripheralBase + 0xB8B8)
+#define MBOX_FULL				0x80000000
+#define MBOX_EMPTY				0x40000000
+#define MBOX_CHANNEL_PROPERTY	8
+
+// See https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+#define PROP_REQUEST			0
+#define PROP_RESPONSE_OK		0x80000000
+#define TAG_ALLOCATE_BUFFER		0x00040001
+#define TAG_GET_PHYSICAL_SIZE	0x00040003
+#define TAG_GET_PITCH			0x00040008
+#define TAG_SET_PHYSICAL_SIZE	0x00048003
+#define TAG_SET_VIRTUAL_SIZE	0x00048004
+#define TAG_SET_DEPTH			0x00048005
+#define TAG_SET_PIXEL_ORDER		0x00048006
+#define TAG_END					0
+#define PIXEL_ORDER_RGB			1
+
+// The GPU sees ARM RAM through its L2 cache alias, and hands back addresses in
+// the same form
+#define PhysToBus(addr)			((addr) | 0x40000000)
+#define BusToPhys(addr)			((addr) & 0x3FFFFFFF)
+
+static DRIVER_FN(fb_handleSvc);
+static void fill(int x, int y, int w, int h, uint16 colour);
+
+/*
+Sends the property message `msg` (whose physical address is `msgPhys`) and waits
+for the reply, which the firmware writes over the top of it. Returns true if
+the firmware understood all of it.
+*/
+static bool mailbox_call(volatile uint32* msg, uintptr msgPhys) {
+	const uint32 val = PhysToBus(msgPhys) | MBOX_CHANNEL_PROPERTY;
+	uint32 zero = 0;
+	DSB_inline(zero); // msg must be in RAM before the GPU goes looking for it
+	while (GET32(MBOX1_STATUS) & MBOX_FULL) {}
+	PUT32(MBOX1_WRITE, val);
+	for (;;) {
+		while (GET32(MBOX0_STATUS) & MBOX_EMPTY) {}
+		// Anything else is a reply to someone else (ie the firmware's own chatter)
+		if (GET32(MBOX0_READ) == val) break;
+	}
+	DSB_inline(zero);
+	return msg[1] == PROP_RESPONSE_OK;
+}
+
+void screen_init() {
+	// The mailbox needs a 16-byte aligned message in memory the GPU can see. The
+	// blit buffer page is uncached kernel memory and we've no other use for it.
+	const uintptr msgPhys = mmu_mapPageInSection(Al, (uint32*)KSectionZeroPt, KBlitBufferAddress, KPageSect0);
+	mmu_finishedUpdatingPageTables();
+	volatile uint32* msg = (volatile uint32*)KBlitBufferAddress;
+
+	// What's the display's native resolution?
+	int i = 0;
+	msg[i++] = 0; // Size, filled in below
+	msg[i++] = PROP_REQUEST;
+	msg[i++] = TAG_GET_PHYSICAL_SIZE; msg[i++] = 8; msg[i++] = 0; msg[i++] = 0; msg[i++] = 0;
+	msg[i++] = TAG_END;
+	msg[0] = i * sizeof(uint32);
+	uint32 width = 0, height = 0;
+	if (mailbox_call(msg, msgPhys)) {
+		width = msg[5];
+		height = msg[6];
+	}
+	if (width == 0 || height == 0 || width * height * 2 > MAX_BUFFER_SIZE) {
+		width = DEFAULT_WIDTH;
+		height = DEFAULT_HEIGHT;
+	}
+
+	// Now ask for a 16bpp framebuffer of that size
+	i = 0;
+	msg[i++] = 0;
+	msg[i++] = PROP_REQUEST;
+	msg[i++] = TAG_SET_PHYSICAL_SIZE; msg[i++] = 8; msg[i++] = 8; msg[i++] = width; msg[i++] = height;
+	msg[i++] = TAG_SET_VIRTUAL_SIZE; msg[i++] = 8; msg[i++] = 8; msg[i++] = width; msg[i++] = height;
+	msg[i++] = TAG_SET_DEPTH; msg[i++] = 4; msg[i++] = 4; msg[i++] = 16;
+	msg[i++] = TAG_SET_PIXEL_ORDER; msg[i++] = 4; msg[i++] = 4; msg[i++] = PIXEL_ORDER_RGB;
+	const int allocIdx = i;
+	msg[i++] = TAG_ALLOCATE_BUFFER; msg[i++] = 8; msg[i++] = 4; msg[i++] = 16; msg[i++] = 0;
+	const int pitchIdx = i;
+	msg[i++] = TAG_GET_PITCH; msg[i++] = 4; msg[i++] = 0; msg[i++] = 0;
+	msg[i++] = TAG_END;
+	msg[0] = i * sizeof(uint32);
+	const bool ok = mailbox_call(msg, msgPhys);
+	const uintptr fbPhys = BusToPhys(msg[allocIdx + 3]);
+	const uint32 fbSize = msg[allocIdx + 4];
+	const uint32 pitch = msg[pitchIdx + 3];
+	if (!ok || !fbPhys || pitch < width * 2 || fbSize < pitch * height || fbSize > MAX_BUFFER_SIZE) {
+		printk("Failed to allocate a framebuffer (%X %X %d)\n", msg[1], (uint)fbPhys, (int)fbSize);
+		return;
+	}
+
+	SuperPage* s = TheSuperPage;
+	s->framebuffer = mmu_mapPhysicalSections(KFramebufferBase, fbPhys, fbSize);
+	mmu_finishedUpdatingPageTables();
+	s->framebufferPitch = pitch;
+	s->screenWidth = width;
+	s->screenHeight = height;
+	s->screenFormat = EFiveSixFive;
+
+	// And fill it with some arbitrary colour, as per pitft.c
+	fill(0, 0, width, height, 0xE01F); // Purple
+
+	kern_registerDriver(FOURCC("SCRN"), fb_handleSvc);
+}
+
+static inline uint16* fbPixel(int x, int y) {
+	SuperPage* s = TheSuperPage;
+	return (uint16*)(s->framebuffer + y * s->framebufferPitch) + x;
+}
+
+static void fill(int x, int y, int w, int h, uint16 colour) {
+	for (int yidx = y; yidx < y + h; yidx++) {
+		uint16* dest = fbPixel(x, yidx);
+		for (int i = 0; i < w; i++) {
+			*dest++ = colour;
+		}
+	}
+}
+
+#define CrashBorderWidth 5
+void screen_drawCrashed() {
+	SuperPage* s = TheSuperPage;
+	if (!s->framebuffer) return;
+	const int w = s->screenWidth;
+	const int h = s->screenHeight;
+	const uint16 red = 0xF800;
+	fill(0, 0, w, CrashBorderWidth, red);
+	fill(0, 0, CrashBorderWidth, h, red);
+	fill(w - CrashBorderWidth, 0, CrashBorderWidth, h, red);
+	fill(0, h - CrashBorderWidth, w, CrashBorderWidth, red);
+}
+
+static inline uint16 swap16(uint16 val) {
+	return (uint16)((val << 8) | (val >> 8));
+}
+
+/*
+Bitmap pixels are big-endian (that's what the PiTFT wants) but the GPU's are
+little-endian, so rather than a straight memcpy this swaps every pixel, two at a
+time where src and dest are similarly aligned.
+*/
+static void copyRow(uint16* dest, const uint16* src, int n) {
+	if ((((uintptr)dest ^ (uintptr)src) & 2) == 0) {
+		if (n && ((uintptr)dest & 2)) {
+			*dest++ = swap16(*src++);
+			n--;
+		}
+		uint32* d32 = (uint32*)dest;
+		const uint32* s32 = (const uint32*)src;
+		for (; n >= 2; n -= 2) {
+			const uint32 val = *s32++;
+			*d32++ = ((val & 0x00FF00FF) << 8) | ((val >> 8) & 0x00FF00FF);
+		}
+		dest = (uint16*)d32;
+		src = (const uint16*)s32;
+	}
+	while (n--) {
+		*dest++ = swap16(*src++);
+	}
+}
+
+// Copying is fast, but a whole 1080p screen is still a few ms
+#define KBlitRowsPerPreemptionPoint 64
+
+static int doBlit(uintptr arg2) {
+	// Format of *arg2 is { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h }
+	ASSERT_USER_PTR32(arg2);
+	const uint32* op = (const uint32*)arg2;
+	const uintptr data = op[0];
+	const uint32 bwidth = op[1];
+	const uint32 screenx = op[2];
+	const uint32 screeny = op[3];
+	const uint32 x = op[4];
+	const uint32 y = op[5];
+	const uint32 w = op[6];
+	const uint32 h = op[7];
+
+	// Unlike the PiTFT there's nothing to stop a bad rect scribbling over
+	// whatever's after the framebuffer. The values are all unsigned and
+	// nothing is added together until it's known not to overflow.
+	SuperPage* s = TheSuperPage;
+	if (screenx > (uint32)s->screenWidth || w > (uint32)s->screenWidth - screenx ||
+		screeny > (uint32)s->screenHeight || h > (uint32)s->screenHeight - screeny ||
+		bwidth == 0 || x > bwidth || w > bwidth - x) {
+		return KErrArgument;
+	}
+	if (w == 0 || h == 0) return 0;
+	// And likewise for the source, where y isn't bounded by anything else. If
+	// the last pixel is below KUserMemLimit then so is every row before it.
+	const uint64 first = (uint64)data + 2 * ((uint64)y * bwidth + x);
+	const uint64 last = first + 2 * ((uint64)(h - 1) * bwidth + w - 1);
+	if (last >= KUserMemLimit) return KErrArgument;
+	const uint16* start = (const uint16*)(uintptr)first;
+	ASSERT_USER_PTR16(start);
+	ASSERT_USER_PTR16((uintptr)last);
+
+	for (uint32 yidx = 0; yidx < h; yidx++) {
+		copyRow(fbPixel(screenx, screeny + yidx), start + yidx * bwidth, w);
+		if ((yidx + 1) % KBlitRowsPerPreemptionPoint == 0) {
+			kern_preemptionPoint();
+		}
+	}
+	return 0;
+}
+
+static DRIVER_FN(fb_handleSvc) {
+	switch(arg1) {
+		case KExecDriverScreenBlit:
+			return doBlit(arg2);
+		case KExecDriverScreenBlitAsync: {
+			// A blit is just a copy, so do it now and complete the request
+			// straight away, like the TiLDA does
+			ASSERT_USER_PTR32(arg2);
+			const uint32* op = (const uint32*)arg2;
+			KAsyncRequest req = { .thread = TheSuperPage->currentThread, .userPtr = op[8] };
+			ASSERT_USER_WPTR32(req.userPtr);
+			thread_requestComplete(&req, doBlit(arg2));
+			return 0;
+		}
+		default:
+			ASSERT(false, arg1);
+	}
+}
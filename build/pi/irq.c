@@ -20,6 +20,7 @@
 bool tick();
 void uart_got_char(byte b);
 void tft_gpioHandleInterrupt();
+void tft_spiHandleInterrupt();
 void spi_init();
 
 #define KTimerControlReset 0x00F90020 // Prescale = 0xF9=249, InterruptEnable=1
@@ -64,12 +65,25 @@ void board_init() {
 	spi_init();
 	}
 
+uint32 board_getMicroseconds() {
+	// The free-running counter is prescaled to 1MHz by board_init()
+	return GET32(ARM_TIMER_CNT);
+}
+
 bool handleIrq(void* savedRegs) {
 	//printk("IRQ!\n");
 	bool threadTimeExpired = false;
 	uint32 irqBasicPending = GET32(IRQ_BASIC);
+	if (irqBasicPending & ~(1 | IRQ_BASIC_SPI_INT)) {
+		// Don't bother tracing plain timer ticks, there's one every ms, or SPI
+		// FIFO refills, there are thousands per async blit
+		TRACE(ETraceIrq, irqBasicPending, 0);
+	}
 	if (irqBasicPending & 1) {
 		// Timer IRQ
+#ifdef KProfileBufferAddress
+		if (TheSuperPage->profileInterval) profiler_tick(savedRegs);
+#endif
 		threadTimeExpired = tick();
 		PUT32(ARM_TIMER_CLI,0);
 	}
@@ -88,6 +102,11 @@ bool handleIrq(void* savedRegs) {
 			}
 		}
 	}
+	if (irqBasicPending & IRQ_BASIC_SPI_INT) {
+#ifdef HAVE_PITFT
+		tft_spiHandleInterrupt();
+#endif
+	}
 	if (irqBasicPending & (1 << 9)) {
 		// IRQ Pending Reg 2
 		uint32 pending2 = GET32(IRQ_PEND2);
@@ -95,7 +114,7 @@ bool handleIrq(void* savedRegs) {
 		if (pending2 & (1 << (GPIO0_INT - 32))) {
 			uint32 gpioInts = GET32(GPEDS0);
 			if (gpioInts & (1<<24)) {
-#ifdef HAVE_SCREEN
+#ifdef HAVE_PITFT
 				tft_gpioHandleInterrupt();
 #endif
 			}
@@ -110,8 +129,12 @@ bool handleIrq(void* savedRegs) {
 		GetSpsr(spsr);
 		bool threadWasInSvc = (spsr & KPsrModeMask) == KPsrModeSvc;
 		if (threadWasInSvc) {
-			atomic_setbool(&TheSuperPage->rescheduleNeededOnSvcExit, true);
-			// Don't reschedule immediately
+			// Don't reschedule immediately, but note when we first wanted to
+			// so that scheduleThread() can measure how long we were held off
+			bool alreadyNeeded = atomic_setbool(&TheSuperPage->rescheduleNeededOnSvcExit, true);
+			if (!alreadyNeeded && TheSuperPage->currentThread) {
+				TheSuperPage->rescheduleRequestTime = board_getMicroseconds();
+			}
 		} else {
 			saveCurrentRegistersForThread(savedRegs);
 			return true; // Reschedule right now
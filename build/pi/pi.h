@@ -12,7 +12,9 @@
 #define ARCH_HEADER <arm.h>
 
 #define HAVE_SCREEN
+#ifndef HAVE_FRAMEBUFFER // See build/pifb/pifb.h
 #define HAVE_PITFT
+#endif
 #define HAVE_MMU
 
 #define NON_SECURE // Ie we do drop to NS mode
@@ -67,8 +69,13 @@
 #define GPIO1_INT			50
 #define GPIO2_INT			51
 #define GPIO3_INT			52
+#define SPI_INT				54
 #define UART_INT			57
 
+// Some interrupts have a shortcut bit in IRQ_BASIC (BCM-2835-ARM-Peripherals
+// p113), and those don't also set the "pending register 2" bit
+#define IRQ_BASIC_SPI_INT	(1 << 16)
+
 // BCM-2835-ARM-Peripherals p12 says you set bit 1 to enable receive. It's actually bit 0.
 #define AUX_MU_EnableReceiveInterrupt	(1 << 0)
 #define AUX_MU_ClearReceiveFIFO			(1 << 1)
@@ -3,7 +3,9 @@
 
 #include <k.h>
 #include <mmu.h> // For switch_process()
+#include <pageAllocator.h>
 #include <exec.h>
+#include <err.h>
 #include "gpio.h"
 
 #define WIDTH 240
@@ -88,6 +90,7 @@ uint32 tsc_register_read(uint8 reg, int regSize);
 void tsc_register_write(uint8 reg, uint8 val);
 static DRIVER_FN(tft_handleSvc);
 static void tft_gpioInterruptDfcFn(uintptr arg1, uintptr arg2, uintptr arg3);
+static void waitForAsyncBlit();
 
 #define GPIO_DC 25 // Data/command signal, aka D/CX on the LCD controller
 
@@ -126,9 +129,10 @@ void screen_init() {
 	uint32 gpfen = GET32(GPFEN0); // falling edge detect enabled
 	PUT32(GPFEN0, gpfen | (1<<24));
 
-	// And enable the gpio_int[0] interrupt
+	// And enable the gpio_int[0] interrupt. The SPI interrupt is also enabled
+	// here, but it's only ever turned on in SPI_CS while an async blit is running
 	uint32 irqen2 = GET32(IRQ_ENABLE_2);
-	PUT32(IRQ_ENABLE_2, irqen2 | (1 << (GPIO0_INT - 32)));
+	PUT32(IRQ_ENABLE_2, irqen2 | (1 << (GPIO0_INT - 32)) | (1 << (SPI_INT - 32)));
 
 	// Pin 25 is DC, data/command signal, and it's OUT_INIT_LOW
 	gpio_set(GPIO_DC, 0);
@@ -203,6 +207,12 @@ void screen_init() {
 	tsc_register_write(FIFO_CTRL_STA, FIFO_RESET);
 	tsc_register_write(FIFO_CTRL_STA, 0);
 
+	// Async blits are staged through the blit buffer
+	for (uintptr addr = KBlitBufferAddress; addr < KBlitBufferAddress + KBlitBufferSize; addr += KPageSize) {
+		mmu_mapPageInSection(Al, (uint32*)KSectionZeroPt, addr, KPageSect0);
+	}
+	mmu_finishedUpdatingPageTables();
+
 	kern_registerDriver(FOURCC("SCRN"), tft_handleSvc);
 	kern_registerDriver(FOURCC("INPT"), tft_handleSvc);
 }
@@ -290,6 +300,9 @@ void tsc_register_write(uint8 reg, uint8 val) {
 #define CrashBorderWidth 5
 #define BlitN(colour, n) for (int i = 0; i < n; i++) { spi_write_poll(colour, 2); }
 void screen_drawCrashed() {
+	// Abandon any async blit that was in progress (which also turns off its
+	// interrupts), we're not going to be completing it
+	PUT32(SPI_CS, SPI_CS_CLEAR_TX | SPI_CS_CLEAR_RX);
 	uint8 red[] = {0xF8, 0x00};
 	int w = TheSuperPage->screenWidth;
 	int h = TheSuperPage->screenHeight;
@@ -309,12 +322,15 @@ void screen_drawCrashed() {
 }
 
 static int doBlit(uintptr arg2);
+static int doBlitAsync(uintptr arg2);
 static int doInputRequest(uintptr arg2);
 
 static DRIVER_FN(tft_handleSvc) {
 	switch(arg1) {
 		case KExecDriverScreenBlit:
 			return doBlit(arg2);
+		case KExecDriverScreenBlitAsync:
+			return doBlitAsync(arg2);
 		case KExecDriverInputRequest:
 			return doInputRequest(arg2);
 		default:
@@ -322,6 +338,11 @@ static DRIVER_FN(tft_handleSvc) {
 	}
 }
 
+// Number of rows to send in each SPI transaction. Between transactions the
+// thread can be preempted, so this bounds how long a blit holds off everything
+// else (16 rows of 320 pixels is about 5ms at 16MHz).
+#define KBlitRowsPerPreemptionPoint 16
+
 static int doBlit(uintptr arg2) {
 	// Format of *arg2 is { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h }
 
@@ -338,21 +359,243 @@ static int doBlit(uintptr arg2) {
 	const int h = op[7];
 	//printk("Blitting %d,%d,%dx%d to %d,%d\n", x, y, w, h, screenx, screeny);
 
-	if (w == bwidth) {
-		// No need to worry about stride, can blit whole lot at once
-		tft_beginUpdate(screenx, screeny, screenx + w - 1, screeny + h - 1);
-		spi_write_poll((uint8*)(data + y*bwidth + x), 2*w*h);
-		spi_endTransaction();
-	} else {
-		for (int yidx = 0; yidx < h; yidx++) {
-			tft_beginUpdate(screenx, screeny + yidx, screenx + w - 1, screeny + yidx);
-			spi_write_poll((uint8*)(data + (y+yidx)*bwidth + x), 2*w);
+	waitForAsyncBlit();
+	for (int band = 0; band < h; band += KBlitRowsPerPreemptionPoint) {
+		const int bandh = min(KBlitRowsPerPreemptionPoint, h - band);
+		// The controller wraps at the edge of the window, so the whole band
+		// goes in one transaction even if the rows aren't contiguous
+		tft_beginUpdate(screenx, screeny + band, screenx + w - 1, screeny + band + bandh - 1);
+		if (w == bwidth) {
+			spi_write_poll((uint8*)(data + (y+band)*bwidth + x), 2*w*bandh);
+		} else {
+			for (int yidx = band; yidx < band + bandh; yidx++) {
+				spi_write_poll((uint8*)(data + (y+yidx)*bwidth + x), 2*w);
+			}
 		}
+		// Each band sets its own window, so it doesn't matter if another blit
+		// or a touchscreen DFC uses the SPI bus while we're preempted
 		spi_endTransaction();
+		kern_preemptionPoint();
 	}
 	return 0;
 }
 
+/*
+Async blits set the address window once for the whole rect and then keep the
+SPI transaction open while tft_spiHandleInterrupt() feeds the FIFO. The
+interrupt only ever reads from the blit buffer, which blitStage_dfc() fills a
+half at a time by copying rows out of the requesting process, so the bitmap's
+stride costs nothing extra and the CPU is free while the pixels go out. Other
+users of the bus wait for the blit to finish, or in the touchscreen's case
+defer until it has.
+*/
+
+#define KBlitHalfSize (KBlitBufferSize / 2)
+#define BlitHalf(i) ((uint8*)KBlitBufferAddress + (i) * KBlitHalfSize)
+#define SPI_CS_INTS (SPI_CS_INTR | SPI_CS_INTD)
+
+static inline bool asyncBlitInProgress() {
+	return TheSuperPage->blitRequest.thread != NULL;
+}
+
+static void waitForAsyncBlit() {
+	while (asyncBlitInProgress()) {
+		kern_preemptionPoint();
+	}
+}
+
+static void setSpiInterrupts(bool enable) {
+	uint32 cs = GET32(SPI_CS) & ~SPI_CS_INTS;
+	PUT32(SPI_CS, enable ? (cs | SPI_CS_INTS) : cs);
+}
+
+// Called with interrupts disabled, from IRQ or DFC context
+static void blitFinished(int result) {
+	SuperPage* s = TheSuperPage;
+	// Like spi_endTransaction() (including disabling the interrupts) but also
+	// discards anything left in the FIFOs so the next user starts clean
+	PUT32(SPI_CS, SPI_CS_CLEAR_TX | SPI_CS_CLEAR_RX);
+	if (s->blitRequest.userPtr) {
+		dfc_requestComplete(&s->blitRequest, result);
+	}
+	s->blitRequest.thread = NULL;
+	if (s->tscDeferred) {
+		s->tscDeferred = false;
+		dfc_queue(tft_gpioInterruptDfcFn, 0, 0, 0);
+	}
+}
+
+/*
+Copies as many rows as will fit into half `h` of the blit buffer. The requesting
+process must be the current one. Returns the number of rows copied, the caller
+must call rowsStaged() to update `d`.
+*/
+static int stageRows(const BlitDescriptor* d, int h) {
+	const int n = min(d->rowsToStage, KBlitHalfSize / d->rowBytes);
+	uint8* dest = BlitHalf(h);
+	uintptr src = d->src;
+	for (int i = 0; i < n; i++) {
+		memcpy(dest, (const void*)src, d->rowBytes);
+		dest += d->rowBytes;
+		src += d->stride;
+	}
+	return n;
+}
+
+static void blitStage_dfc(uintptr arg1, uintptr arg2, uintptr arg3);
+
+static void rowsStaged(BlitDescriptor* d, int h, int n) {
+	d->src += n * d->stride;
+	d->rowsToStage -= n;
+	d->len[h] = n * d->rowBytes;
+}
+
+/*
+Writes to the FIFO until it's full or there's nothing staged. Called with
+interrupts disabled, either from the SPI interrupt or by whatever just staged
+some rows.
+*/
+static void feedFifo() {
+	SuperPage* s = TheSuperPage;
+	BlitDescriptor* d = &s->blit;
+	// We don't care what comes back, but it has to be drained or the
+	// transfer stalls when the RX FIFO fills
+	while (GET32(SPI_CS) & SPI_CS_RXD) {
+		GET32(SPI_FIFO);
+	}
+	while (GET32(SPI_CS) & SPI_CS_TXD) {
+		if (d->txPos == d->len[d->txHalf]) {
+			if (d->txPos) {
+				// Finished with this half, so it can be restaged
+				const int done = d->txHalf;
+				d->len[done] = 0;
+				d->txPos = 0;
+				d->txHalf = done ^ 1;
+				if (d->rowsToStage) dfc_queue(blitStage_dfc, 0, 0, 0);
+			}
+			if (d->len[d->txHalf] == 0) break;
+		}
+		PUT32(SPI_FIFO, BlitHalf(d->txHalf)[d->txPos++]);
+	}
+
+	if (d->len[d->txHalf] == 0) {
+		if (d->rowsToStage == 0) {
+			// Everything's in the FIFO, INTD will bring us back when it's gone
+			while (GET32(SPI_CS) & SPI_CS_RXD) {
+				GET32(SPI_FIFO);
+			}
+			if (GET32(SPI_CS) & SPI_CS_DONE) {
+				blitFinished(0);
+			}
+		} else {
+			// Until blitStage_dfc() catches up, DONE would just keep interrupting
+			d->stalled = true;
+			setSpiInterrupts(false);
+		}
+	}
+}
+
+void tft_spiHandleInterrupt() {
+	if (asyncBlitInProgress() && !TheSuperPage->blit.stalled) {
+		feedFifo();
+	}
+}
+
+static void blitStage_dfc(uintptr arg1, uintptr arg2, uintptr arg3) {
+	SuperPage* s = TheSuperPage;
+	BlitDescriptor* d = &s->blit;
+	Thread* t = s->blitRequest.thread;
+	if (!t) return;
+	Process* p = processForThread(t);
+	// Fill whichever halves are free, starting with the one the interrupt is
+	// (or soon will be) waiting on. The interrupt never touches a free half.
+	for (;;) {
+		int mask = kern_disableInterrupts();
+		const int h = d->len[d->txHalf] == 0 ? d->txHalf : d->txHalf ^ 1;
+		const bool needed = d->len[h] == 0 && d->rowsToStage;
+		kern_restoreInterrupts(mask);
+		if (!needed) break;
+
+		const int rows = min(d->rowsToStage, KBlitHalfSize / d->rowBytes);
+		const uintptr end = d->src + (rows - 1) * d->stride + d->rowBytes;
+		bool srcValid = true;
+		if (d->src >= KUserHeapBase && d->src < KSharedPagesBase) {
+			// The process might have shrunk its heap since the blit started
+			srcValid = end <= p->heapLimit;
+		}
+		const bool dead = t->state == EDying || t->state == EDead;
+		if (dead || !srcValid) {
+			mask = kern_disableInterrupts();
+			if (dead) s->blitRequest.userPtr = 0; // No-one to complete it for
+			blitFinished(KErrArgument);
+			kern_restoreInterrupts(mask);
+			return;
+		}
+
+		Process* oldp = switch_process(p);
+		const int n = stageRows(d, h);
+		switch_process(oldp);
+
+		mask = kern_disableInterrupts();
+		rowsStaged(d, h, n);
+		if (d->stalled) {
+			d->stalled = false;
+			setSpiInterrupts(true);
+			feedFifo();
+		}
+		kern_restoreInterrupts(mask);
+	}
+}
+
+static int doBlitAsync(uintptr arg2) {
+	// Format of *arg2 is { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h, asyncRequestPtr }
+	ASSERT_USER_PTR32(arg2);
+	uint32* op = (uint32*)arg2;
+	const uint16* data = (const uint16*)op[0];
+	const int bwidth = op[1];
+	const int screenx = op[2];
+	const int screeny = op[3];
+	const int x = op[4];
+	const int y = op[5];
+	const int w = op[6];
+	const int h = op[7];
+	const uintptr userRequest = op[8];
+	ASSERT_USER_WPTR32(userRequest);
+	if (w * 2 > KBlitHalfSize) return KErrArgument;
+
+	SuperPage* s = TheSuperPage;
+	waitForAsyncBlit();
+	KAsyncRequest req = { .thread = s->currentThread, .userPtr = userRequest };
+	if (w == 0 || h == 0) {
+		thread_requestComplete(&req, 0);
+		return 0;
+	}
+	const uint16* start = data + y * bwidth + x;
+	ASSERT_USER_PTR16(start);
+	ASSERT_USER_PTR16(start + (h - 1) * bwidth + w - 1);
+
+	BlitDescriptor* d = &s->blit;
+	d->src = (uintptr)start;
+	d->stride = bwidth * 2;
+	d->rowBytes = w * 2;
+	d->rowsToStage = h;
+	d->len[0] = d->len[1] = 0;
+	d->txPos = 0;
+	d->txHalf = 0;
+	d->stalled = false;
+	// We're the current process, so there's no need for a DFC to stage these
+	rowsStaged(d, 0, stageRows(d, 0));
+	if (d->rowsToStage) rowsStaged(d, 1, stageRows(d, 1));
+	s->blitRequest = req;
+
+	tft_beginUpdate(screenx, screeny, screenx + w - 1, screeny + h - 1);
+	int mask = kern_disableInterrupts();
+	setSpiInterrupts(true);
+	feedFifo();
+	kern_restoreInterrupts(mask);
+	return 0;
+}
+
 static void drainFifoAndCompleteRequest() {
 	int numSamples = tsc_register_read(FIFO_SIZE, 1);
 	if (numSamples == 0 && !kern_getFlag(NeedToSendTouchUp)) return;
@@ -387,11 +630,21 @@ static int doInputRequest(uintptr arg2) {
 	int err = kern_setInputRequest(arg2);
 	if (err) return err;
 
-	drainFifoAndCompleteRequest(); // Will only complete if needed
+	if (asyncBlitInProgress()) {
+		// Can't talk to the TSC until the blit is finished
+		TheSuperPage->tscDeferred = true;
+	} else {
+		drainFifoAndCompleteRequest(); // Will only complete if needed
+	}
 	return 0;
 }
 
 static void tft_gpioInterruptDfcFn(uintptr arg1, uintptr arg2, uintptr arg3) {
+	if (asyncBlitInProgress()) {
+		// blitFinished() will queue us again
+		TheSuperPage->tscDeferred = true;
+		return;
+	}
 	if ((tsc_register_read(INT_STA, 1) & TSC_INT_TOUCH_DET) &&
 		(tsc_register_read(TSC_CTRL, 1) & TSC_STA) == 0) {
 		kern_setFlag(NeedToSendTouchUp, true);
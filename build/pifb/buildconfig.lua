@@ -0,0 +1,16 @@
+-- Everything is as per the pi target except that the screen is the HDMI output,
+-- so the PiTFT driver is replaced by build/pi/framebuffer.c. Under QEMU this
+-- runs with:
+--
+--     qemu-system-arm -M raspi1ap -kernel bin/pifb/kernel.img -serial stdio
+
+assert(loadfile(build.baseDir.."build/pi/buildconfig.lua", nil, _ENV))()
+
+config.include = "pifb.h"
+config.userInclude = "../pi/piuser.h"
+
+for i, src in ipairs(config.sources) do
+	if src == "build/pi/pitft.c" then
+		config.sources[i] = "build/pi/framebuffer.c"
+	end
+end
@@ -0,0 +1,10 @@
+#ifndef LUPI_BUILD_PIFB_H
+#define LUPI_BUILD_PIFB_H
+
+// The Pi build, but displaying on HDMI via the GPU's framebuffer (see
+// build/pi/framebuffer.c) instead of on a PiTFT
+#define HAVE_FRAMEBUFFER
+
+#include "../pi/pi.h"
+
+#endif // LUPI_BUILD_PIFB_H
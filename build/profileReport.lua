@@ -0,0 +1,136 @@
+#!/usr/local/bin/lua5.3
+
+--[[
+Symbolises the output of the sampling profiler (lupi.profilerDump() or the klua
+debugger's profileDump()) and prints either a flat profile per process, or
+with --collapsed, one line per unique stack in the "collapsed" format used by
+flamegraph.pl and speedscope. The dump file can contain other text (eg a
+complete UART log), only lines starting with PROF are considered.
+
+Must be run from the root of the source tree.
+]]
+
+local collapsed = false
+local args = {}
+for _, a in ipairs(arg) do
+	if a == "--collapsed" then collapsed = true
+	else table.insert(args, a)
+	end
+end
+
+if #args ~= 2 then
+	print("Syntax: profileReport.lua [--collapsed] <kernel.txt> <dumpfile>")
+	os.exit(1)
+end
+
+local symParser = require("modules/symbolParser")
+symParser.getSymbolsFromReadElf(args[1])
+
+local KProfileSampleKernel = 1 -- Must match k/inc/k.h
+
+local symbolNameCache = {}
+local function symbolName(addr)
+	local name = symbolNameCache[addr]
+	if not name then
+		local sym = symParser.findSymbol(addr)
+		name = sym and sym.name or string.format("0x%08X", addr)
+		symbolNameCache[addr] = name
+	end
+	return name
+end
+
+local processNames = {}
+local function processName(idx)
+	if idx == 0xFF then return "idle" end
+	return processNames[idx] or string.format("process%d", idx)
+end
+
+-- Indexed by process index
+local profiles = {}
+local function getProfile(idx)
+	local p = profiles[idx]
+	if not p then
+		p = { total = 0, self = {}, incl = {}, stacks = {} }
+		profiles[idx] = p
+	end
+	return p
+end
+
+local f = assert(io.open(args[2], "r"))
+for line in f:lines() do
+	local idx, name = line:match("^PROFPROC (%d+) (.*)$")
+	if idx then
+		processNames[tonumber(idx)] = name
+	end
+
+	local pidx, flags, rest = line:match("^PROF (%d+) %d+ (%d+) (.*)$")
+	if pidx then
+		local p = getProfile(tonumber(pidx))
+		p.total = p.total + 1
+		-- Frames are innermost first
+		local frames = {}
+		for addr in rest:gmatch("%x+") do
+			table.insert(frames, symbolName(tonumber(addr, 16)))
+		end
+		local leaf = frames[1]
+		p.self[leaf] = (p.self[leaf] or 0) + 1
+		local seen = {}
+		for _, fn in ipairs(frames) do
+			if not seen[fn] then
+				p.incl[fn] = (p.incl[fn] or 0) + 1
+				seen[fn] = true
+			end
+		end
+		if tonumber(flags) & KProfileSampleKernel ~= 0 then
+			frames[1] = frames[1].."_[k]"
+		end
+		local stack = {}
+		for i = #frames, 1, -1 do
+			table.insert(stack, frames[i])
+		end
+		local key = table.concat(stack, ";")
+		p.stacks[key] = (p.stacks[key] or 0) + 1
+	end
+end
+f:close()
+
+local function sortedKeys(tbl, cmp)
+	local result = {}
+	for k in pairs(tbl) do table.insert(result, k) end
+	table.sort(result, cmp)
+	return result
+end
+
+local processIndexes = sortedKeys(profiles)
+
+if collapsed then
+	for _, idx in ipairs(processIndexes) do
+		local p = profiles[idx]
+		local pname = processName(idx)
+		for _, stack in ipairs(sortedKeys(p.stacks)) do
+			print(string.format("%s;%s %d", pname, stack, p.stacks[stack]))
+		end
+	end
+	return
+end
+
+local function percent(n, total)
+	return string.format("%3d.%d%%", n * 100 // total, (n * 1000 // total) % 10)
+end
+
+for _, idx in ipairs(processIndexes) do
+	local p = profiles[idx]
+	print(string.format("Process %s: %d samples", processName(idx), p.total))
+	print("   self          incl      function")
+	local fns = sortedKeys(p.incl, function(a, b)
+		local sa, sb = p.self[a] or 0, p.self[b] or 0
+		if sa ~= sb then return sa > sb end
+		return p.incl[a] > p.incl[b]
+	end)
+	for _, fn in ipairs(fns) do
+		local self = p.self[fn] or 0
+		print(string.format("%s %5d %s %5d  %s", percent(self, p.total), self,
+			percent(p.incl[fn], p.total), p.incl[fn], fn))
+	end
+	print("")
+end
@@ -66,6 +66,24 @@ void board_init() {
 	kern_registerDriver(FOURCC("INPT"), inputHandleSvc);
 }
 
+uint32 board_getMicroseconds() {
+	// SysTick counts down from SYSTICK_LOAD to zero once every millisecond.
+	// If it has wrapped but the SysTick handler hasn't run yet (eg because
+	// interrupts are masked) then uptime is a millisecond behind val, which
+	// we can tell from the exception being pending. The pending bit is read
+	// either side of val so we know which side of the wrap val was read.
+	volatile uint64* uptime = &TheSuperPage->uptime;
+	uint32 load = GET32(SYSTICK_LOAD);
+	uint32 ms, val, pending;
+	do {
+		ms = (uint32)*uptime;
+		pending = GET32(SCB_ICSR) & ICSR_PENDSTSET;
+		val = GET32(SYSTICK_VAL);
+	} while (ms != (uint32)*uptime || pending != (GET32(SCB_ICSR) & ICSR_PENDSTSET));
+	if (pending) ms++;
+	return ms * 1000 + ((load - val) * 1000) / (load + 1);
+}
+
 static void setPeripheralInterruptPriority(int peripheralId, uint8 priority) {
 	ASSERT((priority & 0xF) == 0);
 	uint32 addr = NVIC_IPR0 + peripheralId;
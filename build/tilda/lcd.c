@@ -206,6 +206,17 @@ static DRIVER_FN(screen_handleSvc) {
 		case KExecDriverScreenBlit:
 			doBlit(arg2);
 			return 0;
+		case KExecDriverScreenBlitAsync: {
+			// There's so little data that it's not worth doing asynchronously,
+			// so blit it now and complete the request straight away
+			ASSERT_USER_PTR32(arg2);
+			const uint32* op = (const uint32*)arg2;
+			KAsyncRequest req = { .thread = TheSuperPage->currentThread, .userPtr = op[8] };
+			ASSERT_USER_WPTR32(req.userPtr);
+			if (op[6] && op[7]) doBlit(arg2);
+			thread_requestComplete(&req, 0);
+			return 0;
+		}
 		default:
 			ASSERT(false, arg1);
 	}
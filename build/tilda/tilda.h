@@ -9,6 +9,7 @@
 #define ARCH_HEADER <armv7-m.h>
 
 #define LUPI_NO_SECTION0 // Implies packed superpage and no MMU translation
+#define MAX_DFCS 8 // Every byte of the SuperPage counts
 
 #define LUPI_NO_IPC // This is a temporary macro
 
@@ -153,8 +154,8 @@ Bit-banded user mem				22E00000-230C0000
 
 #define KUserMemLimit			KHandlerStackBase
 
+// Default size, threads can ask for more or less
 #define USER_STACK_SIZE			(4096)
-#define USER_STACK_AREA_SHIFT	(12)
 
 #define LoadSuperPageAddress(reg) \
 	asm("MOV " #reg ", %0" : : "i" (0x20000000)); \
@@ -0,0 +1,155 @@
+#!/usr/local/bin/lua5.3
+
+--[[
+Converts the output of the klua debugger's traceDump() function into the Chrome
+trace event JSON format, for viewing in chrome://tracing or
+https://ui.perfetto.dev. The dump file can contain other text (eg a complete
+UART log), only lines starting with TRACE are considered.
+
+If a kernel symbols file (as produced by readelf, see stackDecode.lua) is
+supplied, DFC function addresses will be decoded.
+
+Must be run from the root of the source tree.
+]]
+
+if #arg < 1 or #arg > 2 then
+	print("Syntax: traceToChrome.lua <dumpfile> [<kernel.txt>] > trace.json")
+	os.exit(1)
+end
+
+local dumpFile = arg[1]
+local elf = arg[2]
+
+local symParser
+if elf then
+	symParser = require("modules/symbolParser")
+	symParser.getSymbolsFromReadElf(elf)
+end
+
+-- Must match TraceEventType in k/inc/k.h
+local ETraceSvcEntry = 1
+local ETraceSvcExit = 2
+local ETraceContextSwitch = 3
+local ETraceIrq = 4
+local ETraceDfc = 5
+local ETraceIpcSend = 6
+local ETraceIpcComplete = 7
+local ETracePageAlloc = 8
+
+local KNoProcess = 0xFF
+local KDriverHandle = 0x00400000
+
+-- Get the exec names from the header rather than duplicating them here
+local execNames = {}
+local execHeader = io.open("userinc/lupi/exec.h", "r")
+if execHeader then
+	for line in execHeader:lines() do
+		local name, val = line:match("^#define KExec(%w+)%s+(%d+)")
+		if name and not name:match("^Driver") then
+			execNames[tonumber(val)] = name
+		end
+	end
+	execHeader:close()
+end
+
+local function execName(cmd)
+	if cmd & KDriverHandle ~= 0 then
+		return string.format("Driver%d", cmd & 0xFF)
+	end
+	return execNames[cmd] or string.format("Exec%d", cmd)
+end
+
+local function symbol(addr)
+	local desc = symParser and symParser.addressDescription(addr)
+	if desc and desc ~= "" then return desc end
+	return string.format("0x%08X", addr)
+end
+
+local events = {}
+local function emit(fmt, ...)
+	table.insert(events, string.format(fmt, ...))
+end
+
+local processNames = {}
+local lastRawTs, tsBase
+local running -- { pid = , tid = , ts = }
+local openSvcs = {} -- Indexed by pid..":"..tid
+
+local function key(pid, tid)
+	return pid..":"..tid
+end
+
+local function closeSvc(pid, tid, ts)
+	local k = key(pid, tid)
+	if openSvcs[k] then
+		emit('{"ph":"E","pid":%d,"tid":%d,"ts":%d}', pid, tid, ts)
+		openSvcs[k] = nil
+	end
+end
+
+local function instant(name, pid, tid, ts, args)
+	emit('{"name":"%s","ph":"i","s":"t","pid":%d,"tid":%d,"ts":%d,"args":{%s}}',
+		name, pid, tid, ts, args or "")
+end
+
+local f = assert(io.open(dumpFile, "r"))
+for line in f:lines() do
+	local idx, name = line:match("^TRACEPROC (%d+) (.*)$")
+	if idx then
+		processNames[tonumber(idx)] = name
+	end
+
+	local rawTs, typ, pid, tid, arg1, arg2 = line:match("^TRACE (%x+) (%d+) (%d+) (%d+) (%x+) (%x+)")
+	if rawTs then
+		rawTs = tonumber(rawTs, 16)
+		typ, pid, tid = tonumber(typ), tonumber(pid), tonumber(tid)
+		arg1, arg2 = tonumber(arg1, 16), tonumber(arg2, 16)
+		-- Timestamps are a 32-bit microsecond counter, so unwrap them
+		if not tsBase then
+			tsBase = 0
+		elseif rawTs < lastRawTs then
+			tsBase = tsBase + 0x100000000
+		end
+		lastRawTs = rawTs
+		local ts = tsBase + rawTs
+
+		if typ == ETraceSvcEntry then
+			closeSvc(pid, tid, ts) -- Shouldn't happen, but just in case
+			emit('{"name":"%s","cat":"svc","ph":"B","pid":%d,"tid":%d,"ts":%d}',
+				execName(arg1), pid, tid, ts)
+			openSvcs[key(pid, tid)] = true
+		elseif typ == ETraceSvcExit then
+			closeSvc(pid, tid, ts)
+		elseif typ == ETraceContextSwitch then
+			-- Any SVC that the old thread was in will not complete via
+			-- ETraceSvcExit, because blocking SVCs return to user mode
+			-- directly from reschedule()
+			closeSvc(pid, tid, ts)
+			if running then
+				emit('{"name":"running","cat":"sched","ph":"X","pid":%d,"tid":%d,"ts":%d,"dur":%d}',
+					running.pid, running.tid, running.ts, ts - running.ts)
+			end
+			running = { pid = arg1, tid = arg2, ts = ts }
+		elseif typ == ETraceIrq then
+			instant("irq", pid, tid, ts, string.format('"pending":"0x%X"', arg1))
+		elseif typ == ETraceDfc then
+			instant("dfc", pid, tid, ts, string.format('"fn":"%s","arg":"0x%X"', symbol(arg1), arg2))
+		elseif typ == ETraceIpcSend or typ == ETraceIpcComplete then
+			local evName = typ == ETraceIpcSend and "ipcSend" or "ipcComplete"
+			instant(evName, pid, tid, ts, string.format('"request":"0x%X","recipient":"0x%X"', arg1, arg2))
+		elseif typ == ETracePageAlloc then
+			instant("pageAlloc", pid, tid, ts, string.format('"phys":"0x%X","type":%d,"num":%d',
+				arg1, arg2 >> 24, arg2 & 0xFFFFFF))
+		end
+	end
+end
+f:close()
+
+for idx, name in pairs(processNames) do
+	emit('{"name":"process_name","ph":"M","pid":%d,"args":{"name":"%s"}}', idx, name)
+end
+emit('{"name":"process_name","ph":"M","pid":%d,"args":{"name":"kernel"}}', KNoProcess)
+
+print('{"traceEvents":[')
+print(table.concat(events, ",\n"))
+print(']}')
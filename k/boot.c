@@ -109,6 +109,18 @@ void Boot(uintptr atagsPhysAddr) {
 	mmu_createSection(Al, KKernPtForProcPts);
 	// And the DFC thread stack
 	mmu_mapPageInSection(Al, (uint32*)KSectionZeroPt, KDfcThreadStack, KPageSect0);
+#ifdef KTraceBufferAddress
+	// And the trace buffer
+	for (uintptr addr = KTraceBufferAddress; addr < KTraceBufferAddress + KTraceBufferSize; addr += KPageSize) {
+		mmu_mapPageInSection(Al, (uint32*)KSectionZeroPt, addr, KPageSect0);
+	}
+#endif
+#ifdef KProfileBufferAddress
+	// And the profiler sample buffer
+	for (uintptr addr = KProfileBufferAddress; addr < KProfileBufferAddress + KProfileBufferSize; addr += KPageSize) {
+		mmu_mapPageInSection(Al, (uint32*)KSectionZeroPt, addr, KPageSect0);
+	}
+#endif
 
 	// One Process page for first proc
 	mmu_mapPageInSection(Al, (uint32*)KProcessesSection_pt, (uintptr)firstProcess, KPageProcess);
@@ -128,6 +140,9 @@ void Boot(uintptr atagsPhysAddr) {
 	firstProcess->pid = 0;
 #ifdef HAVE_MMU
 	firstProcess->pdePhysicalAddress = 0;
+	firstProcess->numThreadPages = 0;
+	firstProcess->pooled = false;
+	firstProcess->threads = ThreadsForProcess(0);
 #endif
 
 #if defined(KLUA)
@@ -152,8 +167,11 @@ static void initSuperPage(const AtagsParams* atags) {
 	s->bootMode = checkBootMode(BOOT_MODE);
 	s->nextPid = 1;
 	s->numValidProcessPages = 1;
+	s->nextWakeTime = UINT64_MAX;
 #ifdef ARM
 	s->dfcThread.state = EBlockedFromSvc;
+	s->dfcThread.priority = KThreadPriorityDfc;
+	s->dfcThread.basePriority = KThreadPriorityDfc;
 	thread_setBlockedReason(&s->dfcThread, EBlockedWaitingForDfcs);
 	s->svcPsrMode = KPsrModeSvc | KPsrFiqDisable /*| KPsrIrqDisable*/;
 #endif
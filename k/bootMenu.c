@@ -45,7 +45,12 @@ Boot menu:\n\
 Test func:\n\
         a: Run atomics unit tests\n\
         b: Run bitmap tests\n\
+        c: Run compositor tests\n\
+        f: Run threading tests (futexes, mailboxes)\n\
+        l: Run scheduling latency tests\n\
         m: Run memory usage tests\n\
+        p: Run IPC ping-pong benchmark\n\
+        s: Run sampling profiler tests\n\
     ^X, r: Reboot\n\
         t: Run test/init.lua tests\n\
         y: Run yield scheduling tests\n\
@@ -62,7 +67,12 @@ Test func:\n\
 
 			case 'a':
 			case 'b':
+			case 'c':
+			case 'f':
+			case 'l':
 			case 'm':
+			case 'p':
+			case 's':
 			case 't':
 			case 'y':
 				return ch;
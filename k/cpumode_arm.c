@@ -154,8 +154,23 @@ void NAKED svc() {
 	LABEL_WORD(.debuggerStackTop, KLuaDebuggerSvcStackBase + KLuaDebuggerSvcStackSize);
 }
 
+/**
+Returns true if the abort was the current thread touching a part of its stack
+that hadn't been mapped yet, and more has now been mapped.
+*/
+static USED bool handleStackFault() {
+	Thread* t = TheSuperPage->currentThread;
+	return t && thread_growStack(t, getFAR());
+}
+
 void NAKED dataAbort() {
 	asm("PUSH {r0-r12, r14}");
+	asm("BL handleStackFault");
+	asm("CMP r0, #0");
+	// If it was handled, retry the instruction that faulted
+	asm("POPNE {r0-r12, r14}");
+	asm("SUBSNE pc, r14, #8");
+
 	uint32* regs;
 	asm("MOV %0, sp" : "=r" (regs));
 	uint32 addr;
@@ -155,6 +155,16 @@ void dumpRegisters(uint32* regs, uint32 excReturn) {
 	if (cfsr & CFSR_MMARVALID) {
 		printk("MMAR: %X\n", GET32(SCB_MMAR));
 	}
+	Thread* t = TheSuperPage->currentThread;
+	if (t) {
+		// Stacking errors don't set MMAR, but the guard region is the only
+		// thing a PSP in user memory could have hit
+		const uint32 mmar = GET32(SCB_MMAR);
+		bool guardHit = (cfsr & CFSR_MMARVALID) && mmar - t->stackBase < KStackGuardSize;
+		if (guardHit || (cfsr & CFSR_MSTKERR)) {
+			printk("Stack overflow in thread %d\n", t->index);
+		}
+	}
 #ifdef KLUA
 	// First word of Heap structure is the top addr
 	printk("KLua heap top: %X\n", GET32(KLuaHeapBase));
@@ -37,6 +37,7 @@
 #define SCB_BFAR				0xE000ED38 // Bus Fault Address Register
 
 // p172
+#define ICSR_PENDSTSET			(1 << 26)
 #define ICSR_PENDSVCLR			(1 << 27)
 #define ICSR_PENDSVSET			(1 << 28)
 #define ICSR_VECTACTIVE_MASK	(0x1F)
@@ -64,6 +65,7 @@
 // pp186-189
 #define CFSR_BFARVALID			(1 << 15)
 #define CFSR_MMARVALID			(1 << 7)
+#define CFSR_MSTKERR			(1 << 4)
 
 // p200
 #define MPU_TYPE				0xE000ED90
@@ -18,16 +18,48 @@
 
 #ifdef AARCH64
 #define MAX_THREADS 8 //TODO!
+#elif defined(LUPI_NO_SECTION0)
+// The one Process is packed into the SuperPage along with the user BSS
+#define MAX_THREADS 33
 #else
 /*
-Max threads per process
-Hmm, the "one page per process" limit turns out to be somewhat limiting...
+Max threads per process. The Threads live outside the Process page (see
+ThreadsForProcess()) so the limit is Thread.index being a uint8, with 0xFF
+reserved to mean no thread.
 */
-#define MAX_THREADS 48
+#define MAX_THREADS 255
 #endif
 
 #define MAX_SERVERS 32
 
+#ifdef HAVE_MMU
+// Number of processes to keep set up ready for process_new() to claim, see
+// processPool_fill(). Boards may override it, zero disables the pool.
+#ifndef PROCESS_POOL_SIZE
+#define PROCESS_POOL_SIZE 2
+#endif
+#endif
+
+#ifndef LUPI_NO_SECTION0
+// There isn't room in TiLDA's packed SuperPage for per-thread priorities, so
+// there everything runs round-robin.
+#define HAVE_THREAD_PRIORITIES
+#endif
+
+// Must be more than KThreadPriorityHighest
+#define KNumThreadPriorities 8
+// Above anything a user thread can have, so DFCs always run first
+#define KThreadPriorityDfc KNumThreadPriorities
+
+// Number of CPUs the kernel may run on concurrently. Everything is currently
+// single-core, but shared data structures are protected with Spinlocks so that
+// an SMP board can set this.
+#ifndef MAX_CPUS
+#define MAX_CPUS 1
+#endif
+
+typedef uint32 Spinlock;
+
 #define MAX_PROCESS_NAME 31
 
 #define THREAD_TIMESLICE 25 // milliseconds
@@ -104,11 +136,27 @@ ASSERT_COMPILE((SIZEOF_SAVED_REGS & 15) == 0);
 typedef struct Thread {
 	Thread* prev;
 	Thread* next;
+#ifndef LUPI_NO_SECTION0
+	Process* process; // NULL for the DFC thread
+#endif
 	uint8 index;
 	uint8 state;
 	uint8 timeslice;
 	uint8 completedRequests;
-	int exitReason; // Also holds blockedReason if state is EBlockedFromSvc
+#ifdef HAVE_THREAD_PRIORITIES
+	uint8 priority; // Effective priority, ie basePriority or whatever it's inheriting if higher
+	uint8 basePriority; // As set by KExecSetThreadPriority
+#endif
+	int exitReason; // Also holds blockedReason if state is EBlockedFromSvc, or the address if EWaitForFutex
+	uint64 runTime; // in us
+	uint32 numSwitches; // Number of times the thread has been switched to
+	uint32 numSvcs;
+#ifdef ARMV7_M
+	uintptr stackBase; // Bottom of the thread's stack area, including the guard region
+#else
+	uint16 stackSize; // Maximum size of the user stack, in bytes
+	uint16 stackMapped; // How much of it is currently mapped, see thread_growStack()
+#endif
 	uintptr savedRegisters[NUM_SAVED_REGS];
 } Thread;
 
@@ -117,9 +165,14 @@ typedef enum ThreadState {
 	EBlockedFromSvc = 1, // Reason is exitReason
 	EDying = 2, // Thread has executed its last but hasn't yet been cleaned up by threadExit_dfc
 	EDead = 3, // Stacks have been freed
-	EWaitForRequest = 4,
+	EWaitForRequest = 4, // If there's a timeout, queued on SuperPage.sleepList as for ESleeping
+	EWaitForFutex = 5, // Address is exitReason, queued on Process.futexWaitList
+	ESleeping = 6, // Low 32 bits of the wake time are exitReason, queued on SuperPage.sleepList
 } ThreadState;
 
+// Longest thread_sleep() allowed, so that wake times compare correctly in 32 bits
+#define KMaxSleepTime 0x3FFFFFFF
+
 typedef enum ThreadBlockedReason {
 	EBlockedOnGetch = 1,
 	EBlockedWaitingForServerConnect = 2,
@@ -155,7 +208,8 @@ static inline bool atomic_setbool(bool* ptr, bool val) {
 /*
 This structure is one page in size (maximum), and is always page-aligned.
 Unless LUPI_NO_SECTION0 is defined, in which case there's only one and it's
-packed into the SuperPage.
+packed into the SuperPage. With an MMU the Threads are in a separate region of
+their own, which is mapped a page at a time as the process creates threads.
 */
 typedef struct Process {
 	uint32 pid;
@@ -167,8 +221,21 @@ typedef struct Process {
 	// The LSB of heapLimit will always be zero, meaning heapLimit can also act
 	// as the null-terminator for name.
 	uintptr heapLimit;
+	uint8 heapGrowers; // Threads in process_grow_heap() that haven't finished zeroing
+	// Totals for threads that have exited
+	uint64 exitedRunTime;
+	uint32 exitedNumSwitches;
+	uint32 exitedNumSvcs;
+	Thread* futexWaitList; // Threads in EWaitForFutex, in the order they started waiting
+	Thread* deadThreadList; // EDead threads below numThreads, for thread_new() to reuse
 
+#ifdef HAVE_MMU
+	uint8 numThreadPages; // How much of the threads region is mapped
+	bool pooled; // Set up by processPool_fill(), and its memory is already zeroed
+	Thread* threads; // Always ThreadsForProcess(indexForProcess(p))
+#else
 	Thread threads[MAX_THREADS];
+#endif
 } Process;
 
 /*
@@ -180,16 +247,44 @@ Except that page tables take a minimum of one page per 1MB of virtual address sp
 way we can fit it all in one page.
 */
 ASSERT_COMPILE(sizeof(Process) <= KPageSize);
+#ifdef HAVE_MMU
+ASSERT_COMPILE(MAX_THREADS * sizeof(Thread) <= (1 << KProcessThreadsShift));
+ASSERT_COMPILE(MAX_THREADS <= (KUserMemLimit - KUserStacksBase) >> USER_STACK_AREA_SHIFT);
+#endif
 
 typedef struct KAsyncRequest {
 	Thread* thread;
 	uintptr userPtr;
 } KAsyncRequest;
 
+#ifdef HAVE_PITFT
+/**
+Describes an asynchronous screen blit. The source is `rowsToStage` more rows of
+`rowBytes` bytes each, starting at `src` in the requesting process and `stride`
+bytes apart. Rows are staged into the two halves of the blit buffer by a DFC, so
+the SPI interrupt which feeds the FIFO never has to touch user memory.
+*/
+typedef struct BlitDescriptor {
+	uintptr src; // Next row to be staged
+	uint32 stride;
+	uint16 rowBytes;
+	uint16 rowsToStage;
+	uint16 len[2]; // Bytes staged in each half of the blit buffer, zero if it's free
+	uint16 txPos; // Offset into the current half of the next byte for the FIFO
+	uint8 txHalf; // Which half is being sent
+	bool stalled; // SPI interrupts are off until the DFC has staged the next half
+} BlitDescriptor;
+#endif
+
 typedef struct Server {
 	uint32 id; // a fourcc
 	KAsyncRequest serverRequest;
 	Thread* blockedClientList;
+#ifdef HAVE_THREAD_PRIORITIES
+	// Number of requests sent to the server and not yet completed, by the
+	// priority of the sender. See ipc_updateServerPriority().
+	uint16 pendingRequests[KNumThreadPriorities];
+#endif
 } Server;
 
 typedef void (*DfcFn)(uintptr arg1, uintptr arg2, uintptr arg3);
@@ -199,7 +294,10 @@ typedef struct Dfc {
 	uintptr args[3];
 } Dfc;
 
-#define MAX_DFCS 4
+// Depth of the DFC ring, must be a power of 2. Boards may override it.
+#ifndef MAX_DFCS
+#define MAX_DFCS 32
+#endif
 
 typedef struct Driver Driver;
 // Let's see if CaseyM's favourite syntax makes me retch
@@ -217,8 +315,61 @@ typedef enum Flag {
 	NeedToSendTouchUp = 0,
 	TrapAbort = 1,
 	ExceptionOccurred = 2, // only used in kluadebugger
+	TraceEnabled = 3,
 } Flag;
 
+/**
+Kernel event tracing. Events are written into a ring buffer at
+KTraceBufferAddress (on platforms which define it) whenever the TraceEnabled
+flag is set. See trace_setEnabled() and build/traceToChrome.lua.
+*/
+typedef enum TraceEventType {
+	ETraceSvcEntry = 1, // arg1 = exec number
+	ETraceSvcExit = 2, // arg1 = exec number, arg2 = result (bottom 32 bits)
+	ETraceContextSwitch = 3, // arg1 = index of new process, arg2 = new thread index
+	ETraceIrq = 4, // arg1 = platform-specific pending interrupt mask
+	ETraceDfc = 5, // arg1 = DfcFn, arg2 = first DFC argument
+	ETraceIpcSend = 6, // arg1 = request, arg2 = recipient Thread
+	ETraceIpcComplete = 7, // arg1 = request, arg2 = recipient Thread
+	ETracePageAlloc = 8, // arg1 = physical address, arg2 = (type << 24) | numPages
+} TraceEventType;
+
+typedef struct TraceEvent {
+	uint32 timestamp; // in microseconds, wraps every ~71 minutes
+	uint8 type; // a TraceEventType
+	uint8 processIdx; // 0xFF if no current process (ie DFC thread or idle)
+	uint8 threadIdx; // 0xFF if no current thread
+	uint8 spare;
+	uint32 arg1;
+	uint32 arg2;
+} TraceEvent;
+
+void trace_event(TraceEventType type, uintptr arg1, uintptr arg2);
+int trace_setEnabled(bool enable);
+
+#define TRACE(type, arg1, arg2) \
+	do { \
+		if (unlikely(TheSuperPage->flags & (1 << TraceEnabled))) { \
+			trace_event(type, (uintptr)(arg1), (uintptr)(arg2)); \
+		} \
+	} while (0)
+
+#define KProfileMaxDepth 6
+#define KProfileSampleKernel 1 // Sample was taken while in a privileged mode
+
+typedef struct ProfileSample {
+	uint8 processIdx; // 0xFF if no current process
+	uint8 threadIdx; // 0xFF if no current thread
+	uint8 depth; // Number of valid entries in callers
+	uint8 flags;
+	uint32 pc;
+	uint32 callers[KProfileMaxDepth]; // Innermost first
+} ProfileSample;
+
+void profiler_tick(void* savedRegisters);
+int profiler_control(int cmd, uintptr arg);
+int profiler_dump(int processIdx);
+
 typedef struct SuperPage {
 	uint32 totalRam;
 	uint32 boardRev;
@@ -230,30 +381,55 @@ typedef struct SuperPage {
 	Process* currentProcess;
 	Thread* currentThread;
 	int numValidProcessPages;
+#ifdef HAVE_MMU
+	int numPooledProcesses; // Pooled processes which haven't been claimed yet
+#endif
 	Thread* blockedUartReceiveIrqHandler;
 	Thread* readyList;
 	uint32 flags;
+	Thread* accountedThread; // Thread that runTime is being accumulated for, NULL if idle
+	uint32 lastAccountingTime; // board_getMicroseconds() when accountedThread was last updated
+	uint64 idleTime; // in us
+#ifdef KTraceBufferAddress
+	uint32 traceCount; // Total events written to the trace buffer, access only with atomic_*
+#endif
+#ifdef KProfileBufferAddress
+	uint32 profileCount; // Total samples written to the profile buffer
+	uint16 profileInterval; // In ticks, zero if the profiler isn't running
+	uint16 profileCountdown;
+#endif
 	uint8 screenFormat;
-	uint8 numDfcsPending;
+	uint8 dfcHighWater; // Most DFCs that have ever been pending at once
 	bool marvin;
 	uint8 uartDroppedChars; // Access only with atomic_*
 	KAsyncRequest uartRequest;
 	KAsyncRequest timerRequest;
 	uint64 timerCompletionTime;
+	Thread* sleepList; // Threads waiting with a timeout, soonest first
+	uint64 nextWakeTime; // Uptime at which the head of sleepList is due, UINT64_MAX if nothing is
 	uintptr crashRegisters[17];
 	uintptr crashFar;
 	byte uartBuf[68];
 	Server servers[MAX_SERVERS];
+#ifndef LUPI_NO_IPC
+	Spinlock serverLock; // Protects the server table and each server's client queue
+#endif
 	bool quiet; // Suppress printks
 	byte spare1;
 #ifdef ARM
 	bool rescheduleNeededOnSvcExit;
 	byte svcPsrMode; // settable so we don't accidentally enable interrupts when crashed
+	uint32 rescheduleRequestTime; // board_getMicroseconds() when rescheduleNeededOnSvcExit was set, or zero
+	uint32 maxSchedulingLatency; // Longest a reschedule has been deferred by an SVC or DFC, in us
 #endif
 #ifdef ARMV7_M
 	bool rescheduleNeededOnPendSvExit;
 	byte spare2;
 #endif
+	uint32 dfcHead; // Index of the next DFC to run, only modified by the DFC consumer
+	uint32 dfcTail; // Index of the next free slot, claimed with atomic_cas
+	uint16 dfcsCoalesced; // Number of dfc_queue() calls that merged with a pending DFC
+	uint16 dfcsDropped; // Number of dfc_queue() calls that found the ring full
 	Dfc dfcs[MAX_DFCS];
 	Driver drivers[MAX_DRIVERS];
 	KAsyncRequest inputRequest;
@@ -272,6 +448,16 @@ typedef struct SuperPage {
 	uint32 lastSvc;
 #endif
 
+#ifdef HAVE_PITFT
+	KAsyncRequest blitRequest; // thread is set while an async blit owns the SPI bus
+	BlitDescriptor blit;
+	bool tscDeferred; // Touchscreen handling was skipped because a blit owned the bus
+#endif
+#ifdef HAVE_FRAMEBUFFER
+	uintptr framebuffer; // Kernel address of pixel (0, 0), zero if allocation failed
+	uint32 framebufferPitch; // In bytes
+#endif
+
 #ifdef HAVE_AUDIO
 	uintptr audioAddr;
 	uintptr audioEnd;
@@ -312,10 +498,25 @@ ASSERT_COMPILE(sizeof(SuperPage) <= KPageSize);
 #define indexForProcess(p) ((int)((((uintptr)(p)) >> KPageShift) & 0xFF))
 #endif
 
+#ifdef HAVE_MMU
+#define ThreadsForProcess(idx) ((Thread*)(uintptr)(KProcessThreadsSection + ((idx) << KProcessThreadsShift)))
+#endif
+
+
+// Smallest stack KExecThreadCreate will give a thread
+#define KMinUserStackSize 1024
 
 #ifdef ARMV7_M
 
-#define userStackForThread(t) (KUserMemLimit - (((t)->index + 1) << USER_STACK_AREA_SHIFT))
+/*
+Stacks are packed downwards from KUserMemLimit in thread index order, each with
+a KStackGuardSize no-access MPU region below it. userStackForThread() is the
+lowest address the thread may use.
+*/
+#define KStackGuardShift 5 // The smallest MPU region
+#define KStackGuardSize (1 << KStackGuardShift)
+#define userStackTop(t) ((t)->index ? processForThread(t)->threads[(t)->index - 1].stackBase : KUserMemLimit)
+#define userStackForThread(t) ((t)->stackBase + KStackGuardSize)
 
 #else
 
@@ -323,7 +524,9 @@ ASSERT_COMPILE(sizeof(SuperPage) <= KPageSize);
 #define svcStackOffset(threadIdx) (threadIdx << USER_STACK_AREA_SHIFT)
 #define svcStackBase(threadIdx) (KUserStacksBase + svcStackOffset(threadIdx))
 #define userStackBase(threadIdx) (svcStackBase(threadIdx) + 2*KPageSize)
-#define userStackForThread(t) userStackBase(t->index)
+// A thread's stack is the top stackSize bytes of the USER_STACK_SIZE area
+#define userStackTop(t) (userStackBase((t)->index) + USER_STACK_SIZE)
+#define userStackForThread(t) (userStackTop(t) - (t)->stackSize)
 
 #endif
 
@@ -336,12 +539,7 @@ static inline Process* processForThread(Thread* t) {
 #ifdef LUPI_NO_SECTION0
 	return GetProcess(0);
 #else
-	if ((uintptr)t < KProcessesSection) {
-		// Special case. The DFC thread doesn't have an associated process
-		return NULL;
-	}
-	// Otherwise, threads are within their process page, so simply mask off and cast
-	return (Process*)(((uintptr)t) & ~(KPageSize - 1));
+	return t->process;
 #endif
 }
 
@@ -353,34 +551,89 @@ NOIGNORE int process_new(const char* name, Process** resultProcess);
 NORETURN process_start(Process* p);
 NOIGNORE bool process_grow_heap(Process* p, int incr);
 int process_reset(Thread* t, const char* name);
-NOIGNORE int thread_new(Process* p, uintptr context, Thread** resultThread);
+NOIGNORE int thread_new(Process* p, uintptr context, uint32 stackSize, Thread** resultThread);
 void thread_setState(Thread* t, enum ThreadState s);
 NORETURN thread_exit(Thread* t, int reason);
 void thread_requestSignal(KAsyncRequest* request);
 void thread_requestComplete(KAsyncRequest* request, uintptr result);
 void thread_setBlockedReason(Thread* t, ThreadBlockedReason reason);
+void thread_futexWait(Thread* t, uintptr addr);
+void thread_sleep(Thread* t, ThreadState state, int ms);
+void thread_cancelSleep(Thread* t);
+void thread_wakeSleepers(uintptr arg1, uintptr arg2, uintptr arg3);
+bool thread_growStack(Thread* t, uintptr addr);
+int process_futexWake(Process* p, uintptr addr, int count);
 void thread_enqueueBefore(Thread* t, Thread* before);
 void thread_dequeue(Thread* t, Thread** head);
 void thread_yield(Thread* t);
+bool thread_handoff(Thread* from, Thread* to);
 void thread_writeSvcResult(Thread* t, uintptr result);
+void thread_accountSwitch(Thread* next);
+NOIGNORE int thread_setPriority(Thread* t, int priority);
+void thread_setEffectivePriority(Thread* t, int priority);
+int process_getCpuStats(uintptr userBuf, int maxRecords);
 
 int kern_disableInterrupts();
 void kern_enableInterrupts();
 void kern_restoreInterrupts(int mask);
 void kern_sleep(int ms);
+#ifdef AARCH64
+// The AArch64 port doesn't reschedule from IRQs yet (see handleIrq()), so no
+// reschedule is ever waiting for a preemption point to act on
+static inline void kern_preemptionPoint() {}
+#else
+void kern_preemptionPoint();
+#endif
+
+/**
+Disables interrupts and takes `lock`, returning the previous interrupt state to
+be passed to [spinlock_release()](#spinlock_release). Spinlocks are not
+recursive. On a single-CPU build there is nothing to spin on, so this just
+checks that the lock isn't already held.
+*/
+static inline int spinlock_acquire(Spinlock* lock) {
+	int mask = kern_disableInterrupts();
+#if MAX_CPUS > 1
+	while (!atomic_cas(lock, 0, 1)) {
+		// Spin
+	}
+#else
+	ASSERT(*lock == 0, (uintptr)lock);
+	*lock = 1;
+#endif
+	return mask;
+}
+
+static inline void spinlock_release(Spinlock* lock, int mask) {
+#if MAX_CPUS > 1
+	atomic_set(lock, 0);
+#else
+	*lock = 0;
+#endif
+	kern_restoreInterrupts(mask);
+}
+uint32 board_getMicroseconds();
 NORETURN reschedule();
 void saveCurrentRegistersForThread(void* savedRegisters);
 void dfc_queue(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3);
+bool dfc_push(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3);
+bool dfc_pop(Dfc* result);
+static inline bool dfc_pending() {
+	return TheSuperPage->dfcHead != TheSuperPage->dfcTail;
+}
 void dfc_requestComplete(KAsyncRequest* request, int result);
 bool irq_checkDfcs();
 int kern_setInputRequest(uintptr userInputRequestPtr);
 
-NOIGNORE uintptr ipc_mapNewSharedPageInCurrentProcess();
+NOIGNORE uintptr ipc_mapNewSharedPagesInCurrentProcess(int numPages);
+NOIGNORE int ipc_grantSharedPages(uintptr ipcPage, uintptr sharedPages, int numPages);
+NOIGNORE int ipc_checkSharedPages(uintptr ipcPage, uintptr sharedPages, int numPages);
 NOIGNORE int ipc_connectToServer(uint32 id, uintptr sharedPage);
 NOIGNORE int ipc_createServer(uint32 id, Thread* thread);
 NOIGNORE void ipc_processExited(PageAllocator* pa, Process* p);
 void ipc_requestServerMsg(Thread* serverThread, uintptr serverRequest);
-NOIGNORE int ipc_completeRequest(uintptr request, bool toServer);
+NOIGNORE int ipc_completeRequest(uintptr request, bool toServer, Thread** woken);
+void ipc_threadPriorityChanged(Thread* t);
 
 void ring_push(byte* ring, int size, byte b);
 byte ring_pop(byte* ring, int size);
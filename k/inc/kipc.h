@@ -16,10 +16,16 @@
 
 #define KSharedPageMappingServerIsSet (0x80)
 #define KSharedPageMappingPageOwned (0x40)
+// The priority of the requests outstanding on the page, and how many there are
+#define KSharedPageMappingPriorityShift 2
+#define KSharedPageMappingPriorityMask (0x7 << KSharedPageMappingPriorityShift)
+#define KSharedPageMappingPendingShift 24
+#define KSharedPageMappingMaxPending 0xFF
 
 /*
 Since the TTBCR setup means the bottom of the kernel PDE is never even used,
-We have 256 spare uint32s which we will steal for holding the shared pages mappings
+We have 256 spare uint32s which we will steal for holding the shared pages mappings.
+Setting the mapping clears any record of outstanding requests.
 */
 inline static uint32* sharedPagePtrForIndex(int idx) {
 	return ((uint32*)KKernelPdeBase) + idx;
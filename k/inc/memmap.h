@@ -23,17 +23,23 @@ Unused		-----------------	F808F000-F8090000	(4k)
 KKernPtForProcPts_pt			F8090000-F8091000	(4k)
 atags		00000000-00001000	F8091000-F8092000	(12k)
 KDfcThreadStack					F8092000-F8093000	(4k)
-Unused		-----------------	F8093000-F80C0000
+KTraceBuffer					F8093000-F80A3000	(64k)
+KProfileBuffer					F80A3000-F80B3000	(64k)
+KProcessThreadsSection_pt		F80B3000-F80BB000	(32k)
+KBlitBuffer						F80BB000-F80BD000	(8k)
+Unused		-----------------	F80BD000-F80C0000
 PageAlloctr	0008C000-dontcare	F80C0000-F8100000	(256k)
 -------------------------------------------------
 Processes						F8100000-F8200000	(1 MB)
 Kern PTs for user proc PTs		F8200000-F8300000	(1 MB)
 User PDEs						F8300000-F8400000	(1 MB)
+Process Threads					F8400000-F8C00000	(8 MB)
 -------------------------------------------------
 User PTs						90000000-A0000000	(256MB)
 -------------------------------------------------
 Pi specific:
 Peripherals	20000000-20300000	F2000000-F2300000	(3 MB)
+Framebuffer	(from the GPU)		F3000000-F3800000	(8 MB max)
 </pre>
 */
 
@@ -67,6 +73,13 @@ Peripherals	20000000-20300000	F2000000-F2300000	(3 MB)
 
 #define KKernelAtagsBase		0xF8091000ul
 #define KDfcThreadStack			0xF8092000ul
+#define KTraceBufferAddress		0xF8093000ul
+#define KTraceBufferSize		0x00010000ul // 64kB, 4096 TraceEvents
+#define KProfileBufferAddress	0xF80A3000ul
+#define KProfileBufferSize		0x00010000ul // 64kB, 2048 ProfileSamples
+// Only mapped by screen drivers which stage async blits through it
+#define KBlitBufferAddress		0xF80BB000ul
+#define KBlitBufferSize			0x00002000ul // 8kB, two halves of 4kB
 
 #define KSuperPageAddress		0xF8000000ul
 
@@ -81,8 +94,20 @@ Peripherals	20000000-20300000	F2000000-F2300000	(3 MB)
 #define KKernPtForProcPts		0xF8200000ul
 #define KKernPtForProcPts_pt	0xF8090000ul
 
+// 32kB of Threads per process, so this spans 8 sections. Their PTs are
+// consecutive pages starting at KProcessThreadsSection_pt, and are only created
+// when a process first needs them.
+#define KProcessThreadsSection		0xF8400000ul
+#define KProcessThreadsSection_pt	0xF80B3000ul
+#define KProcessThreadsShift		15
+
 #define KProcessPtBase			0x90000000ul
 
+// Only mapped by build/pi/framebuffer.c, at whatever offset into its first
+// section the GPU allocated it
+#define KFramebufferBase		0xF3000000ul
+#define KFramebufferMaxSize		0x00800000ul
+
 #define KLuaDebuggerSection		0x42000000ul
 #define KLuaDebuggerStackBase	0x42000000ul
 #define KLuaDebuggerStackSize	0x00004000ul
@@ -98,7 +123,7 @@ Unmapped						00000000-00007000
 BSS								00007000-00008000
 Heap							00008000-heapLimit
 Shared pages					0F000000-0F100000
-Thread stacks					0FE00000-10000000
+Thread stacks					0F800000-10000000
 </pre>
 */
 
@@ -108,11 +133,12 @@ Thread stacks					0FE00000-10000000
 // Note these next two are also defined in usersrc/ipc.c
 #define KSharedPagesBase		0x0F000000ul
 #define KSharedPagesSize		0x00100000ul
-#define KUserStacksBase			0x0FE00000ul
+#define KUserStacksBase			0x0F800000ul // Room for 256 stack areas
 #define KUserMemLimit			0x10000000ul
 
 /**
-I'm feeling generous.
+I'm feeling generous. This is the most a thread's stack can grow to, most
+threads will only ever have a page or two of it mapped.
 */
 #define USER_STACK_SIZE (16*1024)
 
@@ -128,6 +154,9 @@ calculating the svc stack address simpler.
 	user stack			USER_STACK_SIZE (16kB)
 	guard page			---------------
 	padding				--------------- (4kB)
+
+The user stack occupies the top `stackSize` bytes of its area and is mapped on
+demand as it grows downwards, see thread_growStack().
 */
 
 #define LoadSuperPageAddress(reg) asm("MOV " #reg ", %0" : : "i" (KSuperPageAddress))
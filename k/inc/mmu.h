@@ -31,6 +31,15 @@ void mmu_enable();
 #endif
 void mmu_mapSect0Data(uintptr virtualAddress, uintptr physicalAddress, int npages);
 
+#ifdef HAVE_MPU
+/**
+Makes the KStackGuardSize bytes at `addr` inaccessible, replacing whatever the
+previous call protected. Called on every context switch with the bottom of the
+new thread's stack area.
+*/
+void mmu_setStackGuard(uintptr addr);
+#endif
+
 /**
 Maps 1MB of physically contiguous memory in the top-level PDE at the given
 virtual address. Returns the physical address, or zero on error.
@@ -42,6 +51,15 @@ Only currently supports freeing sections created with `mmu_mapSectionContiguous`
 */
 void mmu_unmapSection(PageAllocator* pa, uintptr virtualAddress);
 
+/**
+Maps `size` bytes of physical memory that the page allocator doesn't own (such
+as memory handed out by the GPU) as uncached device memory, using as many 1MB
+sections as it needs starting at `virtualAddress`. `physicalAddress` doesn't
+have to be section aligned. Returns the virtual address that `physicalAddress`
+ended up at. The caller must call `mmu_finishedUpdatingPageTables()`.
+*/
+uintptr mmu_mapPhysicalSections(uintptr virtualAddress, uintptr physicalAddress, uint32 size);
+
 /**
 Let 'PTS' be the section where the page table for the new section is going to go.
 This function does 3 things.
@@ -112,4 +130,11 @@ int mmu_processInit(Process* p);
 void mmu_processExited(PageAllocator* pa, Process* p);
 Process* mmu_newProcess(PageAllocator* pa);
 
+/**
+Makes sure enough of `p->threads` is mapped for it to hold `numThreads`
+Threads. Pages stay mapped when the process exits, for whatever next uses the
+Process page.
+*/
+bool mmu_mapProcessThreads(PageAllocator* pa, Process* p, int numThreads);
+
 #endif
@@ -17,6 +17,7 @@
 typedef struct PageAllocator {
 	int numPages;
 	int firstFreePage;
+	Spinlock lock;
 	// Don't add anything here without also updating function pageStats()
 	uint8 pageInfo[1]; // Extends beyond struct, up to numPages
 } PageAllocator;
@@ -2,34 +2,46 @@
 
 #include <kipc.h>
 #include <err.h>
+#include <exec.h>
 #include <pageAllocator.h>
 
 #ifdef HAVE_MMU
 
-uintptr ipc_mapNewSharedPageInCurrentProcess() {
-	// First find an unused page
+uintptr ipc_mapNewSharedPagesInCurrentProcess(int numPages) {
+	if (numPages < 1 || numPages > MAX_SHARED_PAGES) return 0;
+	// First find enough consecutive unused pages
 	int idx = -1;
-	uint32* sharedPageMappings = sharedPagePtrForIndex(0);
+	int run = 0;
 	for (int i = 0; i < MAX_SHARED_PAGES; i++) {
-		if (!sharedPageMappings[i]) {
-			idx = i;
+		if (*sharedPagePtrForIndex(i)) {
+			run = 0;
+		} else if (++run == numPages) {
+			idx = i + 1 - numPages;
 			break;
 		}
 	}
 	if (idx == -1) return 0;
 
-	// Now map it. Since all involved processes get the same address for a given shared
+	// Now map them. Since all involved processes get the same address for a given shared
 	// page, we don't need any additional means of referencing the page, and we don't
 	// even need to track its physical address.
 	uintptr userPtr = userAddressForSharedPage(idx);
 	Process* owner = TheSuperPage->currentProcess;
-	bool ok = mmu_newSharedPage(Al, owner, userPtr);
-	if (!ok) {
-		return 0;
+	for (int i = 0; i < numPages; i++) {
+		bool ok = mmu_newSharedPage(Al, owner, userPtr + (i << KPageShift));
+		if (!ok) {
+			if (i) mmu_unmapPagesInProcess(Al, owner, userPtr, i);
+			mmu_finishedUpdatingPageTables();
+			return 0;
+		}
+	}
+	for (int i = 0; i < numPages; i++) {
+		setSharedPageMapping(idx + i, NULL, owner);
 	}
-	setSharedPageMapping(idx, NULL, owner);
 	mmu_finishedUpdatingPageTables();
-	zeroPage((void*)userPtr);
+	for (int i = 0; i < numPages; i++) {
+		zeroPage((void*)(userPtr + (i << KPageShift)));
+	}
 	return userPtr;
 }
 
@@ -51,32 +63,207 @@ static int sharedPageIsValid(uintptr sharedPage, bool toServer) {
 	return sharedPageIdx;
 }
 
+static bool sharedPagesInRange(uintptr sharedPages, int numPages) {
+	return sharedPages >= KSharedPagesBase
+		&& (sharedPages & (KPageSize - 1)) == 0
+		&& numPages > 0
+		&& sharedPages + (numPages << KPageShift) <= KSharedPagesBase + KSharedPagesSize;
+}
+
+/**
+Shares `numPages` pages starting at `sharedPages`, which the current process
+must own and not have shared yet, with the server that `ipcPage` is connected
+to. From then on they are tied to the server and client exactly like the IPC
+page is, so they stay mapped in the server until both sides are done with them.
+This is how a client hands a server a buffer bigger than a message.
+*/
+int ipc_grantSharedPages(uintptr ipcPage, uintptr sharedPages, int numPages) {
+	if (!sharedPagesInRange(ipcPage, 1) || !sharedPagesInRange(sharedPages, numPages)) {
+		return KErrBadHandle;
+	}
+	int ipcPageIdx = sharedPageIsValid(ipcPage, true);
+	if (ipcPageIdx < 0) return ipcPageIdx;
+	Server* s = serverForSharedPage(ipcPageIdx);
+	if (!s) return KErrBadHandle; // Not connected yet
+
+	Process* cp = TheSuperPage->currentProcess;
+	const int idx = indexForUserSharedPage(sharedPages);
+	for (int i = idx; i < idx + numPages; i++) {
+		if (ownerForSharedPage(i) != cp || serverForSharedPage(i)) {
+			return KErrBadHandle;
+		}
+	}
+	int result = 0;
+	for (int i = idx; i < idx + numPages; i++) {
+		if (!mmu_sharePage(Al, cp, processForServer(s), userAddressForSharedPage(i))) {
+			// The ones already done are properly shared, so process exit cleans them up
+			result = KErrNoMemory;
+			break;
+		}
+		setSharedPageMapping(i, s, cp);
+	}
+	mmu_finishedUpdatingPageTables();
+	return result;
+}
+
+/**
+For the server side of a connection: checks that the pages were given to the
+current process by ipc_grantSharedPages() from the client that owns `ipcPage`,
+so they are safe to access.
+*/
+int ipc_checkSharedPages(uintptr ipcPage, uintptr sharedPages, int numPages) {
+	if (!sharedPagesInRange(ipcPage, 1) || !sharedPagesInRange(sharedPages, numPages)) {
+		return KErrBadHandle;
+	}
+	int ipcPageIdx = sharedPageIsValid(ipcPage, false);
+	if (ipcPageIdx < 0) return ipcPageIdx;
+	Server* s = serverForSharedPage(ipcPageIdx);
+	Process* owner = ownerForSharedPage(ipcPageIdx);
+	const int idx = indexForUserSharedPage(sharedPages);
+	for (int i = idx; i < idx + numPages; i++) {
+		if (serverForSharedPage(i) != s || ownerForSharedPage(i) != owner) {
+			return KErrBadHandle;
+		}
+	}
+	return 0;
+}
+
 #else
 
-uintptr ipc_mapNewSharedPageInCurrentProcess() {
+uintptr ipc_mapNewSharedPagesInCurrentProcess(int numPages) {
 	return 0;
 }
 
+int ipc_grantSharedPages(uintptr ipcPage, uintptr sharedPages, int numPages) {
+	return KErrNotSupported;
+}
+
+int ipc_checkSharedPages(uintptr ipcPage, uintptr sharedPages, int numPages) {
+	return KErrNotSupported;
+}
+
+#endif // HAVE_MMU
+
+#ifdef HAVE_THREAD_PRIORITIES
+
+ASSERT_COMPILE(KNumThreadPriorities <= 8); // Has to fit in KSharedPageMappingPriorityMask
+
+/**
+Servers inherit the priority of whoever is waiting on them, so that a high
+priority client isn't held up behind everything else the server is competing
+with. The server thread's effective priority is the highest of its own base
+priority, the priority of every client blocked in `blockedClientList`, and the
+priority of every request sent to it which it hasn't completed yet. The latter
+are counted in `pendingRequests`, and each shared page records which priority
+its outstanding requests were counted against, so they can be released by
+ipc_completeRequest() or when the client exits.
+*/
+static void ipc_updateServerPriority(Server* s) {
+	Thread* t = s->serverRequest.thread;
+	int priority = t->basePriority;
+	for (int i = KNumThreadPriorities - 1; i > priority; i--) {
+		if (s->pendingRequests[i]) {
+			priority = i;
+			break;
+		}
+	}
+	Thread* client = s->blockedClientList;
+	if (client) {
+		do {
+			if (client->priority > priority) priority = client->priority;
+			client = client->next;
+		} while (client != s->blockedClientList);
+	}
+	if (priority != t->priority) {
+		thread_setEffectivePriority(t, priority);
+	}
+}
+
+#ifdef HAVE_MMU
+// Moves all of the page's outstanding requests to `priority` and sets how many there are
+static void setPendingRequests(Server* s, int sharedPageIdx, int priority, int count) {
+	uint32* mapping = sharedPagePtrForIndex(sharedPageIdx);
+	const uint32 old = *mapping;
+	const int oldPriority = (old & KSharedPageMappingPriorityMask) >> KSharedPageMappingPriorityShift;
+	const int oldCount = old >> KSharedPageMappingPendingShift;
+	s->pendingRequests[oldPriority] -= oldCount;
+	s->pendingRequests[priority] += count;
+	*mapping = (old & ~(KSharedPageMappingPriorityMask | (KSharedPageMappingMaxPending << KSharedPageMappingPendingShift)))
+		| (priority << KSharedPageMappingPriorityShift)
+		| (count << KSharedPageMappingPendingShift);
+	ipc_updateServerPriority(s);
+}
+
+static void addPendingRequest(Server* s, int sharedPageIdx, int priority) {
+	const uint32 mapping = *sharedPagePtrForIndex(sharedPageIdx);
+	int count = mapping >> KSharedPageMappingPendingShift;
+	if (count) {
+		const int pagePriority = (mapping & KSharedPageMappingPriorityMask) >> KSharedPageMappingPriorityShift;
+		if (pagePriority > priority) priority = pagePriority;
+	}
+	// If a client is firing off this many requests without waiting, it can't
+	// really complain about the accounting being a bit off
+	if (count < KSharedPageMappingMaxPending) count++;
+	setPendingRequests(s, sharedPageIdx, priority, count);
+}
+
+static void releasePendingRequest(Server* s, int sharedPageIdx) {
+	const uint32 mapping = *sharedPagePtrForIndex(sharedPageIdx);
+	const int count = mapping >> KSharedPageMappingPendingShift;
+	if (count == 0) return; // Server completing something it wasn't sent
+	const int priority = (mapping & KSharedPageMappingPriorityMask) >> KSharedPageMappingPriorityShift;
+	setPendingRequests(s, sharedPageIdx, count == 1 ? KThreadPriorityLowest : priority, count - 1);
+}
 #endif // HAVE_MMU
 
+void ipc_threadPriorityChanged(Thread* t) {
+	Server* ss = TheSuperPage->servers;
+	for (int i = 0; i < MAX_SERVERS; i++) {
+		if (ss[i].serverRequest.thread == t) {
+			ipc_updateServerPriority(&ss[i]);
+			break;
+		}
+	}
+}
+
+#else
+
+#define ipc_updateServerPriority(s)
+#define setPendingRequests(s, idx, priority, count)
+#define addPendingRequest(s, idx, priority)
+#define releasePendingRequest(s, idx)
+
+#endif // HAVE_THREAD_PRIORITIES
+
 // returns server idx or err
 int ipc_createServer(uint32 id, Thread* thread) {
 	// Find a free Server slot
 	int idx = -1;
 	Server* ss = TheSuperPage->servers;
+	int mask = spinlock_acquire(&TheSuperPage->serverLock);
 	for (int i = 0; i < MAX_SERVERS; i++) {
 		if (ss[i].id == id) {
+			spinlock_release(&TheSuperPage->serverLock, mask);
 			return KErrAlreadyExists;
 		} else if (ss[i].serverRequest.thread == NULL) {
 			idx = i;
 		}
 	}
-	if (idx == -1) return KErrNotFound;
+	if (idx == -1) {
+		spinlock_release(&TheSuperPage->serverLock, mask);
+		return KErrNotFound;
+	}
 	Server* s = &ss[idx];
-	s->id = id;
 	s->serverRequest.thread = thread;
 	s->serverRequest.userPtr = 0;
 	s->blockedClientList = NULL;
+#ifdef HAVE_THREAD_PRIORITIES
+	for (int i = 0; i < KNumThreadPriorities; i++) {
+		s->pendingRequests[i] = 0;
+	}
+#endif
+	s->id = id; // Last, so a lookup by id never finds a half-created server
+	spinlock_release(&TheSuperPage->serverLock, mask);
 
 	// Done.
 	return 0;
@@ -86,6 +273,7 @@ void ipc_requestServerMsg(Thread* serverThread, uintptr serverRequest) {
 	// Find the server
 	Server* s = NULL;
 	Server* ss = TheSuperPage->servers;
+	int mask = spinlock_acquire(&TheSuperPage->serverLock);
 	for (int i = 0; i < MAX_SERVERS; i++) {
 		if (ss[i].serverRequest.thread == serverThread) {
 			s = &ss[i];
@@ -104,6 +292,7 @@ void ipc_requestServerMsg(Thread* serverThread, uintptr serverRequest) {
 			// it explicit. For a start that would allow us to actually return
 			// a result from the connect
 			thread_dequeue(t, &s->blockedClientList);
+			ipc_updateServerPriority(s);
 			uintptr sharedPage = t->savedRegisters[2];
 			t->savedRegisters[1] = 0;
 			t->savedRegisters[0] = sharedPage;
@@ -115,6 +304,7 @@ void ipc_requestServerMsg(Thread* serverThread, uintptr serverRequest) {
 			thread_requestComplete(&s->serverRequest, sharedPage);
 		}
 	}
+	spinlock_release(&TheSuperPage->serverLock, mask);
 }
 
 int ipc_connectToServer(uint32 id, uintptr sharedPage) {
@@ -130,19 +320,34 @@ int ipc_connectToServer(uint32 id, uintptr sharedPage) {
 	// Now find the server
 	Server* ss = TheSuperPage->servers;
 	Server* s = NULL;
+	// Held until the client is queued on the server, so that the server's
+	// blockedClientList and serverRequest can't change under us
+	int mask = spinlock_acquire(&TheSuperPage->serverLock);
 	for (int i = 0; i < MAX_SERVERS; i++) {
 		if (ss[i].id == id) {
 			s = &ss[i];
 			break;
 		}
 	}
-	if (!s) return KErrNotFound;
+	if (!s) {
+		spinlock_release(&TheSuperPage->serverLock, mask);
+		return KErrNotFound;
+	}
+	Server* oldServer = serverForSharedPage(sharedPageIdx);
+	if (oldServer) {
+		// As when the client exits, nothing still outstanding with the server
+		// the page was connected to before is going to be completed now
+		setPendingRequests(oldServer, sharedPageIdx, KThreadPriorityLowest, 0);
+	}
 	// Update mapping for the sharedPage (set the server ptr)
 	setSharedPageMapping(sharedPageIdx, s, src);
 
 	// map this page into the server too
 	bool ok = mmu_sharePage(Al, src, processForServer(s), sharedPage);
-	if (!ok) return KErrNoMemory;
+	if (!ok) {
+		spinlock_release(&TheSuperPage->serverLock, mask);
+		return KErrNoMemory;
+	}
 
 	// And now, we tell the server, blocking the client until the server acknowledges
 	// (handleSvc will already have saved the client's user state)
@@ -151,6 +356,7 @@ int ipc_connectToServer(uint32 id, uintptr sharedPage) {
 	thread_enqueueBefore(client, s->blockedClientList);
 	if (!s->blockedClientList) s->blockedClientList = client;
 	client->savedRegisters[2] = sharedPage; // Stash this somewhere we're not using right now
+	ipc_updateServerPriority(s);
 
 	if (s->serverRequest.userPtr) {
 		thread_setBlockedReason(client, EBlockedInServerConnect);
@@ -158,6 +364,7 @@ int ipc_connectToServer(uint32 id, uintptr sharedPage) {
 	} else {
 		thread_setBlockedReason(client, EBlockedWaitingForServerConnect);
 	}
+	spinlock_release(&TheSuperPage->serverLock, mask);
 	// We'll get serviced (eventually) from ipc_requestServerMsg
 	reschedule();
 	//return 0;
@@ -181,6 +388,10 @@ void ipc_processExited(PageAllocator* pa, Process* p) {
 
 		bool changed = false;
 		if (owner == p) {
+			if (server) {
+				// Nobody's waiting for the responses any more
+				setPendingRequests(server, i, KThreadPriorityLowest, 0);
+			}
 			owner = NULL;
 			changed = true;
 		} else if (server && processForServer(server) == p) {
@@ -198,7 +409,12 @@ void ipc_processExited(PageAllocator* pa, Process* p) {
 #endif
 }
 
-int ipc_completeRequest(uintptr request, bool toServer) {
+/**
+Signals the other end of an IPC. If that woke a thread which was waiting for a
+request, it is returned in `woken` so the caller can hand off to it.
+*/
+int ipc_completeRequest(uintptr request, bool toServer, Thread** woken) {
+	*woken = NULL;
 #ifdef HAVE_MMU
 	int sharedPageIdx = sharedPageIsValid(request, toServer);
 	if (sharedPageIdx < 0) {
@@ -210,9 +426,18 @@ int ipc_completeRequest(uintptr request, bool toServer) {
 	if (toServer) recipient = s->serverRequest.thread;
 	else recipient = &ownerForSharedPage(sharedPageIdx)->threads[0]; // TODO support non-main threads
 	ASSERT(recipient, request, (uintptr)s);
+	// Do this before the signal, so a boosted server is readied at its new priority
+	if (toServer) {
+		addPendingRequest(s, sharedPageIdx, TheSuperPage->currentThread->priority);
+	} else {
+		releasePendingRequest(s, sharedPageIdx);
+	}
+	TRACE(toServer ? ETraceIpcSend : ETraceIpcComplete, request, recipient);
 	KAsyncRequest req = { .thread = recipient, .userPtr = request };
+	bool wasWaiting = recipient->state == EWaitForRequest;
 	// User-side handles writing the result, we just have to signal
 	thread_requestSignal(&req);
+	if (wasWaiting) *woken = recipient;
 	return 0;
 #else
 	return KErrNotSupported;
@@ -323,6 +323,17 @@ void mmu_unmapSection(PageAllocator* pa, uintptr virtualAddress) {
 	pageAllocator_freePages(pa, physAddr, KPagesInSection);
 }
 
+uintptr mmu_mapPhysicalSections(uintptr virtualAddress, uintptr physicalAddress, uint32 size) {
+	uint32* pde = (uint32*)KKernelPdeBase;
+	const uintptr offset = physicalAddress & KSectionMask;
+	const uintptr start = physicalAddress - offset;
+	const int numSections = (offset + size + KSectionMask) >> KSectionShift;
+	for (int i = 0; i < numSections; i++) {
+		pde[(virtualAddress >> KAddrToPdeIndexShift) + i] = (start + (i << KSectionShift)) | KPdeSectionPeripheral;
+	}
+	return virtualAddress + offset;
+}
+
 bool mmu_mapSection(PageAllocator* pa, uintptr sectionAddress, uintptr ptAddress, uint32* ptsPt, uint8 ptPageType) {
 	// Map a page for the section pt into the ptsPt
 	uint32 pageTablePhysical = mmu_mapPageInSection(pa, ptsPt, ptAddress, ptPageType);
@@ -558,8 +569,31 @@ Process* mmu_newProcess(PageAllocator* pa) {
 		if (phys) {
 			mmu_finishedUpdatingPageTables();
 			result->pdePhysicalAddress = 0;
+			result->numThreadPages = 0;
+			result->pooled = false;
+			result->threads = ThreadsForProcess(s->numValidProcessPages);
 			s->numValidProcessPages++;
 		}
 	}
 	return result;
 }
+
+bool mmu_mapProcessThreads(PageAllocator* pa, Process* p, int numThreads) {
+	const uintptr end = (uintptr)&p->threads[numThreads];
+	uintptr page = (uintptr)p->threads + (p->numThreadPages << KPageShift);
+	bool ok = true;
+	for (; page < end; page += KPageSize) {
+		const int sectionIdx = (page - KProcessThreadsSection) >> KSectionShift;
+		uint32* pt = (uint32*)(KProcessThreadsSection_pt + (sectionIdx << KPageShift));
+		uint32* kernPde = (uint32*)KKernelPdeBase;
+		if (!kernPde[page >> KAddrToPdeIndexShift]) {
+			ok = mmu_mapSection(pa, page & ~KSectionMask, (uintptr)pt, (uint32*)KSectionZeroPt, KPageSect0);
+			if (!ok) break;
+		}
+		ok = mmu_mapPageInSection(pa, pt, page, KPageProcess) != 0;
+		if (!ok) break;
+		p->numThreadPages++;
+	}
+	mmu_finishedUpdatingPageTables();
+	return ok;
+}
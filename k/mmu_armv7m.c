@@ -10,6 +10,7 @@ ASSERT_COMPILE(KKernelCodesize == (1 << KLogKernelCodesize));
 #define KRasrUserData	0x130B0001 // XN=1, AP=011, TEX=001, C=1, B=1, S=0
 #define KRasrPeripheral	0x11100001 // XN=1, AP=001, TEX=010, C=B=S=0
 #define KRasrScb		0x11000001 // XN=1, AP=001, TEX=000, C=B=S=0
+#define KRasrNoAccess	0x10000001 // XN=1, AP=000, TEX=000, C=B=S=0
 
 // This macro ensures that the constraints on addr and size alignment are correct
 #define SET_REGION(num, addr, sizeShift, attribs) \
@@ -47,7 +48,17 @@ void mmu_init() {
 	SET_REGION(5, 0x22E00000, 21, KRasrUserData); // 1<<21 = 2MB (64KB real mem)
 	SET_REGION(6, 0x23000000, 20, KRasrUserData | (0xC0 << 8)); // 1 << 20 = 1MB (32KB real mem)
 
-	SET_REGION(7, 0, 0, 0); // Region 7 unused
+	// Region 7 - the current thread's stack guard, see mmu_setStackGuard()
+	SET_REGION(7, 0, 0, 0);
+}
+
+void mmu_setStackGuard(uintptr addr) {
+	// Higher-numbered regions take priority, so this overrides regions 1 and 2
+	PUT32(MPU_RNR, 7);
+	PUT32(MPU_RBAR, addr);
+	PUT32(MPU_RASR, ((KStackGuardShift - 1) << RASR_SIZESHIFT) | KRasrNoAccess);
+	// The exception return that follows is enough of an ISB
+	asm("DSB");
 }
 
 void mmu_enable() {
@@ -70,28 +70,37 @@ uintptr pageAllocator_allocAligned(PageAllocator* allocator, uint8 type, int num
 	if (alignment == 0) alignment = KPageSize;
 	ASSERT(IS_POW2(alignment), alignment);
 
+	int mask = spinlock_acquire(&allocator->lock);
 	int idx = pageAllocator_findNextFreePage(allocator, num, alignment);
-	if (idx == -1) return 0;
+	if (idx == -1) {
+		spinlock_release(&allocator->lock, mask);
+		return 0;
+	}
 
 	// Mark pages as used
 	const int end = idx + num;
 	for (int i = idx; i < end; i++) {
 		allocator->pageInfo[i] = type;
 	}
+	spinlock_release(&allocator->lock, mask);
 
-	return KPhysicalRamBase + (idx << KPageShift);
+	uintptr result = KPhysicalRamBase + (idx << KPageShift);
+	TRACE(ETracePageAlloc, result, (type << 24) | num);
+	return result;
 }
 
 static void pageAllocator_doFree(PageAllocator* allocator, int idx, int num) {
 	//ASSERT(idx >= 0 && num > 0 && idx + num < allocator->numPages, idx, num);
 	uint8* p = &allocator->pageInfo[idx];
 	const uint8* endp = p + num;
+	int mask = spinlock_acquire(&allocator->lock);
 	for (; p != endp; p++) {
 		*p = KPageFree;
 	}
 	if (idx < allocator->firstFreePage) {
 		allocator->firstFreePage = idx;
 	}
+	spinlock_release(&allocator->lock, mask);
 }
 
 void pageAllocator_free(PageAllocator* pa, uintptr addr) {
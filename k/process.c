@@ -3,6 +3,7 @@
 #include <mmu.h>
 #include ARCH_HEADER
 #include <err.h>
+#include <exec.h>
 #include <ipc.h>
 #include <module.h>
 
@@ -13,7 +14,7 @@ extern uint32 user_ProcessPid;
 extern char user_ProcessName[];
 
 #ifndef LUPI_NO_PROCESS
-static bool thread_init(Thread* t, uintptr context);
+static bool thread_init(Thread* t, uintptr context, uint32 stackSize);
 bool do_thread_init(Thread* t, uintptr entryPoint, uintptr context);
 NORETURN do_process_start(uintptr sp);
 int newProcessEntryPoint();
@@ -22,34 +23,78 @@ int newThreadEntryPoint(); // Not the correct signature but good enough to take
 
 int strlen(const char *s);
 
-static int process_init(Process* p, const char* processName) {
-	if (strlen(processName) >= MAX_PROCESS_NAME) {
-		return KErrBadName;
-	}
+#if defined(HAVE_MMU) && PROCESS_POOL_SIZE > 0 && !defined(LUPI_NO_PROCESS)
+#define USE_PROCESS_POOL
+#endif
 
-#ifdef LUPI_NO_PROCESS
-	return KErrNotSupported;
+static inline bool processIsPooled(const Process* p) {
+#ifdef HAVE_MMU
+	return p->pooled;
 #else
-	// Do an early check that processName is valid - easier on callers if we fail now rather than
-	// once we've actually started executing the process
-	const LuaModule* module = getLuaModule(processName);
-	if (!module) return KErrNotFound;
+	return false;
+#endif
+}
 
-	// Assume the Process page itself is already mapped, but nothing else necessarily is
-	p->pid = TheSuperPage->nextPid++;
+#ifndef LUPI_NO_PROCESS
 
+/**
+Sets up everything about a new process that doesn't depend on what it's going
+to run: its memory map, and its first thread (which is left `EDead` and not on
+the ready list). The process's memory isn't zeroed until process_start().
+*/
+static int process_setup(Process* p) {
+	// Assume the Process page itself is already mapped, but nothing else necessarily is
 #ifdef HAVE_MMU
 	mmu_processInit(p);
 #endif // HAVE_MMU
 
 	p->heapLimit = KUserHeapBase;
+	p->heapGrowers = 0;
+	p->exitedRunTime = 0;
+	p->exitedNumSwitches = 0;
+	p->exitedNumSvcs = 0;
+	p->futexWaitList = NULL;
+	p->deadThreadList = NULL;
 
 	// Setup initial thread
+#ifdef HAVE_MMU
+	if (!mmu_mapProcessThreads(Al, p, 1)) return KErrNoMemory;
+#endif
 	p->numThreads = 1;
 	Thread* t = &p->threads[0];
 	t->index = 0;
-	bool ok = thread_init(t, 0);
+#ifndef LUPI_NO_SECTION0
+	t->process = p;
+#endif
+#ifdef ARMV7_M
+	t->stackBase = KUserMemLimit - USER_STACK_SIZE - KStackGuardSize;
+#endif
+	bool ok = thread_init(t, 0, USER_STACK_SIZE);
 	if (!ok) return KErrNoMemory;
+	return 0;
+}
+
+#endif // LUPI_NO_PROCESS
+
+static int process_init(Process* p, const char* processName) {
+	if (strlen(processName) >= MAX_PROCESS_NAME) {
+		return KErrBadName;
+	}
+
+#ifdef LUPI_NO_PROCESS
+	return KErrNotSupported;
+#else
+	// Do an early check that processName is valid - easier on callers if we fail now rather than
+	// once we've actually started executing the process
+	const LuaModule* module = getLuaModule(processName);
+	if (!module) return KErrNotFound;
+
+	if (!processIsPooled(p)) {
+		int err = process_setup(p);
+		if (err) return err;
+	}
+	p->pid = TheSuperPage->nextPid++;
+	Thread* t = firstThreadForProcess(p);
 
 	char* pname = p->name;
 	char ch;
@@ -66,21 +111,43 @@ static int process_init(Process* p, const char* processName) {
 
 #ifndef LUPI_NO_PROCESS
 
-static bool thread_init(Thread* t, uintptr context) {
+/**
+On ARMV7_M the stack must already have been laid out by the caller, and is at
+least `stackSize` bytes. Otherwise `stackSize` must be page-aligned and no more
+than USER_STACK_SIZE.
+*/
+static bool thread_init(Thread* t, uintptr context, uint32 stackSize) {
 	t->prev = NULL;
 	t->next = NULL;
 	t->state = EDead;
 	t->timeslice = THREAD_TIMESLICE;
 	t->completedRequests = 0;
+#ifdef HAVE_THREAD_PRIORITIES
+	t->priority = KThreadPriorityDefault;
+	t->basePriority = KThreadPriorityDefault;
+#endif
 	t->exitReason = 0;
-	uintptr stackBase = userStackForThread(t);
+	t->runTime = 0;
+	t->numSwitches = 0;
+	t->numSvcs = 0;
+#ifndef ARMV7_M
+	t->stackSize = stackSize;
+#ifdef ARM
+	// The rest is mapped on demand by thread_growStack()
+	t->stackMapped = KPageSize;
+#else
+	t->stackMapped = stackSize;
+#endif
+#endif
+	const uintptr stackTop = userStackTop(t);
 #ifdef HAVE_MMU
 	Process* p = processForThread(t);
-	bool ok = mmu_mapPagesInProcess(Al, p, stackBase, USER_STACK_SIZE >> KPageShift);
+	const int mappedPages = t->stackMapped >> KPageShift;
+	bool ok = mmu_mapPagesInProcess(Al, p, stackTop - t->stackMapped, mappedPages);
 	if (!ok) return false;
 	ok = mmu_mapSvcStack(Al, p, svcStackBase(t->index));
 	if (!ok) {
-		mmu_unmapPagesInProcess(Al, p, stackBase, USER_STACK_SIZE >> KPageShift);
+		mmu_unmapPagesInProcess(Al, p, stackTop - t->stackMapped, mappedPages);
 		return false;
 	}
 #endif // HAVE_MMU
@@ -88,8 +155,8 @@ static bool thread_init(Thread* t, uintptr context) {
 	for (int i = 0; i < NUM_SAVED_REGS; i++) {
 		t->savedRegisters[i] = 0xA11FADED;
 	}
-	t->savedRegisters[KSavedSp] = stackBase + USER_STACK_SIZE;
-	if ((KUserBss & ~0xFFF) == stackBase) {
+	t->savedRegisters[KSavedSp] = stackTop;
+	if ((KUserBss & ~0xFFF) == userStackForThread(t)) {
 		// Special case for the case where we stuff the BSS into the top of the
 		// stack page
 		t->savedRegisters[KSavedSp] = KUserBss;
@@ -98,17 +165,34 @@ static bool thread_init(Thread* t, uintptr context) {
 	return do_thread_init(t, entryPoint, context);
 }
 
+// Must be called with p as the current process
+static void zeroInitialMemory(Process* p) {
+	Thread* t = firstThreadForProcess(p);
+	if ((KUserBss & 0xFFF) == 0) {
+		// If BSS is mapped to a page boundary, assume we need to clear it
+		zeroPages((void*)KUserBss, 1 + KNumPreallocatedUserPages);
+	}
+#ifdef ARMV7_M
+	zeroPages((void*)userStackForThread(t), USER_STACK_SIZE >> KPageShift);
+#else
+	zeroPages((void*)(userStackTop(t) - t->stackMapped), t->stackMapped >> KPageShift);
+#endif
+}
+
 NORETURN process_start(Process* p) {
 	switch_process(p);
 	mmu_finishedUpdatingPageTables();
 	Thread* t = firstThreadForProcess(p);
 	TheSuperPage->currentThread = t;
-	// Now we've switched process and mapped the BSS, we first need to zero all initial memory
-	if ((KUserBss & 0xFFF) == 0) {
-		// If BSS is mapped to a page boundary, assume we need to clear it
-		zeroPages((void*)KUserBss, 1 + KNumPreallocatedUserPages);
+	// Now we've switched process and mapped the BSS, we first need to zero all
+	// initial memory, unless processPool_fill() already did
+	if (processIsPooled(p)) {
+#ifdef HAVE_MMU
+		p->pooled = false;
+#endif
+	} else {
+		zeroInitialMemory(p);
 	}
-	zeroPages((void*)(uintptr)userStackForThread(t), USER_STACK_SIZE >> KPageShift);
 
 	// And we can set up the user_* variables
 	user_ProcessPid = p->pid;
@@ -143,6 +227,9 @@ bool process_grow_heap(Process* p, int incr) {
 	}
 
 	if (dec) {
+		// Pages that a preempted grow hasn't zeroed yet must stay mapped until
+		// it has, and the simplest way to ensure that is to refuse to shrink
+		if (p->heapGrowers) return false;
 		if (p->heapLimit - amount < KUserHeapBase) {
 			amount = p->heapLimit - KUserHeapBase;
 		}
@@ -163,30 +250,41 @@ bool process_grow_heap(Process* p, int incr) {
 #else
 		// With no MMU heap grows until it hits the stacks
 		Thread* lastThread = &p->threads[p->numThreads-1];
-		const uint32 heapLim = userStackForThread(lastThread);
+		const uint32 heapLim = lastThread->stackBase;
 		if (p->heapLimit + amount > heapLim) {
 			printk("OOM @ heapLimit = %X + %d > %X!\n", (uint)p->heapLimit, incr, heapLim);
 			return false;
 		}
 #endif
-		zeroPages((void*)p->heapLimit, npages);
+		// Zero a page at a time so a large sbrk doesn't hold off the
+		// scheduler. heapLimit is updated first so that if we're preempted,
+		// another thread growing the heap will start after our pages, and
+		// heapGrowers stops another thread shrinking it out from under us.
+		uintptr newPages = p->heapLimit;
 		p->heapLimit += amount;
+		p->heapGrowers++;
+		for (int i = 0; i < npages; i++) {
+			zeroPage((void*)(newPages + (i << KPageShift)));
+			kern_preemptionPoint();
+		}
+		p->heapGrowers--;
 		//printk("-process_grow_heap heapLimit=%p\n", (void*)p->heapLimit);
 		return true;
 	}
 }
 
-int process_new(const char* name, Process** resultProcess) {
-	*resultProcess = NULL;
-	// First see if there is a spare Process* we can use
+/**
+Returns a Process page that isn't in use. If `pooled` is true, returns one from
+the pool if there are any, otherwise it won't return a pooled one.
+*/
+static Process* findFreeProcess(bool pooled) {
 	SuperPage* s = TheSuperPage;
-	Process* p = 0;
-	int err = KErrNoMemory;
+	Process* p = NULL;
 	for (int i = 0; i < s->numValidProcessPages; i++) {
 		Process* candidate = GetProcess(i);
 		if (candidate->pid == 0) {
-			p = candidate;
-			break;
+			if (processIsPooled(candidate) == pooled) return candidate;
+			if (!processIsPooled(candidate) && !p) p = candidate;
 		}
 	}
 #if MAX_PROCESSES > 1
@@ -194,51 +292,141 @@ int process_new(const char* name, Process** resultProcess) {
 		p = mmu_newProcess(Al);
 	}
 #endif
+	return p;
+}
+
+#ifdef USE_PROCESS_POOL
 
+/**
+DFC which tops up the pool of processes that process_new() can claim. These
+have their page tables, BSS and first thread's stacks mapped and zeroed, so all
+that's left to do when one is claimed is to give it a pid and a name.
+*/
+static void processPool_fill(uintptr arg1, uintptr arg2, uintptr arg3) {
+	SuperPage* s = TheSuperPage;
+	while (s->numPooledProcesses < PROCESS_POOL_SIZE) {
+		Process* p = findFreeProcess(false);
+		if (!p) break;
+		if (process_setup(p) != 0) {
+			// Give back whatever did get mapped
+			mmu_processExited(Al, p);
+			break;
+		}
+		Process* oldP = switch_process(p);
+		mmu_finishedUpdatingPageTables();
+		zeroInitialMemory(p);
+		switch_process(oldP);
+		p->pooled = true;
+		s->numPooledProcesses++;
+	}
+}
+
+#endif
+
+int process_new(const char* name, Process** resultProcess) {
+	*resultProcess = NULL;
+	// First see if there is a spare Process* we can use, preferably one that's
+	// already set up
+	Process* p = findFreeProcess(true);
 	if (!p) {
 		return KErrResourceLimit;
 	}
 
-	if (p) {
-		err = process_init(p, name);
-		if (err) p = NULL;
-	}
-	if (p) {
-		err = 0;
-		*resultProcess = p;
+	const bool pooled = processIsPooled(p);
+	int err = process_init(p, name);
+	if (err) return err;
+	*resultProcess = p;
+
+#ifdef USE_PROCESS_POOL
+	SuperPage* s = TheSuperPage;
+	if (pooled) s->numPooledProcesses--;
+	if (s->numPooledProcesses < PROCESS_POOL_SIZE) {
+		dfc_queue(processPool_fill, 0, 0, 0);
 	}
-	return err;
+#else
+	(void)pooled;
+#endif
+	return 0;
+}
+
+#ifndef LUPI_NO_PROCESS
+
+/**
+Rounds a stack size requested by KExecThreadCreate up to one we can actually
+provide, or returns zero if it's too big. Zero means USER_STACK_SIZE.
+*/
+static uint32 roundStackSize(uint32 stackSize) {
+	if (stackSize == 0) return USER_STACK_SIZE;
+	if (stackSize < KMinUserStackSize) stackSize = KMinUserStackSize;
+#ifdef ARMV7_M
+	if (stackSize > KUserMemLimit - KUserHeapBase) return 0;
+	// Keeps every stackBase aligned as the MPU needs for the guard region
+	return (stackSize + KStackGuardSize - 1) & ~(KStackGuardSize - 1);
+#else
+	if (stackSize > USER_STACK_SIZE) return 0;
+	return PAGE_ROUND(stackSize);
+#endif
 }
 
-int thread_new(Process* p, uintptr context, Thread** resultThread) {
+#endif // LUPI_NO_PROCESS
+
+/**
+Creates a new thread in `p` with a user stack of at least `stackSize` bytes (or
+USER_STACK_SIZE if zero). Where stacks grow on demand (see
+[thread_growStack()](#thread_growStack)) this is the most it can grow to.
+*/
+int thread_new(Process* p, uintptr context, uint32 stackSize, Thread** resultThread) {
 #ifdef LUPI_NO_PROCESS
 	return KErrNotSupported;
 #else
 
-	// See if there are any dead threads we can reuse
 	*resultThread = NULL;
-	Thread* t = NULL;
+	stackSize = roundStackSize(stackSize);
+	if (!stackSize) return KErrArgument;
 
-	for (int i = 0; i < p->numThreads; i++) {
-		if (p->threads[i].state == EDead) {
-			t = &p->threads[i];
-			break;
-		}
+	// See if there are any dead threads we can reuse
+	Thread* t = p->deadThreadList;
+#ifdef ARMV7_M
+	// Without an MMU the stack can't be moved so it has to already be big enough
+	while (t && userStackTop(t) - userStackForThread(t) < stackSize) {
+		t = t->next;
+		if (t == p->deadThreadList) t = NULL;
 	}
-	if (!t && p->numThreads < MAX_THREADS) {
+#endif
+	if (t) {
+		thread_dequeue(t, &p->deadThreadList);
+	} else if (p->numThreads < MAX_THREADS) {
+#ifdef HAVE_MMU
+		if (!mmu_mapProcessThreads(Al, p, p->numThreads + 1)) return KErrNoMemory;
+#endif
 		t = &p->threads[p->numThreads];
 		t->index = p->numThreads;
-		if (p->heapLimit > userStackForThread(t)) {
+#ifndef LUPI_NO_SECTION0
+		t->process = p;
+#endif
+#ifdef ARMV7_M
+		t->stackBase = userStackTop(t) - stackSize - KStackGuardSize;
+		if (p->heapLimit > t->stackBase) {
 			// Uh oh the heap has already encroached on where we were going to
 			// put the thread stack, so we can't allow this.
 			return KErrResourceLimit;
 		}
+#endif
 		p->numThreads++;
 	}
 
 	if (t) {
-		bool ok = thread_init(t, context);
-		if (!ok) return KErrNoMemory;
+		bool ok = thread_init(t, context, stackSize);
+		if (!ok) {
+			// thread_init() leaves t EDead, so put it back where it came from
+			if (t->index == p->numThreads - 1) {
+				p->numThreads--;
+			} else {
+				thread_enqueueBefore(t, p->deadThreadList);
+				if (!p->deadThreadList) p->deadThreadList = t;
+			}
+			return KErrNoMemory;
+		}
 		thread_setState(t, EReady);
 		*resultThread = t;
 		return 0;
@@ -250,9 +438,8 @@ int thread_new(Process* p, uintptr context, Thread** resultThread) {
 
 static void freeThreadStacks(Thread* t) {
 #ifdef HAVE_MMU
-	uintptr stackBase = userStackForThread(t);
 	Process* p = processForThread(t);
-	mmu_unmapPagesInProcess(Al, p, stackBase, USER_STACK_SIZE >> KPageShift);
+	mmu_unmapPagesInProcess(Al, p, userStackTop(t) - t->stackMapped, t->stackMapped >> KPageShift);
 	mmu_unmapPagesInProcess(Al, p, svcStackBase(t->index), 1);
 #endif
 }
@@ -296,23 +483,26 @@ static void threadExit_dfc(uintptr arg1, uintptr arg2, uintptr arg3) {
 	freeThreadStacks(t);
 	thread_setState(t, EDead);
 	Process* p = processForThread(t);
+	p->exitedRunTime += t->runTime;
+	p->exitedNumSwitches += t->numSwitches;
+	p->exitedNumSvcs += t->numSvcs;
+
+	thread_enqueueBefore(t, p->deadThreadList);
+	if (!p->deadThreadList) p->deadThreadList = t;
 
 	// See if we can shrink numThreads - important for reclaiming stack memory
-	// in non-MMU mem model.
+	// in non-MMU mem model. This means the last thread below numThreads is
+	// never dead.
 	if (t->index == p->numThreads-1) {
 		while (p->numThreads && p->threads[p->numThreads-1].state == EDead) {
+			thread_dequeue(&p->threads[p->numThreads-1], &p->deadThreadList);
 			p->numThreads--;
 		}
 	}
 
-	// Check if the process still has any alive threads - if not call process_exit()
-	bool dead = true;
-	for (int i = 0; i < p->numThreads; i++) {
-		if (p->threads[i].state != EDead) {
-			dead = false;
-			break;
-		}
-	}
+	// So if there are no threads left below numThreads, there are no alive
+	// ones and the process has exited
+	bool dead = (p->numThreads == 0);
 	// printk("Thread %d exited, process dead=%d\n", t->index, (int)dead);
 	if (dead) {
 		process_exit(p, t->exitReason);
@@ -337,6 +527,85 @@ void thread_setBlockedReason(Thread* t, ThreadBlockedReason reason) {
 	t->exitReason = reason;
 }
 
+/**
+Blocks `t` on the futex at user address `addr`, until another thread in the
+same process calls [process_futexWake()](#process_futexWake) on it. The caller
+is responsible for checking the futex value first, and for saving the thread's
+registers and rescheduling afterwards. The check and the block are atomic
+because neither the KExecFutexWait handler nor this function contains a
+[kern_preemptionPoint()](scheduler_arm.c#kern_preemptionPoint), so no other
+thread can run in between and change the value.
+*/
+void thread_futexWait(Thread* t, uintptr addr) {
+	Process* p = processForThread(t);
+	thread_setState(t, EWaitForFutex);
+	t->exitReason = (int)addr;
+	// Add to the end of the wait list, so wakes are first come first served
+	thread_enqueueBefore(t, p->futexWaitList);
+	if (!p->futexWaitList) p->futexWaitList = t;
+}
+
+/**
+Wakes up to `count` threads in process `p` that are waiting on the futex at
+`addr`, oldest first. Woken threads return 0 from KExecFutexWait. Returns the
+number of threads woken.
+*/
+int process_futexWake(Process* p, uintptr addr, int count) {
+	int numWoken = 0;
+	Thread* t = p->futexWaitList;
+	Thread* last = t ? t->prev : NULL;
+	while (t && numWoken < count) {
+		Thread* next = t->next;
+		bool wasLast = (t == last);
+		if (t->exitReason == (int)addr) {
+			thread_dequeue(t, &p->futexWaitList);
+			thread_writeSvcResult(t, 0);
+			thread_setState(t, EReady);
+			numWoken++;
+		}
+		if (wasLast) break;
+		t = next;
+	}
+	return numWoken;
+}
+
+#ifdef ARM
+
+/**
+Called from the data abort handler when `addr` faults while `t` is the current
+thread. If `addr` is in the part of the thread's stack that hasn't been mapped
+yet, maps (and zeroes) everything from there up to what's already mapped and
+returns true, in which case the faulting instruction can be retried. Faults in
+the rest of the stack area, or in the guard page below it, are reported as a
+stack overflow. Returns false for anything that isn't a stack fault.
+*/
+bool thread_growStack(Thread* t, uintptr addr) {
+	Process* p = processForThread(t);
+	if (!p) return false; // The DFC thread
+	const uintptr top = userStackTop(t);
+	const uintptr mappedBase = top - t->stackMapped;
+	const uintptr guardPage = svcStackBase(t->index) + KPageSize;
+	if (addr < guardPage || addr >= mappedBase) return false;
+
+	if (addr < userStackForThread(t)) {
+		printk("Stack overflow in thread %s/%d (stack size %d)\n", p->name, t->index, t->stackSize);
+		return false;
+	}
+
+	const uintptr newBase = addr & ~(KPageSize - 1);
+	const int npages = (mappedBase - newBase) >> KPageShift;
+	if (!mmu_mapPagesInProcess(Al, p, newBase, npages)) {
+		printk("No memory to grow stack of thread %s/%d\n", p->name, t->index);
+		return false;
+	}
+	mmu_finishedUpdatingPageTables();
+	zeroPages((void*)newBase, npages);
+	t->stackMapped += npages << KPageShift;
+	return true;
+}
+
+#endif // ARM
+
 #ifdef AARCH64
 
 static NOINLINE NAKED void do_user_write(uintptr ptr, uintptr data) {
@@ -376,6 +645,7 @@ void thread_requestSignal(KAsyncRequest* request) {
 	//printk("Thread %s signalled nreq=%d state=%d\n", processForThread(t)->name, t->completedRequests, t->state);
 	request->userPtr = 0;
 	if (t->state == EWaitForRequest) {
+		thread_cancelSleep(t); // In case it was waiting with a timeout
 		thread_writeSvcResult(t, t->completedRequests);
 		t->completedRequests = 0;
 		thread_setState(t, EReady);
@@ -396,3 +666,102 @@ int process_reset(Thread* t, const char* name) {
 	return process_init(p, name);
 #endif
 }
+
+static void copyName(char* dest, const char* src) {
+	char ch;
+	do {
+		ch = *src++;
+		*dest++ = ch;
+	} while (ch);
+}
+
+#define KMaxCpuStatsRecords (2 + MAX_PROCESSES * (MAX_THREADS + 1))
+
+static void addCpuStats(ExecCpuStats* buf, int maxRecords, int* n, const ExecCpuStats* rec) {
+	if (*n < maxRecords) {
+		buf[*n] = *rec;
+	}
+	(*n)++;
+}
+
+static void threadCpuStats(ExecCpuStats* rec, const Thread* t) {
+	rec->threadIdx = t->index;
+	rec->state = t->state;
+#ifdef HAVE_THREAD_PRIORITIES
+	rec->priority = t->priority;
+#endif
+	rec->runTime = t->runTime;
+	rec->numSwitches = t->numSwitches;
+	rec->numSvcs = t->numSvcs;
+}
+
+/**
+Handles KExecGetCpuStats. Fills in up to `maxRecords` `ExecCpuStats` at
+`userBuf` and returns the total number of records available, which may be more
+than `maxRecords`. The first record is always the idle time, followed by the DFC
+thread if there is one. After that, each process has a record with its totals
+(including threads which have exited), followed by one for each thread that is
+still alive.
+*/
+int process_getCpuStats(uintptr userBuf, int maxRecords) {
+	if (maxRecords < 0) return KErrArgument;
+	// Never more than idle, dfcs, and a total plus every thread for each
+	// process, so there's no point checking any more of the buffer than that -
+	// and it means the size calculation below can't overflow.
+	if (maxRecords > KMaxCpuStatsRecords) maxRecords = KMaxCpuStatsRecords;
+	if (maxRecords) {
+		ASSERT_USER_WPTR32(userBuf);
+		ASSERT_USER_WPTR8(userBuf + maxRecords * sizeof(ExecCpuStats) - 1);
+	}
+	ExecCpuStats* buf = (ExecCpuStats*)userBuf;
+	SuperPage* s = TheSuperPage;
+	int n = 0;
+	int mask = kern_disableInterrupts();
+	// Bring the current thread's runTime up to date
+	thread_accountSwitch(s->accountedThread);
+
+	ExecCpuStats rec = {
+		.runTime = s->idleTime,
+		.processIdx = KCpuStatsNoProcess,
+		.threadIdx = KCpuStatsProcessTotal,
+	};
+	copyName(rec.name, "idle");
+	addCpuStats(buf, maxRecords, &n, &rec);
+#ifdef ARM
+	threadCpuStats(&rec, &s->dfcThread);
+	copyName(rec.name, "dfcs");
+	addCpuStats(buf, maxRecords, &n, &rec);
+#endif
+
+	for (int i = 0; i < s->numValidProcessPages; i++) {
+		Process* p = GetProcess(i);
+		if (p->pid == 0) continue;
+		ExecCpuStats total = {
+			.runTime = p->exitedRunTime,
+			.numSwitches = p->exitedNumSwitches,
+			.numSvcs = p->exitedNumSvcs,
+			.pid = p->pid,
+			.processIdx = i,
+			.threadIdx = KCpuStatsProcessTotal,
+		};
+		copyName(total.name, p->name);
+		for (int j = 0; j < p->numThreads; j++) {
+			Thread* t = &p->threads[j];
+			if (t->state == EDead) continue;
+			total.runTime += t->runTime;
+			total.numSwitches += t->numSwitches;
+			total.numSvcs += t->numSvcs;
+		}
+		addCpuStats(buf, maxRecords, &n, &total);
+
+		rec = total;
+		for (int j = 0; j < p->numThreads; j++) {
+			Thread* t = &p->threads[j];
+			if (t->state == EDead) continue;
+			threadCpuStats(&rec, t);
+			addCpuStats(buf, maxRecords, &n, &rec);
+		}
+	}
+	kern_restoreInterrupts(mask);
+	return n;
+}
@@ -0,0 +1,154 @@
+#include <k.h>
+#include <err.h>
+#include <exec.h>
+#include ARCH_HEADER
+
+/**
+The sampling profiler records the interrupted PC every `profileInterval` timer
+ticks, along with a short chain of return addresses. For threads interrupted in
+user mode the chain is LR followed by whatever can be recovered by walking
+frame pointers, which is only meaningful for code compiled with
+`-fno-omit-frame-pointer`. Every frame is validated against the thread's stack
+and the code segment so a bad chain just ends early.
+
+Samples go into a single ring buffer tagged with the process and thread they
+belong to, and exec callers only ever see their own process's samples. Use
+build/profileReport.lua to symbolise the output of profiler_dump().
+*/
+
+#ifdef KProfileBufferAddress
+
+#define TheProfileBuffer ((ProfileSample*)KProfileBufferAddress)
+#define KProfileMaxSamples (KProfileBufferSize / sizeof(ProfileSample))
+ASSERT_COMPILE(IS_POW2(KProfileMaxSamples));
+
+static inline bool isCodeAddress(uintptr addr) {
+	return addr >= KKernelCodeBase && addr < KKernelCodeBase + KKernelCodesize;
+}
+
+#ifdef ARM
+
+// Only the mapped part of the stack, we can't take a stack fault from the IRQ handler
+static inline bool isUserStackAddress(Thread* t, uintptr addr) {
+	const uintptr top = userStackTop(t);
+	return (addr & 3) == 0 && addr >= top - t->stackMapped && addr < top;
+}
+
+static void sampleUserCallers(Thread* t, ProfileSample* sample, const uint32* regs) {
+	uint32 splr[2];
+	ASM_JFDI("STM %0, {r13-r14}^" : : "r" (splr)); // User (banked) r13 and r14
+	int depth = 0;
+	if (isCodeAddress(splr[1])) {
+		sample->callers[depth++] = splr[1];
+	}
+	// With an AAPCS frame, fp points to the saved lr and fp-4 to the saved fp
+	uintptr fp = regs[11];
+	while (depth < KProfileMaxDepth && isUserStackAddress(t, fp - 4) && isUserStackAddress(t, fp)) {
+		uintptr lr = *(uint32*)fp;
+		uintptr nextFp = *(uint32*)(fp - 4);
+		if (!isCodeAddress(lr)) break;
+		sample->callers[depth++] = lr;
+		if (nextFp <= fp) break; // Frames must get strictly older
+		fp = nextFp;
+	}
+	sample->depth = depth;
+}
+
+#endif // ARM
+
+/**
+Called from the timer IRQ with `savedRegisters` pointing to {r0-r12, lr_irq}.
+Only called when `profileInterval` is non-zero.
+*/
+void profiler_tick(void* savedRegisters) {
+	SuperPage* s = TheSuperPage;
+	if (--s->profileCountdown) return;
+	s->profileCountdown = s->profileInterval;
+
+	const uint32* regs = (const uint32*)savedRegisters;
+	ProfileSample* sample = &TheProfileBuffer[s->profileCount++ & (KProfileMaxSamples - 1)];
+	Thread* t = s->currentThread;
+	Process* p = t ? processForThread(t) : NULL;
+	sample->processIdx = p ? indexForProcess(p) : 0xFF;
+	sample->threadIdx = t ? t->index : 0xFF;
+	sample->depth = 0;
+	sample->flags = 0;
+#ifdef ARM
+	sample->pc = regs[13] - 4; // LR_irq is 4 more than the interrupted PC
+	if ((getSpsr() & KPsrModeMask) == KPsrModeUsr) {
+		if (t) sampleUserCallers(t, sample, regs);
+	} else {
+		sample->flags |= KProfileSampleKernel;
+	}
+#endif
+}
+
+/**
+Prints all samples belonging to the process with index `processIdx`, or all
+samples if `processIdx` is negative. Returns the number of samples printed.
+*/
+int profiler_dump(int processIdx) {
+	const SuperPage* s = TheSuperPage;
+	const uint32 count = s->profileCount;
+	const uint32 n = min(count, KProfileMaxSamples);
+	for (int i = 0; i < s->numValidProcessPages; i++) {
+		if (processIdx < 0 || processIdx == i) {
+			printk("PROFPROC %d %s\n", i, GetProcess(i)->name);
+		}
+	}
+	int numDumped = 0;
+	for (uint32 i = count - n; i != count; i++) {
+		const ProfileSample* sample = &TheProfileBuffer[i & (KProfileMaxSamples - 1)];
+		if (processIdx >= 0 && sample->processIdx != processIdx) continue;
+		printk("PROF %d %d %d %X", sample->processIdx, sample->threadIdx,
+			sample->flags, sample->pc);
+		for (int j = 0; j < sample->depth; j++) {
+			printk(" %X", sample->callers[j]);
+		}
+		printk("\n");
+		numDumped++;
+	}
+	return numDumped;
+}
+
+/**
+Handles KExecProfilerControl. `arg` is the sample interval in ticks for
+EProfilerStart, and is ignored otherwise. EProfilerStop returns the total
+number of samples taken. EProfilerDump only dumps the samples belonging to the
+calling process.
+*/
+int profiler_control(int cmd, uintptr arg) {
+	SuperPage* s = TheSuperPage;
+	switch (cmd) {
+		case EProfilerStart: {
+			if (arg == 0 || arg > 0xFFFF) return KErrArgument;
+			int mask = kern_disableInterrupts();
+			s->profileCount = 0;
+			s->profileInterval = arg;
+			s->profileCountdown = arg;
+			kern_restoreInterrupts(mask);
+			return 0;
+		}
+		case EProfilerStop:
+			s->profileInterval = 0;
+			return s->profileCount;
+		case EProfilerDump: {
+			Process* p = s->currentProcess;
+			return profiler_dump(p ? indexForProcess(p) : -1);
+		}
+		default:
+			return KErrArgument;
+	}
+}
+
+#else
+
+int profiler_control(int cmd, uintptr arg) {
+	return KErrNotSupported;
+}
+
+int profiler_dump(int processIdx) {
+	return KErrNotSupported;
+}
+
+#endif // KProfileBufferAddress
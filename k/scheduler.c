@@ -1,19 +1,37 @@
 #include <k.h>
 #include <mmu.h>
+#include <err.h>
+#include <exec.h>
 #include ARCH_HEADER
 
+#ifdef HAVE_THREAD_PRIORITIES
+ASSERT_COMPILE(KThreadPriorityHighest < KNumThreadPriorities);
+ASSERT_COMPILE(KThreadPriorityDfc <= 0xFF);
+#endif
+
+/**
+Returns the first thread in the ready list with the highest priority, so that
+threads of equal priority still run round-robin.
+*/
 Thread* findNextReadyThread() {
 	Thread* head = TheSuperPage->readyList;
 	if (!head) return NULL;
 	Thread* t = head;
+	Thread* result = NULL;
 	//printk("t=%p t->next=%p\n", t, t?t->next:0);
 	do {
 		if (t->state == EReady) {
+#ifdef HAVE_THREAD_PRIORITIES
+			if (!result || t->priority > result->priority) {
+				result = t;
+			}
+#else
 			return t;
+#endif
 		}
 		t = t->next;
 	} while (t != head);
-	return NULL;
+	return result;
 }
 
 static void dequeueFromReadyList(Thread* t) {
@@ -63,18 +81,149 @@ void thread_yield(Thread* t) {
 	if (!s->readyList) s->readyList = t;
 }
 
+// Can't compare the whole uint64, exitReason is only 32 bits
+static inline bool wakesBefore(uint32 a, uint32 b) {
+	return (int32)(a - b) < 0;
+}
+
+static void updateNextWakeTime() {
+	SuperPage* s = TheSuperPage;
+	int mask = kern_disableInterrupts();
+	Thread* t = s->sleepList;
+	if (t) {
+		// exitReason is within 2^31 ms of now so this recovers the high bits
+		int32 delta = (int32)((uint32)t->exitReason - (uint32)s->uptime);
+		s->nextWakeTime = s->uptime + delta;
+	} else {
+		s->nextWakeTime = UINT64_MAX;
+	}
+	kern_restoreInterrupts(mask);
+}
+
+/**
+Blocks the current thread `t` in `state` (ESleeping or EWaitForRequest) until
+`ms` milliseconds have passed, at which point it is readied by
+thread_wakeSleepers() with an SVC result of zero. Like kern_sleep() it may sleep
+up to 1ms longer. The caller must have saved the thread's registers and must
+reschedule afterwards.
+*/
+void thread_sleep(Thread* t, ThreadState state, int ms) {
+	SuperPage* s = TheSuperPage;
+	if (ms > KMaxSleepTime) ms = KMaxSleepTime;
+	thread_setState(t, state);
+	thread_writeSvcResult(t, 0);
+	int mask = kern_disableInterrupts();
+	const uint32 wakeTime = (uint32)s->uptime + ms + 1;
+	kern_restoreInterrupts(mask);
+	t->exitReason = (int)wakeTime;
+
+	// Insert after everything due at or before wakeTime
+	Thread* head = s->sleepList;
+	Thread* before = head;
+	if (head) {
+		do {
+			if (wakesBefore(wakeTime, before->exitReason)) break;
+			before = before->next;
+		} while (before != head);
+	}
+	thread_enqueueBefore(t, before);
+	if (!head || (before == head && wakesBefore(wakeTime, head->exitReason))) {
+		s->sleepList = t;
+		updateNextWakeTime();
+	}
+}
+
+/**
+Removes `t` from the sleep list, for when something other than the timeout has
+woken it. Does nothing if `t` isn't on the list.
+*/
+void thread_cancelSleep(Thread* t) {
+	SuperPage* s = TheSuperPage;
+	if (!t->next) return;
+	bool wasHead = (s->sleepList == t);
+	thread_dequeue(t, &s->sleepList);
+	if (wasHead) updateNextWakeTime();
+}
+
+/**
+DFC queued by the timer tick once `nextWakeTime` has been reached. Readies every
+thread on the sleep list whose time has come.
+*/
+void thread_wakeSleepers(uintptr arg1, uintptr arg2, uintptr arg3) {
+	SuperPage* s = TheSuperPage;
+	int mask = kern_disableInterrupts();
+	const uint32 now = (uint32)s->uptime;
+	kern_restoreInterrupts(mask);
+	Thread* t;
+	while ((t = s->sleepList) != NULL && !wakesBefore(now, t->exitReason)) {
+		thread_dequeue(t, &s->sleepList);
+		t->exitReason = 0;
+		thread_setState(t, EReady);
+	}
+	// If the next one became due while we were doing this, the tick will see
+	// nextWakeTime is already in the past and queue us again
+	updateNextWakeTime();
+}
+
 void thread_setState(Thread* t, ThreadState s) {
 	//printk("thread_setState thread %d-%d s=%d t->next=%p\n", indexForProcess(processForThread(t)), t->index, s, t->next);
 	if (s == EReady) {
 		// Move to head of ready list
 		thread_enqueueBefore(t, TheSuperPage->readyList);
 		TheSuperPage->readyList = t;
+#ifdef HAVE_THREAD_PRIORITIES
+		Thread* current = TheSuperPage->currentThread;
+		if (current && t->priority > current->priority) {
+			// Don't make t wait for the current thread's timeslice to run out.
+			// If we're in an IRQ the handler will be rescheduling anyway.
+			TheSuperPage->rescheduleNeededOnSvcExit = true;
+		}
+#endif
 	} else if (t->state == EReady) {
 		dequeueFromReadyList(t);
 	}
 	t->state = s;
 }
 
+/**
+Sets the effective priority of `t`, without changing its base priority. Used by
+priority inheritance.
+*/
+void thread_setEffectivePriority(Thread* t, int priority) {
+#ifdef HAVE_THREAD_PRIORITIES
+	Thread* current = TheSuperPage->currentThread;
+	if (t == current && priority < t->priority) {
+		// Something else might now be more important than us
+		TheSuperPage->rescheduleNeededOnSvcExit = true;
+	} else if (t != current && t->state == EReady && current && priority > current->priority) {
+		TheSuperPage->rescheduleNeededOnSvcExit = true;
+	}
+	t->priority = priority;
+#endif
+}
+
+/**
+Handles KExecSetThreadPriority. Sets the base priority of `t` and returns the
+previous one. If `t` is a server which is currently inheriting a higher
+priority from its clients, it keeps that until the requests are completed.
+*/
+int thread_setPriority(Thread* t, int priority) {
+#ifdef HAVE_THREAD_PRIORITIES
+	if (priority < KThreadPriorityLowest || priority > KThreadPriorityHighest) {
+		return KErrArgument;
+	}
+	int old = t->basePriority;
+	t->basePriority = priority;
+	thread_setEffectivePriority(t, priority);
+#ifndef LUPI_NO_IPC
+	ipc_threadPriorityChanged(t);
+#endif
+	return old;
+#else
+	return KErrNotSupported;
+#endif
+}
+
 /**
 Sleep for a number of milliseconds. Uses the system timer so may sleep up to 1ms
 longer. Can only be called from SVC mode with interrupts enabled (otherwise
@@ -97,6 +246,95 @@ void kern_sleep(int msec) {
 	}
 }
 
+/**
+Charges the time since the last call to whichever thread was running, or to
+`TheSuperPage->idleTime` if none was, and makes `next` the thread that
+subsequent time will be charged to. Called whenever a thread is scheduled, and
+with `next` NULL when reschedule() is about to WFI.
+*/
+void thread_accountSwitch(Thread* next) {
+	SuperPage* s = TheSuperPage;
+	uint32 now = board_getMicroseconds();
+	uint32 elapsed = now - s->lastAccountingTime;
+	s->lastAccountingTime = now;
+	Thread* prev = s->accountedThread;
+	if (prev) {
+		prev->runTime += elapsed;
+	} else {
+		s->idleTime += elapsed;
+	}
+	if (next && next != prev) {
+		next->numSwitches++;
+	}
+	s->accountedThread = next;
+}
+
+#define DfcSlot(s, idx) (&(s)->dfcs[(idx) & (MAX_DFCS - 1)])
+ASSERT_COMPILE(IS_POW2(MAX_DFCS));
+
+/**
+Adds a DFC to the ring. Safe to call from any context, without disabling
+interrupts. If an identical DFC (same function and arguments) is already
+pending, nothing is added, on the basis that the function will still run after
+whatever event caused this call. Returns false if the ring was full and the DFC
+was dropped.
+
+The ring is multiple-producer, single-consumer. A producer claims a slot by
+atomically advancing `dfcTail`, fills it in, and publishes it by setting `fn`
+last. The consumer (the DFC thread or PendSV handler) never preempts a
+producer, but producers can preempt the consumer and each other.
+*/
+bool dfc_push(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3) {
+	SuperPage* s = TheSuperPage;
+	for (uint32 i = s->dfcHead; i != s->dfcTail; i++) {
+		const Dfc* d = DfcSlot(s, i);
+		if (d->fn == fn && d->args[0] == arg1 && d->args[1] == arg2 && d->args[2] == arg3) {
+			s->dfcsCoalesced++;
+			return true;
+		}
+	}
+
+	uint32 tail;
+	do {
+		tail = s->dfcTail;
+		if (tail - s->dfcHead >= MAX_DFCS) {
+			s->dfcsDropped++;
+			return false;
+		}
+	} while (!atomic_cas(&s->dfcTail, tail, tail + 1));
+
+	Dfc* dfc = DfcSlot(s, tail);
+	dfc->args[0] = arg1;
+	dfc->args[1] = arg2;
+	dfc->args[2] = arg3;
+	asm("" : : : "memory"); // fn must be written last
+	dfc->fn = fn;
+
+	uint32 used = tail + 1 - s->dfcHead;
+	if (used > s->dfcHighWater) s->dfcHighWater = used;
+	return true;
+}
+
+/**
+Removes the oldest published DFC from the ring and copies it to `result`. Must
+only be called by the DFC consumer. The slot is released before the DFC is
+run, so a dfc_queue() of the same DFC while it is running will cause it to run
+again. Returns false if there are no DFCs ready to run, which includes the
+case where the oldest slot has been claimed but not yet filled in.
+*/
+bool dfc_pop(Dfc* result) {
+	SuperPage* s = TheSuperPage;
+	uint32 head = s->dfcHead;
+	if (head == s->dfcTail) return false;
+	Dfc* dfc = DfcSlot(s, head);
+	if (!dfc->fn) return false;
+	*result = *dfc;
+	dfc->fn = NULL;
+	asm("" : : : "memory");
+	s->dfcHead = head + 1;
+	return true;
+}
+
 static void do_request_complete(uintptr arg1, uintptr arg2, uintptr arg3) {
 	// printk("do_request_complete t=%X ptr=%X\n", (uint)arg1, (uint)arg2);
 	KAsyncRequest req = {
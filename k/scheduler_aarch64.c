@@ -38,6 +38,7 @@ NORETURN NAKED doScheduleThread(uintptr* savedRegisters, uintptr sp, uintptr sps
 
 NORETURN scheduleThread(Thread* t) {
 	Process* p = processForThread(t);
+	thread_accountSwitch(t);
 	switch_process(p);
 	t->timeslice = THREAD_TIMESLICE;
 	TheSuperPage->currentThread = t;
@@ -53,13 +54,7 @@ void thread_writeSvcResult(Thread* t, uintptr result) {
 }
 
 void dfc_queue(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3) {
-	uint32 n = atomic_inc8(&TheSuperPage->numDfcsPending);
-	ASSERT(n <= MAX_DFCS);
-	Dfc* dfc = &TheSuperPage->dfcs[n-1];
-	dfc->fn = fn;
-	dfc->args[0] = arg1;
-	dfc->args[1] = arg2;
-	dfc->args[2] = arg3;
+	dfc_push(fn, arg1, arg2, arg3);
 }
 
 /**
@@ -86,6 +81,10 @@ bool tick() {
 		s->timerCompletionTime = UINT64_MAX;
 		dfc_requestComplete(&s->timerRequest, 0);
 	}
+	if (s->uptime >= s->nextWakeTime) {
+		s->nextWakeTime = UINT64_MAX;
+		dfc_queue(thread_wakeSleepers, 0, 0, 0);
+	}
 	Thread* t = s->currentThread;
 	if (t && t->state == EReady) {
 		if (t->timeslice > 0) {
@@ -46,6 +46,25 @@ static NAKED NOINLINE void irq_saveSvcSpLr(uint32* splr) {
 	asm("BX lr");
 }
 
+// In usersrc/sync.c
+extern const char sync_rasStart[];
+extern const char sync_rasEnd[];
+
+/**
+User code can't disable interrupts, and LDREX/STREX aren't usable on this
+platform, so user-side atomics (see usersrc/sync.c) use a restartable atomic
+sequence instead. If a thread is preempted partway through it, the thread
+resumes from the start of the sequence rather than where it was interrupted.
+The sequence is short and doesn't modify its inputs, so rerunning it is always
+safe. Preemption after the final store doesn't need any fixup.
+*/
+static inline void restartAtomicSequence(Thread* t) {
+	uint32 pc = t->savedRegisters[15];
+	if (pc - (uintptr)sync_rasStart < (uintptr)(sync_rasEnd - sync_rasStart)) {
+		t->savedRegisters[15] = (uintptr)sync_rasStart;
+	}
+}
+
 /**
 The behaviour of this function is different depending on the mode it is called
 in, and the mode the current thread is in (as indicated by the current value of
@@ -68,6 +87,7 @@ void saveCurrentRegistersForThread(void* savedRegisters) {
 		memcpy(&t->savedRegisters[0], savedRegisters, 13 * sizeof(uint32));
 		// LR_irq in savedRegisters[13] is 4 more than what PC_usr needs to be restored to
 		t->savedRegisters[15] = ((uint32*)savedRegisters)[13] - 4;
+		restartAtomicSequence(t);
 		if ((spsr & KPsrModeMask) == KPsrModeSvc) {
 			// Have to mode switch to retrieve r13 and r14
 			ASSERT(false, 0x5C4D); // We don't currently ever save SVC registers
@@ -107,11 +127,29 @@ static NORETURN NAKED doScheduleKernThread(uint32* savedRegisters, uint32 spsr)
 	// And we're done
 }
 
-// Enter in SVC
-NORETURN scheduleThread(Thread* t) {
+/**
+Called whenever a thread is scheduled, with interrupts disabled. Any
+reschedule that an SVC or DFC deferred has now happened, so clears
+`rescheduleNeededOnSvcExit` and records how long it was deferred for.
+*/
+static void recordSchedulingLatency() {
+	SuperPage* s = TheSuperPage;
+	s->rescheduleNeededOnSvcExit = false;
+	if (s->rescheduleRequestTime) {
+		// thread_accountSwitch() has just updated lastAccountingTime
+		uint32 latency = s->lastAccountingTime - s->rescheduleRequestTime;
+		if (latency > s->maxSchedulingLatency) s->maxSchedulingLatency = latency;
+		s->rescheduleRequestTime = 0;
+	}
+}
+
+// Enter in SVC. Like scheduleThread() but leaves t->timeslice alone.
+static NORETURN switchToThread(Thread* t) {
 	Process* p = processForThread(t);
+	TRACE(ETraceContextSwitch, p ? indexForProcess(p) : 0xFF, t->index);
+	thread_accountSwitch(t);
+	recordSchedulingLatency();
 	switch_process(p);
-	t->timeslice = THREAD_TIMESLICE;
 	TheSuperPage->currentThread = t;
 	//printk("Scheduling thread %d-%d ts=%d\n", indexForProcess(p), t->index, t->timeslice);
 	//worddump(t->savedRegisters, sizeof(t->savedRegisters));
@@ -128,6 +166,49 @@ NORETURN scheduleThread(Thread* t) {
 	}
 }
 
+// Enter in SVC
+NORETURN scheduleThread(Thread* t) {
+	t->timeslice = THREAD_TIMESLICE;
+	switchToThread(t);
+}
+
+/**
+Switches directly from the current thread `from` to `to` without going through
+the ready list, giving `to` whatever is left of `from`'s timeslice. Used when
+`from` has just woken `to` with an IPC message, so that a request/response
+round trip doesn't have to wait behind every other ready thread. `from` must
+have had its registers saved, and both threads must be `EReady`.
+
+`to` is moved to the head of the ready list and `from` to immediately behind
+it, so that when `to` blocks again (as a server does once it has replied)
+`from` is the next thread to run.
+
+Does not return unless the switch can't be done because `from`'s timeslice has
+expired, `to` has a lower priority than `from`, or something else needs to be
+scheduled first, in which case it returns false and the caller should carry on
+as normal.
+*/
+bool thread_handoff(Thread* from, Thread* to) {
+	SuperPage* s = TheSuperPage;
+	int mask = kern_disableInterrupts();
+	if (from->timeslice == 0 || s->rescheduleNeededOnSvcExit || to == from
+#ifdef HAVE_THREAD_PRIORITIES
+		|| to->priority < from->priority
+#endif
+		) {
+		kern_restoreInterrupts(mask);
+		return false;
+	}
+	ASSERT(from->state == EReady && to->state == EReady, from->state, to->state);
+	thread_dequeue(to, &s->readyList);
+	thread_dequeue(from, &s->readyList);
+	thread_enqueueBefore(to, s->readyList);
+	s->readyList = to;
+	thread_enqueueBefore(from, to->next);
+	to->timeslice = from->timeslice;
+	switchToThread(to);
+}
+
 NORETURN do_process_start(uint32 sp) {
 	scheduleThread(TheSuperPage->currentThread);
 }
@@ -143,6 +224,10 @@ Interrupts may or may not be enabled. Must be in SVC mode.
 See also: [reschedule_irq()](#reschedule_irq)
 */
 NORETURN NAKED reschedule() {
+	// Whatever stack we were on belongs to a thread that isn't running any
+	// more, and after switch_process() it may not even be mapped. In the case
+	// of a thread preempted in an SVC it must also not be trashed.
+	GetKernelStackTop(AL, r13);
 	asm(".doReschedule:");
 	// asm("BL reschedule_debug");
 	asm("BL findNextReadyThread");
@@ -151,6 +236,8 @@ NORETURN NAKED reschedule() {
 
 	// If we get here, no more threads to run, need to just WFI
 	// But in order to do that we need to safely reenable interrupts
+	asm("BL thread_accountSwitch"); // r0 is NULL, so this starts counting idle time
+	asm("MOV r0, #0");
 	asm("LDR r1, .TheCurrentThreadAddr");
 	asm("STR r0, [r1]"); // currentThread = NULL
 	DSB(r0);
@@ -177,6 +264,62 @@ NORETURN NAKED reschedule_irq() {
 	LABEL_WORD(.irqStack, KIrqStackBase + KPageSize);
 }
 
+/**
+Saves the SVC-mode context of the current thread on its SVC stack, including
+the user r13, r14 and spsr_svc that the next thread will overwrite, and sets up
+`t->savedRegisters` so that scheduleThread() will resume it in SVC mode at
+`.svcPreemptResume` with interrupts disabled. Then reschedules. Returns when the
+thread is next scheduled.
+*/
+static NAKED void svc_preempt(Thread* t) {
+	asm("PUSH {r4-r12, lr}"); // r12 is just to keep the stack 8-byte aligned
+	asm("SUB sp, sp, #8");
+	ASM_JFDI("STM sp, {r13-r14}^"); // Saves the user (banked) r13 and r14
+	asm("MRS r1, spsr");
+	asm("PUSH {r1, r2}");
+	asm("STR sp, [r0, %0]" : : "i" (offsetof(Thread, savedRegisters) + 13 * sizeof(uintptr)));
+	// See doScheduleKernThread for why we set reg[14] not reg[15]
+	asm("ADR r1, .svcPreemptResume");
+	asm("STR r1, [r0, %0]" : : "i" (offsetof(Thread, savedRegisters) + 14 * sizeof(uintptr)));
+	asm("MOV r1, %0" : : "i" (KPsrModeSvc | KPsrIrqDisable | KPsrFiqDisable));
+	asm("STR r1, [r0, %0]" : : "i" (offsetof(Thread, savedRegisters) + 16 * sizeof(uintptr)));
+	asm("B reschedule");
+
+	asm(".svcPreemptResume:");
+	asm("POP {r1, r2}");
+	asm("MSR spsr_cxsf, r1");
+	ASM_JFDI("LDM sp, {r13-r14}^");
+	asm("NOP"); // Banked registers can't be accessed in the instruction after an LDM ^
+	asm("ADD sp, sp, #8");
+	asm("POP {r4-r12, pc}");
+}
+
+/**
+Long-running SVCs should call this periodically, at points where they don't
+have any kernel state half-updated (or any hardware mid-transaction) that
+another thread or a DFC might need. If the current thread's timeslice has
+expired or there are DFCs waiting to run, the thread is rescheduled and this
+function returns when it next gets to run. Otherwise it returns immediately.
+
+Must only be called from a user thread's SVC (that is, somewhere below
+handleSvc()), with interrupts enabled. Does nothing when called from the DFC
+thread or the debugger.
+*/
+void kern_preemptionPoint() {
+	SuperPage* s = TheSuperPage;
+	if (!s->rescheduleNeededOnSvcExit) return;
+	Thread* t = s->currentThread;
+	if (!t || t == &s->dfcThread || s->marvin) return;
+
+	int mask = kern_disableInterrupts();
+	if (atomic_setbool(&s->rescheduleNeededOnSvcExit, false)) {
+		// If it was a timeslice expiry, tick() will already have moved us to
+		// the back of the ready list. Either way we're still EReady.
+		svc_preempt(t);
+	}
+	kern_restoreInterrupts(mask);
+}
+
 void thread_writeSvcResult(Thread* t, uintptr result) {
 	t->savedRegisters[0] = result;
 }
@@ -189,6 +332,10 @@ bool tick() {
 		s->timerCompletionTime = UINT64_MAX;
 		dfc_requestComplete(&s->timerRequest, 0);
 	}
+	if (s->uptime >= s->nextWakeTime) {
+		s->nextWakeTime = UINT64_MAX;
+		dfc_queue(thread_wakeSleepers, 0, 0, 0);
+	}
 	Thread* t = s->currentThread;
 	if (t && t->state == EReady) {
 		if (t->timeslice > 0) {
@@ -209,7 +356,7 @@ bool tick() {
 	return false;
 }
 
-static void dfcs_run(int numDfcsPending, Dfc* dfcs);
+static void dfcs_run();
 
 /**
 Call from end of IRQ handler to check for any pending DFCs to run. Runs in IRQ
@@ -223,18 +370,11 @@ bool irq_checkDfcs() {
 		// Then DFC thread is already scheduled or running, nothing we can do
 		return false;
 	}
-	uint8 numDfcsPending = atomic_set8(&TheSuperPage->numDfcsPending, 0);
-	if (numDfcsPending == 0) return false;
-	// If we have some DFCs, ready the DFC thread
+	if (!dfc_pending()) return false;
+	// If we have some DFCs, ready the DFC thread. It drains the ring in place.
 	thread_setState(dfcThread, EReady);
-	// Copy DFCs into dfcThread's stack so that we don't have to access the
-	// SuperPage's copy with interrupts enabled.
-	uintptr sp = KDfcThreadStack + KPageSize - sizeof(TheSuperPage->dfcs);
-	memcpy((void*)sp, TheSuperPage->dfcs, sizeof(TheSuperPage->dfcs));
 	// And massage the register set so that scheduleThread() will do the right thing
-	dfcThread->savedRegisters[0] = numDfcsPending;
-	dfcThread->savedRegisters[1] = sp;
-	dfcThread->savedRegisters[13] = sp;
+	dfcThread->savedRegisters[13] = KDfcThreadStack + KPageSize;
 	// See doScheduleKernThread for why we set reg[14] not reg[15]
 	dfcThread->savedRegisters[14] = (uintptr)&dfcs_run;
 	uint32 psr;
@@ -245,13 +385,7 @@ bool irq_checkDfcs() {
 }
 
 void dfc_queue(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3) {
-	uint32 n = atomic_inc8(&TheSuperPage->numDfcsPending);
-	ASSERT(n <= MAX_DFCS);
-	Dfc* dfc = &TheSuperPage->dfcs[n-1];
-	dfc->fn = fn;
-	dfc->args[0] = arg1;
-	dfc->args[1] = arg2;
-	dfc->args[2] = arg3;
+	dfc_push(fn, arg1, arg2, arg3);
 
 	/*
 	if (n == 1 && (getCpsr() & KPsrModeMask) == KPsrModeSvc) {
@@ -260,20 +394,23 @@ void dfc_queue(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3) {
 	*/
 }
 
-// Stack alignment must be 16 bytes and we push one of these directly onto the
-// stack
-ASSERT_COMPILE((sizeof(TheSuperPage->dfcs) & 0xF) == 0);
-
 // Run as if it were a normal (albeit kernel-only) thread.
-static void dfcs_run(int numDfcsPending, Dfc* dfcs) {
-	for (int i = 0; i < numDfcsPending; i++) {
-		Dfc* dfc = &dfcs[i];
-		dfc->fn(dfc->args[0], dfc->args[1], dfc->args[2]);
+static void dfcs_run() {
+	Dfc dfc;
+	for (;;) {
+		while (dfc_pop(&dfc)) {
+			TRACE(ETraceDfc, dfc.fn, dfc.args[0]);
+			dfc.fn(dfc.args[0], dfc.args[1], dfc.args[2]);
+		}
+		// Have to do disable before messing with the current thread's state.
+		// Recheck with interrupts off, because irq_checkDfcs() won't reready
+		// us for anything queued after we last looked.
+		kern_disableInterrupts();
+		if (!dfc_pending()) break;
+		kern_enableInterrupts();
 	}
 	Thread* me = TheSuperPage->currentThread;
 	ASSERT(me == &TheSuperPage->dfcThread);
-	// Have to do disable before messing with the current thread's state
-	kern_disableInterrupts();
 	thread_setState(me, EBlockedFromSvc);
 	thread_setBlockedReason(me, EBlockedWaitingForDfcs);
 	reschedule();
@@ -1,6 +1,7 @@
 #include <k.h>
 #include <armv7-m.h>
 #include <exec.h>
+#include <mmu.h>
 
 int kern_disableInterrupts() {
 	int result;
@@ -139,8 +140,11 @@ static NORETURN NAKED doScheduleThread(uint32* savedRegisters) {
 }
 
 static NORETURN USED scheduleThread(Thread* t) {
+	TRACE(ETraceContextSwitch, 0, t->index);
+	thread_accountSwitch(t);
 	t->timeslice = THREAD_TIMESLICE;
 	TheSuperPage->currentThread = t;
+	mmu_setStackGuard(t->stackBase);
 	// printk("Scheduling thread\n");
 	doScheduleThread(t->savedRegisters);
 }
@@ -166,6 +170,7 @@ NORETURN reschedule() {
 	}
 
 	TheSuperPage->currentThread = NULL;
+	thread_accountSwitch(NULL);
 	// Bump pendsv priority so it can run during the WFI
 	// in case of ISRs that need a DFC to make a thread ready
 	setPendSvPriority(KPriorityWfiPendsv);
@@ -198,21 +203,13 @@ static void USED doPendSv(void* savedRegisters) {
 	TheSuperPage->lastPendSvTime = (TheSuperPage->uptime << 16) + GET32(SYSTICK_VAL);
 #endif
 	// printk("+pendSV\n");
-	Dfc dfcs[MAX_DFCS];
-	// Interrupts will always be enabled on entry to a configurable exception handler
-	kern_disableInterrupts();
-	const int n = TheSuperPage->numDfcsPending;
-	if (n) {
-		memcpy(dfcs, TheSuperPage->dfcs, n * sizeof(Dfc));
-		TheSuperPage->numDfcsPending = 0;
-		kern_enableInterrupts();
-
-		for (int i = 0; i < n; i++) {
-			Dfc* dfc = &dfcs[i];
-			dfc->fn(dfc->args[0], dfc->args[1], dfc->args[2]);
-		}
-	} else {
-		kern_enableInterrupts();
+	// Interrupts will always be enabled on entry to a configurable exception
+	// handler. Anything queued while we're draining the ring will be picked up
+	// by this loop, or else will have re-pended PendSV.
+	Dfc dfc;
+	while (dfc_pop(&dfc)) {
+		TRACE(ETraceDfc, dfc.fn, dfc.args[0]);
+		dfc.fn(dfc.args[0], dfc.args[1], dfc.args[2]);
 	}
 
 	// Last thing the pendSV handler does is to check for thread timeslice expired
@@ -237,6 +234,10 @@ void sysTick() {
 		dfc_requestComplete(&s->timerRequest, 0);
 		// printk("Done\n");
 	}
+	if (s->uptime >= s->nextWakeTime) {
+		s->nextWakeTime = UINT64_MAX;
+		dfc_queue(thread_wakeSleepers, 0, 0, 0);
+	}
 	Thread* t = s->currentThread;
 	if (t && t->state == EReady) {
 		if (t->timeslice > 0) {
@@ -258,16 +259,14 @@ void sysTick() {
 }
 
 void dfc_queue(DfcFn fn, uintptr arg1, uintptr arg2, uintptr arg3) {
-	int mask = kern_disableInterrupts();
-	// printk("+dfc_queue\n");
-	uint8 n = ++(TheSuperPage->numDfcsPending);
-	ASSERT(n <= MAX_DFCS);
-	Dfc* dfc = &TheSuperPage->dfcs[n-1];
-	dfc->fn = fn;
-	dfc->args[0] = arg1;
-	dfc->args[1] = arg2;
-	dfc->args[2] = arg3;
-	// printk("-dfc_queue\n");
-	kern_restoreInterrupts(mask);
+	dfc_push(fn, arg1, arg2, arg3);
 	PUT32(SCB_ICSR, ICSR_PENDSVSET);
 }
+
+/**
+SVCs run in Handler mode on the one shared Handler stack, so there is nowhere
+to keep the context of a preempted SVC. Long SVCs still call this so that they
+pick up preemption if it's ever supported here.
+*/
+void kern_preemptionPoint() {
+}
@@ -41,9 +41,11 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 	if (cmd & KFastExec) {
 		cmd = cmd & ~KFastExec;
 	}
+	TRACE(ETraceSvcEntry, cmd, 0);
 
 	Process* p = TheSuperPage->currentProcess;
 	Thread* t = TheSuperPage->currentThread;
+	if (t) t->numSvcs++;
 	uint64 result = 0;
 
 	switch (cmd) {
@@ -105,7 +107,7 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 		}
 		case KExecThreadCreate: {
 			Thread* result = NULL;
-			return thread_new(p, arg1, &result);
+			return thread_new(p, arg1, arg2, &result);
 		}
 		case KExecThreadExit:
 			thread_exit(t, (int)arg1); // Never returns
@@ -129,6 +131,9 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 			thread_yield(t);
 			reschedule();
 			break;
+		case KExecSetThreadPriority:
+			result = thread_setPriority(t, (int)arg1);
+			break;
 		case KExecGetch_Async: {
 			if (byteReady()) {
 				KAsyncRequest req = { .thread = t, .userPtr = arg1 };
@@ -153,13 +158,58 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 			}
 			break;
 		}
+		case KExecWaitForAnyRequestTimeout: {
+			uint8* reqs = &t->completedRequests;
+			if (*reqs) {
+				result = *reqs;
+				*reqs = 0;
+			} else if ((int)arg1 > 0) {
+				// Returns zero if the timeout expires first
+				saveCurrentRegistersForThread(savedRegisters);
+				thread_sleep(t, EWaitForRequest, (int)arg1);
+				reschedule();
+			}
+			break;
+		}
+		case KExecSleep:
+			if ((int)arg1 > 0) {
+				saveCurrentRegistersForThread(savedRegisters);
+				thread_sleep(t, ESleeping, (int)arg1);
+				reschedule();
+			}
+			break;
+		case KExecFutexWait: {
+			if (arg1 >= KUserBss && arg1 < KUserHeapBase) {
+				// ASSERT_USER doesn't allow for BSS, which is only below the heap on MMU builds
+				ASSERT(!(arg1 & 3), arg1);
+			} else {
+				ASSERT_USER_WPTR32(arg1);
+			}
+			if (*(uint32*)arg1 != (uint32)arg2) {
+				// Already changed, so whatever we'd be waiting for has happened
+				break;
+			}
+			saveCurrentRegistersForThread(savedRegisters);
+			thread_futexWait(t, arg1);
+			reschedule(); // Doesn't return
+		}
+		case KExecFutexWake:
+			result = process_futexWake(p, arg1, (int)arg2);
+			break;
 #endif
 		case KExecGetUptime:
 			result = TheSuperPage->uptime;
 			break;
 #ifndef LUPI_NO_IPC
 		case KExecNewSharedPage:
-			result = ipc_mapNewSharedPageInCurrentProcess();
+			result = ipc_mapNewSharedPagesInCurrentProcess(arg1);
+			break;
+		case KExecGrantSharedPages:
+			// Pages are aligned so the count fits in the bottom bits
+			result = ipc_grantSharedPages(arg1, arg2 & ~(KPageSize - 1), arg2 & (KPageSize - 1));
+			break;
+		case KExecCheckSharedPages:
+			result = ipc_checkSharedPages(arg1, arg2 & ~(KPageSize - 1), arg2 & (KPageSize - 1));
 			break;
 		case KExecCreateServer:
 			result = ipc_createServer(arg1, t);
@@ -173,9 +223,20 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 		case KExecRequestServerMsg:
 			ipc_requestServerMsg(t, arg1);
 			break;
-		case KExecCompleteIpcRequest:
-			result = ipc_completeRequest(arg1, arg2);
+		case KExecCompleteIpcRequest: {
+			Thread* woken;
+			result = ipc_completeRequest(arg1, arg2, &woken);
+#ifdef ARM
+			if (woken) {
+				// Switch straight to whoever we just woke, rather than making
+				// the round trip wait for the ready list
+				saveCurrentRegistersForThread(savedRegisters);
+				thread_writeSvcResult(t, result);
+				thread_handoff(t, woken); // Only returns if it couldn't
+			}
+#endif
 			break;
+		}
 #endif
 		case KExecSetTimer: {
 			if (TheSuperPage->timerRequest.thread && TheSuperPage->timerRequest.thread != t) {
@@ -201,6 +262,15 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 		case KExecGetString:
 			result = (uintptr)getString(arg1);
 			break;
+		case KExecTraceControl:
+			result = trace_setEnabled((bool)arg1);
+			break;
+		case KExecProfilerControl:
+			result = profiler_control((int)arg1, arg2);
+			break;
+		case KExecGetCpuStats:
+			result = process_getCpuStats(arg1, (int)arg2);
+			break;
 		case KExecDriverConnect: {
 			uint32 id = arg1;
 			// Find the driver
@@ -242,13 +312,15 @@ int64 handleSvc(int cmd, uintptr arg1, uintptr arg2, void* savedRegisters) {
 		}
 	}
 
+	TRACE(ETraceSvcExit, cmd, result);
+
 #ifdef ARM
 	// This is handled by pendSV on ARMv7-M
 	kern_disableInterrupts();
 	// Now we're done servicing the SVC, check if rescheduleNeededOnSvcExit
 	// was set meaning our thread's timeslice expired during the SVC (but
-	// because we don't support preempting SVC threads yet it couldn't
-	// reschedule at that point). We disable interrupts here to make sure the
+	// because SVCs can only be preempted at a kern_preemptionPoint() it
+	// couldn't reschedule at that point). We disable interrupts here to make sure the
 	// timeslice doesn't expire after we've checked rescheduleNeededOnSvcExit
 	// but before we return.
 	if (atomic_setbool(&TheSuperPage->rescheduleNeededOnSvcExit, false)) {
@@ -276,6 +348,14 @@ static int getInt(int arg) {
 		return TheSuperPage->screenHeight;
 	case EValScreenFormat:
 		return TheSuperPage->screenFormat;
+	case EValMaxSchedulingLatency:
+#ifdef ARM
+		return TheSuperPage->maxSchedulingLatency;
+#else
+		return KErrNotSupported;
+#endif
+	case EValMaxThreads:
+		return MAX_THREADS;
 	default:
 		ASSERT(false, arg);
 	}
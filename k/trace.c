@@ -0,0 +1,59 @@
+#include <k.h>
+#include <err.h>
+
+/**
+The trace buffer is a ring of `TraceEvent`s. `TheSuperPage->traceCount` is the
+total number of events written since tracing was last enabled, so the valid
+events are the last `min(traceCount, KTraceMaxEvents)` slots before
+`traceCount & (KTraceMaxEvents-1)`. Slots are claimed with an atomic increment
+so that it is safe to call trace_event() from any context, including IRQ
+handlers, without disabling interrupts.
+*/
+
+#ifdef KTraceBufferAddress
+
+#define TheTraceBuffer ((TraceEvent*)KTraceBufferAddress)
+#define KTraceMaxEvents (KTraceBufferSize / sizeof(TraceEvent))
+ASSERT_COMPILE(IS_POW2(KTraceMaxEvents));
+
+void trace_event(TraceEventType type, uintptr arg1, uintptr arg2) {
+	uint32 n = atomic_inc(&TheSuperPage->traceCount) - 1;
+	TraceEvent* e = &TheTraceBuffer[n & (KTraceMaxEvents - 1)];
+	Thread* t = TheSuperPage->currentThread;
+	Process* p = t ? processForThread(t) : NULL;
+	e->timestamp = board_getMicroseconds();
+	e->type = type;
+	e->processIdx = p ? indexForProcess(p) : 0xFF;
+	e->threadIdx = t ? t->index : 0xFF;
+	e->spare = 0;
+	e->arg1 = arg1;
+	e->arg2 = arg2;
+}
+
+/**
+Enables or disables event tracing. Enabling tracing when it was previously
+disabled discards any events already in the buffer. Returns whether tracing was
+previously enabled, or `KErrNotSupported` if the platform has no trace buffer.
+*/
+int trace_setEnabled(bool enable) {
+	// Flags can be modified from IRQ context
+	int mask = kern_disableInterrupts();
+	bool wasEnabled = kern_getFlag(TraceEnabled);
+	if (enable && !wasEnabled) {
+		TheSuperPage->traceCount = 0;
+	}
+	kern_setFlag(TraceEnabled, enable);
+	kern_restoreInterrupts(mask);
+	return wasEnabled;
+}
+
+#else
+
+void trace_event(TraceEventType type, uintptr arg1, uintptr arg2) {
+}
+
+int trace_setEnabled(bool enable) {
+	return KErrNotSupported;
+}
+
+#endif // KTraceBufferAddress
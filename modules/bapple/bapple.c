@@ -7,9 +7,16 @@
 
 #include "bapple.xbm"
 
+// Generated from bapple.pbm by the build, see build/animEncoder.lua
+extern const unsigned char bapple_anim[];
+extern const int bapple_anim_size;
+
 int init_module_bapple_bapple(lua_State* L) {
 	mbuf_newXbm(L, bapple);
 	lua_setfield(L, 1, "xbm");
 
+	mbuf_new(L, (void*)bapple_anim, bapple_anim_size, NULL);
+	lua_setfield(L, 1, "anim");
+
 	return 0;
 }
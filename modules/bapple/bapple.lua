@@ -1,7 +1,25 @@
+--[[**
+Plays the bapple animation, looping, in the middle of the screen. Run with:
+
+	lupi.createProcess("bapple")
+
+The frames come from bapple.pbm, which is encoded by the build (see
+[animEncoder.lua](../../build/animEncoder.lua)). Replace it with your own
+footage to play something else.
+]]
+
+require "runloop"
 require "bitmap"
+local player = require "bitmap.anim"
 
 function main()
+	local rl = runloop.new()
 	bmp = bitmap.create()
-	bmp:setAutoBlit(true)
 	bmp:clear()
+	bmp:blit()
+	local animation = player.new(anim)
+	local x = (bmp:width() - animation.width) // 2
+	local y = (bmp:height() - animation.height) // 2
+	animation:play(bmp, x, y, { loop = true })
+	rl:run()
 end
@@ -0,0 +1,153 @@
+--[[**
+Plays animations which have been encoded by the build system (see
+[animEncoder.lua](../../build/animEncoder.lua)). Frames are decoded natively
+straight into a bitmap, and only the parts which changed are drawn and blitted,
+so even full screen animations are cheap so long as not much moves.
+
+	local anim = require "bitmap.anim"
+	local bmp = bitmap.create()
+	local animation = anim.new(bapple.anim)
+	animation:play(bmp, 0, 0, { loop = true })
+	runloop.current:run()
+
+## Format
+
+All values are little-endian. There is a 16 byte header:
+
+	Offset  Size  Description
+	0       4     "ANIM"
+	4       2     Width
+	6       2     Height
+	8       2     Number of frames
+	10      2     Frame interval, in milliseconds
+	12      1     Format: 0 for one bit per pixel, 1 for RGB565
+	13      3     Reserved, zero
+
+followed by the frames. Each frame starts with a byte giving the number of rects
+it updates (at most `KMaxDirtyRects`, so they map exactly onto the bitmap's
+invalidated region), and each rect is its x, y, width and height as 2 bytes
+each, followed by ops which between them cover every pixel of the rect, row by
+row. Each op is a byte with the op in the top two bits and the number of pixels
+it covers in the bottom six. A count of zero means the count follows as a
+ULEB128. The ops are:
+
+* 0 (skip): Leaves the pixels as they were in the previous frame.
+* 1 (fill): Sets the pixels to one colour. For RGB565 the colour follows as 2
+  big-endian bytes, for one bit animations it's the background colour.
+* 2 (literal): The pixels follow. For RGB565 that's 2 big-endian bytes each, for
+  one bit animations it's a bit each, least significant bit first (like XBMs)
+  and padded to a whole byte. A set bit is the foreground colour.
+* 3 (fill one): One bit animations only, sets the pixels to the foreground
+  colour.
+
+The first frame covers the whole animation and has no skips, so that looping
+back to it doesn't depend on what was there before.
+]]
+
+require "bitmap"
+
+local KHeaderSize = 16
+local KMagic = "ANIM"
+
+local function isAnimation(data)
+	if data:getLength() < KHeaderSize then return false end
+	for i = 1, #KMagic do
+		if data:getByte(i - 1) ~= KMagic:byte(i) then return false end
+	end
+	return true
+end
+
+Animation = {}
+Animation.__index = Animation
+
+--[[**
+Returns a new `Animation` for the encoded data in MemBuf `data`. Its `width`,
+`height`, `numFrames` and `frameInterval` members are read from the header.
+]]
+function new(data)
+	assert(isAnimation(data), "Not an animation")
+	local anim = setmetatable({
+		data = data,
+		width = data:getUint16(4),
+		height = data:getUint16(6),
+		numFrames = data:getUint16(8),
+		frameInterval = data:getUint16(10),
+		format = data:getByte(12),
+	}, Animation)
+	anim:rewind()
+	return anim
+end
+
+--[[**
+Goes back to the first frame.
+]]
+function Animation:rewind()
+	self.frame = 0
+	self.offset = KHeaderSize
+end
+
+--[[**
+Returns true if there are no frames left to draw.
+]]
+function Animation:finished()
+	return self.frame == self.numFrames
+end
+
+--[[**
+Decodes the next frame into `bmp` at (x, y), without blitting it. `bmp` must
+still contain the previous frame, at the same place.
+]]
+function Animation:drawNextFrame(bmp, x, y)
+	assert(not self:finished(), "No more frames")
+	self.offset = bmp:drawAnimFrame(self.data, self.offset, x, y)
+	self.frame = self.frame + 1
+end
+
+--[[**
+Plays the animation from the current frame into `bmp` at (x, y), blitting each
+frame. Frames are paced off the uptime rather than by adding up timer delays,
+so the frame rate stays steady. If drawing falls behind, the frames which are
+due are all decoded (each one depends on the last) and blitted together. There
+must be a run loop. `opts` may contain:
+
+* `loop`: If true, goes back to the first frame after the last one, forever.
+* `completionFn`: Called after the last frame has been blitted.
+* `frameInterval`: Overrides the animation's frame interval, in milliseconds.
+]]
+function Animation:play(bmp, x, y, opts)
+	opts = opts or {}
+	-- Not required up front, so decoding frames doesn't need a run loop
+	local timers = require "timerserver.local"
+	local interval = opts.frameInterval or self.frameInterval
+	local start = lupi.getUptime()
+	local shown = 0
+	self.stopped = false
+	local function nextFrame()
+		if self.stopped then return end
+		local due = (lupi.getUptime() - start):lo() // interval + 1
+		repeat
+			if self:finished() then
+				if not opts.loop then break end
+				self:rewind()
+			end
+			self:drawNextFrame(bmp, x, y)
+			shown = shown + 1
+		until shown >= due
+		bmp:blit()
+		if self:finished() and not opts.loop then
+			if opts.completionFn then opts.completionFn() end
+			return
+		end
+		local deadline = start + shown * interval
+		local now = lupi.getUptime()
+		timers.after(nextFrame, now < deadline and (deadline - now):lo() or 0)
+	end
+	nextFrame()
+end
+
+--[[**
+Stops a `play()` in progress, without calling its `completionFn`.
+]]
+function Animation:stop()
+	self.stopped = true
+end
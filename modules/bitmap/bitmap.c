@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <lupi/exec.h>
+#include <lupi/ipc.h>
+#include <lupi/runloop.h>
 #include "bitmap.h"
 #include "font.xbm" // Rockin' the retro!
 #include "font_small.xbm"
@@ -31,10 +33,15 @@ int exec_getInt(ExecGettableValue val);
 
 #endif // ONE_BPP_BITMAPS
 
+// The span and packing code relies on pixel rows being word aligned
+ASSERT_COMPILE((offsetof(Bitmap, data) & 3) == 0);
+
 typedef enum Flags {
 	AutoBlit = 1,
 	SmallFont = 2,
 	TransformSet = 4,
+	IncrementalBlit = 8,
+	PackedBufferStale = 16, // The packed buffer may not match what's on the screen
 } Flags;
 
 struct DrawContext;
@@ -96,6 +103,22 @@ static inline void setPixelRaw(const DrawContext* context, int x, int y, uint16
 
 #endif // ONE_BPP_BITMAPS
 
+#if defined(ONE_BPP_BITMAPS)
+
+static inline uint16 getPixelRaw(const Bitmap* b, int width, int x, int y) {
+	int page = y / 8;
+	int bitidx = (page * width + x) * 8 + (y - page * 8);
+	return bitmap_getPixels(b)[bitidx] ? BLACK : WHITE;
+}
+
+#else
+
+static inline uint16 getPixelRaw(const Bitmap* b, int width, int x, int y) {
+	return bitmap_getPixels(b)[y * width + x];
+}
+
+#endif // ONE_BPP_BITMAPS
+
 static void setPixelTransformed(const DrawContext* context, int x, int y, uint16 col) {
 	AffineTransform const*const t = &context->pixelTransform;
 	int xx = transform_x(*t, x, y);
@@ -107,6 +130,250 @@ static void setPixelTransformed(const DrawContext* context, int x, int y, uint16
 	setPixelRaw(context, xx, yy, col);
 }
 
+/*
+A transform made up only of 90-degree rotations and reflections maps every rect
+in drawing coordinates onto a rect in the raw pixel data, and every row onto a
+run of pixels a constant distance apart. That's all we ever use in practice, so
+the fill and XBM code has span-based paths for it which don't go through
+setPixelFn. Anything else (or anything which would go out of bounds) takes the
+generic path.
+*/
+static inline bool isRightAngleTransform(const AffineTransform* t) {
+	return (t->b == 0 && t->c == 0 && (t->a == 1 || t->a == -1) && (t->d == 1 || t->d == -1))
+		|| (t->a == 0 && t->d == 0 && (t->b == 1 || t->b == -1) && (t->c == 1 || t->c == -1));
+}
+
+/*
+r must not be empty. Everything that writes pixels other than one at a time
+goes through here, so defining BITMAP_PER_PIXEL makes them all fall back to
+set_pixel(). build/bitmaphostref does that, to check the fast paths against.
+*/
+static bool getRawRect(const DrawContext* context, const Rect* r, Rect* raw) {
+#ifdef BITMAP_PER_PIXEL
+	return false;
+#endif
+	const AffineTransform* t = &context->pixelTransform;
+	if (!isRightAngleTransform(t)) return false;
+	const int x0 = transform_x(*t, r->x, r->y);
+	const int y0 = transform_y(*t, r->x, r->y);
+	const int x1 = transform_x(*t, r->x + r->w - 1, r->y + r->h - 1);
+	const int y1 = transform_y(*t, r->x + r->w - 1, r->y + r->h - 1);
+	const int xmin = min(x0, x1), xmax = max(x0, x1);
+	const int ymin = min(y0, y1), ymax = max(y0, y1);
+	if (xmin < 0 || ymin < 0 || xmax >= context->bwidth || ymax >= context->bheight) {
+		return false;
+	}
+	rect_set(raw, xmin, ymin, xmax - xmin + 1, ymax - ymin + 1);
+	return true;
+}
+
+#ifdef ONE_BPP_BITMAPS
+
+// Bitbanded pixels aren't laid out in rows, so no spans for us
+static inline bool fillRectSpans(const DrawContext* context, const Rect* r, uint16 col) {
+	return false;
+}
+
+static inline bool drawXbmSpans(const DrawContext* context, int x, int y, int w, int h,
+	const Rect* r, const uint8* xbm, int xbm_stride, uint16 fg, uint16 bg) {
+	return false;
+}
+
+static inline bool blitBitmapSpans(const DrawContext* context, int x, int y, int w, int h,
+	const Bitmap* src, int swidth, int srcx, int srcy, bool transparent) {
+	return false;
+}
+
+#else
+
+// So we can write pixels in bigger chunks without upsetting strict aliasing
+typedef uint32 __attribute__((may_alias)) Pixels32;
+typedef uint64 __attribute__((may_alias)) Pixels64;
+
+static void fillSpan32(uint16* dst, int n, uint16 col) {
+	if (n && ((uintptr)dst & 2)) {
+		*dst++ = col;
+		n--;
+	}
+	const uint32 pair = col | ((uint32)col << 16);
+	Pixels32* w = (Pixels32*)dst;
+	for (; n >= 2; n -= 2) {
+		*w++ = pair;
+	}
+	if (n) *(uint16*)w = col;
+}
+
+static void fillSpan64(uint16* dst, int n, uint16 col) {
+	while (n && ((uintptr)dst & 7)) {
+		*dst++ = col;
+		n--;
+	}
+	const uint32 pair = col | ((uint32)col << 16);
+	const uint64 quad = pair | ((uint64)pair << 32);
+	Pixels64* w = (Pixels64*)dst;
+	for (; n >= 4; n -= 4) {
+		*w++ = quad;
+	}
+	dst = (uint16*)w;
+	while (n--) *dst++ = col;
+}
+
+static bool fillRectSpans(const DrawContext* context, const Rect* r, uint16 col) {
+	Rect raw;
+	if (!getRawRect(context, r, &raw)) return false;
+	uint16* row = context->data + raw.y * context->bwidth + raw.x;
+	// Not worth aligning to 64 bits for really narrow rects
+	void (*fillSpan)(uint16*, int, uint16) = raw.w < 8 ? fillSpan32 : fillSpan64;
+	for (int i = 0; i < raw.h; i++, row += context->bwidth) {
+		fillSpan(row, raw.w, col);
+	}
+	return true;
+}
+
+typedef uint16 XbmLut[16][4];
+
+// The 4 pixels for each nibble of XBM data, least significant bit first
+static void makeXbmLut(XbmLut lut, uint16 fg, uint16 bg) {
+	for (int n = 0; n < 16; n++) {
+		for (int i = 0; i < 4; i++) {
+			lut[n][i] = (n & (1 << i)) ? fg : bg;
+		}
+	}
+}
+
+/*
+Expands `w` bits of XBM data, starting `bitIdx` bits into `src`, to pixels `step`
+apart starting at `dst`. Works a byte of XBM at a time, so `src` must have
+enough bits in it to cover the last byte we touch.
+*/
+static inline void expandXbmRow(uint16* dst, const int step, const uint8* src, int bitIdx, int w, const XbmLut lut) {
+	src += bitIdx >> 3;
+	const int shift = bitIdx & 7;
+	while (w > 0) {
+		uint32 bits = *src++ >> shift;
+		if (shift && w > 8 - shift) bits |= (uint32)*src << (8 - shift);
+		const uint16* lo = lut[bits & 0xF];
+		const uint16* hi = lut[(bits >> 4) & 0xF];
+		if (w >= 8) {
+			dst[0] = lo[0];
+			dst[step] = lo[1];
+			dst[2 * step] = lo[2];
+			dst[3 * step] = lo[3];
+			dst[4 * step] = hi[0];
+			dst[5 * step] = hi[1];
+			dst[6 * step] = hi[2];
+			dst[7 * step] = hi[3];
+			dst += 8 * step;
+			w -= 8;
+		} else {
+			for (int i = 0; i < w; i++) {
+				dst[i * step] = i < 4 ? lo[i] : hi[i - 4];
+			}
+			w = 0;
+		}
+	}
+}
+
+// Draws rect r of the xbm at (x, y), already clipped to w by h
+static bool drawXbmSpans(const DrawContext* context, int x, int y, int w, int h,
+	const Rect* r, const uint8* xbm, int xbm_stride, uint16 fg, uint16 bg) {
+	Rect raw;
+	const Rect drawRect = rect_make(x, y, w, h);
+	if (!getRawRect(context, &drawRect, &raw)) return false;
+
+	const AffineTransform* t = &context->pixelTransform;
+	const int bwidth = context->bwidth;
+	const int xstep = t->a + t->c * bwidth;
+	const int ystep = t->b + t->d * bwidth;
+	uint16* row = context->data + transform_y(*t, x, y) * bwidth + transform_x(*t, x, y);
+	int bitIdx = r->y * xbm_stride + r->x;
+	XbmLut lut;
+	makeXbmLut(lut, fg, bg);
+
+	// Separate loops so the common steps are constants in the inner loop
+	if (xstep == 1) {
+		for (int i = 0; i < h; i++, row += ystep, bitIdx += xbm_stride) {
+			expandXbmRow(row, 1, xbm, bitIdx, w, lut);
+		}
+	} else if (xstep == -1) {
+		for (int i = 0; i < h; i++, row += ystep, bitIdx += xbm_stride) {
+			expandXbmRow(row, -1, xbm, bitIdx, w, lut);
+		}
+	} else if (xstep == bwidth) {
+		for (int i = 0; i < h; i++, row += ystep, bitIdx += xbm_stride) {
+			expandXbmRow(row, bwidth, xbm, bitIdx, w, lut);
+		}
+	} else {
+		for (int i = 0; i < h; i++, row += ystep, bitIdx += xbm_stride) {
+			expandXbmRow(row, -bwidth, xbm, bitIdx, w, lut);
+		}
+	}
+	return true;
+}
+
+/*
+Copies w pixels from `src` to pixels `step` apart starting at `dst`. The
+transparent version leaves alone any pixel where `src` is equal to `key`.
+*/
+static inline void copyRow(uint16* dst, const int step, const uint16* src, int w) {
+	if (step == 1) {
+		memcpy(dst, src, w * 2);
+		return;
+	}
+	for (int i = 0; i < w; i++) {
+		dst[i * step] = src[i];
+	}
+}
+
+static inline void copyRowTransparent(uint16* dst, const int step, const uint16* src, int w, uint16 key) {
+	if (step == 1) {
+		// Written as a select rather than a conditional store so it vectorises
+		for (int i = 0; i < w; i++) {
+			dst[i] = src[i] == key ? dst[i] : src[i];
+		}
+		return;
+	}
+	for (int i = 0; i < w; i++) {
+		if (src[i] != key) dst[i * step] = src[i];
+	}
+}
+
+#define FOR_EACH_BLIT_ROW(step) \
+	for (int i = 0; i < h; i++, row += ystep, srcRow += swidth) { \
+		if (transparent) copyRowTransparent(row, step, srcRow, w, key); \
+		else copyRow(row, step, srcRow, w); \
+	}
+
+// Copies the w by h pixels at (srcx, srcy) in src (which is swidth wide) to (x, y), already clipped
+static bool blitBitmapSpans(const DrawContext* context, int x, int y, int w, int h,
+	const Bitmap* src, int swidth, int srcx, int srcy, bool transparent) {
+	Rect raw;
+	const Rect drawRect = rect_make(x, y, w, h);
+	if (!getRawRect(context, &drawRect, &raw)) return false;
+
+	const AffineTransform* t = &context->pixelTransform;
+	const int bwidth = context->bwidth;
+	const int xstep = t->a + t->c * bwidth;
+	const int ystep = t->b + t->d * bwidth;
+	uint16* row = context->data + transform_y(*t, x, y) * bwidth + transform_x(*t, x, y);
+	const uint16* srcRow = (const uint16*)src->data + srcy * swidth + srcx;
+	const uint16 key = src->bgcolour;
+
+	// As with drawXbmSpans, keep the step a constant in each inner loop
+	if (xstep == 1) {
+		FOR_EACH_BLIT_ROW(1)
+	} else if (xstep == -1) {
+		FOR_EACH_BLIT_ROW(-1)
+	} else if (xstep == bwidth) {
+		FOR_EACH_BLIT_ROW(bwidth)
+	} else {
+		FOR_EACH_BLIT_ROW(-bwidth)
+	}
+	return true;
+}
+
+#endif // ONE_BPP_BITMAPS
+
 // Width and height must not be zero
 int bitmap_getAllocSize(uint16 width, uint16 height) {
 	int bufSize = datasize(width, height);
@@ -131,7 +398,8 @@ Bitmap* bitmap_construct(void* mem, uint16 width, uint16 height) {
 		b->flags |= SmallFont;
 	}
 	b->format = (uint8)exec_getInt(EValScreenFormat);
-	rect_zero(&b->dirtyRect);
+	b->glyphCache = NULL;
+	b->dirty.count = 0;
 	b->transform = IdentityTransform;
 	memset(b->data, 0, datasize(width, height));
 	return b;
@@ -260,6 +528,73 @@ void rect_clip(Rect* r, const Rect* clipr) {
 	if (dy > 0) r->h -= dy;
 }
 
+static inline int rect_area(const Rect* r) {
+	return (int)r->w * (int)r->h;
+}
+
+static inline bool rect_intersects(const Rect* r, const Rect* r2) {
+	return r->x < r2->x + r2->w && r2->x < r->x + r->w
+		&& r->y < r2->y + r2->h && r2->y < r->y + r->h;
+}
+
+// Roughly what one extra blit costs, in pixels: a driver call plus setting the
+// display window. Merging two rects is worth it if it adds fewer pixels than this.
+#define KBlitOverheadPixels 64
+
+// How many more pixels would have to be sent if a and b were blitted as one rect
+static int mergeCost(const Rect* a, const Rect* b) {
+	Rect u = *a;
+	rect_union(&u, b);
+	return rect_area(&u) - rect_area(a) - rect_area(b) - KBlitOverheadPixels;
+}
+
+static void region_remove(DirtyRegion* d, int i) {
+	d->rects[i] = d->rects[--d->count];
+}
+
+/*
+Adds r to the region. Any rects r overlaps, or which are cheaper to send
+together with r than separately, are merged into it first, so the rects stay
+disjoint. If the region is already full, whichever pair of rects (including r)
+adds the fewest extra pixels when merged is combined.
+*/
+static void region_add(DirtyRegion* d, Rect r) {
+	for (int i = 0; i < d->count; i++) {
+		if (rect_intersects(&d->rects[i], &r) || mergeCost(&d->rects[i], &r) <= 0) {
+			rect_union(&r, &d->rects[i]);
+			region_remove(d, i);
+			i = -1; // r has grown, so start again
+		}
+	}
+	if (d->count < KMaxDirtyRects) {
+		d->rects[d->count++] = r;
+		return;
+	}
+
+	int best = mergeCost(&d->rects[0], &r);
+	int bi = 0, bj = -1; // bj < 0 means merge rects[bi] with r
+	for (int i = 0; i < d->count; i++) {
+		int cost = mergeCost(&d->rects[i], &r);
+		if (cost < best) { best = cost; bi = i; bj = -1; }
+		for (int j = i + 1; j < d->count; j++) {
+			cost = mergeCost(&d->rects[i], &d->rects[j]);
+			if (cost < best) { best = cost; bi = i; bj = j; }
+		}
+	}
+	if (bj < 0) {
+		rect_union(&r, &d->rects[bi]);
+		region_remove(d, bi);
+	} else {
+		Rect merged = d->rects[bi];
+		rect_union(&merged, &d->rects[bj]);
+		region_remove(d, bj); // bj > bi so this doesn't move rects[bi]
+		region_remove(d, bi);
+		// The merged rect may now overlap others
+		region_add(d, merged);
+	}
+	region_add(d, r);
+}
+
 static void updateDirtyRect(Bitmap* b, Rect* r) {
 	BMP_DEBUG("drawnRect = %d,%d,%dx%d\n", r->x, r->y, r->w, r->h);
 	if (b->flags & TransformSet) {
@@ -268,11 +603,20 @@ static void updateDirtyRect(Bitmap* b, Rect* r) {
 	}
 	bitmap_clipToBounds(b, r);
 	BMP_DEBUG("clipped drawnRect = %d,%d,%dx%d\n", r->x, r->y, r->w, r->h);
-	rect_union(&b->dirtyRect, r);
-	BMP_DEBUG("dirtyRect = %d,%d,%dx%d\n", b->dirtyRect.x, b->dirtyRect.y, b->dirtyRect.w, b->dirtyRect.h);
+	if (rect_isEmpty(r)) return;
+	region_add(&b->dirty, *r);
+	BMP_DEBUG("dirty region has %d rects\n", b->dirty.count);
 	if (b->flags & AutoBlit) bitmap_blitDirtyToScreen(b);
 }
 
+// Sets result to the bounding rect of everything that needs blitting
+void bitmap_getDirtyRect(const Bitmap* b, Rect* result) {
+	rect_zero(result);
+	for (int i = 0; i < b->dirty.count; i++) {
+		rect_union(result, &b->dirty.rects[i]);
+	}
+}
+
 void bitmap_drawRect(Bitmap* b, const Rect* rect) {
 	// Line by line, by the numbers
 	DECLARE_CONTEXT(b);
@@ -283,9 +627,11 @@ void bitmap_drawRect(Bitmap* b, const Rect* rect) {
 	const uint16 yend = r.y + r.h;
 
 	const uint16 col = b->colour;
-	for (int yidx = r.y; yidx < yend; yidx++) {
-		for (int xidx = r.x; xidx < xend; xidx++) {
-			set_pixel(xidx, yidx, col);
+	if (!rect_isEmpty(&r) && !fillRectSpans(&context, &r, col)) {
+		for (int yidx = r.y; yidx < yend; yidx++) {
+			for (int xidx = r.x; xidx < xend; xidx++) {
+				set_pixel(xidx, yidx, col);
+			}
 		}
 	}
 	updateDirtyRect(b, &r);
@@ -322,15 +668,196 @@ static inline int drawch(Bitmap* b, uint16 x, uint16 y, int chIdx) {
 	return charw;
 }
 
+static inline int charIndex(char ch) {
+	if (ch < ' ' || ch >= 0x80) ch = 0x7F;
+	return ch - ' ';
+}
+
+#define KNumGlyphs 96 // 8 chars per line, 12 rows
+#define KGlyphCacheEntries 2
+
+#ifdef ONE_BPP_BITMAPS
+
+// Bitbanded pixels can't be copied a row at a time, so there's no cache
+int glyphCache_getAllocSize(void) {
+	return 0;
+}
+
+struct GlyphCache* glyphCache_construct(void* mem) {
+	return (struct GlyphCache*)mem;
+}
+
+static inline bool drawTextCached(Bitmap* b, uint16 x, uint16 y, const char* text) {
+	return false;
+}
+
+#else
+
+#define KMaxGlyphPixels max(CHAR_WIDTH(font) * CHAR_HEIGHT(font), \
+	CHAR_WIDTH(font_small) * CHAR_HEIGHT(font_small))
+
+typedef struct GlyphCacheEntry {
+	const uint8* font; // NULL if the entry is unused
+	uint16 fg, bg;
+	int8 a, b, c, d; // The rotation part of the transform the glyphs are drawn with
+	uint16 glyphs[KNumGlyphs * KMaxGlyphPixels];
+} GlyphCacheEntry;
+
+/*
+Every glyph of a font, expanded to pixels in the given colours and already
+rotated, so drawing a character is just copying its rows into place. Each entry
+is a whole font, and with 2 of them replacing the one not used most recently is
+the same as LRU.
+*/
+typedef struct GlyphCache {
+	uint32 mru; // Index of the entry used most recently
+	GlyphCacheEntry entries[KGlyphCacheEntries];
+} GlyphCache;
+
+typedef struct FontInfo {
+	const uint8* bits;
+	int xbmStride;
+	int charw, charh;
+} FontInfo;
+
+static void getFontInfo(const Bitmap* b, FontInfo* f) {
+	if (b->flags & SmallFont) {
+		*f = (FontInfo){ font_small_bits, (font_small_width + 7) & ~7, CHAR_WIDTH(font_small), CHAR_HEIGHT(font_small) };
+	} else {
+		*f = (FontInfo){ font_bits, (font_width + 7) & ~7, CHAR_WIDTH(font), CHAR_HEIGHT(font) };
+	}
+}
+
+int glyphCache_getAllocSize(void) {
+	return sizeof(GlyphCache);
+}
+
+GlyphCache* glyphCache_construct(void* mem) {
+	GlyphCache* cache = (GlyphCache*)mem;
+	cache->mru = 0;
+	for (int i = 0; i < KGlyphCacheEntries; i++) {
+		cache->entries[i].font = NULL;
+	}
+	return cache;
+}
+
+// Where the top left of a glyph's raw rect is, relative to where its origin transforms to
+#define glyphRawMinX(t, f) (min(0, (t)->a * ((f)->charw - 1)) + min(0, (t)->b * ((f)->charh - 1)))
+#define glyphRawMinY(t, f) (min(0, (t)->c * ((f)->charw - 1)) + min(0, (t)->d * ((f)->charh - 1)))
+#define glyphRawWidth(t, f) ((t)->b == 0 ? (f)->charw : (f)->charh)
+
+static void expandGlyphs(GlyphCacheEntry* e, const FontInfo* f) {
+	const AffineTransform t = { .a = e->a, .b = e->b, .c = e->c, .d = e->d };
+	const int minx = glyphRawMinX(&t, f);
+	const int miny = glyphRawMinY(&t, f);
+	const int rw = glyphRawWidth(&t, f);
+	uint16* glyph = e->glyphs;
+	for (int g = 0; g < KNumGlyphs; g++, glyph += f->charw * f->charh) {
+		const int chx = (g & 7) * f->charw;
+		const int chy = (g >> 3) * f->charh;
+		for (int gy = 0; gy < f->charh; gy++) {
+			for (int gx = 0; gx < f->charw; gx++) {
+				const int dx = transform_x(t, gx, gy) - minx;
+				const int dy = transform_y(t, gx, gy) - miny;
+				const bool set = getBit(f->bits, (chy + gy) * f->xbmStride + chx + gx);
+				glyph[dy * rw + dx] = set ? e->fg : e->bg;
+			}
+		}
+	}
+}
+
+static const uint16* getGlyphs(GlyphCache* cache, const FontInfo* f, const AffineTransform* t, uint16 fg, uint16 bg) {
+	for (int i = 0; i < KGlyphCacheEntries; i++) {
+		const GlyphCacheEntry* e = &cache->entries[i];
+		if (e->font == f->bits && e->fg == fg && e->bg == bg
+				&& e->a == t->a && e->b == t->b && e->c == t->c && e->d == t->d) {
+			cache->mru = i;
+			return e->glyphs;
+		}
+	}
+	cache->mru = (cache->mru + 1) % KGlyphCacheEntries;
+	GlyphCacheEntry* e = &cache->entries[cache->mru];
+	e->font = f->bits;
+	e->fg = fg;
+	e->bg = bg;
+	e->a = t->a; e->b = t->b; e->c = t->c; e->d = t->d;
+	expandGlyphs(e, f);
+	return e->glyphs;
+}
+
+static bool drawTextCached(Bitmap* b, uint16 x, uint16 y, const char* text) {
+	DECLARE_CONTEXT(b);
+	const AffineTransform* t = &context.pixelTransform;
+	if (!isRightAngleTransform(t)) return false;
+	FontInfo f;
+	getFontInfo(b, &f);
+	const uint16* glyphs = getGlyphs(b->glyphCache, &f, t, b->colour, b->bgcolour);
+	const int glyphSize = f.charw * f.charh;
+	const int minx = glyphRawMinX(t, &f);
+	const int miny = glyphRawMinY(t, &f);
+	const int rw = glyphRawWidth(t, &f);
+	const Rect bounds = rect_make(0, 0, context.drawWidth, context.drawHeight);
+	// Any glyphs drawn by drawch() shouldn't blit individually
+	const uint8 autoBlit = b->flags & AutoBlit;
+	b->flags &= ~AutoBlit;
+
+	int cx = x;
+	// As with drawXbm, characters must start inside the bitmap but can run off the edge
+	if (y < context.drawHeight) {
+		for (const char* chptr = text; *chptr && cx < context.drawWidth; chptr++, cx += f.charw) {
+			Rect r = rect_make(cx, y, f.charw, f.charh);
+			rect_clip(&r, &bounds);
+			Rect raw;
+			if (!getRawRect(&context, &r, &raw)) {
+				// Can't copy rows for this one, so draw it uncached
+				drawch(b, cx, y, charIndex(*chptr));
+				continue;
+			}
+			// The clipped raw rect is somewhere within the glyph's unclipped one
+			const int glyphx = raw.x - (transform_x(*t, cx, y) + minx);
+			const int glyphy = raw.y - (transform_y(*t, cx, y) + miny);
+			const uint16* src = glyphs + charIndex(*chptr) * glyphSize + glyphy * rw + glyphx;
+			uint16* dst = context.data + raw.y * context.bwidth + raw.x;
+			for (int i = 0; i < raw.h; i++, src += rw, dst += context.bwidth) {
+				memcpy(dst, src, raw.w * 2);
+			}
+		}
+	}
+	b->flags |= autoBlit;
+	Rect drawnRect = rect_make(x, y, cx - x, f.charh);
+	updateDirtyRect(b, &drawnRect);
+	return true;
+}
+
+#endif // ONE_BPP_BITMAPS
+
+/*
+Subsequent text drawn into b will use cache, which must have been constructed
+with glyphCache_construct() in a buffer of glyphCache_getAllocSize() bytes. The
+same cache can be shared by any number of bitmaps. Pass NULL to stop using it.
+*/
+void bitmap_setGlyphCache(Bitmap* b, struct GlyphCache* cache) {
+	b->glyphCache = cache;
+}
+
 void bitmap_drawText(Bitmap* b, uint16 x, uint16 y, const char* text) {
+	if (b->glyphCache && drawTextCached(b, x, y, text)) return;
+
+	// Only blit once, for the whole string
+	const uint8 autoBlit = b->flags & AutoBlit;
+	b->flags &= ~AutoBlit;
+	const uint16 startx = x;
 	const char* chptr = text;
 	for (;;) {
 		char ch = *chptr++;
 		if (ch == 0) break;
-		if (ch < ' ' || ch >= 0x80) ch = 0x7F;
-		int charIdx = ch - ' ';
-		x += drawch(b, x, y, charIdx);
+		x += drawch(b, x, y, charIndex(ch));
 	}
+	b->flags |= autoBlit;
+	Rect drawnRect;
+	bitmap_getTextRect(b, 0, &drawnRect);
+	rect_set(&drawnRect, startx, y, x - startx, drawnRect.h);
+	updateDirtyRect(b, &drawnRect);
 }
 
 void bitmap_getTextRect(Bitmap* b, int numChars, Rect* result) {
@@ -355,6 +882,14 @@ void bitmap_drawXbmData(Bitmap* b, uint16 x, uint16 y, const Rect* r, const uint
 		return;
 	}
 	const int xbm_stride = (xbm_width + 7) & ~7;
+	const int w = min((int)r->w, context.drawWidth - x);
+	const int h = min((int)r->h, context.drawHeight - y);
+
+	if (w > 0 && h > 0 && drawXbmSpans(&context, x, y, w, h, r, xbm, xbm_stride, b->colour, b->bgcolour)) {
+		Rect drawnRect = rect_make(x, y, r->w, r->h);
+		updateDirtyRect(b, &drawnRect);
+		return;
+	}
 
 	for (int yidx = 0; yidx < r->h; yidx++) {
 		if (y+yidx >= context.drawHeight) break; // rest of xbm will be outside bitmap
@@ -370,6 +905,195 @@ void bitmap_drawXbmData(Bitmap* b, uint16 x, uint16 y, const Rect* r, const uint
 	updateDirtyRect(b, &drawnRect);
 }
 
+/*
+Draws the `srcRect` part of `src`, in its raw unrotated coordinates, at (x, y) in
+b. b's transform applies as usual, so a sprite can be drawn into a rotated
+screen bitmap without having to rotate it first. x and y may be negative, and
+whatever falls outside b is clipped. If `flags` includes EBlitTransparent, pixels
+equal to src's background colour are left alone. src must not be b.
+*/
+void bitmap_blitBitmap(Bitmap* b, const Bitmap* src, const Rect* srcRect, int x, int y, uint32 flags) {
+	bitmap_blitBitmapSized(b, src, bitmap_getWidth(src), bitmap_getHeight(src), srcRect, x, y, flags);
+}
+
+/*
+Like bitmap_blitBitmap(), but src is taken to be srcWidth by srcHeight whatever
+its header says. For when src is in memory that another process can write to,
+so its header can't be trusted to stay the same as when it was checked.
+*/
+void bitmap_blitBitmapSized(Bitmap* b, const Bitmap* src, uint16 srcWidth, uint16 srcHeight,
+	const Rect* srcRect, int x, int y, uint32 flags) {
+	DECLARE_CONTEXT(b);
+	int srcx = srcRect->x, srcy = srcRect->y;
+	int w = min((int)srcRect->w, srcWidth - srcx);
+	int h = min((int)srcRect->h, srcHeight - srcy);
+	// Clip to the destination, moving the source origin along with it
+	if (x < 0) { srcx -= x; w += x; x = 0; }
+	if (y < 0) { srcy -= y; h += y; y = 0; }
+	w = min(w, context.drawWidth - x);
+	h = min(h, context.drawHeight - y);
+	if (w <= 0 || h <= 0) return;
+
+	const bool transparent = (flags & EBlitTransparent) != 0;
+	if (!blitBitmapSpans(&context, x, y, w, h, src, srcWidth, srcx, srcy, transparent)) {
+		const uint16 key = src->bgcolour;
+		for (int yidx = 0; yidx < h; yidx++) {
+			for (int xidx = 0; xidx < w; xidx++) {
+				const uint16 col = getPixelRaw(src, srcWidth, srcx + xidx, srcy + yidx);
+				if (!transparent || col != key) {
+					set_pixel(x + xidx, y + yidx, col);
+				}
+			}
+		}
+	}
+	Rect drawnRect = rect_make(x, y, w, h);
+	updateDirtyRect(b, &drawnRect);
+}
+
+// The ops in an animation frame, see modules/bitmap/anim.lua
+enum {
+	EAnimSkip = 0,
+	EAnimFill = 1,
+	EAnimLiteral = 2,
+	EAnimFillOne = 3, // One bit animations only
+};
+
+static inline int readLe16(const uint8* p) {
+	return p[0] | ((int)p[1] << 8);
+}
+
+// Animation colours are big-endian, same as our pixels
+static inline uint16 readColour(const uint8* p) {
+	return tobe(((uint16)p[0] << 8) | p[1]);
+}
+
+/*
+Draws n pixels of an op along the row starting at (x, y). `data` is the op's
+data, and for literals `idx` is how many of its pixels have already been drawn.
+*/
+static void drawAnimSpan(const DrawContext* context, int x, int y, int n, int op, bool oneBit,
+	const uint8* data, int idx, uint16 fg, uint16 bg) {
+	uint16 col = (op == EAnimFillOne) ? fg : bg;
+	if (op == EAnimFill && !oneBit) col = readColour(data);
+#ifndef ONE_BPP_BITMAPS
+	Rect raw;
+	const Rect r = rect_make(x, y, n, 1);
+	if (getRawRect(context, &r, &raw)) {
+		const AffineTransform* t = &context->pixelTransform;
+		const int step = t->a + t->c * context->bwidth;
+		uint16* dst = context->data + transform_y(*t, x, y) * context->bwidth + transform_x(*t, x, y);
+		if (op != EAnimLiteral) {
+			if (step == 1) {
+				fillSpan32(dst, n, col);
+			} else {
+				for (int i = 0; i < n; i++) dst[i * step] = col;
+			}
+		} else if (oneBit) {
+			for (int i = 0; i < n; i++, idx++) {
+				dst[i * step] = getBit(data, idx) ? fg : bg;
+			}
+		} else if (step == 1) {
+			memcpy(dst, data + idx * 2, n * 2);
+		} else {
+			for (int i = 0; i < n; i++, idx++) {
+				dst[i * step] = readColour(data + idx * 2);
+			}
+		}
+		return;
+	}
+#endif
+	for (int i = 0; i < n; i++, idx++) {
+		if (op == EAnimLiteral) {
+			col = oneBit ? (getBit(data, idx) ? fg : bg) : readColour(data + idx * 2);
+		}
+		context->setPixelFn(context, x + i, y, col);
+	}
+}
+
+/*
+Decodes the animation frame starting `offset` bytes into `anim` (which is `len`
+bytes long) into b, with the animation's top left at (x, y). The frame only
+updates what changed since the previous one, so b must still have that in it.
+Exactly the rects the frame draws are added to b's dirty region. The whole
+animation must fit in b. Returns the offset of the next frame (which will be
+`len` after the last one), or -1 if the data is bad.
+*/
+int bitmap_drawAnimFrame(Bitmap* b, uint16 x, uint16 y, const uint8* anim, int len, int offset) {
+	if (len < KAnimHeaderSize || memcmp(anim, "ANIM", 4) != 0) return -1;
+	const int animWidth = readLe16(anim + 4);
+	const int animHeight = readLe16(anim + 6);
+	const int format = anim[12];
+	if (format != EAnimOneBit && format != EAnimFiveSixFive) return -1;
+	const bool oneBit = (format == EAnimOneBit);
+	DECLARE_CONTEXT(b);
+	if (x + animWidth > context.drawWidth || y + animHeight > context.drawHeight) return -1;
+	if (offset < KAnimHeaderSize || offset >= len) return -1;
+
+	const uint8* p = anim + offset;
+	const uint8* const end = anim + len;
+	const uint16 fg = b->colour, bg = b->bgcolour;
+	const int numRects = *p++;
+	for (int i = 0; i < numRects; i++) {
+		if (end - p < 8) return -1;
+		const Rect r = rect_make(readLe16(p), readLe16(p + 2), readLe16(p + 4), readLe16(p + 6));
+		p += 8;
+		if (r.x + r.w > animWidth || r.y + r.h > animHeight) return -1;
+		// Ops run along the rows of r, carrying on onto the next row as needed
+		int remaining = r.w * r.h;
+		int cx = 0, cy = 0;
+		while (remaining) {
+			if (p >= end) return -1;
+			const int op = *p >> 6;
+			int n = *p++ & 0x3F;
+			if (n == 0) {
+				// Longer counts follow as a ULEB128
+				int shift = 0;
+				uint8 byte;
+				do {
+					if (p >= end || shift > 21) return -1;
+					byte = *p++;
+					n |= (byte & 0x7F) << shift;
+					shift += 7;
+				} while (byte & 0x80);
+			}
+			if (n == 0 || n > remaining) return -1;
+			int dataLen = 0;
+			if (op == EAnimFill) {
+				dataLen = oneBit ? 0 : 2;
+			} else if (op == EAnimLiteral) {
+				dataLen = oneBit ? (n + 7) >> 3 : n * 2;
+			} else if (op == EAnimFillOne && !oneBit) {
+				return -1;
+			}
+			if (end - p < dataLen) return -1;
+			remaining -= n;
+
+			if (op == EAnimSkip) {
+				cx += n;
+				cy += cx / r.w;
+				cx = cx % r.w;
+			} else {
+				int idx = 0;
+				while (n) {
+					const int span = min(n, r.w - cx);
+					drawAnimSpan(&context, x + r.x + cx, y + r.y + cy, span, op, oneBit, p, idx, fg, bg);
+					idx += span;
+					n -= span;
+					cx += span;
+					if (cx == r.w) {
+						cx = 0;
+						cy++;
+					}
+				}
+			}
+			p += dataLen;
+		}
+		Rect drawnRect = rect_make(x + r.x, y + r.y, r.w, r.h);
+		updateDirtyRect(b, &drawnRect);
+	}
+	return p - anim;
+}
+
 void bitmap_drawLine(Bitmap* b, uint16 x0, uint16 y0, uint16 x1, uint16 y1) {
 	// Prof Bresenham, we salute you
 	// Ok I'm too stupid, this is copied from the internets
@@ -440,14 +1164,119 @@ void bitmap_drawLine(Bitmap* b, uint16 x0, uint16 y0, uint16 x1, uint16 y1) {
 int exec_driverConnect(uint32 driverId);
 int exec_driverCmd(uint32 driverHandle, uint32 arg1, uint32 arg2);
 
-void bitmap_blitToScreen(Bitmap* b, const Rect* r) {
+#ifndef ONE_BPP_BITMAPS
+
+/*
+Converting to EOneBitColumnPacked is done in 8x8 tiles. Each row of a tile is
+turned into an 8-bit mask of which pixels are BLACK using word loads, and the
+8x8 bit matrix made from the masks is then transposed so that each byte holds
+one column. Assumes little-endian, which everything we run on is.
+*/
+
+// Bit i of the result is set if pixel i of the 8 at p is BLACK. p must be word aligned
+static inline uint32 blackMask8(const uint16* p) {
+	const Pixels32* w = (const Pixels32*)p;
+	uint32 nonBlack = 0;
+	for (int i = 0; i < 4; i++) {
+		const uint32 v = w[i];
+		// Top bit of each halfword is set if that pixel is non-zero (BLACK is zero)
+		const uint32 nz = (((v & 0x7FFF7FFF) + 0x7FFF7FFF) | v) & 0x80008000;
+		nonBlack |= (((nz >> 15) | (nz >> 30)) & 3) << (i * 2);
+	}
+	return ~nonBlack & 0xFF;
+}
+
+// Transposes an 8x8 bit matrix where byte i is row i and bit j of it is column j
+static inline uint64 transpose8x8(uint64 x) {
+	uint64 t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+// Returns the 8 packed column bytes for the tile whose top left pixel is p
+static inline uint64 packTile(const uint16* p, int bwidth) {
+	uint64 rows = 0;
+	for (int i = 0; i < 8; i++) {
+		rows |= (uint64)blackMask8(p + i * bwidth) << (i * 8);
+	}
+	return transpose8x8(rows);
+}
+
+/*
+Converts the pages covering r into the packed buffer. Whole tiles are converted
+so this may do a few more columns than r asks for. Sets `first` and `last` to
+the range of columns whose packed bytes changed (last < first if none did).
+*/
+static void packColumns(const Bitmap* b, const Rect* r, uint8* buf, int* first, int* last) {
+	const int bwidth = bitmap_getWidth(b);
+	const int bheight = bitmap_getHeight(b);
+	const uint16* data = bitmap_getPixels(b);
+	const int startx = r->x & ~7;
+	const int endx = min((r->x + r->w + 7) & ~7, bwidth);
+	const int starty = r->y & ~7;
+	const int endy = min(r->y + r->h, bheight);
+#ifdef BITMAP_PER_PIXEL
+	const bool wordRows = false;
+#else
+	// Tiles need every row to be word aligned
+	const bool wordRows = (bwidth & 1) == 0 && ((uintptr)data & 3) == 0;
+#endif
+	*first = bwidth;
+	*last = -1;
+	for (int y = starty; y < endy; y += 8) {
+		uint8* page = buf + (y >> 3) * bwidth;
+		int x = startx;
+		if (wordRows && y + 8 <= bheight) {
+			for (; x + 8 <= endx; x += 8) {
+				const uint64 packed = packTile(data + y * bwidth + x, bwidth);
+				uint64 old;
+				memcpy(&old, page + x, sizeof(old));
+				const uint64 diff = packed ^ old;
+				if (diff) {
+					memcpy(page + x, &packed, sizeof(packed));
+					*first = min(*first, x + __builtin_ctzll(diff) / 8);
+					*last = max(*last, x + (63 - __builtin_clzll(diff)) / 8);
+				}
+			}
+		}
+		// Whatever's left over (odd widths, the bottom of a bitmap whose height
+		// isn't a multiple of 8) is done a pixel at a time
+		for (; x < endx; x++) {
+			byte pageByte = 0;
+			for (int i = 0; i < 8 && y + i < bheight; i++) {
+				if (data[(y+i)*bwidth + x] == BLACK) {
+					pageByte |= 1 << i;
+				}
+			}
+			if (page[x] != pageByte) {
+				page[x] = pageByte;
+				*first = min(*first, x);
+				*last = max(*last, x);
+			}
+		}
+	}
+}
+
+#endif // ONE_BPP_BITMAPS
+
+/*
+Returns the number of bytes of pixel data sent to the driver. If req is non-NULL
+this always makes a driver call, even if there's nothing to send, so that req is
+completed.
+*/
+static int blit(Bitmap* b, const Rect* rect, AsyncRequest* req) {
 	if (!b->screenDriverHandle) {
 		b->screenDriverHandle = exec_driverConnect(FOURCC("SCRN"));
 	}
+	const uint32 cmd = req ? KExecDriverScreenBlitAsync : KExecDriverScreenBlit;
 	if (b->format == EOneBitColumnPacked) {
 		const int bwidth = bitmap_getWidth(b);
-		const int starty = r->y & ~0x7; // Round down to 8px boundary
-		const int endy = (r->y + r->h + 7) & ~0x7;
+		Rect r = *rect;
 #ifdef ONE_BPP_BITMAPS
 		uint8* buf = (uint8*)b->data;
 #else
@@ -455,43 +1284,84 @@ void bitmap_blitToScreen(Bitmap* b, const Rect* r) {
 		// buf past the end of the bitmap data, then send that to the driver
 		//ASSERT((b->bounds.y & 7) == 0); // Otherwise the compositing is too nasty to contemplate
 		uint8* buf = (uint8*)b->data + datasize(bwidth, bitmap_getHeight(b));
-		PixelType* data = bitmap_getPixels(b);
-		for (int y = starty; y < endy; y += 8) {
-			for (int x = r->x; x < r->x + r->w; x++) {
-				// Each byte has bits for col x, rows y thru y+7
-				byte pageByte = 0;
-				for (int i = 0; i < 8; i++) {
-					if (data[(y+i)*bwidth + x] == BLACK) {
-						pageByte |= 1 << i;
-					}
-				}
-				int bufIdx = (y >> 3) * bwidth + x;
-				buf[bufIdx] = pageByte;
-			}
+		if (b->flags & PackedBufferStale) {
+			// We don't know what's on the screen, so it all has to go
+			rect_set(&r, 0, 0, bwidth, bitmap_getHeight(b));
 		}
+		if (rect_isEmpty(&r) && !req) return 0;
+		int first, last;
+		packColumns(b, &r, buf, &first, &last);
+		if ((b->flags & (IncrementalBlit | PackedBufferStale)) == IncrementalBlit) {
+			// Only send the columns which actually changed
+			if (last < first && !req) return 0;
+			r.x = first;
+			r.w = last < first ? 0 : last + 1 - first;
+		}
+		b->flags &= ~PackedBufferStale;
 #endif // ONE_BPP_BITMAPS
-		// { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h }
+		const int starty = r.y & ~0x7; // Round down to 8px boundary
+		const int endy = (r.y + r.h + 7) & ~0x7;
+		// { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h, asyncRequest }
 		uint32 op[] = {
-			(uint32)buf, bwidth,
-			b->bounds.x + r->x, b->bounds.y + starty,
-			r->x, starty, r->w, endy-starty
+			(uint32)(uintptr)buf, bwidth,
+			b->bounds.x + r.x, b->bounds.y + starty,
+			r.x, starty, r.w, endy-starty,
+			(uint32)(uintptr)req
 		};
-		exec_driverCmd(b->screenDriverHandle, KExecDriverScreenBlit, (uint32)&op);
-		return;
+		exec_driverCmd(b->screenDriverHandle, cmd, (uint32)(uintptr)&op);
+		return r.w * ((endy - starty) >> 3);
 	} else {
-		// { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h }
+		// { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h, asyncRequest }
 		uint32 op[] = {
-			(uint32)&b->data, b->bounds.w,
-			b->bounds.x + r->x, b->bounds.y + r->y,
-			r->x, r->y, r->w, r->h
+			(uint32)(uintptr)&b->data, b->bounds.w,
+			b->bounds.x + rect->x, b->bounds.y + rect->y,
+			rect->x, rect->y, rect->w, rect->h,
+			(uint32)(uintptr)req
 		};
-		exec_driverCmd(b->screenDriverHandle, KExecDriverScreenBlit, (uint32)&op);
+		exec_driverCmd(b->screenDriverHandle, cmd, (uint32)(uintptr)&op);
+		return rect_area(rect) * 2;
 	}
 }
 
-void bitmap_blitDirtyToScreen(Bitmap* b) {
-	bitmap_blitToScreen(b, &b->dirtyRect);
-	rect_zero(&b->dirtyRect);
+int bitmap_blitToScreen(Bitmap* b, const Rect* r) {
+	return blit(b, r, NULL);
+}
+
+/*
+Blits each rect of the dirty region separately, and returns the total number of
+bytes sent to the screen driver. That's the figure to watch when tuning
+KMaxDirtyRects and KBlitOverheadPixels.
+*/
+int bitmap_blitDirtyToScreen(Bitmap* b) {
+	int bytes = 0;
+	for (int i = 0; i < b->dirty.count; i++) {
+		bytes += blit(b, &b->dirty.rects[i], NULL);
+	}
+	b->dirty.count = 0;
+	return bytes;
+}
+
+/*
+Starts blitting r to the screen and returns without waiting for it to finish.
+req, which must be pending, is completed when it has. Until then the pixels in
+r may still be being read, so draw into another bitmap (or another part of this
+one) if you don't want them to tear. Drivers that can't do it asynchronously
+complete req immediately.
+*/
+void bitmap_blitToScreenAsync(Bitmap* b, const Rect* r, AsyncRequest* req) {
+	req->flags |= KAsyncFlagAccepted;
+	blit(b, r, req);
+}
+
+/*
+The driver can only have one asynchronous blit in flight, so this sends the
+bounding rect of the dirty region rather than each rect separately.
+*/
+void bitmap_blitDirtyToScreenAsync(Bitmap* b, AsyncRequest* req) {
+	Rect r;
+	bitmap_getDirtyRect(b, &r);
+	bitmap_blitToScreenAsync(b, &r, req);
+	b->dirty.count = 0;
 }
 
 void bitmap_setAutoBlit(Bitmap* b, bool flag) {
@@ -499,6 +1369,17 @@ void bitmap_setAutoBlit(Bitmap* b, bool flag) {
 	else b->flags &= ~AutoBlit;
 }
 
+/*
+In incremental mode, blits to an EOneBitColumnPacked screen only send the
+columns whose packed bytes differ from the last time they were converted. The
+first blit after turning it on sends the whole bitmap, so that the screen and
+the packed buffer are known to match. Has no effect on other screen formats.
+*/
+void bitmap_setIncrementalBlit(Bitmap* b, bool flag) {
+	if (flag) b->flags |= IncrementalBlit | PackedBufferStale;
+	else b->flags &= ~IncrementalBlit;
+}
+
 void bitmap_setTransform(Bitmap* b, const AffineTransform* t) {
 	if (!t) t = &IdentityTransform;
 	b->transform = *t;
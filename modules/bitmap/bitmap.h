@@ -4,6 +4,8 @@
 #include <stddef.h>
 
 struct AffineTransform;
+struct AsyncRequest;
+struct GlyphCache;
 
 typedef struct Rect {
 	uint16 x, y, w, h;
@@ -33,6 +35,18 @@ void rect_clip(Rect* r, const Rect* clipRect);
 void rect_transform(Rect* r, const struct AffineTransform* t);
 void rect_invert(Rect* r, const struct AffineTransform* t);
 
+/*
+Up to KMaxDirtyRects disjoint rects which between them cover everything that has
+been drawn since the last blit. See region_add() in bitmap.c for how rects are
+merged once there would otherwise be too many.
+*/
+#define KMaxDirtyRects 4
+
+typedef struct DirtyRegion {
+	Rect rects[KMaxDirtyRects];
+	uint16 count;
+} DirtyRegion;
+
 typedef struct AffineTransform {
 	int8 a, b, c, d;
 	int16 tx, ty;
@@ -43,13 +57,26 @@ typedef struct Bitmap {
 	uint32 screenDriverHandle; // Doesn't really belong here, but hey
 	uint16 colour; // Current pen colour
 	uint16 bgcolour; // Background colour, when drawing text or XBMs
-	Rect dirtyRect;
+	DirtyRegion dirty;
 	AffineTransform transform;
 	uint8 flags;
 	uint8 format; // a ScreenBufferFormat
+	struct GlyphCache* glyphCache; // Optional, see bitmap_setGlyphCache()
 	uint16 data[1]; // Extends beyond the struct
 } Bitmap;
 
+typedef enum BlitFlags {
+	EBlitTransparent = 1, // Don't draw pixels which are the source's background colour
+} BlitFlags;
+
+// See modules/bitmap/anim.lua for the animation format
+#define KAnimHeaderSize 16
+
+typedef enum AnimFormat {
+	EAnimOneBit = 0,
+	EAnimFiveSixFive = 1,
+} AnimFormat;
+
 int bitmap_getAllocSize(uint16 width, uint16 height);
 Bitmap* bitmap_construct(void* mem, uint16 width, uint16 height);
 
@@ -68,11 +95,23 @@ void bitmap_drawRect(Bitmap* b, const Rect* r);
 void bitmap_drawText(Bitmap* b, uint16 x, uint16 y, const char* text);
 void bitmap_drawXbmData(Bitmap* b, uint16 x, uint16 y, const Rect* r, const uint8* xbm, uint16 xbm_width);
 void bitmap_getTextRect(Bitmap* b, int numChars, Rect* result);
-void bitmap_blitToScreen(Bitmap* b, const Rect* r);
-void bitmap_blitDirtyToScreen(Bitmap* b);
+void bitmap_blitBitmap(Bitmap* b, const Bitmap* src, const Rect* srcRect, int x, int y, uint32 flags);
+void bitmap_blitBitmapSized(Bitmap* b, const Bitmap* src, uint16 srcWidth, uint16 srcHeight,
+	const Rect* srcRect, int x, int y, uint32 flags);
+int bitmap_drawAnimFrame(Bitmap* b, uint16 x, uint16 y, const uint8* anim, int len, int offset);
+int bitmap_blitToScreen(Bitmap* b, const Rect* r);
+int bitmap_blitDirtyToScreen(Bitmap* b);
+void bitmap_blitToScreenAsync(Bitmap* b, const Rect* r, struct AsyncRequest* req);
+void bitmap_blitDirtyToScreenAsync(Bitmap* b, struct AsyncRequest* req);
+
+int glyphCache_getAllocSize(void);
+struct GlyphCache* glyphCache_construct(void* mem);
+void bitmap_setGlyphCache(Bitmap* b, struct GlyphCache* cache);
 
 void bitmap_setAutoBlit(Bitmap* b, bool flag);
+void bitmap_setIncrementalBlit(Bitmap* b, bool flag);
 void bitmap_clipToBounds(const Bitmap* b, Rect* r);
+void bitmap_getDirtyRect(const Bitmap* b, Rect* result);
 
 #define bitmap_drawXbm(b, x, y, r, xbmName) \
 	bitmap_drawXbmData(b, x, y, r, xbmName ## _bits, xbmName ## _width)
@@ -12,6 +12,29 @@ dimensions are used.
 ]]
 --native function Bitmap.create(width, height)
 
+--[[**
+Returns how many bytes a bitmap of the given size needs, for use with
+`createInBuffer()`.
+]]
+--native function Bitmap.getAllocSize(width, height)
+
+--[[**
+Creates a new bitmap in the memory of `membuf`, rather than in the Lua heap.
+This is how a compositor surface is put in pages shared with the compositor
+process.
+]]
+--native function Bitmap.createInBuffer(membuf, width, height)
+
+--[[**
+Returns a bitmap for one which has already been created in `membuf` with
+`createInBuffer()`, most likely by another process. Only use it as the source
+of `blitBitmap()`, because anything else it refers to, like its glyph cache, is
+in the other process's memory. Its size is read from the header once, here, and
+`blitBitmap()`, `width()` and so on use that copy, so the other process can't
+make a blit read outside `membuf` by changing the header afterwards.
+]]
+--native function Bitmap.fromBuffer(membuf)
+
 --[[**
 Get height of the bitmap. Note that this takes into account any transform that
 is currently applied, so for example if `setRotation(90)` has been called then
@@ -71,6 +94,32 @@ and following parameters are not specified, draws the entire XBM.
 ]]
 --native function Bitmap:drawXbm(xbm, x, y [, xbmx, xbmy, w, h])
 
+--[[**
+Copies another bitmap (or the part of it given by `srcx` and following) to
+(x, y) in this one. The source is read in its raw, unrotated coordinates, and
+drawn using this bitmap's rotation, so a sprite drawn unrotated will be the
+right way up on a rotated screen. `x` and `y` may be negative to partly draw it
+off the edge. If `transparent` is true, pixels in `src` which are its
+background colour are not drawn.
+
+	local sprite = Bitmap.create(16, 16)
+	sprite:setBackgroundColour(0xF81F) -- Magenta is see-through
+	sprite:clear()
+	-- ...draw the sprite...
+	bmp:blitBitmap(sprite, x, y, true)
+]]
+--native function Bitmap:blitBitmap(src, x, y, [transparent, [srcx, srcy, w, h]])
+
+--[[**
+Decodes the frame starting `offset` bytes into the animation `anim` (a MemBuf)
+with the animation's top left at (x, y), and returns the offset of the next
+frame. Each frame only draws what changed since the previous one, and exactly
+the rects it drew are added to the invalidated region. One bit animations are
+drawn using the current foreground and background colours. Normally you'd use
+the [bitmap.anim](anim.lua) module rather than calling this directly.
+]]
+--native function Bitmap:drawAnimFrame(anim, offset, x, y)
+
 --[[**
 Fills the given region (or the entire bitmap if not specified) with the
 background colour.
@@ -134,13 +183,50 @@ You may also pass arrays for the two points, for example:
 
 --[[**
 Blit the bitmap to the screen device. If no parameters are supplied, only blits
-the invalidated region. The invalidated region is the union of all rects that
-have been drawn to since the last call to `blit()`.
+the invalidated region. The invalidated region covers all the rects that have
+been drawn to since the last call to `blit()`, and is kept as a few separate
+rects so that drawing in opposite corners doesn't mean sending the whole screen.
 
 If parameters are specified, they should be in unrotated coordinates.
+
+Returns the number of bytes sent to the screen driver, which is useful for
+seeing how much a redraw actually costs.
 ]]
 --native function Bitmap:blit([x [,y [,w [,h]]]])
 
+--[[**
+Returns the invalidated region (see [blit()](#Bitmap_blit)) as an array of
+`{ x, y, w, h }` rects in unrotated coordinates, and resets it as if the
+bitmap had been blitted. For when something other than the screen driver
+consumes the bitmap, such as the compositor.
+]]
+--native function Bitmap:takeDirtyRects()
+
+--[[**
+Like [blit()](#Bitmap_blit) but returns as soon as the transfer has started,
+completing `asyncRequest` (which must have been queued on a run loop) when the
+pixels have all gone out. Until then the driver may still be reading from the
+bitmap, so draw the next frame into a different bitmap to avoid tearing. On
+screens where the driver can't do this asynchronously, the blit happens
+immediately and the request completes straight away.
+
+	local req = runloop.current:newAsyncRequest({
+		completionFn = function() frameDone = true end,
+	})
+	runloop.current:queue(req)
+	bmp:blitAsync(req)
+]]
+--native function Bitmap:blitAsync(asyncRequest, [x [,y [,w [,h]]]])
+
+--[[**
+On screens using the one bit per pixel column-packed format, only send the
+columns which have changed since the last blit. Costs a little memory
+bandwidth to find the changes, but for things like Tetris where only a few
+blocks move each frame, it means much less SPI traffic. The first blit after
+enabling this sends the whole bitmap. Has no effect on other screens.
+]]
+--native function Bitmap:setIncrementalBlit(flag)
+
 local function clamp(n)
 	if n < 0 then return 0
 	elseif n > 255 then return 255
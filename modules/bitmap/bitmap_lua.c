@@ -4,17 +4,57 @@
 
 #include <lupi/membuf.h>
 #include <lupi/exec.h>
+#include <lupi/runloop.h>
 #include "bitmap.h"
 
 #define BitmapMetatable "LupiBitmapMt"
 
 int exec_getInt(ExecGettableValue val);
 
+/*
+What fromBuffer() returns. The bitmap's header is in memory that another process
+can write to whenever it likes, so its size is copied out and checked once, when
+it's opened, and from then on only the copy is used.
+*/
+typedef struct SharedBitmap {
+	Bitmap* b; // Must be first, so bitmap_check() can treat it like any other indirect bitmap
+	uint16 width;
+	uint16 height;
+} SharedBitmap;
+
 Bitmap* bitmap_check(lua_State* L, int idx) {
 	void* ptr = luaL_checkudata(L, idx, BitmapMetatable);
+	const size_t len = lua_rawlen(L, idx);
+	if (len == sizeof(Bitmap*) || len == sizeof(SharedBitmap)) {
+		// It's an indirect one, living in a MemBuf
+		return *(Bitmap**)ptr;
+	}
 	return (Bitmap*)ptr;
 }
 
+// Gets the raw size of b (which must be the bitmap at idx) without trusting its header if it's shared
+static void getRawSize(lua_State* L, int idx, const Bitmap* b, uint16* w, uint16* h) {
+	if (lua_rawlen(L, idx) == sizeof(SharedBitmap)) {
+		const SharedBitmap* shared = (const SharedBitmap*)lua_touserdata(L, idx);
+		*w = shared->width;
+		*h = shared->height;
+	} else {
+		*w = bitmap_getWidth(b);
+		*h = bitmap_getHeight(b);
+	}
+}
+
+// Like runloop_newIndirectAsyncRequest(), for bitmaps whose memory Lua doesn't own
+static void* newIndirectBitmap(lua_State* L, Bitmap* b, size_t size, int memBufIdx) {
+	Bitmap** obj = (Bitmap**)lua_newuserdata(L, size);
+	*obj = b;
+	luaL_setmetatable(L, BitmapMetatable);
+	// Keep the MemBuf alive for as long as the bitmap is
+	lua_pushvalue(L, memBufIdx);
+	lua_setuservalue(L, -2);
+	return obj;
+}
+
 static int getxy(lua_State* L, int idx, int* x, int* y) {
 	if (lua_type(L, idx) == LUA_TTABLE) {
 		// Assume arg is a table {x,y}
@@ -39,17 +79,34 @@ static int drawRect(lua_State* L) {
 	int h = luaL_checkint(L, nextArg+1);
 	Rect r = rect_make(x, y, w, h);
 	bitmap_drawRect(b, &r);
-	// PRINTL("dirtyRect = %d,%d,%dx%d", b->dirtyRect.x, b->dirtyRect.y, b->dirtyRect.w, b->dirtyRect.h);
+	// PRINTL("dirty region has %d rects", b->dirty.count);
 	return 0;
 }
 
+static const char KGlyphCacheRegistryKey = 0;
+
+// Every bitmap in a Lua state shares one glyph cache, created the first time any of them draws text
+static void attachGlyphCache(lua_State* L, Bitmap* b) {
+	const int size = glyphCache_getAllocSize();
+	if (b->glyphCache || size == 0) return;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &KGlyphCacheRegistryKey);
+	struct GlyphCache* cache = (struct GlyphCache*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (!cache) {
+		cache = glyphCache_construct(lua_newuserdata(L, size));
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &KGlyphCacheRegistryKey);
+	}
+	bitmap_setGlyphCache(b, cache);
+}
+
 static int drawText(lua_State* L) {
 	Bitmap* b = bitmap_check(L, 1);
 	const char* text = luaL_checkstring(L, 2);
+	attachGlyphCache(L, b);
 	int x, y;
 	getxy(L, 3, &x, &y);
 	bitmap_drawText(b, x, y, text);
-	// PRINTL("dirtyRect = %d,%d,%dx%d", b->dirtyRect.x, b->dirtyRect.y, b->dirtyRect.w, b->dirtyRect.h);
+	// PRINTL("dirty region has %d rects", b->dirty.count);
 	return 0;
 }
 
@@ -73,7 +130,7 @@ static int drawLine(lua_State* L) {
 	int nextIdx = getxy(L, 2, &x0, &y0);
 	getxy(L, nextIdx, &x1, &y1);
 	bitmap_drawLine(b, x0, y0, x1, y1);
-	// PRINTL("dirtyRect = %d,%d,%dx%d", b->dirtyRect.x, b->dirtyRect.y, b->dirtyRect.w, b->dirtyRect.h);
+	// PRINTL("dirty region has %d rects", b->dirty.count);
 	return 0;
 }
 
@@ -105,7 +162,9 @@ static int getBackgroundColour(lua_State* L) {
 
 static int getHeight(lua_State* L) {
 	Bitmap* b = bitmap_check(L, 1);
-	Rect r = rect_make(0, 0, bitmap_getWidth(b), bitmap_getHeight(b));
+	uint16 w, h;
+	getRawSize(L, 1, b, &w, &h);
+	Rect r = rect_make(0, 0, w, h);
 	rect_invert(&r, &b->transform);
 	lua_pushinteger(L, r.h);
 	return 1;
@@ -113,7 +172,9 @@ static int getHeight(lua_State* L) {
 
 static int getWidth(lua_State* L) {
 	Bitmap* b = bitmap_check(L, 1);
-	Rect r = rect_make(0, 0, bitmap_getWidth(b), bitmap_getHeight(b));
+	uint16 w, h;
+	getRawSize(L, 1, b, &w, &h);
+	Rect r = rect_make(0, 0, w, h);
 	rect_invert(&r, &b->transform);
 	lua_pushinteger(L, r.w);
 	return 1;
@@ -121,15 +182,17 @@ static int getWidth(lua_State* L) {
 
 static int getRawHeight(lua_State* L) {
 	Bitmap* b = bitmap_check(L, 1);
-	Rect r = rect_make(0, 0, bitmap_getWidth(b), bitmap_getHeight(b));
-	lua_pushinteger(L, r.h);
+	uint16 w, h;
+	getRawSize(L, 1, b, &w, &h);
+	lua_pushinteger(L, h);
 	return 1;
 }
 
 static int getRawWidth(lua_State* L) {
 	Bitmap* b = bitmap_check(L, 1);
-	Rect r = rect_make(0, 0, bitmap_getWidth(b), bitmap_getHeight(b));
-	lua_pushinteger(L, r.w);
+	uint16 w, h;
+	getRawSize(L, 1, b, &w, &h);
+	lua_pushinteger(L, w);
 	return 1;
 }
 
@@ -145,19 +208,96 @@ static int create(lua_State* L) {
 	return 1;
 }
 
+static int getAllocSize(lua_State* L) {
+	int w = luaL_checkint(L, 1);
+	int h = luaL_checkint(L, 2);
+	lua_pushinteger(L, bitmap_getAllocSize(w, h));
+	return 1;
+}
+
+static int createInBuffer(lua_State* L) {
+	MemBuf* buf = mbuf_checkbuf(L, 1);
+	int w = luaL_checkint(L, 2);
+	int h = luaL_checkint(L, 3);
+	luaL_argcheck(L, w > 0 && w <= 0xFFFF && h > 0 && h <= 0xFFFF, 2, "bad size");
+	luaL_argcheck(L, bitmap_getAllocSize(w, h) <= buf->len, 1, "MemBuf too small");
+	newIndirectBitmap(L, bitmap_construct(buf->ptr, w, h), sizeof(Bitmap*), 1);
+	return 1;
+}
+
+static int fromBuffer(lua_State* L) {
+	MemBuf* buf = mbuf_checkbuf(L, 1);
+	Bitmap* b = (Bitmap*)buf->ptr;
+	luaL_argcheck(L, buf->len >= (int)sizeof(Bitmap), 1, "MemBuf too small");
+	// Read the size exactly once, see SharedBitmap
+	const uint16 w = *(volatile uint16*)&b->bounds.w;
+	const uint16 h = *(volatile uint16*)&b->bounds.h;
+	luaL_argcheck(L, w > 0 && h > 0 && bitmap_getAllocSize(w, h) <= buf->len, 1, "MemBuf too small");
+	SharedBitmap* shared = (SharedBitmap*)newIndirectBitmap(L, b, sizeof(SharedBitmap), 1);
+	shared->width = w;
+	shared->height = h;
+	return 1;
+}
+
+static int takeDirtyRects(lua_State* L) {
+	Bitmap* b = bitmap_check(L, 1);
+	// Don't trust count too much, the bitmap might be in memory shared with another process
+	const int n = min(b->dirty.count, KMaxDirtyRects);
+	lua_createtable(L, n, 0);
+	for (int i = 0; i < n; i++) {
+		const Rect* r = &b->dirty.rects[i];
+		lua_createtable(L, 4, 0);
+		lua_pushinteger(L, r->x);
+		lua_rawseti(L, -2, 1);
+		lua_pushinteger(L, r->y);
+		lua_rawseti(L, -2, 2);
+		lua_pushinteger(L, r->w);
+		lua_rawseti(L, -2, 3);
+		lua_pushinteger(L, r->h);
+		lua_rawseti(L, -2, 4);
+		lua_rawseti(L, -2, i + 1);
+	}
+	b->dirty.count = 0;
+	return 1;
+}
+
 static int blit(lua_State* L) {
 	Bitmap* b = bitmap_check(L, 1);
+	int bytes;
 	if (lua_isnoneornil(L, 2)) {
-		bitmap_blitDirtyToScreen(b);
+		bytes = bitmap_blitDirtyToScreen(b);
 	} else {
 		int x = luaL_optint(L, 2, 0);
 		int y = luaL_optint(L, 3, 0);
 		int w = luaL_optint(L, 4, bitmap_getWidth(b) - x);
 		int h = luaL_optint(L, 5, bitmap_getHeight(b) - y);
 		Rect r = rect_make(x, y, w, h);
-		bitmap_blitToScreen(b, &r);
+		bytes = bitmap_blitToScreen(b, &r);
+	}
+	lua_pushinteger(L, bytes);
+	return 1;
+}
+
+static int blitAsync(lua_State* L) {
+	Bitmap* b = bitmap_check(L, 1);
+	AsyncRequest* req = runloop_checkRequestPending(L, 2);
+	// The driver reads from the bitmap until req completes, so make sure it
+	// isn't collected before then
+	lua_getuservalue(L, 2);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "bitmap");
+	lua_pop(L, 1);
+	if (lua_isnoneornil(L, 3)) {
+		bitmap_blitDirtyToScreenAsync(b, req);
+	} else {
+		int x = luaL_optint(L, 3, 0);
+		int y = luaL_optint(L, 4, 0);
+		int w = luaL_optint(L, 5, bitmap_getWidth(b) - x);
+		int h = luaL_optint(L, 6, bitmap_getHeight(b) - y);
+		Rect r = rect_make(x, y, w, h);
+		bitmap_blitToScreenAsync(b, &r, req);
 	}
-	return 0;	
+	return 0;
 }
 
 static int setAutoBlit(lua_State* L) {
@@ -166,6 +306,12 @@ static int setAutoBlit(lua_State* L) {
 	return 0;
 }
 
+static int setIncrementalBlit(lua_State* L) {
+	Bitmap* b = bitmap_check(L, 1);
+	bitmap_setIncrementalBlit(b, lua_toboolean(L, 2));
+	return 0;
+}
+
 static int drawXbm(lua_State* L) {
 	// bmp, xbmMemBuf, x, y, [, xbmx, xbmy, w, h]
 	Bitmap* b = bitmap_check(L, 1);
@@ -193,6 +339,43 @@ static int drawXbm(lua_State* L) {
 	return 0;
 }
 
+static int blitBitmap(lua_State* L) {
+	// bmp, src, x, y, [transparent, [srcx, srcy, w, h]]
+	Bitmap* b = bitmap_check(L, 1);
+	Bitmap* src = bitmap_check(L, 2);
+	ASSERTL(src != b, "Can't blit a bitmap onto itself");
+	int x = luaL_checkint(L, 3);
+	int y = luaL_checkint(L, 4);
+	uint32 flags = lua_toboolean(L, 5) ? EBlitTransparent : 0;
+	uint16 srcWidth, srcHeight;
+	getRawSize(L, 2, src, &srcWidth, &srcHeight);
+	Rect r = rect_make(0, 0, srcWidth, srcHeight);
+	if (!lua_isnoneornil(L, 6)) {
+		r.x = luaL_checkint(L, 6);
+		r.y = luaL_checkint(L, 7);
+		r.w = luaL_checkint(L, 8);
+		r.h = luaL_checkint(L, 9);
+	}
+	bitmap_blitBitmapSized(b, src, srcWidth, srcHeight, &r, x, y, flags);
+	return 0;
+}
+
+static int drawAnimFrame(lua_State* L) {
+	// bmp, animMemBuf, offset, x, y
+	Bitmap* b = bitmap_check(L, 1);
+	MemBuf* anim = mbuf_checkbuf(L, 2);
+	int offset = luaL_checkint(L, 3);
+	int x = luaL_checkint(L, 4);
+	int y = luaL_checkint(L, 5);
+	luaL_argcheck(L, x >= 0 && y >= 0, 4, "Animation must be drawn inside the bitmap");
+	int next = bitmap_drawAnimFrame(b, x, y, (const uint8*)anim->ptr, anim->len, offset);
+	if (next < 0) {
+		return luaL_error(L, "Bad animation frame at offset %d", offset);
+	}
+	lua_pushinteger(L, next);
+	return 1;
+}
+
 static int setTransform(lua_State* L) {
 	Bitmap* bmp = bitmap_check(L, 1);
 	if (lua_isnoneornil(L, 2)) {
@@ -230,6 +413,8 @@ int init_module_bitmap_bitmap(lua_State* L) {
 		{ "getTextSize", getTextSize },
 		{ "drawLine", drawLine },
 		{ "drawXbm", drawXbm },
+		{ "blitBitmap", blitBitmap },
+		{ "drawAnimFrame", drawAnimFrame },
 		{ "height", getHeight },
 		{ "width", getWidth },
 		{ "rawHeight", getRawHeight },
@@ -239,8 +424,14 @@ int init_module_bitmap_bitmap(lua_State* L) {
 		{ "getColour", getColour },
 		{ "getBackgroundColour", getBackgroundColour},
 		{ "create", create },
+		{ "createInBuffer", createInBuffer },
+		{ "fromBuffer", fromBuffer },
+		{ "getAllocSize", getAllocSize },
+		{ "takeDirtyRects", takeDirtyRects },
 		{ "blit", blit },
+		{ "blitAsync", blitAsync },
 		{ "setAutoBlit", setAutoBlit },
+		{ "setIncrementalBlit", setIncrementalBlit },
 		{ "setTransform", setTransform },
 		{ "getTransform", getTransform },
 		{ NULL, NULL },
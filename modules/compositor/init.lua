@@ -0,0 +1,190 @@
+--[[**
+Client side of the [compositor](server.lua), which lets several processes share
+the screen. Each surface is a `Bitmap` in pages shared with the compositor
+process, so drawing to it is exactly like drawing to any other bitmap, except
+that instead of calling `blit()` you call `present()` to have the compositor
+put what changed on the screen.
+
+	local compositor = require "compositor"
+	runloop.new()
+	local comp = compositor.connect()
+	local surface = comp:newSurface(10, 10, 100, 50)
+	surface.bitmap:drawText("Hello", 2, 2)
+	surface:present(function() print("On screen") end)
+	runloop.current:run()
+
+Until the completion function passed to `present()` is called the compositor
+may still be reading from the bitmap, so don't draw to it in the meantime.
+]]
+
+require "runloop"
+require "ipc"
+require "bitmap"
+
+ServerName = "comp"
+
+CreateSurface = 1
+Present = 2
+Move = 3
+Raise = 4
+Destroy = 5
+GetInput = 6
+
+-- Errors the server completes messages with
+ErrBadSurface = -1
+ErrTooManySurfaces = -2
+
+-- Surface ids are per-connection, and must fit in an input event
+MaxSurfaces = 255
+
+local KNumMessages = 8
+local KPageSize = 4096
+
+local function clamp(n, max)
+	if n < 0 then return 0
+	elseif n > max then return max
+	else return n
+	end
+end
+
+--[[**
+Input events are packed into a message result as the surface id, the input op
+(one of the `input` module's constants) and the position relative to the
+surface. For button events x is the button number and y is zero.
+]]
+function encodeInputEvent(id, op, x, y)
+	x, y = clamp(x, 0x3FF), clamp(y, 0x3FF)
+	return (id << 23) | (op << 20) | (x << 10) | y
+end
+
+function decodeInputEvent(val)
+	return val >> 23, (val >> 20) & 7, (val >> 10) & 0x3FF, val & 0x3FF
+end
+
+-- Positions are sent as one int, allowing for them being partly off screen
+function encodePos(x, y)
+	return ((x & 0xFFFF) << 16) | (y & 0xFFFF)
+end
+
+function decodePos(val)
+	local x, y = (val >> 16) & 0xFFFF, val & 0xFFFF
+	if x >= 0x8000 then x = x - 0x10000 end
+	if y >= 0x8000 then y = y - 0x10000 end
+	return x, y
+end
+
+local function checkResult(result)
+	if result < 0 then
+		error(string.format("Compositor error %d", result))
+	end
+end
+
+local Surface = {}
+Surface.__index = Surface
+
+--[[**
+Asks the compositor to show everything drawn to the surface's bitmap since the
+last `present()`. `completionFn` is called when it has been put on the screen.
+Presents from all clients are coalesced, so the screen is updated at most once
+per frame however many clients are drawing.
+]]
+function Surface:present(completionFn)
+	ipc.send(self.session, Present, { self.id }, function(result)
+		checkResult(result)
+		if completionFn then completionFn() end
+	end)
+end
+
+--[[**
+Moves the surface so its top left corner is at (x, y) on the screen.
+]]
+function Surface:move(x, y)
+	self.x, self.y = x, y
+	ipc.send(self.session, Move, { self.id, encodePos(x, y) }, checkResult)
+end
+
+--[[**
+Brings the surface in front of all the others. It also gets the button presses.
+]]
+function Surface:raise()
+	ipc.send(self.session, Raise, { self.id }, checkResult)
+end
+
+--[[**
+Removes the surface from the screen. Its pages aren't given back until the
+client exits, so it's better to reuse surfaces than to keep making new ones.
+]]
+function Surface:destroy()
+	ipc.send(self.session, Destroy, { self.id }, checkResult)
+	self.compositor.surfaces[self.id] = nil
+end
+
+local Compositor = {}
+Compositor.__index = Compositor
+
+--[[**
+Creates a new surface of size `w` by `h`, with its top left at (x, y) on the
+screen and in front of everything else. Draw to `surface.bitmap`.
+]]
+function Compositor:newSurface(x, y, w, h)
+	local id = 1
+	while self.surfaces[id] do id = id + 1 end
+	assert(id <= MaxSurfaces, "Too many surfaces")
+	local numPages = (bitmap.Bitmap.getAllocSize(w, h) + KPageSize - 1) // KPageSize
+	local buf = ipc.newSharedPage(numPages)
+	local bmp = bitmap.Bitmap.createInBuffer(buf, w, h)
+	ipc.grantPages(self.session, buf)
+	local surface = setmetatable({
+		id = id,
+		x = x,
+		y = y,
+		bitmap = bmp,
+		compositor = self,
+		session = self.session,
+	}, Surface)
+	self.surfaces[id] = surface
+	ipc.send(self.session, CreateSurface, { id, buf:getAddress(), numPages, encodePos(x, y) }, checkResult)
+	return surface
+end
+
+--[[**
+Calls `fn(surface, op, x, y)` for input routed to this client. Touches go to
+the front-most surface under them, with x and y relative to the surface, and
+button presses go to the front-most surface, with x being the button. `op` is
+one of the constants from the `input` module such as `input.TouchDown`. The
+compositor owns the input driver, so clients must not use
+`input.registerInputObserver()` themselves.
+]]
+function Compositor:registerInputObserver(fn)
+	assert(not self.inputObserver, "Input observer already registered")
+	self.inputObserver = fn
+	local function gotInput(result)
+		checkResult(result)
+		local id, op, x, y = decodeInputEvent(result)
+		local surface = self.surfaces[id]
+		ipc.send(self.session, GetInput, gotInput)
+		if surface then fn(surface, op, x, y) end
+	end
+	ipc.send(self.session, GetInput, gotInput)
+end
+
+--[[**
+Connects to the compositor, starting it if it isn't already running. There
+must be a run loop.
+]]
+function connect()
+	assert(runloop.current, "Must have set up a runloop before calling connect()")
+	local ok, session = pcall(ipc.connect, ServerName, KNumMessages)
+	if not ok then
+		lupi.createProcess("compositor.server")
+		-- The server process gets to run as soon as it's created, but just in
+		-- case it hasn't got as far as creating its server yet
+		for i = 1, 10 do
+			ok, session = pcall(ipc.connect, ServerName, KNumMessages)
+			if ok then break end
+			lupi.yield()
+		end
+		assert(ok, "Couldn't connect to the compositor")
+	end
+	return setmetatable({ session = session, surfaces = {} }, Compositor)
+end
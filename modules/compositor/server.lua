@@ -0,0 +1,297 @@
+--[[**
+The compositor server, which owns the screen and the input driver on behalf of
+any number of client processes. Clients use the API in the
+[compositor](init.lua) module, which starts this process if necessary.
+
+Each surface is a `Bitmap` which the client creates in shared pages and grants
+to the compositor, so the compositor reads the client's pixels directly without
+any copying over IPC. Surfaces are kept in z-order, and the compositor tracks
+the damaged areas of the screen: whatever a client's bitmap says it has drawn
+to since its last present, plus wherever surfaces have moved, appeared or gone
+away. Once per frame it redraws just those areas of its own screen bitmap, front
+to back until a surface covers the area, and then blits the screen bitmap's
+dirty region in one go. Clients drawing at the same time therefore don't fight
+over the screen driver, and their updates are merged.
+
+Touches go to the front-most surface under them (and stay with it until the
+touch is lifted), and button presses go to the front-most surface.
+
+Surfaces belonging to a client that exits without destroying them stay on the
+screen, because the compositor isn't told when clients go away.
+]]
+
+require "runloop"
+require "ipc"
+require "bitmap"
+require "input"
+require "compositor"
+
+local timers = require "timerserver.local"
+
+local KFrameInterval = 20 -- ms
+local KMaxQueuedInput = 32
+local KBackgroundColour = bitmap.Colour.Black
+
+local screen
+local clients = {} -- Keyed by IPC page address
+local zorder = {} -- Surfaces, back to front
+local damage = {} -- Screen rects { x, y, w, h } needing redrawing next frame
+local pendingPresents = {}
+local frameScheduled = false
+local lastFrame
+local touchCapture
+
+local function min(a, b) if a < b then return a else return b end end
+local function max(a, b) if a > b then return a else return b end end
+
+local function intersect(a, x, y, w, h)
+	local x0, y0 = max(a[1], x), max(a[2], y)
+	local x1, y1 = min(a[1] + a[3], x + w), min(a[2] + a[4], y + h)
+	if x1 <= x0 or y1 <= y0 then return nil end
+	return x0, y0, x1 - x0, y1 - y0
+end
+
+local function contains(s, x, y)
+	return x >= s.x and y >= s.y and x < s.x + s.w and y < s.y + s.h
+end
+
+-- Anything overlapping gets merged into one, so no part of the screen is drawn twice
+local function addDamage(x, y, w, h)
+	local r = { x, y, w, h }
+	if not intersect(r, 0, 0, screen:rawWidth(), screen:rawHeight()) then return end
+	local i = 1
+	while i <= #damage do
+		local d = damage[i]
+		if intersect(d, r[1], r[2], r[3], r[4]) then
+			local x0, y0 = min(d[1], r[1]), min(d[2], r[2])
+			r = { x0, y0, max(d[1] + d[3], r[1] + r[3]) - x0, max(d[2] + d[4], r[2] + r[4]) - y0 }
+			table.remove(damage, i)
+			i = 1
+		else
+			i = i + 1
+		end
+	end
+	table.insert(damage, r)
+end
+
+local function addSurfaceDamage(s)
+	addDamage(s.x, s.y, s.w, s.h)
+end
+
+local function redraw(rect)
+	-- Find the front-most surface which covers the whole rect, nothing behind
+	-- that needs drawing
+	local first = 1
+	for i = #zorder, 1, -1 do
+		local s = zorder[i]
+		local x, y, w, h = intersect(rect, s.x, s.y, s.w, s.h)
+		if x and w == rect[3] and h == rect[4] then
+			first = i
+			break
+		end
+	end
+	if first == 1 then
+		screen:clear(rect[1], rect[2], rect[3], rect[4])
+	end
+	for i = first, #zorder do
+		local s = zorder[i]
+		local x, y, w, h = intersect(rect, s.x, s.y, s.w, s.h)
+		if x then
+			screen:blitBitmap(s.bitmap, x, y, false, x - s.x, y - s.y, w, h)
+		end
+	end
+end
+
+local function doFrame()
+	frameScheduled = false
+	lastFrame = lupi.getUptime()
+	for _, s in ipairs(zorder) do
+		if s.presentPending then
+			s.presentPending = false
+			for _, r in ipairs(s.bitmap:takeDirtyRects()) do
+				local x, y, w, h = intersect(r, 0, 0, s.w, s.h)
+				if x then addDamage(s.x + x, s.y + y, w, h) end
+			end
+		end
+	end
+	for _, rect in ipairs(damage) do
+		redraw(rect)
+	end
+	damage = {}
+	screen:blit()
+	-- Clients can draw again now we're not reading their bitmaps
+	local presents = pendingPresents
+	pendingPresents = {}
+	for _, msg in ipairs(presents) do
+		ipc.complete(msg, 0)
+	end
+end
+
+local function scheduleFrame()
+	if frameScheduled then return end
+	frameScheduled = true
+	local wait = 0
+	if lastFrame then
+		wait = max(0, KFrameInterval - (lupi.getUptime() - lastFrame):lo())
+	end
+	timers.after(doFrame, wait)
+end
+
+local function getClient(msg)
+	local addr = msg.page:getAddress()
+	local client = clients[addr]
+	if not client then
+		client = { surfaces = {}, input = {} }
+		clients[addr] = client
+	end
+	return client
+end
+
+local function getSurface(msg, id)
+	local s = getClient(msg).surfaces[id]
+	if not s then
+		ipc.complete(msg, compositor.ErrBadSurface)
+	end
+	return s
+end
+
+local function removeFromZorder(s)
+	for i, z in ipairs(zorder) do
+		if z == s then
+			table.remove(zorder, i)
+			return
+		end
+	end
+end
+
+local function createSurface(msg, id, addr, numPages, pos)
+	local client = getClient(msg)
+	if id < 1 or id > compositor.MaxSurfaces or client.surfaces[id] then
+		return ipc.complete(msg, compositor.ErrBadSurface)
+	end
+	local ok, bmp = pcall(function()
+		return bitmap.Bitmap.fromBuffer(ipc.getGrantedPages(msg, addr, numPages))
+	end)
+	if not ok then
+		print("[compositor] "..bmp)
+		return ipc.complete(msg, compositor.ErrBadSurface)
+	end
+	local x, y = compositor.decodePos(pos)
+	local s = {
+		id = id,
+		client = client,
+		bitmap = bmp,
+		x = x,
+		y = y,
+		-- These are fromBuffer()'s copies, not the client-writable header
+		w = bmp:rawWidth(),
+		h = bmp:rawHeight(),
+	}
+	client.surfaces[id] = s
+	table.insert(zorder, s)
+	addSurfaceDamage(s)
+	scheduleFrame()
+	ipc.complete(msg, 0)
+end
+
+local function present(msg, id)
+	local s = getSurface(msg, id)
+	if not s then return end
+	s.presentPending = true
+	table.insert(pendingPresents, msg)
+	scheduleFrame()
+end
+
+local function move(msg, id, pos)
+	local s = getSurface(msg, id)
+	if not s then return end
+	addSurfaceDamage(s)
+	s.x, s.y = compositor.decodePos(pos)
+	addSurfaceDamage(s)
+	scheduleFrame()
+	ipc.complete(msg, 0)
+end
+
+local function raise(msg, id)
+	local s = getSurface(msg, id)
+	if not s then return end
+	removeFromZorder(s)
+	table.insert(zorder, s)
+	addSurfaceDamage(s)
+	scheduleFrame()
+	ipc.complete(msg, 0)
+end
+
+local function destroy(msg, id)
+	local s = getSurface(msg, id)
+	if not s then return end
+	removeFromZorder(s)
+	s.client.surfaces[id] = nil
+	if touchCapture == s then touchCapture = nil end
+	addSurfaceDamage(s)
+	scheduleFrame()
+	ipc.complete(msg, 0)
+end
+
+local function getInput(msg)
+	local client = getClient(msg)
+	if #client.input > 0 then
+		ipc.complete(msg, table.remove(client.input, 1))
+	else
+		client.inputMsg = msg
+	end
+end
+
+local function deliverInput(s, op, x, y)
+	local client = s.client
+	local event = compositor.encodeInputEvent(s.id, op, x, y)
+	if client.inputMsg then
+		local msg = client.inputMsg
+		client.inputMsg = nil
+		ipc.complete(msg, event)
+	elseif #client.input < KMaxQueuedInput then
+		table.insert(client.input, event)
+	end
+end
+
+local function gotInput(op, x, y)
+	if op == input.TouchDown then
+		if not touchCapture then
+			for i = #zorder, 1, -1 do
+				if contains(zorder[i], x, y) then
+					touchCapture = zorder[i]
+					break
+				end
+			end
+		end
+		if touchCapture then
+			deliverInput(touchCapture, op, x - touchCapture.x, y - touchCapture.y)
+		end
+	elseif op == input.TouchUp then
+		if touchCapture then
+			deliverInput(touchCapture, op, 0, 0)
+			touchCapture = nil
+		end
+	elseif #zorder > 0 then
+		-- Buttons go to whatever is at the front
+		deliverInput(zorder[#zorder], op, x, 0)
+	end
+end
+
+function main()
+	local loop = runloop.new()
+	screen = bitmap.create()
+	screen:setBackgroundColour(KBackgroundColour)
+	screen:clear()
+	screen:blit()
+	input.registerInputObserver(gotInput)
+	ipc.startServer(loop, compositor.ServerName, {
+		[compositor.CreateSurface] = createSurface,
+		[compositor.Present] = present,
+		[compositor.Move] = move,
+		[compositor.Raise] = raise,
+		[compositor.Destroy] = destroy,
+		[compositor.GetInput] = getInput,
+	})
+	loop:run()
+end
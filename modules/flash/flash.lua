@@ -1,6 +1,3 @@
-local timers = require "timerserver.local"
-require "runloop"
-
 FlashErase = 1
 FlashStatus = 2
 FlashRead = 3
@@ -29,18 +26,11 @@ function getStatus()
 end
 
 function waitForWriteComplete(pollTime)
-	local stopper = {}
-	local function checkWriteCompletion()
-		local status = lupi.driverCmd(handle, FlashStatus)
-		if status & 1 == 0 then
-			stopper.exit = true
-		else
-			timers.after(checkWriteCompletion, pollTime)
-		end
+	-- Sleeping in the kernel is much cheaper than a round trip to the timer server
+	lupi.sleep(2)
+	while lupi.driverCmd(handle, FlashStatus) & 1 ~= 0 do
+		lupi.sleep(pollTime)
 	end
-	collectgarbage()
-	timers.after(checkWriteCompletion, 2)
-	runloop.current:run(stopper)
 end
 
 --[[**
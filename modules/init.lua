@@ -37,6 +37,17 @@ local function doMain()
 		require("bootMenu").main()
 	elseif bootMode == string.byte('m') then
 		require("test.memTests").test_mem()
+	elseif bootMode == string.byte('p') then
+		lupi.createProcess("test.pingpong")
+	elseif bootMode == string.byte('l') then
+		lupi.createProcess("test.latencyTests")
+	elseif bootMode == string.byte('s') then
+		lupi.createProcess("test.profilerTests")
+	elseif bootMode == string.byte('c') then
+		lupi.createProcess("test.compositorTests")
+	elseif bootMode == string.byte('f') then
+		lupi.createProcess("test.syncTests")
+		lupi.createProcess("test.mailboxTests")
 	end
 	local interpreter = require("interpreter")
 	local hadPreCmd = false
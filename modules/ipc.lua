@@ -1,17 +1,19 @@
 require "membuf"
 require "runloop"
 
+MaxMsgData = 4 * 4 -- Up to 4 ints per message
+
 ------------ Server functions ------------
 
 -- Incoming message from a client
 local function doHandleMsg(msg, cmd)
 	local dataPos, len = getMsgData(msg.page, msg.index)
-	if len > 4*4 then
+	if len > MaxMsgData then
 		error("Message too big!")
 	end
 	local decodedMsg = {
 	}
-	for i=0,len,4 do -- for (i = 0; i <= len; i+= 4)
+	for i = 0, len - 4, 4 do
 		table.insert(decodedMsg, msg.page:getInt(dataPos + i))
 	end
 
@@ -73,6 +75,15 @@ server-side msg.
 ]]
 --native function complete(msg, result)
 
+--[[**
+Returns the shared pages at address `ptr` as a MemBuf, after checking that they
+were given to this server by the client which sent `msg`, using
+[grantPages()](#grantPages).
+]]
+function getGrantedPages(msg, ptr, numPages)
+	return doGetGrantedPages(msg.page, ptr, numPages)
+end
+
 ------------ Client functions ------------
 
 local function msgCompleted(msg, result)
@@ -107,14 +118,32 @@ function connect(serverName, numMessages)
 	return session
 end
 
-function serialiseToPage(server, args)
+--[[**
+Returns a MemBuf of `numPages` (default 1) contiguous pages which can be shared
+with a server.
+]]
+--native function newSharedPage([numPages])
+
+--[[**
+Gives the server that `session` is connected to access to `buf`, which must
+have come from `newSharedPage()` and not been granted before. This is for
+passing data which won't fit in a message: grant the pages, then send a message
+with the address (`buf:getAddress()`) and number of pages, and the server can
+get at them with [getGrantedPages()](#getGrantedPages). The pages stay shared
+until the client exits.
+]]
+function grantPages(session, buf)
+	doGrantSharedPages(session.ipcPage, buf)
+end
+
+function serialiseToPage(session, args, msgIdx)
 	-- Currently the only supported args are an array of ints [1]-[4]
-	local page = server.ipcPage
-	-- Work out where in the page to put the data
-	-- TODO! For now always put at end
-	local startOfData = server.endPtr or 32
+	local page = session.ipcPage
+	-- Each message has its own slot for its data after the array of messages,
+	-- which it can reuse because it can't be sent again until it's completed
+	local startOfData = IpcPageHeaderSize + #session.msgs * IpcMessageSize + (msgIdx - 1) * MaxMsgData
 	local max = page:getLength()
-	if startOfData + 4 * 4 > max then
+	if startOfData + MaxMsgData > max then
 		error("Page full, aargh")
 	end
 	local pos = startOfData
@@ -123,8 +152,7 @@ function serialiseToPage(server, args)
 		page:setInt(pos, v)
 		pos = pos + 4
 	end
-	server.endPtr = pos
-	return startOfData, server.endPtr - startOfData
+	return startOfData, pos - startOfData
 end
 
 function send(session, cmd, args, completionFn)
@@ -141,17 +169,17 @@ function send(session, cmd, args, completionFn)
 	-- Find a free message - note this is actually the response msg not the request msg,
 	-- because the response is what we're interested in our address space. The C code
 	-- is smart enough to do the right thing and actually complete the request msg.
-	local msg
+	local msg, msgIdx
 	for i, m in ipairs(session.msgs) do
 		if m:isFree() then
-			msg = m
+			msg, msgIdx = m, i
 			break
 		end
 	end
 	assert(msg, "No free message available")
 	local startOfData, len = 0, 0
 	if args then
-		startOfData, len = serialiseToPage(session, args)
+		startOfData, len = serialiseToPage(session, args, msgIdx)
 	end
 
 	if session.runloop then
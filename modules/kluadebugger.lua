@@ -42,6 +42,16 @@ Functions
                         number (which is assumed to be a stack pointer) or nil
                         (in which case TheSuperPage.crashRegisters.r13 is used).
     pageStats()         Print stats about the PageAllocator.
+    traceEnable(bool)   Enables or disables kernel event tracing. Enabling
+                        discards any previously-recorded events.
+    traceDump()         Prints the kernel trace buffer, suitable for passing to
+                        build/traceToChrome.lua. Not available on platforms
+                        without a trace buffer.
+    profileStart([n])   Starts the sampling profiler, taking a sample every n
+                        timer ticks (default 1).
+    profileStop()       Stops the sampling profiler.
+    profileDump([idx])  Prints the profiler samples for process idx (or all
+                        processes), suitable for build/profileReport.lua.
     reboot(), ^X        Reboot the device.
 
     buf:getAddress()    returns the address of the MemBuf.
@@ -0,0 +1,92 @@
+--[[**
+Mailboxes pass Lua values between threads in the same process, without going
+through the kernel. Each thread created by [spawn()](#spawn) (or
+`lupi.createThread()`) runs in its own Lua state, so values sent to a mailbox
+are deep-copied: nil, booleans, numbers, strings, light userdata and tables
+of those (without metatables or cycles) are supported.
+
+Sending never blocks and doesn't take a lock, so any number of threads can send
+to the same mailbox. Receiving blocks until there's a message, and only calls
+into the kernel if there isn't one already. Messages are received in the order
+they were sent by any given thread.
+
+Example:
+
+	require "mailbox"
+
+	local function worker(inboxHandle, replyHandle)
+		local mailbox = require("mailbox")
+		local inbox, reply = mailbox.open(inboxHandle), mailbox.open(replyHandle)
+		mailbox.release(replyHandle)
+		while true do
+			local n = inbox:receive()
+			if n == nil then break end
+			reply:send(n * n)
+		end
+	end
+
+	function main()
+		local results = mailbox.new()
+		local inbox = mailbox.spawn(worker, results:handle())
+		inbox:send(3)
+		print(results:receive()) -- 9
+		inbox:send(nil)
+	end
+
+Because `lupi.createThread()` serialises the function, it cannot have any
+upvalues (except `_ENV`) - in particular, it can't refer to locals in the
+enclosing module.
+]]
+
+--[[**
+The following functions are implemented natively, in `usersrc/mailbox.c`:
+
+* `new()`: Returns a new, empty `Mailbox`.
+* `open(handle)`: Returns a `Mailbox` for a handle obtained from
+  `Mailbox:handle()` in another thread. The `Mailbox` has its own reference, so
+  a handle can be opened any number of times until it is released.
+* `release(handle)`: Drops the reference held by `handle`, which must not be
+  used again afterwards. Normally the thread that the handle was passed to
+  calls this once it has opened it. If the handle never reaches that thread,
+  for example because creating the thread failed, the sender must release it.
+* `Mailbox:handle()`: Returns a light userdata referring to the mailbox, which
+  can be passed to another thread and opened there. The handle keeps the mailbox
+  alive until it is released.
+* `Mailbox:send(...)`: Sends the arguments as a single message. Raises an
+  error if any of them can't be copied.
+* `Mailbox:receive()`: Blocks until there is a message and returns its values.
+* `Mailbox:tryReceive()`: Returns `false` if the mailbox is empty, otherwise
+  `true` followed by the values of the next message.
+* `Mailbox:count()`: Returns the number of messages waiting to be received.
+* `Mailbox:close()`: Releases this state's reference to the mailbox. Also
+  happens when the `Mailbox` is garbage collected.
+]]
+
+-- Runs in the new thread's state, so mustn't have upvalues. Holding inbox open
+-- for as long as fn runs means the handle can be released straight away.
+local function spawnEntry(fn, inboxHandle, ...)
+	local mailbox = require("mailbox")
+	local inbox = mailbox.open(inboxHandle)
+	mailbox.release(inboxHandle)
+	fn(inboxHandle, ...)
+	inbox:close()
+end
+
+--[[**
+Starts a new thread, with its own Lua state, which calls `fn(inboxHandle, ...)`.
+Returns a `Mailbox` that the caller can send messages to the new thread with.
+The thread should call `require("mailbox").open(inboxHandle)` to receive them,
+but doesn't need to release `inboxHandle`. The other arguments are copied in the
+same way as a mailbox message.
+]]
+function spawn(fn, ...)
+	local inbox = new()
+	local handle = inbox:handle()
+	local ok, err = pcall(lupi.createThread, spawnEntry, fn, handle, ...)
+	if not ok then
+		release(handle)
+		inbox:close()
+		error(err, 2)
+	end
+	return inbox
+end
@@ -0,0 +1,279 @@
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+// For getting at the Proto and CallInfo of the function a hook refers to
+#include <lobject.h>
+#include <lstate.h>
+
+/**
+The profiler state is a single userdata allocated by start() and anchored in the
+registry, so that nothing the hook does touches the Lua heap. Functions are
+identified by their Proto (or lua_CFunction for C functions) and live in a
+fixed-size open-addressing hash table. A shadow call stack records which entry
+each active CallInfo belongs to.
+
+Cost is measured in Lua VM instructions, counted by the count hook in units of
+`countInterval`. This needs no exec (which klua can't make) and is independent
+of whatever else the system is doing. Exclusive cost is charged to the function
+that is executing when the count hook fires; inclusive cost is the difference
+in the instruction count between the call and return, and is only charged to
+the outermost activation of a recursive function.
+*/
+
+#define KProfilerNameLen 28
+#define KProfilerDefaultMaxFunctions 96
+#define KProfilerDefaultCountInterval 64
+#define KProfilerMaxDepth 128
+
+typedef struct ProfilerEntry {
+	const void* key; // Proto* or lua_CFunction
+	uint32 calls;
+	uint32 inclusive;
+	uint32 exclusive;
+	int line; // -1 for C functions
+	int active; // Number of activations on the shadow stack
+	char source[KProfilerNameLen];
+} ProfilerEntry;
+
+typedef struct ProfilerFrame {
+	lua_State* L;
+	CallInfo* ci;
+	ProfilerEntry* entry;
+	uint32 start;
+} ProfilerFrame;
+
+typedef struct Profiler {
+	lua_State* L; // The state that start() was called on
+	bool running;
+	int countInterval;
+	uint32 now; // Instructions executed (to within countInterval) since start
+	int numEntries;
+	int maxEntries; // As passed to start()
+	int tableSize; // Always a power of 2, and at least 4/3 of maxEntries
+	int depth;
+	uint32 missedFunctions; // Calls not recorded because the table was full
+	uint32 missedFrames; // Calls not recorded because the stack was full
+	ProfilerFrame frames[KProfilerMaxDepth];
+	ProfilerEntry entries[1]; // Extends beyond struct, size tableSize
+} Profiler;
+
+static const char KProfilerRegistryKey = 0;
+
+static Profiler* getProfiler(lua_State* L) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &KProfilerRegistryKey);
+	Profiler* prof = (Profiler*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return prof;
+}
+
+static const void* keyForFunction(const TValue* func) {
+	if (ttisLclosure(func)) return clLvalue(func)->p;
+	else if (ttislcf(func)) return (const void*)fvalue(func);
+	else if (ttisCclosure(func)) return (const void*)clCvalue(func)->f;
+	else return NULL;
+}
+
+static ProfilerEntry* findEntry(Profiler* prof, lua_State* L, lua_Debug* ar, const void* key) {
+	const uint32 mask = prof->tableSize - 1;
+	uint32 idx = (((uintptr)key) >> 2) * 2654435761u;
+	for (;; idx++) {
+		ProfilerEntry* e = &prof->entries[idx & mask];
+		if (e->key == key) return e;
+		if (e->key) continue;
+
+		// tableSize keeps the table at most 3/4 full so probe sequences stay short
+		if (prof->numEntries >= prof->maxEntries) {
+			prof->missedFunctions++;
+			return NULL;
+		}
+		prof->numEntries++;
+		e->key = key;
+		// "S" doesn't push anything or allocate, and this only happens once per function
+		lua_getinfo(L, "S", ar);
+		e->line = ar->linedefined;
+		if (ar->what[0] == 'C') {
+			e->source[0] = 0;
+		} else {
+			// Keep the end of the name, that's generally the interesting bit
+			const char* src = ar->short_src;
+			int len = strlen(src);
+			if (len >= KProfilerNameLen) src += len - (KProfilerNameLen - 1);
+			strcpy(e->source, src);
+		}
+		return e;
+	}
+}
+
+static void finishFrame(Profiler* prof, ProfilerFrame* f) {
+	ProfilerEntry* e = f->entry;
+	if (--e->active == 0) {
+		e->inclusive += prof->now - f->start;
+	}
+}
+
+static void pushFrame(Profiler* prof, lua_State* L, lua_Debug* ar, CallInfo* ci) {
+	if (prof->depth == KProfilerMaxDepth) {
+		prof->missedFrames++;
+		return;
+	}
+	const void* key = keyForFunction(ar->i_ci->func);
+	ProfilerEntry* e = key ? findEntry(prof, L, ar, key) : NULL;
+	if (!e) return;
+	e->calls++;
+	e->active++;
+	ProfilerFrame* f = &prof->frames[prof->depth++];
+	f->L = L;
+	f->ci = ci;
+	f->entry = e;
+	f->start = prof->now;
+}
+
+/**
+Pops the frame for `ci`, along with any frames above it belonging to the same
+lua_State. The latter can only be left over from an error unwinding the stack,
+which doesn't call the return hook. Frames belonging to other coroutines are
+left where they are. Does nothing if `ci` isn't on the shadow stack, ie it was
+called before the profiler was started or when the stack was full.
+*/
+static void popFrame(Profiler* prof, lua_State* L, CallInfo* ci) {
+	int i = prof->depth - 1;
+	while (i >= 0 && !(prof->frames[i].L == L && prof->frames[i].ci == ci)) i--;
+	if (i < 0) return;
+
+	int newDepth = i;
+	for (int j = i; j < prof->depth; j++) {
+		ProfilerFrame* f = &prof->frames[j];
+		if (f->L == L) {
+			finishFrame(prof, f);
+		} else {
+			prof->frames[newDepth++] = *f;
+		}
+	}
+	prof->depth = newDepth;
+}
+
+static void hook(lua_State* L, lua_Debug* ar) {
+	Profiler* prof = getProfiler(L);
+	if (!prof || !prof->running) return;
+
+	switch (ar->event) {
+		case LUA_HOOKCOUNT: {
+			prof->now += prof->countInterval;
+			for (int i = prof->depth - 1; i >= 0; i--) {
+				if (prof->frames[i].L == L) {
+					prof->frames[i].entry->exclusive += prof->countInterval;
+					break;
+				}
+			}
+			break;
+		}
+		case LUA_HOOKCALL:
+			pushFrame(prof, L, ar, ar->i_ci);
+			break;
+		case LUA_HOOKTAILCALL: {
+			// The hook is called before the new frame replaces the caller's,
+			// so ar->i_ci is the new frame but the caller's CallInfo is the one
+			// that will eventually return.
+			CallInfo* ci = ar->i_ci->previous;
+			popFrame(prof, L, ci);
+			pushFrame(prof, L, ar, ci);
+			break;
+		}
+		case LUA_HOOKRET:
+			popFrame(prof, L, ar->i_ci);
+			break;
+	}
+}
+
+static void setHook(Profiler* prof, bool enable) {
+	if (enable) {
+		lua_sethook(prof->L, hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, prof->countInterval);
+	} else {
+		lua_sethook(prof->L, NULL, 0, 0);
+	}
+	prof->running = enable;
+}
+
+static int start(lua_State* L) {
+	int maxFunctions = luaL_optint(L, 1, KProfilerDefaultMaxFunctions);
+	int countInterval = luaL_optint(L, 2, KProfilerDefaultCountInterval);
+	luaL_argcheck(L, maxFunctions > 0, 1, "maxFunctions must be positive");
+	luaL_argcheck(L, countInterval > 0, 2, "countInterval must be positive");
+
+	Profiler* prof = getProfiler(L);
+	if (prof) setHook(prof, false);
+
+	int tableSize = 4;
+	while (tableSize - (tableSize >> 2) < maxFunctions) tableSize <<= 1;
+	size_t size = sizeof(Profiler) + (tableSize - 1) * sizeof(ProfilerEntry);
+	prof = (Profiler*)lua_newuserdata(L, size);
+	memset(prof, 0, size);
+	prof->L = L;
+	prof->countInterval = countInterval;
+	prof->maxEntries = maxFunctions;
+	prof->tableSize = tableSize;
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &KProfilerRegistryKey);
+
+	setHook(prof, true);
+	return 0;
+}
+
+static int stop(lua_State* L) {
+	Profiler* prof = getProfiler(L);
+	if (prof && prof->running) {
+		setHook(prof, false);
+		// Anything still on the stack is charged up to now
+		for (int i = prof->depth - 1; i >= 0; i--) {
+			finishFrame(prof, &prof->frames[i]);
+		}
+		prof->depth = 0;
+	}
+	return 0;
+}
+
+static int results(lua_State* L) {
+	Profiler* prof = getProfiler(L);
+	if (!prof) return 0;
+	if (prof->running) return luaL_error(L, "Profiler is still running");
+
+	lua_createtable(L, prof->numEntries, 4);
+	int n = 0;
+	for (int i = 0; i < prof->tableSize; i++) {
+		const ProfilerEntry* e = &prof->entries[i];
+		if (!e->key) continue;
+		lua_createtable(L, 0, 5);
+		if (e->source[0]) {
+			lua_pushfstring(L, "%s:%d", e->source, e->line);
+		} else {
+			lua_pushfstring(L, "[C]:%p", e->key);
+		}
+		lua_setfield(L, -2, "name");
+		lua_pushinteger(L, e->calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, e->inclusive);
+		lua_setfield(L, -2, "inclusive");
+		lua_pushinteger(L, e->exclusive);
+		lua_setfield(L, -2, "exclusive");
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_pushinteger(L, prof->now);
+	lua_setfield(L, -2, "total");
+	lua_pushinteger(L, prof->countInterval);
+	lua_setfield(L, -2, "countInterval");
+	lua_pushinteger(L, prof->missedFunctions);
+	lua_setfield(L, -2, "missedFunctions");
+	lua_pushinteger(L, prof->missedFrames);
+	lua_setfield(L, -2, "missedFrames");
+	return 1;
+}
+
+int init_module_profiler_profiler(lua_State* L) {
+	luaL_Reg fns[] = {
+		{ "start", start },
+		{ "stop", stop },
+		{ "results", results },
+		{ NULL, NULL }
+	};
+	luaL_setfuncs(L, fns, 0);
+	return 0;
+}
@@ -0,0 +1,86 @@
+--[[**
+Profiler
+========
+
+A function-level profiler for Lua code. Unlike the kernel's sampling profiler,
+which for Lua code mostly just reports time spent in `luaV_execute`, this
+records how often each Lua (and C) function is called and how much work is done
+in it, by way of a call/return and count hook. All accounting is done in native
+code without allocating from the Lua heap, so it is cheap enough to leave
+running. Works in both ulua and klua.
+
+Costs are in Lua VM instructions, measured to the nearest `countInterval`
+instructions. Functions are identified by their prototype, so all closures
+created from the same function definition are counted together. Usage:
+
+		require "profiler"
+		profiler.start()
+		doSomethingSlow()
+		profiler.stop()
+		profiler.report()
+
+Only the coroutine that calls `start()`, and coroutines created after that, are
+profiled. A function that yields continues to accumulate inclusive cost until
+it is resumed and returns.
+]]
+
+--[[**
+Starts profiling, discarding any previous results. `maxFunctions` (default 96)
+is the number of distinct functions that can be tracked; calls to any further
+functions are not recorded. `countInterval` (default 64) is the number of VM
+instructions between each invocation of the count hook, smaller numbers give
+more accurate results at the expense of a greater overhead.
+]]
+--native function start([maxFunctions, [countInterval]])
+
+--[[**
+Stops profiling. Any functions which are still executing are charged for their
+cost up to this point.
+]]
+--native function stop()
+
+--[[**
+Returns an array of all the functions called while the profiler was running,
+in no particular order. Each element is a table with members `name`
+(`source:line`, or `[C]:address` for C functions), `calls`, `inclusive` and
+`exclusive`. The array also has members `total` (the number of instructions
+executed), `countInterval`, and `missedFunctions` and `missedFrames` which are
+the number of calls that were not recorded because too many functions were
+called or the call stack got too deep. Returns nil if the profiler has never
+been started, and errors if it is still running.
+]]
+--native function results()
+
+--[[**
+Prints the results of the last profiling run, sorted by `sortBy` which may be
+`"exclusive"` (the default), `"inclusive"` or `"calls"`. Only the first
+`maxLines` functions are printed, if specified.
+]]
+function report(sortBy, maxLines)
+	sortBy = sortBy or "exclusive"
+	local r = results()
+	if not r then
+		print("Profiler has not been run")
+		return
+	end
+	table.sort(r, function(a, b)
+		if a[sortBy] ~= b[sortBy] then return a[sortBy] > b[sortBy] end
+		return a.name < b.name
+	end)
+	local total = r.total > 0 and r.total or 1
+	local function percent(n)
+		return string.format("%3d.%d%%", n * 100 // total, (n * 1000 // total) % 10)
+	end
+	print(string.format("%d instructions (+/- %d per call)", r.total, r.countInterval))
+	if r.missedFunctions > 0 or r.missedFrames > 0 then
+		print(string.format("%d calls not recorded (%d table full, %d stack full)",
+			r.missedFunctions + r.missedFrames, r.missedFunctions, r.missedFrames))
+	end
+	print("    calls    exclusive     inclusive    function")
+	for i, fn in ipairs(r) do
+		if maxLines and i > maxLines then break end
+		print(string.format("%9d %s %8d %s %8d  %s", fn.calls,
+			percent(fn.exclusive), fn.exclusive,
+			percent(fn.inclusive), fn.inclusive, fn.name))
+	end
+end
@@ -206,6 +206,7 @@ end
 
 --[[**
 Blocks the thread until any request completes. Returns the number of completed
-requests (which will always be >= 1).
+requests (which will always be >= 1). If `timeout` is specified, gives up after
+that many milliseconds and returns 0.
 ]]
---native function RunLoop:waitForAnyRequest()
+--native function RunLoop:waitForAnyRequest([timeout])
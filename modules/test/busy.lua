@@ -0,0 +1,13 @@
+--[[**
+Spins for `KBusyTime` ms, to give the ping-pong benchmark some competition for
+the CPU.
+]]
+
+local KBusyTime = 10000
+
+function main()
+	local stopTime = lupi.getUptime() + KBusyTime
+	while lupi.getUptime() < stopTime do
+		-- Spin
+	end
+end
@@ -0,0 +1,85 @@
+--[[**
+Exercises the [compositor](../compositor/init.lua): two overlapping surfaces
+animate independently, one of them moving around on top of the other, and then
+they are raised, destroyed and so on. Prints how many frames each got through.
+
+Run from the boot menu with `c`, or from the interpreter with:
+
+	lupi.createProcess("test.compositorTests")
+]]
+
+require "runloop"
+require "bitmap"
+local compositor = require "compositor"
+
+local KFrames = 100
+local Colour = bitmap.Colour
+
+local function animate(surface, frames, drawFn, doneFn)
+	local n = 0
+	local function nextFrame()
+		n = n + 1
+		if n > frames then
+			return doneFn()
+		end
+		drawFn(surface.bitmap, n)
+		surface:present(nextFrame)
+	end
+	nextFrame()
+end
+
+-- A bar sweeping across, so only a small part is presented each frame
+local function drawBar(b, n)
+	local x = n % b:width()
+	b:setColour(Colour.Red)
+	b:drawRect(x, 0, 1, b:height())
+	b:setColour(Colour.Black)
+	b:drawRect((x + 8) % b:width(), 0, 1, b:height())
+end
+
+local function drawCounter(b, n)
+	b:drawText(string.format("Frame %d", n), 4, 4)
+end
+
+function main()
+	local rl = runloop.new()
+	local comp = compositor.connect()
+	local back = comp:newSurface(20, 20, 160, 120)
+	back.bitmap:setBackgroundColour(Colour.Blue)
+	back.bitmap:clear()
+	local front = comp:newSurface(60, 80, 100, 40)
+	front.bitmap:setBackgroundColour(Colour.Grey)
+	front.bitmap:clear()
+	front.bitmap:setColour(Colour.White)
+
+	comp:registerInputObserver(function(surface, op, x, y)
+		printf("[compositorTests] Input %d at %d,%d on surface %d", op, x, y, surface.id)
+	end)
+
+	local start = lupi.getUptime()
+	local running = 2
+	local stopper = {}
+	local function done()
+		running = running - 1
+		if running == 0 then stopper.exit = true end
+	end
+	animate(back, KFrames, drawBar, done)
+	animate(front, KFrames, function(b, n)
+		drawCounter(b, n)
+		if n % 10 == 0 then front:move(60 + n // 2, 80 + n // 4) end
+	end, done)
+	rl:run(stopper)
+	local ms = (lupi.getUptime() - start):lo()
+	printf("[compositorTests] 2 surfaces x %d frames in %d ms", KFrames, ms)
+
+	-- Bring the back one to the front, then get rid of it to reveal the other again
+	stopper = {}
+	back:raise()
+	back:present(function()
+		back:destroy()
+		front:present(function() stopper.exit = true end)
+	end)
+	rl:run(stopper)
+	front:destroy()
+	print("[compositorTests] Done")
+end
@@ -0,0 +1,67 @@
+--[[**
+Measures how long the long-running SVCs hold off the scheduler, by repeatedly
+growing the heap and blitting the whole screen and reading
+`lupi.getInt("MaxSchedulingLatency")` after each. That value is the worst
+case since boot and is never reset, so each figure printed only says something
+about that phase if it went up. Nothing needs to be competing for the CPU:
+timeslice expiries and DFCs are enough to make the kernel want to reschedule
+while we're in an SVC.
+
+These are the numbers to quote when changing where the
+[preemption points](../../doc/internals.md) are. On ARMv7-M and AArch64
+preemption points do nothing, so expect a figure about the length of the
+longest single SVC.
+
+Run from the boot menu with `l`, or from the interpreter with:
+
+	lupi.createProcess("test.latencyTests")
+]]
+
+local KHeapGrowSize = 2 * 1024 * 1024
+local KIterations = 20
+
+local function maxLatency()
+	return lupi.getInt("MaxSchedulingLatency")
+end
+
+local function report(name, before)
+	local after = maxLatency()
+	if after > before then
+		print(string.format("[latencyTests] %s: max scheduling latency %d us", name, after))
+	else
+		print(string.format("[latencyTests] %s: no worse than the previous max of %d us", name, before))
+	end
+end
+
+local function heapGrowth()
+	local before = maxLatency()
+	for i = 1, KIterations do
+		-- Each one is a single big sbrk, whose pages the kernel has to zero.
+		-- Collecting afterwards means the next one has to grow the heap again.
+		local str = string.rep("x", KHeapGrowSize)
+		str = nil
+		collectgarbage()
+	end
+	report(string.format("%d heap grows of %d KB", KIterations, KHeapGrowSize // 1024), before)
+end
+
+local function screenBlits()
+	local ok, bmp = pcall(function() return require("bitmap").create() end)
+	if not ok then
+		print("[latencyTests] Skipping screen blits: "..bmp)
+		return
+	end
+	local before = maxLatency()
+	for i = 1, KIterations do
+		bmp:drawRect(0, 0, bmp:width(), bmp:height())
+		bmp:blit()
+	end
+	report(string.format("%d %dx%d screen blits", KIterations, bmp:width(), bmp:height()), before)
+end
+
+function main()
+	print(string.format("[latencyTests] Max scheduling latency at start %d us", maxLatency()))
+	heapGrowth()
+	screenBlits()
+	print("[latencyTests] Done")
+end
@@ -0,0 +1,148 @@
+--[[**
+Tests for [mailbox](../mailbox.lua). Checks that values survive being copied
+between Lua states, then runs a two-stage pipeline of threads in this process
+and checks that everything comes out the other end in order. Also checks that
+threads with non-default stack sizes (see `lupi.createThreadWithStackSize()`)
+can use their stacks.
+
+Run from the boot menu with `f`, or from the interpreter with:
+
+	lupi.createProcess("test.mailboxTests")
+]]
+
+require "mailbox"
+
+local KNumItems = 500
+
+local function deepEqual(a, b)
+	if type(a) ~= "table" or type(b) ~= "table" then return a == b end
+	for k, v in pairs(a) do
+		if not deepEqual(v, b[k]) then return false end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then return false end
+	end
+	return true
+end
+
+local function testCopy()
+	local mb = mailbox.new()
+	local tbl = {
+		"one", 2, true, false,
+		nested = { deeper = { "x", [10] = "ten" } },
+		[-7] = "negative key",
+		str = string.rep("abc", 100),
+	}
+	mb:send(tbl, nil, 42, "hello")
+	assert(mb:count() == 1)
+	local got, gotNil, n, s = mb:receive()
+	assert(got ~= tbl)
+	assert(deepEqual(got, tbl), "Table didn't survive the copy")
+	assert(gotNil == nil and n == 42 and s == "hello")
+
+	mb:send()
+	assert(select("#", mb:receive()) == 0)
+	assert(mb:tryReceive() == false)
+
+	local ok = pcall(mb.send, mb, setmetatable({}, {}))
+	assert(not ok, "Shouldn't be able to send a table with a metatable")
+	local cyclic = {}
+	cyclic.self = cyclic
+	ok = pcall(mb.send, mb, cyclic)
+	assert(not ok, "Shouldn't be able to send a cyclic table")
+	ok = pcall(mb.send, mb, print)
+	assert(not ok, "Shouldn't be able to send a function")
+	assert(mb:count() == 0)
+
+	-- Each open() has its own reference, independent of the handle's
+	local handle = mb:handle()
+	local a, b = mailbox.open(handle), mailbox.open(handle)
+	mailbox.release(handle)
+	a:close()
+	b:send("still open")
+	assert(mb:receive() == "still open")
+	b:close()
+	mb:close()
+end
+
+-- The first stage turns each number into a table, the second one (which sends
+-- back to main) turns the table into a string. These run in their own states
+-- so mustn't have upvalues.
+local function decodeStage(inboxHandle, nextHandle)
+	local mailbox = require("mailbox")
+	local inbox, nextStage = mailbox.open(inboxHandle), mailbox.open(nextHandle)
+	mailbox.release(nextHandle)
+	while true do
+		local n = inbox:receive()
+		if n == nil then break end
+		nextStage:send({ n = n, square = n * n })
+	end
+	nextStage:send(nil)
+end
+
+local function renderStage(inboxHandle, resultHandle)
+	local mailbox = require("mailbox")
+	local inbox, results = mailbox.open(inboxHandle), mailbox.open(resultHandle)
+	mailbox.release(resultHandle)
+	while true do
+		local item = inbox:receive()
+		if item == nil then break end
+		results:send(string.format("%d^2=%d", item.n, item.square))
+	end
+	results:send(nil)
+end
+
+local function testPipeline()
+	local results = mailbox.new()
+	local render = mailbox.spawn(renderStage, results:handle())
+	local decode = mailbox.spawn(decodeStage, render:handle())
+	local start = lupi.getUptime()
+	for i = 1, KNumItems do
+		decode:send(i)
+	end
+	decode:send(nil)
+	for i = 1, KNumItems do
+		local str = results:receive()
+		assert(str == string.format("%d^2=%d", i, i * i), "Got "..tostring(str).." for item "..i)
+	end
+	assert(results:receive() == nil)
+	local elapsed = (lupi.getUptime() - start):lo()
+	printf("%d items through a 2-stage pipeline took %d ms", KNumItems, elapsed)
+end
+
+-- Nests pcalls, each of which recurses in C, so the thread's stack actually
+-- gets used. Runs in its own state so mustn't have upvalues.
+local function stackUser(resultHandle, depth)
+	local function recurse(n)
+		if n == 0 then return 0 end
+		local ok, result = pcall(recurse, n - 1)
+		assert(ok, result)
+		return result + 1
+	end
+	local mailbox = require("mailbox")
+	local results = mailbox.open(resultHandle)
+	mailbox.release(resultHandle)
+	results:send(recurse(depth))
+end
+
+local function testStackSizes()
+	local results = mailbox.new()
+	-- Enough depth to need more than a page of the larger stack
+	local sizes = { { 4096, 2 }, { 12 * 1024, 20 } }
+	for _, s in ipairs(sizes) do
+		lupi.createThreadWithStackSize(s[1], stackUser, results:handle(), s[2])
+		assert(results:receive() == s[2], "Thread with stack size "..s[1].." failed")
+	end
+	local ok = pcall(lupi.createThreadWithStackSize, 1 << 30, stackUser)
+	assert(not ok, "Shouldn't be able to create a thread with a 1GB stack")
+	ok = pcall(mailbox.spawn, stackUser, setmetatable({}, {}))
+	assert(not ok, "spawn() should fail if its arguments can't be copied")
+	results:close()
+end
+
+function main()
+	testCopy()
+	testPipeline()
+	testStackSizes()
+	print("Mailbox tests passed")
+end
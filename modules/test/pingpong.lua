@@ -0,0 +1,81 @@
+--[[**
+IPC round-trip latency benchmark. Starts a [test.pingserver](pingserver.lua)
+process and times a series of synchronous request/response round trips to it,
+first with nothing else running and then with some [test.busy](busy.lua)
+processes competing for the CPU. With directed handoff the two figures should
+be about the same. Finally the client raises its own priority above the busy
+processes: the server is still at the default priority, so this relies on it
+inheriting the client's priority while it has a request outstanding.
+
+Run from the boot menu with `p`, or from the interpreter with:
+
+	lupi.createProcess("test.pingpong")
+]]
+
+require "runloop"
+require "ipc"
+
+local Ping = 1 -- Must match test/pingserver.lua
+local KRoundTrips = 2000
+local KNumBusyProcesses = 3
+local KHighPriority = 5
+
+local function connect()
+	-- The server process gets to run as soon as it's created, but just in
+	-- case it hasn't got as far as creating its server yet
+	for i = 1, 10 do
+		local ok, session = pcall(ipc.connect, "ping")
+		if ok then return session end
+		lupi.yield()
+	end
+	error("Couldn't connect to the ping server")
+end
+
+local function measure(session, n)
+	local stopper = {}
+	local count = 0
+	local function pong()
+		count = count + 1
+		if count == n then
+			stopper.exit = true
+		else
+			ipc.send(session, Ping, pong)
+		end
+	end
+
+	local start = lupi.getUptime()
+	ipc.send(session, Ping, pong)
+	runloop.current:run(stopper)
+	return (lupi.getUptime() - start):lo()
+end
+
+local function report(desc, n, ms)
+	printf("[pingpong] %s: %d round trips in %d ms, %d us each", desc, n, ms, ms * 1000 // n)
+end
+
+function main()
+	runloop.new()
+	lupi.createProcess("test.pingserver")
+	local session = connect()
+
+	measure(session, 10) -- Warm up
+	report("Idle", KRoundTrips, measure(session, KRoundTrips))
+
+	for i = 1, KNumBusyProcesses do
+		lupi.createProcess("test.busy")
+	end
+	report(string.format("With %d busy processes", KNumBusyProcesses), KRoundTrips, measure(session, KRoundTrips))
+
+	local oldPriority = lupi.setThreadPriority(KHighPriority)
+	if oldPriority then
+		report(string.format("High priority client, %d busy processes", KNumBusyProcesses), KRoundTrips, measure(session, KRoundTrips))
+		local stats = lupi.getCpuStats()
+		for _, rec in ipairs(stats) do
+			if rec.name == "test.pingserver" and rec.thread == 0 then
+				assert(rec.priority == oldPriority, "Server should have gone back to its own priority")
+			end
+		end
+		lupi.setThreadPriority(oldPriority)
+	end
+	printf("[pingpong] Max scheduling latency %d us", lupi.getInt("MaxSchedulingLatency"))
+end
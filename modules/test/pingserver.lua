@@ -0,0 +1,19 @@
+--[[**
+Server half of the IPC ping-pong benchmark, see [test.pingpong](pingpong.lua).
+Completes every message it receives straight away.
+]]
+
+require "runloop"
+require "ipc"
+
+Ping = 1
+
+function main()
+	local loop = runloop.new()
+	ipc.startServer(loop, "ping", {
+		[Ping] = function(msg)
+			ipc.complete(msg, 0)
+		end,
+	})
+	loop:run()
+end
@@ -0,0 +1,47 @@
+--[[**
+Tests for the kernel's sampling profiler (see `lupi.profilerStart()`). Spins for
+a while with the profiler running and checks that samples were taken, that this
+process got its share of them, and that stopping the profiler stops them.
+Symbolising the dump is left to build/profileReport.lua, so this only checks the
+counts.
+
+Run from the boot menu with `s`, or from the interpreter with:
+
+	lupi.createProcess("test.profilerTests")
+]]
+
+local KSpinTime = 250 -- ms
+local KInterval = 5 -- ticks, so about one sample every 5ms
+
+local function spin(ms)
+	local stopTime = lupi.getUptime() + ms
+	while lupi.getUptime() < stopTime do
+		-- Spin
+	end
+end
+
+function main()
+	local ok, err = pcall(lupi.profilerStart, KInterval)
+	if not ok then
+		-- Only platforms with a KProfileBufferAddress have a profiler
+		print("[profilerTests] Skipped: "..err)
+		return
+	end
+	spin(KSpinTime)
+	local total = lupi.profilerStop()
+	-- Nothing else should be runnable while we spin, but allow some slack
+	local expected = KSpinTime // KInterval
+	assert(total >= expected // 2 and total <= expected * 2,
+		string.format("Expected about %d samples, got %d", expected, total))
+
+	spin(20)
+	assert(lupi.profilerStop() == total, "Samples were still being taken after profilerStop()")
+
+	local ours = lupi.profilerDump()
+	assert(ours > 0 and ours <= total, string.format("Dumped %d of %d samples", ours, total))
+	assert(ours * 2 >= total, "Most of the samples should be from the spinning process")
+
+	assert(not pcall(lupi.profilerStart, 0), "An interval of zero should be rejected")
+	print(string.format("[profilerTests] %d samples, %d from this process", total, ours))
+	print("[profilerTests] Done")
+end
@@ -0,0 +1,84 @@
+--[[**
+Tests for the user-side mutex, condition variable and semaphore in
+`userinc/lupi/sync.h`, and the futex execs underneath them. A number of threads
+increment a shared counter under a mutex, yielding while they hold it so that
+the others have to block in the kernel. The workers wait on a condition
+variable for the go signal, and report back with a semaphore. Also times
+creating lots of threads, twice, so the second round reuses the thread slots
+freed by the first. Finally checks that `lupi.sleep()` and a timed-out
+`RunLoop:waitForAnyRequest()` block for at least as long as they should.
+
+Run from the boot menu with `f`, or from the interpreter with:
+
+	lupi.createProcess("test.syncTests")
+]]
+
+local KNumWorkers = 4
+local KIterations = 2000
+local KUncontendedIterations = 100000
+local KMaxCreateThreads = 100
+local KCreateThreadStackSize = 4096
+local KSleepTime = 50
+
+-- Runs in a new thread (and therefore a new Lua state), so can't have upvalues
+local function workerMain(state, iterations)
+	require("test.syncTests").worker(state, iterations)
+end
+
+local function timeThreadCreation(n)
+	local state = newState()
+	local startTime = lupi.getUptime()
+	for i = 1, n do
+		lupi.createThreadWithStackSize(KCreateThreadStackSize, workerMain, state, 1)
+	end
+	local elapsed = (lupi.getUptime() - startTime):lo()
+	start(state)
+	local counter = waitForWorkers(state, n)
+	assert(counter == n, string.format("Counter is %d, expected %d", counter, n))
+	return elapsed
+end
+
+function main()
+	local state = newState()
+	for i = 1, KNumWorkers do
+		lupi.createThread(workerMain, state, KIterations)
+	end
+	-- Give the workers a chance to start waiting on the condvar
+	lupi.yield()
+	local startTime = lupi.getUptime()
+	start(state)
+	local counter, atomicCounter = waitForWorkers(state, KNumWorkers)
+	local elapsed = (lupi.getUptime() - startTime):lo()
+	local expected = KNumWorkers * KIterations
+	assert(counter == expected, string.format("Mutex-protected counter is %d, expected %d", counter, expected))
+	assert(atomicCounter == expected, string.format("Atomic counter is %d, expected %d", atomicCounter, expected))
+	printf("%d contended increments by %d threads took %d ms", expected, KNumWorkers, elapsed)
+
+	local ms = uncontended(KUncontendedIterations)
+	printf("%d uncontended lock/unlocks took %d ms", KUncontendedIterations, ms)
+
+	-- Every thread gets its own Lua state, so don't go mad on small devices
+	local n = math.min(lupi.getInt("MaxThreads") - 1, KMaxCreateThreads)
+	if lupi.getInt("TotalRam") < 1024*1024 then n = math.min(n, 8) end
+	for round = 1, 2 do
+		ms = timeThreadCreation(n)
+		printf("Creating %d threads took %d ms (round %d)", n, ms, round)
+		-- Let the workers finish exiting so their slots can be reused
+		lupi.yield()
+	end
+
+	local sleepStart = lupi.getUptime()
+	lupi.sleep(KSleepTime)
+	ms = (lupi.getUptime() - sleepStart):lo()
+	assert(ms >= KSleepTime, string.format("lupi.sleep(%d) only took %d ms", KSleepTime, ms))
+	printf("lupi.sleep(%d) took %d ms", KSleepTime, ms)
+
+	require "runloop"
+	local loop = runloop.current or runloop.new()
+	sleepStart = lupi.getUptime()
+	local numReqs = loop:waitForAnyRequest(KSleepTime)
+	ms = (lupi.getUptime() - sleepStart):lo()
+	assert(numReqs == 0, string.format("waitForAnyRequest returned %d, expected a timeout", numReqs))
+	assert(ms >= KSleepTime, string.format("waitForAnyRequest(%d) only took %d ms", KSleepTime, ms))
+	print("Sync tests passed")
+end
@@ -145,6 +145,8 @@ function init()
 		bmp:clear()
 	else
 		bmp = bitmap.create()
+		-- Only a few blocks move each tick, so don't resend the whole screen
+		bmp:setIncrementalBlit(true)
 		baseRotation = RotateTransform(90, bmp:rawWidth(), bmp:rawHeight())
 		input.registerInputObserver(buttonPressed, 4)
 		timers.init()
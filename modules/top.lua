@@ -0,0 +1,127 @@
+--[[**
+A `top`-style display of how much CPU time each process and thread is using,
+based on the kernel's per-thread accounting (see `lupi.getCpuStats()`). Run from
+the interpreter with:
+
+	require "top"
+	top.run()
+
+The display refreshes over the UART every second until a key is pressed. CPU
+percentages are relative to the refresh interval, so idle + dfcs + all the
+processes add up to 100%.
+]]
+
+require "runloop"
+local timers = require "timerserver.local"
+
+-- Must match enum ThreadState in k/inc/k.h
+local stateNames = {
+	[0] = "ready",
+	[1] = "blocked",
+	[2] = "dying",
+	[3] = "dead",
+	[4] = "waiting",
+	[5] = "futex",
+	[6] = "sleep",
+}
+
+local function key(rec)
+	if rec.process then
+		return string.format("%d:%s", rec.pid, rec.thread or "*")
+	else
+		return rec.name
+	end
+end
+
+local function percent(n, total)
+	if total == 0 then total = 1 end
+	return string.format("%3d.%d%%", n * 100 // total, (n * 1000 // total) % 10)
+end
+
+--[[**
+Returns a table mapping from a key identifying each record in
+`lupi.getCpuStats()` to that record, along with the array itself. Processes are
+identified by pid, so a new process reusing a process index is not confused
+with the old one.
+]]
+function sample()
+	local stats = lupi.getCpuStats()
+	local byKey = {}
+	for _, rec in ipairs(stats) do
+		byKey[key(rec)] = rec
+	end
+	return byKey, stats
+end
+
+--[[**
+Prints one screenful of stats, comparing `stats` with the sample `prev` (as
+returned by [sample()](#sample)) taken `interval` ms earlier.
+]]
+function display(prev, stats, interval)
+	-- The total is idle plus every process total, which excludes the per-thread records
+	local function delta(rec, member)
+		local p = prev[key(rec)]
+		return rec[member] - (p and p[member] or 0)
+	end
+	local total = 0
+	for _, rec in ipairs(stats) do
+		if not (rec.process and rec.thread) then
+			total = total + delta(rec, "runTime")
+		end
+	end
+
+	printf("\27[2J\27[HUptime: %d ms  Interval: %d ms  (press any key to exit)", lupi.getUptime():lo(), interval)
+	print("  PID TID STATE   PRI    CPU   TIME(ms) SWITCHES     SVCS  NAME")
+	for _, rec in ipairs(stats) do
+		local name = rec.name
+		if rec.thread then
+			name = string.format("  %s[%d]", rec.name, rec.thread)
+		end
+		printf("%5s %3s %-7s %3s %s %10d %8d %8d  %s",
+			rec.pid and tostring(rec.pid) or "-",
+			rec.thread and tostring(rec.thread) or "-",
+			rec.state and stateNames[rec.state] or "",
+			rec.priority and tostring(rec.priority) or "",
+			percent(delta(rec, "runTime"), total),
+			rec.runTime, delta(rec, "switches"), delta(rec, "svcs"), name)
+	end
+end
+
+--[[**
+Displays CPU usage every `interval` ms (default 1000). If `iterations` is
+specified, returns after that many refreshes, otherwise runs until a key is
+pressed. Must be called from a process with a run loop.
+]]
+function run(interval, iterations)
+	interval = interval or 1000
+	local stopper = {}
+	local prev = sample()
+	local count = 0
+
+	local function refresh()
+		if stopper.exit then return end
+		local byKey, stats = sample()
+		display(prev, stats, interval)
+		prev = byKey
+		count = count + 1
+		if iterations and count >= iterations then
+			stopper.exit = true
+		else
+			timers.after(refresh, interval)
+		end
+	end
+
+	local loop = runloop.current or runloop.new()
+	if not iterations then
+		-- Only take over the UART if we're going to need it to exit
+		local getchRequest = loop:newAsyncRequest({
+			completionFn = function()
+				stopper.exit = true
+			end,
+		})
+		loop:queue(getchRequest)
+		lupi.getch_async(getchRequest)
+	end
+	timers.after(refresh, interval)
+	loop:run(stopper)
+end
@@ -0,0 +1,119 @@
+--[[
+Tests for the animation encoder (build/animEncoder.lua) and the native decoder,
+run on the host with:
+
+	./build/build.lua bitmaphost
+	bin/bitmaphost testing/animTests.lua
+
+Some frames are made up, encoded, and then decoded a frame at a time into a
+bitmap, blitting only its dirty rects. After each frame the screen must match
+the same frame drawn pixel by pixel and blitted in full, which checks both the
+decoding and that the dirty rects cover everything that changed.
+]]
+
+require "bitmap"
+local anim = require "bitmap.anim"
+local encoder = require "animEncoder"
+
+local Colour = bitmap.Colour
+local KWidth, KHeight = 40, 30
+local KNumFrames = 12
+local KPalette = { 0x0000, 0xFFFF, 0xF800, 0x07E0, 0x001F, 0xF81F }
+
+local function makeFrames(format)
+	local frames = { width = KWidth, height = KHeight, format = format }
+	local seed = 1
+	for n = 1, KNumFrames do
+		local frame = {}
+		for y = 0, KHeight - 1 do
+			for x = 0, KWidth - 1 do
+				local v = 0
+				-- A square moving diagonally
+				if x >= n * 2 and x < n * 2 + 8 and y >= n and y < n + 8 then
+					v = 1
+				end
+				if format == encoder.FiveSixFive then
+					-- A gradient background, so literals get used too
+					v = (v == 1) and KPalette[n % #KPalette + 1] or ((x * 2) << 5) | y
+				end
+				frame[#frame + 1] = v
+			end
+		end
+		-- Noise in a corner every few frames, but leave two frames the same
+		if n % 4 == 1 and n ~= 1 then
+			for y = 20, 27 do
+				for x = 30, 37 do
+					seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF
+					frame[y * KWidth + x + 1] = (format == encoder.OneBit) and (seed >> 16) & 1 or (seed >> 8) & 0xFFFF
+				end
+			end
+		elseif n == 8 then
+			frame = frames[7]
+		end
+		frames[n] = frame
+	end
+	return frames
+end
+
+local function drawFrame(b, frames, n, x0, y0)
+	local fg, bg = b:getColour(), b:getBackgroundColour()
+	local frame = frames[n]
+	for y = 0, KHeight - 1 do
+		for x = 0, KWidth - 1 do
+			local v = frame[y * KWidth + x + 1]
+			if frames.format == encoder.OneBit then
+				v = (v == 1) and fg or bg
+			end
+			b:setColour(v)
+			b:drawRect(x0 + x, y0 + y, 1, 1)
+		end
+	end
+	b:setColour(fg)
+end
+
+local function test(name, format, rotation)
+	host.setScreen(96, 64, false)
+	local frames = makeFrames(format)
+	local data = encoder.encode(frames, 50)
+	local animation = anim.new(host.memBuf(data))
+	assert(animation.width == KWidth and animation.height == KHeight and animation.numFrames == KNumFrames)
+
+	local decoded, expected = bitmap.create(), bitmap.create()
+	for _, b in ipairs({ decoded, expected }) do
+		b:setRotation(rotation)
+		b:setColour(Colour.White)
+		b:setBackgroundColour(Colour.Blue)
+	end
+	local x, y = 7, 5
+	-- Play it through and then some, to check looping
+	for i = 1, KNumFrames + 3 do
+		if animation:finished() then animation:rewind() end
+		local n = animation.frame + 1
+		animation:drawNextFrame(decoded, x, y)
+		host.resetStats()
+		decoded:blit()
+		local got = host.checksum()
+		local bytes = host.stats()
+		if n == 8 then
+			assert(bytes == 0, name..": frame 8 is the same as frame 7 but blitted "..bytes.." bytes")
+		end
+
+		drawFrame(expected, frames, n, x, y)
+		expected:blit(0, 0, expected:rawWidth(), expected:rawHeight())
+		if got ~= host.checksum() then
+			error(string.format("%s: frame %d doesn't match", name, n))
+		end
+	end
+
+	-- Corrupt data must be caught rather than drawn
+	local ok = pcall(decoded.drawAnimFrame, decoded, host.memBuf(data:sub(1, 40)), 16, x, y)
+	assert(not ok, name..": truncated frame wasn't detected")
+
+	print(string.format("%s: %d frames in %d bytes", name, KNumFrames, #data))
+end
+
+test("onebit", encoder.OneBit, 0)
+test("onebit_rotated", encoder.OneBit, 90)
+test("rgb565", encoder.FiveSixFive, 0)
+test("rgb565_rotated", encoder.FiveSixFive, 270)
+print("All animation tests passed")
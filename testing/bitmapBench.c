@@ -0,0 +1,485 @@
+/**
+Host benchmark for the bitmap drawing primitives. Build and run with:
+
+	./build/build.lua bitmapbench
+	bin/bitmapbench [width height [packed]]
+
+By default runs everything at the Pi's 240x320 RGB565 screen size and then at
+the TiLDA's 128x64 column-packed one. Prints how many pixels per second each
+primitive manages, including the old per-pixel setPixelFn loops for comparison,
+and checks the optimised versions draw exactly the same pixels. Blits go to the
+fake screen driver in fakeScreen.c. bitmap.c is included directly so the static
+span functions can be timed on their own.
+*/
+
+#define _POSIX_C_SOURCE 199309L // For clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../modules/bitmap/bitmap.c"
+#include "fakeScreen.h"
+
+static int screenWidth;
+static int screenHeight;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef void (*BenchFn)(Bitmap* b);
+
+// Runs fn for about half a second and prints its rate
+static void bench(const char* name, Bitmap* b, BenchFn fn, uint64 pixelsPerCall) {
+	if (pixelsPerCall == 0) {
+		printf("%-32s %10s (doesn't fit)\n", name, "n/a");
+		return;
+	}
+	int iterations = 0;
+	fn(b); // Warm up
+	const double start = now();
+	double elapsed;
+	do {
+		for (int i = 0; i < 16; i++) fn(b);
+		iterations += 16;
+		elapsed = now() - start;
+	} while (elapsed < 0.5);
+	printf("%-32s %10.1f Mpixels/s\n", name, pixelsPerCall * iterations / elapsed / 1e6);
+}
+
+static uint16 nextColour = 0x1234;
+
+static void fill32(Bitmap* b) {
+	uint16* data = bitmap_getPixels(b);
+	const int w = bitmap_getWidth(b);
+	for (int y = 0; y < bitmap_getHeight(b); y++) {
+		fillSpan32(data + y * w, w, nextColour++);
+	}
+}
+
+static void fill64(Bitmap* b) {
+	uint16* data = bitmap_getPixels(b);
+	const int w = bitmap_getWidth(b);
+	for (int y = 0; y < bitmap_getHeight(b); y++) {
+		fillSpan64(data + y * w, w, nextColour++);
+	}
+}
+
+// What bitmap_drawRect used to do
+static void fillPerPixel(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	const uint16 col = nextColour++;
+	for (int y = 0; y < context.drawHeight; y++) {
+		for (int x = 0; x < context.drawWidth; x++) {
+			set_pixel(x, y, col);
+		}
+	}
+}
+
+static void drawRect(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	Rect r = rect_make(0, 0, context.drawWidth, context.drawHeight);
+	b->colour = nextColour++;
+	bitmap_drawRect(b, &r);
+}
+
+// The whole font, as many times as fits
+#define FOR_EACH_FONT_TILE(context, x, y) \
+	for (int y = 0; y + font_height <= context.drawHeight; y += font_height) \
+		for (int x = 0; x + font_width <= context.drawWidth; x += font_width)
+
+// What bitmap_drawXbmData used to do
+static void xbmPerPixel(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	const int stride = (font_width + 7) & ~7;
+	FOR_EACH_FONT_TILE(context, x, y) {
+		for (int yidx = 0; yidx < font_height; yidx++) {
+			for (int xidx = 0; xidx < font_width; xidx++) {
+				uint16 colour = getBit(font_bits, yidx * stride + xidx) ? b->colour : b->bgcolour;
+				set_pixel(x + xidx, y + yidx, colour);
+			}
+		}
+	}
+}
+
+static void drawXbm(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	Rect r = rect_make(0, 0, font_width, font_height);
+	FOR_EACH_FONT_TILE(context, x, y) {
+		bitmap_drawXbm(b, x, y, &r, font);
+	}
+}
+
+static uint64 fontTilePixels(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	return (uint64)(context.drawWidth / font_width) * font_width
+		* (context.drawHeight / font_height) * font_height;
+}
+
+// Unaligned source rect, so every byte of XBM straddles two
+static void drawXbmOffset(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	Rect r = rect_make(3, 0, font_width - 3, font_height);
+	FOR_EACH_FONT_TILE(context, x, y) {
+		bitmap_drawXbm(b, x, y, &r, font);
+	}
+}
+
+static const char* const KText = "The quick brown fox jumps over the lazy dog";
+
+static void drawText(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	Rect r;
+	bitmap_getTextRect(b, 1, &r);
+	for (int y = 0; y + r.h <= context.drawHeight; y += r.h) {
+		bitmap_drawText(b, 0, y, KText + (y / r.h) % 8);
+	}
+}
+
+static struct GlyphCache* glyphCache;
+
+static void drawTextWithCache(Bitmap* b) {
+	bitmap_setGlyphCache(b, glyphCache);
+	drawText(b);
+	bitmap_setGlyphCache(b, NULL);
+}
+
+// Checks text drawn from the glyph cache matches the XBM path, including the
+// partial characters at the edges
+static bool checkGlyphCache(Bitmap* b) {
+	const size_t size = datasize(bitmap_getWidth(b), bitmap_getHeight(b));
+	uint16* expected = malloc(size);
+	bool ok = true;
+	for (int font = 0; font < 2 && ok; font++) {
+		b->flags = font ? (b->flags | SmallFont) : (b->flags & ~SmallFont);
+		memset(b->data, 0, size);
+		drawText(b);
+		bitmap_drawText(b, 3, bitmap_getHeight(b) > bitmap_getWidth(b) ? 5 : 2, KText);
+		memcpy(expected, b->data, size);
+		memset(b->data, 0, size);
+		drawTextWithCache(b);
+		bitmap_setGlyphCache(b, glyphCache);
+		bitmap_drawText(b, 3, bitmap_getHeight(b) > bitmap_getWidth(b) ? 5 : 2, KText);
+		bitmap_setGlyphCache(b, NULL);
+		ok = memcmp(expected, b->data, size) == 0;
+	}
+	b->flags &= ~SmallFont;
+	if (screenHeight < 200) b->flags |= SmallFont;
+	free(expected);
+	return ok;
+}
+
+static uint64 textPixels(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	Rect r;
+	bitmap_getTextRect(b, 1, &r);
+	uint64 total = 0;
+	for (int y = 0; y + r.h <= context.drawHeight; y += r.h) {
+		// Characters are drawn even if they run off the end
+		total += strlen(KText + (y / r.h) % 8) * r.w * r.h;
+	}
+	return total;
+}
+
+// What bitmap_blitToScreen used to do for EOneBitColumnPacked screens
+static void packPerPixel(Bitmap* b) {
+	const int bwidth = bitmap_getWidth(b);
+	const int bheight = bitmap_getHeight(b) & ~7;
+	uint8* buf = (uint8*)b->data + datasize(bwidth, bitmap_getHeight(b));
+	const uint16* data = bitmap_getPixels(b);
+	for (int y = 0; y < bheight; y += 8) {
+		for (int x = 0; x < bwidth; x++) {
+			byte pageByte = 0;
+			for (int i = 0; i < 8; i++) {
+				if (data[(y+i)*bwidth + x] == BLACK) {
+					pageByte |= 1 << i;
+				}
+			}
+			buf[(y >> 3) * bwidth + x] = pageByte;
+		}
+	}
+}
+
+static void pack(Bitmap* b) {
+	const int bwidth = bitmap_getWidth(b);
+	uint8* buf = (uint8*)b->data + datasize(bwidth, bitmap_getHeight(b));
+	Rect r = rect_make(0, 0, bwidth, bitmap_getHeight(b) & ~7);
+	int first, last;
+	// Invalidate a column per page so there's always something to write back
+	for (int y = 0; y < r.h; y += 8) buf[(y >> 3) * bwidth] ^= 1;
+	packColumns(b, &r, buf, &first, &last);
+}
+
+// Checks packColumns() against the per-pixel conversion
+static bool checkPack(Bitmap* b) {
+	const int bwidth = bitmap_getWidth(b);
+	const int pagesSize = bwidth * (bitmap_getHeight(b) >> 3);
+	uint8* buf = (uint8*)b->data + datasize(bwidth, bitmap_getHeight(b));
+	uint16* data = bitmap_getPixels(b);
+	srand(1);
+	for (int i = 0; i < bwidth * bitmap_getHeight(b); i++) {
+		data[i] = (rand() & 1) ? BLACK : (uint16)rand(); // Any colour that isn't BLACK is white
+	}
+	packPerPixel(b);
+	uint8* expected = malloc(pagesSize);
+	memcpy(expected, buf, pagesSize);
+	memset(buf, 0, pagesSize);
+	pack(b);
+	bool ok = memcmp(expected, buf, pagesSize) == 0;
+	free(expected);
+	return ok;
+}
+
+// Draws random small rects and checks the dirty region covers every one of them
+// with disjoint rects. Prints how many bytes that saves over a single union rect.
+static bool checkDirtyRegion(Bitmap* b) {
+	const int w = bitmap_getWidth(b), h = bitmap_getHeight(b);
+	uint8* drawn = malloc(w * h);
+	uint64 regionBytes = 0, unionBytes = 0;
+	bool ok = true;
+	srand(2);
+	for (int frame = 0; frame < 200 && ok; frame++) {
+		memset(drawn, 0, w * h);
+		const int n = 1 + rand() % 8;
+		for (int i = 0; i < n; i++) {
+			Rect r = rect_make(rand() % w, rand() % h, 1 + rand() % 24, 1 + rand() % 16);
+			bitmap_drawRect(b, &r);
+			rect_clip(&r, &b->bounds);
+			for (int y = r.y; y < r.y + r.h; y++) memset(drawn + y * w + r.x, 1, r.w);
+		}
+		const DirtyRegion* d = &b->dirty;
+		ok = d->count > 0 && d->count <= KMaxDirtyRects;
+		for (int i = 0; i < d->count; i++) {
+			const Rect* r = &d->rects[i];
+			regionBytes += rect_area(r) * 2;
+			for (int j = i + 1; j < d->count; j++) {
+				if (rect_intersects(r, &d->rects[j])) ok = false;
+			}
+			for (int y = r->y; y < r->y + r->h; y++) memset(drawn + y * w + r->x, 0, r->w);
+		}
+		for (int i = 0; i < w * h; i++) {
+			if (drawn[i]) ok = false;
+		}
+		Rect u;
+		bitmap_getDirtyRect(b, &u);
+		unionBytes += rect_area(&u) * 2;
+		b->dirty.count = 0;
+	}
+	free(drawn);
+	printf("%-32s %10llu bytes/frame (union rect %llu)\n", "dirty region", regionBytes / 200, unionBytes / 200);
+	return ok;
+}
+
+static Bitmap* sprite;
+static const uint16 KSpriteKey = 0xF81F;
+
+// A 32x32 sprite which is about half transparent
+static Bitmap* makeSprite() {
+	Bitmap* sp = bitmap_construct(malloc(bitmap_getAllocSize(32, 32)), 32, 32);
+	uint16* data = bitmap_getPixels(sp);
+	for (int i = 0; i < 32 * 32; i++) {
+		data[i] = ((i / 5) & 1) ? KSpriteKey : (uint16)(i * 37);
+	}
+	sp->bgcolour = KSpriteKey;
+	return sp;
+}
+
+#define FOR_EACH_SPRITE_TILE(context, x, y) \
+	for (int y = -5; y + 32 <= context.drawHeight; y += 32) \
+		for (int x = -5; x + 32 <= context.drawWidth; x += 32)
+
+static void blitBitmapOpaque(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	const Rect r = rect_make(0, 0, 32, 32);
+	FOR_EACH_SPRITE_TILE(context, x, y) {
+		bitmap_blitBitmap(b, sprite, &r, x, y, 0);
+	}
+}
+
+static void blitBitmapTransparent(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	const Rect r = rect_make(0, 0, 32, 32);
+	FOR_EACH_SPRITE_TILE(context, x, y) {
+		bitmap_blitBitmap(b, sprite, &r, x, y, EBlitTransparent);
+	}
+}
+
+// The same, a pixel at a time through setPixelFn
+static void blitBitmapPerPixel(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	FOR_EACH_SPRITE_TILE(context, x, y) {
+		for (int yidx = 0; yidx < 32; yidx++) {
+			for (int xidx = 0; xidx < 32; xidx++) {
+				const uint16 col = getPixelRaw(sprite, bitmap_getWidth(sprite), xidx, yidx);
+				if (col != KSpriteKey && x + xidx >= 0 && y + yidx >= 0) {
+					set_pixel(x + xidx, y + yidx, col);
+				}
+			}
+		}
+	}
+}
+
+static uint64 spritePixels(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	uint64 total = 0;
+	FOR_EACH_SPRITE_TILE(context, x, y) total += 32 * 32;
+	return total;
+}
+
+// Checks the span version of a transparent blitBitmap against the per-pixel one
+static bool checkBlitBitmap(Bitmap* b) {
+	const size_t size = datasize(bitmap_getWidth(b), bitmap_getHeight(b));
+	uint16* expected = malloc(size);
+	memset(b->data, 0, size);
+	blitBitmapPerPixel(b);
+	memcpy(expected, b->data, size);
+	memset(b->data, 0, size);
+	blitBitmapTransparent(b);
+	bool ok = memcmp(expected, b->data, size) == 0;
+	free(expected);
+	return ok;
+}
+
+// Lines fanning out from the top left corner to every 8th point on the far edges
+#define FOR_EACH_FAN_LINE(context, x, y) \
+	for (int i = 0, x, y; i < context.drawWidth + context.drawHeight; i += 8) \
+		if (x = min(i, context.drawWidth - 1), y = max(0, i - context.drawWidth), y < context.drawHeight)
+
+static void drawLines(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	FOR_EACH_FAN_LINE(context, x, y) {
+		bitmap_drawLine(b, 0, 0, x, context.drawHeight - 1 - y);
+	}
+}
+
+static uint64 linePixels(Bitmap* b) {
+	DECLARE_CONTEXT(b);
+	uint64 total = 0;
+	FOR_EACH_FAN_LINE(context, x, y) {
+		total += max(x, context.drawHeight - 1 - y) + 1;
+	}
+	return total;
+}
+
+static void blitWhole(Bitmap* b) {
+	Rect r = rect_make(0, 0, bitmap_getWidth(b), bitmap_getHeight(b));
+	bitmap_blitToScreen(b, &r);
+}
+
+// A typical UI update: a couple of small changes in different places
+static void blitDirty(Bitmap* b) {
+	Rect r = rect_make(4, 4, 40, 16);
+	bitmap_drawRect(b, &r);
+	r = rect_make(bitmap_getWidth(b) - 44, bitmap_getHeight(b) - 20, 40, 16);
+	bitmap_drawRect(b, &r);
+	bitmap_blitDirtyToScreen(b);
+}
+
+static const struct {
+	const char* name;
+	int8 a, b, c, d;
+	bool tx, ty; // Whether to translate by the width or height
+} KRotations[] = {
+	{ "0", 1, 0, 0, 1, false, false },
+	{ "90", 0, -1, 1, 0, true, false },
+	{ "180", -1, 0, 0, -1, true, true },
+	{ "270", 0, 1, -1, 0, false, true },
+};
+
+static int runSuite(int width, int height, int format) {
+	screenWidth = width;
+	screenHeight = height;
+	fakeScreen_init(width, height, format);
+	// Always allow room for the packed buffer, even if the format is RGB565
+	const int packedSize = screenWidth * ((screenHeight + 7) >> 3);
+	Bitmap* b = bitmap_construct(malloc(bitmap_getAllocSize(screenWidth, screenHeight) + packedSize), screenWidth, screenHeight);
+	const uint64 area = (uint64)screenWidth * screenHeight;
+	printf("%dx%d %s\n", screenWidth, screenHeight, format == EOneBitColumnPacked ? "column packed" : "RGB565");
+
+	bench("fillSpan32", b, fill32, area);
+	bench("fillSpan64", b, fill64, area);
+	// Only bother with whole pages, which is what the TiLDA screen has
+	if ((screenHeight & 7) == 0) {
+		if (!checkPack(b)) {
+			printf("packColumns does not match per-pixel conversion!\n");
+			return 1;
+		}
+		bench("column pack per pixel", b, packPerPixel, area);
+		bench("column pack tiles", b, pack, area);
+	}
+	if (!checkDirtyRegion(b)) {
+		printf("Dirty region does not cover what was drawn!\n");
+		return 1;
+	}
+	bench("blitToScreen", b, blitWhole, area);
+	bench("blitDirtyToScreen", b, blitDirty, 2 * 40 * 16);
+	bitmap_setIncrementalBlit(b, true);
+	bench("blitDirtyToScreen incremental", b, blitDirty, 2 * 40 * 16);
+	bitmap_setIncrementalBlit(b, false);
+	sprite = makeSprite();
+	glyphCache = glyphCache_construct(malloc(glyphCache_getAllocSize()));
+	char name[64];
+	for (int i = 0; i < 4; i++) {
+		AffineTransform t = {
+			.a = KRotations[i].a, .b = KRotations[i].b,
+			.c = KRotations[i].c, .d = KRotations[i].d,
+			.tx = KRotations[i].tx ? screenWidth : 0,
+			.ty = KRotations[i].ty ? screenHeight : 0,
+		};
+		bitmap_setTransform(b, &t);
+		const char* rot = KRotations[i].name;
+		snprintf(name, sizeof(name), "drawRect per pixel %s", rot);
+		bench(name, b, fillPerPixel, area);
+		snprintf(name, sizeof(name), "drawRect %s", rot);
+		bench(name, b, drawRect, area);
+		snprintf(name, sizeof(name), "drawLine %s", rot);
+		bench(name, b, drawLines, linePixels(b));
+		snprintf(name, sizeof(name), "drawXbm per pixel %s", rot);
+		bench(name, b, xbmPerPixel, fontTilePixels(b));
+		snprintf(name, sizeof(name), "drawXbm %s", rot);
+		bench(name, b, drawXbm, fontTilePixels(b));
+		snprintf(name, sizeof(name), "drawXbm unaligned %s", rot);
+		bench(name, b, drawXbmOffset, fontTilePixels(b) * (font_width - 3) / font_width);
+		snprintf(name, sizeof(name), "drawText %s", rot);
+		bench(name, b, drawText, textPixels(b));
+		if (!checkGlyphCache(b)) {
+			printf("Cached text does not match drawXbm at %s degrees!\n", rot);
+			return 1;
+		}
+		snprintf(name, sizeof(name), "drawText cached %s", rot);
+		bench(name, b, drawTextWithCache, textPixels(b));
+		if (!checkBlitBitmap(b)) {
+			printf("blitBitmap does not match per-pixel drawing at %s degrees!\n", rot);
+			return 1;
+		}
+		snprintf(name, sizeof(name), "blitBitmap per pixel %s", rot);
+		bench(name, b, blitBitmapPerPixel, spritePixels(b));
+		snprintf(name, sizeof(name), "blitBitmap %s", rot);
+		bench(name, b, blitBitmapOpaque, spritePixels(b));
+		snprintf(name, sizeof(name), "blitBitmap transparent %s", rot);
+		bench(name, b, blitBitmapTransparent, spritePixels(b));
+	}
+	bitmap_setTransform(b, NULL);
+	free(sprite);
+	free(glyphCache);
+	free(b);
+	return 0;
+}
+
+static int benchMain(int argc, char* argv[]) {
+	if (argc >= 3) {
+		const bool packed = argc == 4 && strcmp(argv[3], "packed") == 0;
+		return runSuite(atoi(argv[1]), atoi(argv[2]), packed ? EOneBitColumnPacked : EFiveSixFive);
+	}
+	int err = runSuite(240, 320, EFiveSixFive);
+	if (!err) {
+		printf("\n");
+		err = runSuite(128, 64, EOneBitColumnPacked);
+	}
+	return err;
+}
+
+int main(int argc, char* argv[]) {
+	return fakeScreen_run(benchMain, argc, argv);
+}
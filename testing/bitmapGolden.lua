@@ -0,0 +1,181 @@
+--[[
+Golden image tests for the bitmap module, run on the host with:
+
+	./build/build.lua bitmaphost
+	bin/bitmaphost testing/bitmapGolden.lua [update]
+
+Each scene is drawn and blitted at the Pi and TiLDA screen sizes, and a checksum
+of what the fake screen received is compared with the expected value below.
+With `update`, the scenes are written to bin/golden/ as PPMs for inspection (the
+directory must already exist), and a new expected table is printed to paste in
+here after checking them.
+
+The expected values come from bin/bitmaphostref (`./build/build.lua
+bitmaphostref`), where the bitmap module draws everything a pixel at a time, so
+only ever run `update` under that. Running the test under both bitmaphost and
+bitmaphostref then checks the fast paths draw exactly what the per-pixel code
+does.
+]]
+
+require "bitmap"
+
+local Colour = bitmap.Colour
+
+local KScreens = {
+	{ name = "pi", w = 240, h = 320, packed = false },
+	{ name = "tilda", w = 128, h = 64, packed = true },
+}
+
+local function fills(b)
+	local w, h = b:width(), b:height()
+	b:setColour(Colour.Red)
+	b:drawRect(0, 0, w // 2, h // 2)
+	b:setColour(Colour.Green)
+	b:drawRect(w // 2, 0, w - w // 2, h // 2)
+	b:setColour(Colour.Blue)
+	b:drawRect(3, h // 2 + 1, w // 3, h // 4)
+	b:setColour(Colour.White)
+	b:drawBox(1, 1, w - 2, h - 2)
+end
+
+local function lines(b)
+	local w, h = b:width(), b:height()
+	b:setColour(Colour.White)
+	for i = 0, w + h, 12 do
+		local x = i < w and i or w - 1
+		local y = i < w and h - 1 or h - 1 - (i - w)
+		if y >= 0 then
+			b:drawLine(0, 0, x, y)
+			b:drawLine(w - 1, h - 1, w - 1 - x, h - 1 - y)
+		end
+	end
+end
+
+local function text(b)
+	b:setColour(Colour.White)
+	b:setBackgroundColour(Colour.Blue)
+	b:drawText("Hello, world!", 2, 2)
+	b:setColour(Colour.Black)
+	b:setBackgroundColour(Colour.White)
+	b:drawText("{0123} [xyz]", 5, 20)
+	local tw, th = b:getTextSize("Centred")
+	b:drawTextCentred("Centred", 0, b:height() - th - 2, b:width(), th)
+end
+
+local function xbm(b)
+	local font = host.fontXbm()
+	b:setColour(Colour.Purple)
+	b:setBackgroundColour(Colour.Black)
+	b:drawXbm(font, 0, 0)
+	b:setColour(Colour.White)
+	b:drawXbm(font, 7, b:height() // 2, 13, 3, 40, 20)
+end
+
+local function rotated(b)
+	for _, degrees in ipairs({ 0, 90, 180, 270 }) do
+		b:setRotation(degrees)
+		b:setColour(Colour.White)
+		b:setBackgroundColour(Colour.Black)
+		b:drawText(tostring(degrees), 2, 2)
+		b:setColour(Colour.Green)
+		b:drawRect(2, 14, 20, 4)
+		b:drawLine(2, 20, 30, 28)
+	end
+	b:setRotation(0)
+end
+
+local function sprites(b)
+	local sprite = bitmap.create(16, 16)
+	sprite:setBackgroundColour(Colour.Purple)
+	sprite:clear()
+	sprite:setColour(Colour.Red)
+	sprite:drawRect(4, 4, 8, 8)
+	sprite:setColour(Colour.White)
+	sprite:drawLine(0, 15, 15, 0)
+
+	b:setColour(Colour.Grey)
+	b:drawRect(0, 0, b:width(), b:height())
+	b:blitBitmap(sprite, 4, 4)
+	b:blitBitmap(sprite, 24, 4, true)
+	b:blitBitmap(sprite, -8, 30, true)
+	b:blitBitmap(sprite, b:width() - 10, 30, true, 2, 2, 12, 12)
+	b:setRotation(90)
+	b:blitBitmap(sprite, 44, 4, true)
+	b:setRotation(0)
+end
+
+-- Only the dirty rects are blitted, so this checks they cover everything drawn
+local function dirty(b)
+	b:blit()
+	b:setColour(Colour.White)
+	b:drawRect(1, 1, 5, 5)
+	b:drawRect(b:width() - 9, b:height() - 9, 8, 8)
+	b:drawLine(10, 30, 40, 33)
+	b:drawText("dirty", 20, 10)
+end
+
+local KScenes = {
+	{ "fills", fills },
+	{ "lines", lines },
+	{ "text", text },
+	{ "xbm", xbm },
+	{ "rotated", rotated },
+	{ "sprites", sprites },
+	{ "dirty", dirty, dirtyOnly = true },
+}
+
+local KExpected = {
+	fills_pi = "ce4ee0ea",
+	lines_pi = "01bf453d",
+	text_pi = "b5cb35d4",
+	xbm_pi = "92da0032",
+	rotated_pi = "1bafc9c3",
+	sprites_pi = "96755164",
+	dirty_pi = "0e809233",
+	fills_tilda = "a792ba85",
+	lines_tilda = "b7d1476b",
+	text_tilda = "3b8b4fac",
+	xbm_tilda = "9db41f38",
+	rotated_tilda = "f6b7a0fd",
+	sprites_tilda = "1f116dc5",
+	dirty_tilda = "c2635d2f",
+}
+
+local update = arg[1] == "update"
+local results = {}
+local failures = 0
+for _, screen in ipairs(KScreens) do
+	for _, scene in ipairs(KScenes) do
+		local name = scene[1].."_"..screen.name
+		host.setScreen(screen.w, screen.h, screen.packed)
+		local b = bitmap.create()
+		b:setColour(Colour.Black)
+		b:setBackgroundColour(Colour.Black)
+		scene[2](b)
+		if scene.dirtyOnly then
+			b:blit()
+		else
+			b:blit(0, 0, b:rawWidth(), b:rawHeight())
+		end
+		local sum = string.format("%08x", host.checksum())
+		results[#results + 1] = { name, sum }
+		if update then
+			host.writePpm("bin/golden/"..name..".ppm")
+		elseif KExpected[name] ~= sum then
+			print(string.format("FAIL %s: got %s expected %s", name, sum, tostring(KExpected[name])))
+			failures = failures + 1
+		end
+	end
+end
+
+if update then
+	print("local KExpected = {")
+	for _, result in ipairs(results) do
+		print(string.format('\t%s = "%s",', result[1], result[2]))
+	end
+	print("}")
+elseif failures > 0 then
+	error(string.format("%d of %d golden images did not match", failures, #results))
+else
+	print(string.format("All %d golden images match", #results))
+end
@@ -0,0 +1,228 @@
+/**
+Runs a Lua script on the host with the bitmap module and its Lua bindings,
+drawing to the fake screen driver in fakeScreen.c. Build and run from the top of
+the source tree (modules are loaded from their source files) with:
+
+	./build/build.lua bitmaphost
+	bin/bitmaphost [-s <width>x<height>] [-p] script.lua [args...]
+
+The screen defaults to 240x320 RGB565, `-p` makes it column packed like the
+TiLDA's. The script is run as a module, so it can `require "bitmap"` as normal,
+and gets `arg` as a global array of the remaining arguments. There is also a
+`host` global with the following functions:
+
+* `host.setScreen(width, height, packed)`: Reconfigures the fake screen, and
+  clears it. Only affects bitmaps created afterwards.
+* `host.checksum()`: Returns a hash of the framebuffer contents.
+* `host.writePpm(path)`: Writes the framebuffer to a PPM file.
+* `host.stats()`: Returns the number of bytes and the number of blits the
+  screen driver has received since the last `host.resetStats()`.
+* `host.resetStats()`
+* `host.clock()`: Returns a monotonic time in microseconds.
+* `host.fontXbm()`: Returns the large font as an XBM MemBuf, for drawXbm().
+* `host.memBuf(string)`: Returns a new MemBuf containing a copy of `string`.
+
+The animation encoder is available as the `animEncoder` module, and so is the
+Lua function profiler. See testing/bitmapGolden.lua for the golden image tests,
+testing/animTests.lua for the animation ones, testing/profilerTests.lua for the
+profiler's, and testing/sharedBitmapTests.lua for `Bitmap.fromBuffer()`'s.
+*/
+
+#define _POSIX_C_SOURCE 199309L // For clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include <lupi/exec.h>
+#include <lupi/membuf.h>
+#include <lupi/module.h>
+#include <lupi/runloop.h>
+#include "fakeScreen.h"
+#include "../modules/bitmap/font.xbm"
+
+int init_module_bitmap_bitmap(lua_State* L);
+int init_module_membuf_membuf(lua_State* L);
+int init_module_int64(lua_State* L);
+int init_module_profiler_profiler(lua_State* L);
+lua_State* newLuaStateForModule(const char* moduleName, lua_State* L);
+int traceback_lua(lua_State* L);
+
+static const struct {
+	const char* name;
+	const char* path;
+	lua_CFunction nativeInit;
+} KModules[] = {
+	{ "misc", "modules/misc.lua", NULL },
+	{ "oo", "modules/oo.lua", NULL },
+	{ "int64", "modules/int64.lua", init_module_int64 },
+	{ "membuf", "modules/membuf/membuf.lua", init_module_membuf_membuf },
+	{ "bitmap", "modules/bitmap/bitmap.lua", init_module_bitmap_bitmap },
+	{ "bitmap.transform", "modules/bitmap/transform.lua", NULL },
+	{ "bitmap.anim", "modules/bitmap/anim.lua", NULL },
+	{ "animEncoder", "build/animEncoder.lua", NULL },
+	{ "profiler", "modules/profiler/profiler.lua", init_module_profiler_profiler },
+	{ "main", NULL, NULL }, // The script, path filled in by main
+};
+#define KNumModules (sizeof(KModules) / sizeof(KModules[0]))
+
+static const char* scriptPath;
+static LuaModule loadedModules[KNumModules];
+
+static char* readFile(const char* path, int* size) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* data = malloc(*size);
+	if (fread(data, 1, *size, f) != (size_t)*size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+// Instead of the table of compiled-in modules, read them from the source tree
+const LuaModule* getLuaModule(const char* moduleName) {
+	for (int i = 0; i < KNumModules; i++) {
+		if (strcmp(moduleName, KModules[i].name) != 0) continue;
+		LuaModule* module = &loadedModules[i];
+		if (!module->data) {
+			const char* path = KModules[i].path ? KModules[i].path : scriptPath;
+			char* data = readFile(path, &module->size);
+			if (!data) {
+				fprintf(stderr, "Couldn't read %s\n", path);
+				return NULL;
+			}
+			module->name = KModules[i].name;
+			module->nativeInit = KModules[i].nativeInit;
+			module->data = data;
+		}
+		return module;
+	}
+	return NULL;
+}
+
+// uklua.c wants these when MALLOC_AVAILABLE, but they're only for dlmalloc stats
+void malloc_inspect_all(void(*handler)(void*, void *, size_t, void*), void* arg) {
+}
+
+// There's no run loop on the host, so Bitmap:blitAsync() can't be used
+AsyncRequest* runloop_checkRequestPending(lua_State* L, int idx) {
+	luaL_error(L, "Run loops aren't supported by bitmaphost");
+	return NULL;
+}
+
+static int setScreen(lua_State* L) {
+	int w = luaL_checkint(L, 1);
+	int h = luaL_checkint(L, 2);
+	fakeScreen_init(w, h, lua_toboolean(L, 3) ? EOneBitColumnPacked : EFiveSixFive);
+	return 0;
+}
+
+static int checksum(lua_State* L) {
+	lua_pushinteger(L, fakeScreen_checksum());
+	return 1;
+}
+
+static int writePpm(lua_State* L) {
+	const char* path = luaL_checkstring(L, 1);
+	if (!fakeScreen_writePpm(path)) {
+		return luaL_error(L, "Couldn't write %s", path);
+	}
+	return 0;
+}
+
+static int stats(lua_State* L) {
+	uint64 bytes;
+	uint32 blits;
+	fakeScreen_getStats(&bytes, &blits);
+	lua_pushinteger(L, bytes);
+	lua_pushinteger(L, blits);
+	return 2;
+}
+
+static int resetStats(lua_State* L) {
+	fakeScreen_resetStats();
+	return 0;
+}
+
+static int hostClock(lua_State* L) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushinteger(L, (lua_Integer)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	return 1;
+}
+
+static int fontXbm(lua_State* L) {
+	mbuf_newXbm(L, font);
+	return 1;
+}
+
+static int memBuf(lua_State* L) {
+	size_t len;
+	const char* str = luaL_checklstring(L, 1, &len);
+	MemBuf* buf = mbuf_new(L, NULL, len, NULL);
+	memcpy(buf->ptr, str, len);
+	return 1;
+}
+
+static int hostMain(int argc, char* argv[]) {
+	int width = 240, height = 320;
+	bool packed = false;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) break;
+		} else if (strcmp(argv[i], "-p") == 0) {
+			packed = true;
+		} else {
+			break;
+		}
+	}
+	if (i >= argc || argv[i][0] == '-') {
+		fprintf(stderr, "Syntax: bitmaphost [-s <width>x<height>] [-p] script.lua [args...]\n");
+		return 1;
+	}
+	scriptPath = argv[i++];
+	fakeScreen_init(width, height, packed ? EOneBitColumnPacked : EFiveSixFive);
+
+	lua_State* L = newLuaStateForModule(NULL, NULL);
+	luaL_Reg fns[] = {
+		{ "setScreen", setScreen },
+		{ "checksum", checksum },
+		{ "writePpm", writePpm },
+		{ "stats", stats },
+		{ "resetStats", resetStats },
+		{ "clock", hostClock },
+		{ "fontXbm", fontXbm },
+		{ "memBuf", memBuf },
+		{ NULL, NULL }
+	};
+	luaL_newlib(L, fns);
+	lua_setglobal(L, "host");
+	lua_createtable(L, argc - i, 0);
+	for (int n = 1; i < argc; i++, n++) {
+		lua_pushstring(L, argv[i]);
+		lua_rawseti(L, -2, n);
+	}
+	lua_setglobal(L, "arg");
+
+	lua_pushcfunction(L, traceback_lua);
+	lua_getglobal(L, "require");
+	lua_pushliteral(L, "main");
+	int err = lua_pcall(L, 1, 0, -3);
+	if (err) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+	}
+	lua_close(L);
+	return err ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+	return fakeScreen_run(hostMain, argc, argv);
+}
@@ -0,0 +1,214 @@
+/**
+A stand-in for the SCRN driver, so that the bitmap module can run on the host.
+Blits are copied into an in-memory framebuffer in the screen's native format, as
+the Pi and TiLDA drivers would send them to the hardware. The result can be
+checksummed or written out as a PPM.
+
+The driver ABI passes pointers as 32-bit words, so everything the bitmap code
+hands to exec_driverCmd() must be in the bottom 4GB. On Linux, fakeScreen_run()
+arranges that by running the program on a MAP_32BIT stack, and by stopping
+malloc from using anything except the brk heap. The program must be linked
+with -no-pie.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <lupi/exec.h>
+#include <lupi/ipc.h>
+#include <lupi/runloop.h>
+#include "fakeScreen.h"
+
+static struct {
+	int width;
+	int height;
+	int format; // a ScreenBufferFormat
+	uint8* fb;
+	uint64 bytes;
+	uint32 blits;
+} screen;
+
+static int framebufferSize() {
+	if (screen.format == EOneBitColumnPacked) {
+		return screen.width * ((screen.height + 7) >> 3);
+	} else {
+		return screen.width * screen.height * 2;
+	}
+}
+
+void fakeScreen_init(int width, int height, int format) {
+	free(screen.fb);
+	screen.width = width;
+	screen.height = height;
+	screen.format = format;
+	screen.fb = calloc(1, framebufferSize());
+	fakeScreen_resetStats();
+}
+
+const uint8* fakeScreen_getFramebuffer(void) {
+	return screen.fb;
+}
+
+// Returns the pixel as RGB565, whatever the format
+uint16 fakeScreen_getPixel(int x, int y) {
+	if (screen.format == EOneBitColumnPacked) {
+		const uint8 page = screen.fb[(y >> 3) * screen.width + x];
+		return (page & (1 << (y & 7))) ? 0 : 0xFFFF;
+	} else {
+		// Big-endian, as the panel expects
+		const uint8* p = screen.fb + (y * screen.width + x) * 2;
+		return (p[0] << 8) | p[1];
+	}
+}
+
+// FNV-1a of the framebuffer, for comparing against golden images
+uint32 fakeScreen_checksum(void) {
+	uint32 hash = 2166136261u;
+	const int size = framebufferSize();
+	for (int i = 0; i < size; i++) {
+		hash = (hash ^ screen.fb[i]) * 16777619u;
+	}
+	return hash;
+}
+
+bool fakeScreen_writePpm(const char* path) {
+	FILE* f = fopen(path, "wb");
+	if (!f) return false;
+	fprintf(f, "P6\n%d %d\n255\n", screen.width, screen.height);
+	for (int y = 0; y < screen.height; y++) {
+		for (int x = 0; x < screen.width; x++) {
+			const uint16 col = fakeScreen_getPixel(x, y);
+			const uint8 rgb[3] = {
+				((col >> 11) & 0x1F) * 255 / 31,
+				((col >> 5) & 0x3F) * 255 / 63,
+				(col & 0x1F) * 255 / 31,
+			};
+			fwrite(rgb, 1, sizeof(rgb), f);
+		}
+	}
+	return fclose(f) == 0;
+}
+
+void fakeScreen_getStats(uint64* bytes, uint32* blits) {
+	*bytes = screen.bytes;
+	*blits = screen.blits;
+}
+
+void fakeScreen_resetStats(void) {
+	screen.bytes = 0;
+	screen.blits = 0;
+}
+
+int exec_getInt(ExecGettableValue val) {
+	switch (val) {
+		case EValScreenWidth: return screen.width;
+		case EValScreenHeight: return screen.height;
+		case EValScreenFormat: return screen.format;
+		default: return 0;
+	}
+}
+
+int exec_driverConnect(uint32 driverId) {
+	return driverId == FOURCC("SCRN") ? 1 : 0;
+}
+
+// Same checks and format as the real drivers, see build/pi/pitft.c and build/tilda/lcd.c
+static void doBlit(const uint32* op) {
+	// { dataPtr, bitmapWidth, screenx, screeny, x, y, w, h, asyncRequest }
+	const uint8* data = (const uint8*)(uintptr)op[0];
+	const int bwidth = op[1];
+	const int screenx = op[2];
+	const int screeny = op[3];
+	const int x = op[4];
+	const int y = op[5];
+	const int w = op[6];
+	const int h = op[7];
+	if (screenx + w > screen.width || screeny + h > screen.height) {
+		fprintf(stderr, "Blit of %dx%d to %d,%d is off the screen\n", w, h, screenx, screeny);
+		abort();
+	}
+	screen.blits++;
+	if (screen.format == EOneBitColumnPacked) {
+		// y and h are multiples of 8, one byte per column per page
+		for (int page = 0; page < h >> 3; page++) {
+			memcpy(screen.fb + ((screeny >> 3) + page) * screen.width + screenx,
+				data + ((y >> 3) + page) * bwidth + x, w);
+			screen.bytes += w;
+		}
+	} else {
+		for (int i = 0; i < h; i++) {
+			memcpy(screen.fb + ((screeny + i) * screen.width + screenx) * 2,
+				data + ((y + i) * bwidth + x) * 2, w * 2);
+			screen.bytes += w * 2;
+		}
+	}
+}
+
+int exec_driverCmd(uint32 driverHandle, uint32 arg1, uint32 arg2) {
+	const uint32* op = (const uint32*)(uintptr)arg2;
+	switch (arg1) {
+		case KExecDriverScreenBlit:
+			doBlit(op);
+			return 0;
+		case KExecDriverScreenBlitAsync: {
+			// Like TiLDA, complete it straight away
+			AsyncRequest* req = (AsyncRequest*)(uintptr)op[8];
+			if (op[6] && op[7]) doBlit(op);
+			req->result = 0;
+			req->flags = KAsyncFlagPending | KAsyncFlagCompleted | KAsyncFlagIntResult;
+			return 0;
+		}
+		default:
+			return -1;
+	}
+}
+
+typedef struct MainArgs {
+	int (*mainFn)(int, char**);
+	int argc;
+	char** argv;
+	int result;
+} MainArgs;
+
+static void* mainThread(void* ptr) {
+	MainArgs* args = (MainArgs*)ptr;
+	int dummy;
+	void* heap = malloc(256 * 1024);
+	if ((uintptr)&dummy >> 32 || (uintptr)heap >> 32) {
+		fprintf(stderr, "Couldn't get memory below 4GB, was this linked with -no-pie?\n");
+		args->result = 1;
+	} else {
+		free(heap);
+		args->result = args->mainFn(args->argc, args->argv);
+	}
+	return NULL;
+}
+
+// Calls mainFn on a thread whose stack and heap are both addressable with 32 bits
+int fakeScreen_run(int (*mainFn)(int, char**), int argc, char* argv[]) {
+	// Only the main arena uses brk, the others (and big allocations) are mmapped anywhere
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_MMAP_MAX, 0);
+	const size_t stackSize = 8 * 1024 * 1024;
+	void* stack = mmap(NULL, stackSize, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (stack == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	MainArgs args = { mainFn, argc, argv, 0 };
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, stackSize);
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, mainThread, &args) != 0) {
+		fprintf(stderr, "Couldn't create main thread\n");
+		return 1;
+	}
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+	munmap(stack, stackSize);
+	return args.result;
+}
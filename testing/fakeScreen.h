@@ -0,0 +1,15 @@
+#ifndef LUPI_TESTING_FAKESCREEN_H
+#define LUPI_TESTING_FAKESCREEN_H
+
+#include <stdio.h>
+
+void fakeScreen_init(int width, int height, int format);
+const uint8* fakeScreen_getFramebuffer(void);
+uint16 fakeScreen_getPixel(int x, int y);
+uint32 fakeScreen_checksum(void);
+bool fakeScreen_writePpm(const char* path);
+void fakeScreen_getStats(uint64* bytes, uint32* blits);
+void fakeScreen_resetStats(void);
+int fakeScreen_run(int (*mainFn)(int, char**), int argc, char* argv[]);
+
+#endif
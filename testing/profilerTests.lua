@@ -0,0 +1,101 @@
+--[[
+Tests for the Lua function profiler (modules/profiler), run on the host with:
+
+	./build/build.lua bitmaphost
+	bin/bitmaphost testing/profilerTests.lua
+
+Nothing here needs a screen, bitmaphost is just a convenient way of running
+native modules. Instruction counts depend on the compiler, so only call counts
+are checked exactly and costs are checked relative to each other.
+]]
+
+require "profiler"
+
+local function leaf(n)
+	local x = 0
+	for i = 1, n do x = x + i end
+	return x
+end
+
+local function caller(n)
+	-- Does about as much work itself as its callee
+	local y = leaf(n)
+	for i = 1, n do y = y - i end
+	return y
+end
+
+local function fib(n)
+	if n < 2 then return n end
+	return fib(n - 1) + fib(n - 2)
+end
+
+local function failing()
+	leaf(10)
+	error("expected")
+end
+
+local function find(r, name)
+	local found
+	for _, fn in ipairs(r) do
+		if fn.name == name then
+			assert(not found, "Duplicate entry for "..name)
+			found = fn
+		end
+	end
+	return assert(found, "No entry for "..name)
+end
+
+local function nameOf(fn)
+	local info = debug.getinfo(fn, "S")
+	return info.short_src:sub(-27)..":"..info.linedefined
+end
+
+assert(profiler.results() == nil, "No results before the first run")
+
+profiler.start(nil, 1)
+for i = 1, 10 do caller(1000) end
+fib(10)
+for i = 1, 3 do pcall(failing) end
+local co = coroutine.wrap(function()
+	leaf(100)
+	coroutine.yield()
+	leaf(100)
+end)
+co()
+co()
+assert(not pcall(profiler.results), "results() should error while running")
+profiler.stop()
+
+local r = profiler.results()
+assert(r.missedFunctions == 0 and r.missedFrames == 0)
+local leafStats, callerStats = find(r, nameOf(leaf)), find(r, nameOf(caller))
+local fibStats, failingStats = find(r, nameOf(fib)), find(r, nameOf(failing))
+-- 10 from caller, 3 from failing, 2 from the coroutine
+assert(leafStats.calls == 15, "leaf called "..leafStats.calls.." times")
+assert(callerStats.calls == 10)
+assert(fibStats.calls == 177, "fib called "..fibStats.calls.." times") -- fib(10) makes 177 calls
+assert(failingStats.calls == 3)
+
+for _, fn in ipairs(r) do
+	assert(fn.exclusive <= fn.inclusive or fn.inclusive == 0,
+		fn.name.." has more exclusive than inclusive cost")
+	assert(fn.inclusive <= r.total, fn.name.." has more inclusive cost than the total")
+end
+assert(callerStats.inclusive >= callerStats.exclusive + leafStats.exclusive // 2)
+-- Roughly half each, allowing plenty of slack for the loop setup
+assert(callerStats.exclusive * 3 >= callerStats.inclusive and callerStats.exclusive * 3 <= callerStats.inclusive * 2,
+	string.format("caller: exclusive %d inclusive %d", callerStats.exclusive, callerStats.inclusive))
+-- Recursion is only charged once, otherwise fib's inclusive cost would be many
+-- times the total (which the loop above checks it isn't)
+assert(fibStats.exclusive > 0 and fibStats.inclusive >= fibStats.exclusive)
+
+-- A new run starts from scratch, and a full table is counted rather than crashing
+profiler.start(2, 1)
+leaf(10); caller(10); fib(3)
+profiler.stop()
+r = profiler.results()
+assert(#r <= 2, "Expected at most 2 functions, got "..#r)
+assert(r.missedFunctions > 0)
+
+profiler.report("calls", 3)
+print("All profiler tests passed")
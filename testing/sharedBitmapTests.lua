@@ -0,0 +1,49 @@
+--[[
+Tests for bitmaps shared between processes (see `Bitmap.fromBuffer()`), run on
+the host with:
+
+	./build/build.lua bitmaphost
+	bin/bitmaphost testing/sharedBitmapTests.lua
+
+A compositor surface's header is in memory the client can write to at any time,
+so after the server has opened it the client mustn't be able to change what size
+the server thinks it is. This draws a surface, composites it, then scribbles
+over the size in its header and checks the composited result doesn't change.
+]]
+
+require "bitmap"
+
+local Bitmap = bitmap.Bitmap
+local KWidth, KHeight = 24, 16
+-- Bitmap starts with its bounds Rect, whose w and h are the uint16s at 4 and 6
+local KSizeOffset = 4
+
+local buf = host.memBuf(string.rep("\0", Bitmap.getAllocSize(KWidth, KHeight)))
+local surface = Bitmap.createInBuffer(buf, KWidth, KHeight)
+surface:setColour(0xF800)
+surface:drawRect(0, 0, KWidth, KHeight)
+surface:setColour(0x001F)
+surface:drawLine(0, 0, KWidth - 1, KHeight - 1)
+
+local shared = Bitmap.fromBuffer(buf)
+assert(shared:rawWidth() == KWidth and shared:rawHeight() == KHeight)
+
+local screen = Bitmap.create()
+local function composite(src)
+	screen:setColour(0xFFFF)
+	screen:drawRect(0, 0, screen:width(), screen:height())
+	screen:blitBitmap(src, 10, 10)
+	screen:blit()
+	return host.checksum()
+end
+
+local expected = composite(shared)
+
+buf:setInt(KSizeOffset, 0x7FFF7FFF)
+assert(shared:rawWidth() == KWidth and shared:rawHeight() == KHeight,
+	"Shared bitmap's size changed with its header")
+assert(shared:width() == KWidth and shared:height() == KHeight)
+assert(composite(shared) == expected, "Blit used the size from the shared header")
+assert(not pcall(Bitmap.fromBuffer, buf), "A header bigger than the MemBuf should be rejected")
+
+print("All shared bitmap tests passed")
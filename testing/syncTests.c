@@ -0,0 +1,110 @@
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lupi/sync.h>
+
+uint64 exec_getUptime();
+void exec_threadYield();
+
+typedef struct SyncTestState {
+	Mutex lock;
+	CondVar started;
+	Semaphore finished;
+	bool go; // Protected by lock
+	uint32 counter; // Protected by lock
+	uint32 atomicCounter; // Only modified with sync_add()
+} SyncTestState;
+
+#define KYieldInterval 64
+
+static SyncTestState* checkState(lua_State* L, int idx) {
+	luaL_checktype(L, idx, LUA_TLIGHTUSERDATA);
+	return (SyncTestState*)lua_touserdata(L, idx);
+}
+
+// Returns a pointer to a zeroed SyncTestState as a lightuserdata, so it can be
+// passed to lupi.createThread(). It is anchored in the registry and never freed.
+static int newState(lua_State* L) {
+	SyncTestState* s = (SyncTestState*)lua_newuserdata(L, sizeof(SyncTestState));
+	memset(s, 0, sizeof(SyncTestState));
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushlightuserdata(L, s);
+	return 1;
+}
+
+// Runs in each worker thread. Waits for start() then increments both counters
+// `iterations` times, periodically yielding while holding the lock so that the
+// other workers have to block on it.
+static int worker(lua_State* L) {
+	SyncTestState* s = checkState(L, 1);
+	int iterations = luaL_checkint(L, 2);
+
+	mutex_lock(&s->lock);
+	while (!s->go) {
+		condvar_wait(&s->started, &s->lock);
+	}
+	mutex_unlock(&s->lock);
+
+	for (int i = 0; i < iterations; i++) {
+		mutex_lock(&s->lock);
+		uint32 val = s->counter;
+		if ((i % KYieldInterval) == 0) {
+			exec_threadYield();
+		}
+		s->counter = val + 1;
+		mutex_unlock(&s->lock);
+		sync_add(&s->atomicCounter, 1);
+	}
+	semaphore_signal(&s->finished);
+	return 0;
+}
+
+static int start(lua_State* L) {
+	SyncTestState* s = checkState(L, 1);
+	mutex_lock(&s->lock);
+	s->go = true;
+	condvar_broadcast(&s->started);
+	mutex_unlock(&s->lock);
+	return 0;
+}
+
+// Blocks until `numWorkers` workers have finished and returns the two counters
+static int waitForWorkers(lua_State* L) {
+	SyncTestState* s = checkState(L, 1);
+	int numWorkers = luaL_checkint(L, 2);
+	for (int i = 0; i < numWorkers; i++) {
+		semaphore_wait(&s->finished);
+	}
+	luaL_argcheck(L, !semaphore_tryWait(&s->finished), 2, "more workers finished than expected");
+	mutex_lock(&s->lock);
+	lua_pushinteger(L, s->counter);
+	mutex_unlock(&s->lock);
+	lua_pushinteger(L, s->atomicCounter);
+	return 2;
+}
+
+// Returns how many ms `n` uncontended lock/unlock pairs take
+static int uncontended(lua_State* L) {
+	int n = luaL_checkint(L, 1);
+	Mutex m = { 0 };
+	uint64 startTime = exec_getUptime();
+	for (int i = 0; i < n; i++) {
+		mutex_lock(&m);
+		mutex_unlock(&m);
+	}
+	lua_pushinteger(L, (int)(exec_getUptime() - startTime));
+	return 1;
+}
+
+int init_module_test_syncTests(lua_State* L) {
+	luaL_Reg fns[] = {
+		{ "newState", newState },
+		{ "worker", worker },
+		{ "start", start },
+		{ "waitForWorkers", waitForWorkers },
+		{ "uncontended", uncontended },
+		{ NULL, NULL }
+	};
+	luaL_setfuncs(L, fns, 0);
+	return 0;
+}
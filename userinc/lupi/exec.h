@@ -33,6 +33,22 @@
 #define KExecReplaceProcess		24
 
 #define KExecGetString			25
+#define KExecTraceControl		26
+#define KExecProfilerControl	27
+#define KExecGetCpuStats		28
+
+#define KExecFutexWait			29
+#define KExecFutexWake			30
+#define KExecSetThreadPriority	31
+#define KExecSleep				32
+#define KExecWaitForAnyRequestTimeout	33
+#define KExecGrantSharedPages	34
+#define KExecCheckSharedPages	35
+
+// Higher priority threads always run in preference to lower ones
+#define KThreadPriorityLowest	0
+#define KThreadPriorityDefault	2
+#define KThreadPriorityHighest	7
 
 typedef enum {
 	EValTotalRam,
@@ -41,8 +57,31 @@ typedef enum {
 	EValScreenHeight,
 	EValScreenFormat,
 	EValVersion,
+	EValMaxSchedulingLatency, // in us, KErrNotSupported if not measured
+	EValMaxThreads, // Per process, including the main thread
 } ExecGettableValue;
 
+typedef enum {
+	EProfilerStop = 0,
+	EProfilerStart = 1,
+	EProfilerDump = 2,
+} ProfilerCommand;
+
+#define KCpuStatsNoProcess		0xFF // processIdx for idle time and the DFC thread
+#define KCpuStatsProcessTotal	0xFF // threadIdx for a process's totals
+
+typedef struct ExecCpuStats {
+	uint64 runTime; // in us
+	uint32 numSwitches;
+	uint32 numSvcs;
+	uint32 pid;
+	uint8 processIdx;
+	uint8 threadIdx;
+	uint8 state; // ThreadState
+	uint8 priority; // Including anything inherited, zero if no priorities
+	char name[32];
+} ExecCpuStats;
+
 typedef enum {
 	EFiveSixFive,
 	EOneBitColumnPacked,
@@ -50,6 +89,7 @@ typedef enum {
 
 #define KExecDriverScreenBlit		0
 #define KExecDriverInputRequest	1
+#define KExecDriverScreenBlitAsync	2
 
 typedef enum {
 	InputTouchUp = 0,
@@ -0,0 +1,48 @@
+#ifndef LUPI_SYNC_H
+#define LUPI_SYNC_H
+
+#include <stddef.h>
+
+/**
+Synchronisation primitives for threads in the same process. They are built on
+sync_cmpxchg() and only call into the kernel (via KExecFutexWait and
+KExecFutexWake) when a thread actually has to block or be woken. All of them are
+initialised by zeroing, so they can be put in BSS or a calloc'd struct without
+further setup.
+*/
+
+typedef struct Mutex {
+	uint32 state; // 0 = unlocked, 1 = locked, 2 = locked and there may be waiters
+} Mutex;
+
+typedef struct CondVar {
+	uint32 seq; // Incremented on every signal, this is the futex word
+	uint32 numWaiters;
+} CondVar;
+
+typedef struct Semaphore {
+	uint32 count; // This is the futex word
+	uint32 numWaiters;
+} Semaphore;
+
+int exec_futexWait(uint32* addr, uint32 expected);
+int exec_futexWake(uint32* addr, int count);
+
+uint32 sync_cmpxchg(uint32* ptr, uint32 expected, uint32 newVal);
+uint32 sync_exchange(uint32* ptr, uint32 newVal);
+uint32 sync_add(uint32* ptr, int delta);
+
+void mutex_lock(Mutex* m);
+bool mutex_tryLock(Mutex* m);
+void mutex_unlock(Mutex* m);
+
+void condvar_wait(CondVar* cv, Mutex* m);
+void condvar_signal(CondVar* cv);
+void condvar_broadcast(CondVar* cv);
+
+void semaphore_init(Semaphore* s, uint32 count);
+void semaphore_wait(Semaphore* s);
+bool semaphore_tryWait(Semaphore* s);
+void semaphore_signal(Semaphore* s);
+
+#endif // LUPI_SYNC_H
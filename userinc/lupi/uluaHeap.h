@@ -2,6 +2,7 @@
 #define ULUAHEAP_H
 
 #include <stddef.h>
+#include <lupi/sync.h>
 
 typedef struct FreeCell FreeCell;
 typedef struct lua_State lua_State;
@@ -12,6 +13,7 @@ typedef struct Heap {
 	uint16 totalAllocs;
 	uint16 totalFrees;
 	lua_State** luaState; // Bottom bit also doubles as "no debug" flag
+	Mutex lock; // Threads' lua_States all share the process's heap
 } Heap;
 
 typedef struct HeapStats {
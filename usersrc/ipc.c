@@ -32,7 +32,9 @@ typedef struct IpcPage {
 #define KSharedPagesBase		0x0F000000u
 #define KSharedPagesSize		0x00100000u
 
-uintptr exec_newSharedPage();
+uintptr exec_newSharedPages(int numPages);
+int exec_grantSharedPages(void* ipcPage, uintptr pagesAndCount);
+int exec_checkSharedPages(void* ipcPage, uintptr pagesAndCount);
 int exec_connectToServer(uint32 server, void* ipcPage);
 int exec_completeIpcRequest(AsyncRequest* ipcRequest, bool toServer);
 void exec_requestServerMessage(AsyncRequest* serverRequest);
@@ -48,10 +50,11 @@ static int getSharedPage(lua_State* L) {
 }
 
 static int newSharedPage(lua_State* L) {
-	uintptr page = exec_newSharedPage();
-	if (!page) return luaL_error(L, "Couldn't get new shared page");
+	int numPages = luaL_optint(L, 1, 1);
+	uintptr page = exec_newSharedPages(numPages);
+	if (!page) return luaL_error(L, "Couldn't get %d new shared pages", numPages);
 
-	/*MemBuf* buf =*/ mbuf_new(L, (void*)page, KPageSize, NULL);
+	/*MemBuf* buf =*/ mbuf_new(L, (void*)page, numPages * KPageSize, NULL);
 	return 1;
 }
 
@@ -161,6 +164,22 @@ static int getMsgData(lua_State* L) {
 	return 2;
 }
 
+static int doGetGrantedPages(lua_State* L) {
+	IpcPage* p = checkPage(L, 1);
+	uintptr ptr = luaL_checkinteger(L, 2);
+	int numPages = luaL_checkint(L, 3);
+	// The kernel checks the range and alignment too, this is just so numPages can't spill into ptr
+	if (numPages < 1 || numPages >= KPageSize || (ptr & (KPageSize - 1))) {
+		return luaL_error(L, "Bad shared pages %p numPages=%d", (void*)ptr, numPages);
+	}
+	int err = exec_checkSharedPages(p, ptr | numPages);
+	if (err) {
+		return luaL_error(L, "Error %d checking shared pages %p", err, (void*)ptr);
+	}
+	mbuf_new(L, (void*)ptr, numPages * KPageSize, NULL);
+	return 1;
+}
+
 static int complete(lua_State* L) {
 	IpcMessage* msg = checkRequestMessage(L, 1);
 	int result = lua_tointeger(L, 2);
@@ -193,6 +212,18 @@ static int connectToServer(lua_State* L) {
 	return 2;
 }
 
+static int doGrantSharedPages(lua_State* L) {
+	IpcPage* ipcPage = checkPage(L, 1);
+	checkPage(L, 2);
+	MemBuf* buf = mbuf_checkbuf(L, 2);
+	int numPages = buf->len / KPageSize;
+	int err = exec_grantSharedPages(ipcPage, (uintptr)buf->ptr | numPages);
+	if (err) {
+		return luaL_error(L, "Error %d granting shared pages", err);
+	}
+	return 0;
+}
+
 static int doSendMsg(lua_State* L) {
 	// args: (msg, cmd, startOfData, len)
 	// The lua code passes us in the response message not the request like you might
@@ -222,6 +253,7 @@ int init_module_ipc(lua_State* L) {
 		{ "newSharedPage", newSharedPage },
 		{ "connectToServer", connectToServer },
 		{ "doSendMsg", doSendMsg },
+		{ "doGrantSharedPages", doGrantSharedPages },
 
 		// Server functions
 		{ "doCreateServer", doCreateServer },
@@ -229,10 +261,16 @@ int init_module_ipc(lua_State* L) {
 		{ "getSharedPage", getSharedPage },
 		{ "setupMsgsForClient", setupMsgsForClient },
 		{ "getMsgData", getMsgData },
+		{ "doGetGrantedPages", doGetGrantedPages },
 		{ "complete", complete },
 		{ NULL, NULL }
 	};
 	luaL_setfuncs(L, modFns, 0);
+	// So ipc.lua can work out where the message data goes
+	lua_pushinteger(L, offsetof(IpcPage, msgs));
+	lua_setfield(L, -2, "IpcPageHeaderSize");
+	lua_pushinteger(L, sizeof(IpcMessage));
+	lua_setfield(L, -2, "IpcMessageSize");
 
 	return 0;
 }
@@ -10,6 +10,7 @@
 #include <armv7-m.h>
 #endif
 #include <lupi/membuf.h>
+#include <lupi/exec.h>
 
 int memStats_lua(lua_State* L);
 
@@ -52,6 +53,53 @@ static int pageStats_getCounts(lua_State* L) {
 }
 #endif // HAVE_MMU
 
+#ifdef KTraceBufferAddress
+
+// Prints the trace buffer in the format expected by build/traceToChrome.lua
+static int traceDump_lua(lua_State* L) {
+	const uint32 maxEvents = KTraceBufferSize / sizeof(TraceEvent);
+	const TraceEvent* events = (const TraceEvent*)KTraceBufferAddress;
+	const uint32 count = TheSuperPage->traceCount;
+	const uint32 n = min(count, maxEvents);
+	for (int i = 0; i < TheSuperPage->numValidProcessPages; i++) {
+		printk("TRACEPROC %d %s\n", i, GetProcess(i)->name);
+	}
+	for (uint32 i = count - n; i != count; i++) {
+		const TraceEvent* e = &events[i & (maxEvents - 1)];
+		printk("TRACE %X %d %d %d %X %X\n", e->timestamp, e->type,
+			e->processIdx, e->threadIdx, e->arg1, e->arg2);
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static int traceEnable_lua(lua_State* L) {
+	lua_pushinteger(L, trace_setEnabled(lua_toboolean(L, 1)));
+	return 1;
+}
+
+#endif // KTraceBufferAddress
+
+#ifdef KProfileBufferAddress
+
+static int profileStart_lua(lua_State* L) {
+	lua_pushinteger(L, profiler_control(EProfilerStart, luaL_optint(L, 1, 1)));
+	return 1;
+}
+
+static int profileStop_lua(lua_State* L) {
+	lua_pushinteger(L, profiler_control(EProfilerStop, 0));
+	return 1;
+}
+
+// Unlike the exec, this dumps every process's samples unless given an index
+static int profileDump_lua(lua_State* L) {
+	lua_pushinteger(L, profiler_dump(luaL_optint(L, 1, -1)));
+	return 1;
+}
+
+#endif // KProfileBufferAddress
+
 static int switch_process_lua(lua_State* L) {
 	Process* p;
 	if (lua_isnumber(L, 1)) {
@@ -256,6 +304,18 @@ int init_module_kluadebugger(lua_State* L) {
 	MBUF_ENUM(Flag, NeedToSendTouchUp);
 	MBUF_ENUM(Flag, TrapAbort);
 	MBUF_ENUM(Flag, ExceptionOccurred);
+	MBUF_ENUM(Flag, TraceEnabled);
+
+#ifdef HAVE_PITFT
+	MBUF_TYPE(BlitDescriptor);
+	MBUF_MEMBER(BlitDescriptor, src);
+	MBUF_MEMBER(BlitDescriptor, stride);
+	MBUF_MEMBER(BlitDescriptor, rowBytes);
+	MBUF_MEMBER(BlitDescriptor, rowsToStage);
+	MBUF_MEMBER(BlitDescriptor, txPos);
+	MBUF_MEMBER(BlitDescriptor, txHalf);
+	MBUF_MEMBER(BlitDescriptor, stalled);
+#endif
 
 	MBUF_TYPE(SuperPage);
 	MBUF_MEMBER(SuperPage, totalRam);
@@ -268,16 +328,31 @@ int init_module_kluadebugger(lua_State* L) {
 	MBUF_MEMBER(SuperPage, currentProcess);
 	MBUF_MEMBER(SuperPage, currentThread);
 	MBUF_MEMBER(SuperPage, numValidProcessPages);
+#ifdef HAVE_MMU
+	MBUF_MEMBER(SuperPage, numPooledProcesses);
+#endif
 	MBUF_MEMBER(SuperPage, blockedUartReceiveIrqHandler);
 	MBUF_MEMBER(SuperPage, readyList);
 	MBUF_MEMBER_BITFIELD(SuperPage, flags, "Flag");
+	MBUF_MEMBER(SuperPage, accountedThread);
+	MBUF_MEMBER(SuperPage, lastAccountingTime);
+	MBUF_MEMBER(SuperPage, idleTime);
+#ifdef KTraceBufferAddress
+	MBUF_MEMBER(SuperPage, traceCount);
+#endif
+#ifdef KProfileBufferAddress
+	MBUF_MEMBER(SuperPage, profileCount);
+	MBUF_MEMBER(SuperPage, profileInterval);
+#endif
 	MBUF_MEMBER(SuperPage, screenFormat);
-	MBUF_MEMBER(SuperPage, numDfcsPending);
+	MBUF_MEMBER(SuperPage, dfcHighWater);
 	MBUF_MEMBER(SuperPage, marvin);
 	MBUF_MEMBER(SuperPage, uartDroppedChars);
 	MBUF_MEMBER_TYPE(SuperPage, uartRequest, "KAsyncRequest");
 	MBUF_MEMBER_TYPE(SuperPage, timerRequest, "KAsyncRequest");
 	MBUF_MEMBER(SuperPage, timerCompletionTime);
+	MBUF_MEMBER(SuperPage, sleepList);
+	MBUF_MEMBER(SuperPage, nextWakeTime);
 	MBUF_MEMBER_TYPE(SuperPage, crashRegisters, "regset");
 	MBUF_MEMBER(SuperPage, crashFar);
 	// TODO handle arrays...
@@ -287,10 +362,16 @@ int init_module_kluadebugger(lua_State* L) {
 #ifdef ARM
 	MBUF_MEMBER(SuperPage, rescheduleNeededOnSvcExit);
 	MBUF_MEMBER(SuperPage, svcPsrMode);
+	MBUF_MEMBER(SuperPage, rescheduleRequestTime);
+	MBUF_MEMBER(SuperPage, maxSchedulingLatency);
 #endif
 #ifdef ARMV7_M
 	MBUF_MEMBER(SuperPage, rescheduleNeededOnPendSvExit);
 #endif
+	MBUF_MEMBER(SuperPage, dfcHead);
+	MBUF_MEMBER(SuperPage, dfcTail);
+	MBUF_MEMBER(SuperPage, dfcsCoalesced);
+	MBUF_MEMBER(SuperPage, dfcsDropped);
 
 	// MBUF_MEMBER(SuperPage, needToSendTouchUp);
 	// dfcThread has to be declared after Thread
@@ -310,6 +391,15 @@ int init_module_kluadebugger(lua_State* L) {
 	MBUF_MEMBER(SuperPage, lastSvcTime);
 	MBUF_MEMBER(SuperPage, lastSvc);
 #endif
+#ifdef HAVE_PITFT
+	MBUF_MEMBER_TYPE(SuperPage, blitRequest, "KAsyncRequest");
+	MBUF_MEMBER_TYPE(SuperPage, blit, "BlitDescriptor");
+	MBUF_MEMBER(SuperPage, tscDeferred);
+#endif
+#ifdef HAVE_FRAMEBUFFER
+	MBUF_MEMBER(SuperPage, framebuffer);
+	MBUF_MEMBER(SuperPage, framebufferPitch);
+#endif
 #ifdef HAVE_AUDIO
 	MBUF_MEMBER(SuperPage, audioAddr);
 	MBUF_MEMBER(SuperPage, audioEnd);
@@ -324,15 +414,33 @@ int init_module_kluadebugger(lua_State* L) {
 	MBUF_ENUM(ThreadState, EDying);
 	MBUF_ENUM(ThreadState, EDead);
 	MBUF_ENUM(ThreadState, EWaitForRequest);
+	MBUF_ENUM(ThreadState, EWaitForFutex);
+	MBUF_ENUM(ThreadState, ESleeping);
 
 	MBUF_TYPE(Thread);
 	MBUF_MEMBER(Thread, prev);
 	MBUF_MEMBER(Thread, next);
+#ifndef LUPI_NO_SECTION0
+	MBUF_MEMBER(Thread, process);
+#endif
 	MBUF_MEMBER(Thread, index);
 	MBUF_MEMBER_TYPE(Thread, state, "ThreadState");
 	MBUF_MEMBER(Thread, timeslice);
 	MBUF_MEMBER(Thread, completedRequests);
+#ifdef HAVE_THREAD_PRIORITIES
+	MBUF_MEMBER(Thread, priority);
+	MBUF_MEMBER(Thread, basePriority);
+#endif
 	MBUF_MEMBER(Thread, exitReason);
+	MBUF_MEMBER(Thread, runTime);
+	MBUF_MEMBER(Thread, numSwitches);
+	MBUF_MEMBER(Thread, numSvcs);
+#ifdef ARMV7_M
+	MBUF_MEMBER(Thread, stackBase);
+#else
+	MBUF_MEMBER(Thread, stackSize);
+	MBUF_MEMBER(Thread, stackMapped);
+#endif
 #ifdef ARMV7_M
 	MBUF_MEMBER_TYPE(Thread, savedRegisters, "threadregset");
 #else
@@ -354,6 +462,16 @@ int init_module_kluadebugger(lua_State* L) {
 	MBUF_MEMBER(Process, numThreads);
 	MBUF_MEMBER_TYPE(Process, name, "char[]");
 	MBUF_MEMBER(Process, heapLimit);
+	MBUF_MEMBER(Process, exitedRunTime);
+	MBUF_MEMBER(Process, exitedNumSwitches);
+	MBUF_MEMBER(Process, exitedNumSvcs);
+	MBUF_MEMBER(Process, futexWaitList);
+	MBUF_MEMBER(Process, deadThreadList);
+#ifdef HAVE_MMU
+	MBUF_MEMBER(Process, numThreadPages);
+	MBUF_MEMBER(Process, pooled);
+	MBUF_MEMBER(Process, threads);
+#endif
 	//mbuf_declare_member(L, "Process", "firstThread", offsetof(Process, threads), sizeof(Thread), "Thread");
 
 	for (int i = 0; i < TheSuperPage->numValidProcessPages; i++) {
@@ -380,6 +498,7 @@ int init_module_kluadebugger(lua_State* L) {
 	MBUF_TYPE(PageAllocator);
 	MBUF_MEMBER(PageAllocator, numPages);
 	MBUF_MEMBER(PageAllocator, firstFreePage);
+	MBUF_MEMBER(PageAllocator, lock);
 	MBUF_NEW(PageAllocator, Al);
 	lua_setglobal(L, "Al");
 
@@ -402,6 +521,15 @@ int init_module_kluadebugger(lua_State* L) {
 	DECLARE_FN(L, switch_process_lua, "switch_process");
 	DECLARE_FN(L, processForThread_lua, "processForThread");
 	DECLARE_FN(L, memStats_lua, "memStats");
+#ifdef KTraceBufferAddress
+	DECLARE_FN(L, traceDump_lua, "traceDump");
+	DECLARE_FN(L, traceEnable_lua, "traceEnable");
+#endif
+#ifdef KProfileBufferAddress
+	DECLARE_FN(L, profileStart_lua, "profileStart");
+	DECLARE_FN(L, profileStop_lua, "profileStop");
+	DECLARE_FN(L, profileDump_lua, "profileDump");
+#endif
 
 	// Force out of line copies of a few inline fns so that they're callable
 	// via the symbol table should we want to
@@ -415,7 +543,9 @@ int init_module_kluadebugger(lua_State* L) {
 #endif
 
 	EXPORT_INT(L, USER_STACK_SIZE);
+#ifndef ARMV7_M
 	EXPORT_INT(L, USER_STACK_AREA_SHIFT);
+#endif
 	EXPORT_INT(L, KPageSize);
 	EXPORT_INT(L, MAX_PROCESSES);
 	EXPORT_INT(L, MAX_THREADS);
@@ -0,0 +1,399 @@
+#include <stddef.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lupi/sync.h>
+
+/**
+A Mailbox is a queue of messages between Lua states (and therefore threads) in
+the same process. Messages are deep copies of Lua values, serialised into a
+single allocation, so the sending and receiving states never touch each other's
+objects. The allocation comes from the process heap, which all the states share
+and which serialises allocations itself (see createThread() in ulua.c).
+
+Senders push onto `head` with sync_cmpxchg(), which is lock-free. The receiver
+takes the whole of `head` in one go, reverses it into arrival order in
+`pending`, and then consumes from that. Receivers are serialised by
+`receiveLock`, which is only ever contended if two states are receiving from the
+same mailbox. `count` is the number of messages in `head` and `pending`
+combined, and is what a receiver blocks on when the mailbox is empty.
+*/
+
+#define MailboxMetatable "LupiMailboxMt"
+#define KMaxDepth 32
+
+typedef struct Message {
+	struct Message* next;
+	uint32 size; // Of the whole allocation, including this header
+	uint32 numValues;
+	char data[];
+} Message;
+
+typedef struct Mailbox {
+	uint32 head; // Message*, most recently sent first
+	Message* pending; // Oldest first, protected by receiveLock
+	Mutex receiveLock;
+	Semaphore count;
+	uint32 refCount;
+	lua_Alloc allocFn;
+	void* allocUd;
+} Mailbox;
+
+enum {
+	ETagNil,
+	ETagFalse,
+	ETagTrue,
+	ETagInteger,
+	ETagNumber,
+	ETagString,
+	ETagLightUserdata,
+	ETagTable,
+	ETagTableEnd,
+};
+
+// User addresses always fit in 32 bits, even on AArch64
+#define MsgToWord(msg) ((uint32)(uintptr)(msg))
+#define WordToMsg(word) ((Message*)(uintptr)(word))
+
+static Mailbox* checkMailbox(lua_State* L, int idx) {
+	Mailbox** ref = (Mailbox**)luaL_checkudata(L, idx, MailboxMetatable);
+	if (!*ref) luaL_error(L, "Mailbox has been closed");
+	return *ref;
+}
+
+static void pushMailbox(lua_State* L, Mailbox* mb) {
+	Mailbox** ref = (Mailbox**)lua_newuserdata(L, sizeof(Mailbox*));
+	*ref = mb;
+	luaL_setmetatable(L, MailboxMetatable);
+}
+
+static void freeMessages(Mailbox* mb, Message* msg) {
+	while (msg) {
+		Message* next = msg->next;
+		mb->allocFn(mb->allocUd, msg, msg->size, 0);
+		msg = next;
+	}
+}
+
+static void releaseMailbox(Mailbox* mb) {
+	if (sync_add(&mb->refCount, -1) == 1) {
+		freeMessages(mb, mb->pending);
+		freeMessages(mb, WordToMsg(mb->head));
+		mb->allocFn(mb->allocUd, mb, sizeof(Mailbox), 0);
+	}
+}
+
+//////// Serialisation
+
+/**
+Encodes values into a message. This is called twice for each send, first with
+`buf` NULL to validate the values and work out the size, then again to actually
+write them. That way any error happens before anything has been allocated.
+*/
+typedef struct Encoder {
+	lua_State* L;
+	char* buf;
+	uint32 pos;
+} Encoder;
+
+static void put(Encoder* e, const void* data, uint32 len) {
+	if (e->buf) memcpy(e->buf + e->pos, data, len);
+	e->pos += len;
+}
+
+static void putTag(Encoder* e, char tag) {
+	put(e, &tag, 1);
+}
+
+static void encode(Encoder* e, int idx, int depth) {
+	lua_State* L = e->L;
+	idx = lua_absindex(L, idx);
+	int type = lua_type(L, idx);
+	switch (type) {
+		case LUA_TNIL:
+			putTag(e, ETagNil);
+			break;
+		case LUA_TBOOLEAN:
+			putTag(e, lua_toboolean(L, idx) ? ETagTrue : ETagFalse);
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, idx)) {
+				lua_Integer i = lua_tointeger(L, idx);
+				putTag(e, ETagInteger);
+				put(e, &i, sizeof(i));
+			} else {
+				lua_Number n = lua_tonumber(L, idx);
+				putTag(e, ETagNumber);
+				put(e, &n, sizeof(n));
+			}
+			break;
+		case LUA_TSTRING: {
+			size_t len;
+			const char* str = lua_tolstring(L, idx, &len);
+			uint32 len32 = len;
+			putTag(e, ETagString);
+			put(e, &len32, sizeof(len32));
+			put(e, str, len32);
+			break;
+		}
+		case LUA_TLIGHTUSERDATA: {
+			void* ptr = lua_touserdata(L, idx);
+			putTag(e, ETagLightUserdata);
+			put(e, &ptr, sizeof(ptr));
+			break;
+		}
+		case LUA_TTABLE:
+			if (depth == KMaxDepth) {
+				luaL_error(L, "Tables nested too deeply to send (cycles are not supported)");
+			}
+			if (lua_getmetatable(L, idx)) {
+				luaL_error(L, "Sending tables with metatables is not supported");
+			}
+			luaL_checkstack(L, 2, NULL);
+			putTag(e, ETagTable);
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0) {
+				encode(e, -2, depth + 1);
+				encode(e, -1, depth + 1);
+				lua_pop(L, 1);
+			}
+			putTag(e, ETagTableEnd);
+			break;
+		default:
+			luaL_error(L, "Type '%s' cannot be sent to a mailbox", lua_typename(L, type));
+	}
+}
+
+static const char* decode(lua_State* L, const char* ptr) {
+	luaL_checkstack(L, 3, NULL);
+	char tag = *ptr++;
+	switch (tag) {
+		case ETagNil:
+			lua_pushnil(L);
+			break;
+		case ETagFalse:
+		case ETagTrue:
+			lua_pushboolean(L, tag == ETagTrue);
+			break;
+		case ETagInteger: {
+			lua_Integer i;
+			memcpy(&i, ptr, sizeof(i));
+			ptr += sizeof(i);
+			lua_pushinteger(L, i);
+			break;
+		}
+		case ETagNumber: {
+			lua_Number n;
+			memcpy(&n, ptr, sizeof(n));
+			ptr += sizeof(n);
+			lua_pushnumber(L, n);
+			break;
+		}
+		case ETagString: {
+			uint32 len;
+			memcpy(&len, ptr, sizeof(len));
+			ptr += sizeof(len);
+			lua_pushlstring(L, ptr, len);
+			ptr += len;
+			break;
+		}
+		case ETagLightUserdata: {
+			void* p;
+			memcpy(&p, ptr, sizeof(p));
+			ptr += sizeof(p);
+			lua_pushlightuserdata(L, p);
+			break;
+		}
+		case ETagTable:
+			lua_newtable(L);
+			while (*ptr != ETagTableEnd) {
+				ptr = decode(L, ptr); // key
+				ptr = decode(L, ptr); // value
+				lua_rawset(L, -3);
+			}
+			ptr++;
+			break;
+	}
+	return ptr;
+}
+
+//////// Sending and receiving
+
+static void pushMessage(Mailbox* mb, Message* msg) {
+	uint32 old = mb->head;
+	for (;;) {
+		msg->next = WordToMsg(old);
+		uint32 seen = sync_cmpxchg(&mb->head, old, MsgToWord(msg));
+		if (seen == old) break;
+		old = seen;
+	}
+	semaphore_signal(&mb->count);
+}
+
+static Message* popMessage(Mailbox* mb, bool block) {
+	if (block) {
+		semaphore_wait(&mb->count);
+	} else if (!semaphore_tryWait(&mb->count)) {
+		return NULL;
+	}
+	mutex_lock(&mb->receiveLock);
+	if (!mb->pending) {
+		// Take everything that's been sent so far, and reverse it so the oldest
+		// is first. count guarantees there's at least one.
+		Message* msg = WordToMsg(sync_exchange(&mb->head, 0));
+		while (msg) {
+			Message* next = msg->next;
+			msg->next = mb->pending;
+			mb->pending = msg;
+			msg = next;
+		}
+	}
+	Message* result = mb->pending;
+	mb->pending = result->next;
+	mutex_unlock(&mb->receiveLock);
+	return result;
+}
+
+static int decodeMessage(lua_State* L) {
+	const Message* msg = (const Message*)lua_touserdata(L, 1);
+	lua_pop(L, 1);
+	const int n = msg->numValues;
+	luaL_checkstack(L, n, NULL);
+	const char* ptr = msg->data;
+	for (int i = 0; i < n; i++) {
+		ptr = decode(L, ptr);
+	}
+	return n;
+}
+
+static int pushMessageValues(lua_State* L, Mailbox* mb, Message* msg) {
+	// Decoding can run out of memory, and msg has to be freed either way
+	const int top = lua_gettop(L);
+	lua_pushcfunction(L, decodeMessage);
+	lua_pushlightuserdata(L, msg);
+	const int err = lua_pcall(L, 1, LUA_MULTRET, 0);
+	mb->allocFn(mb->allocUd, msg, msg->size, 0);
+	if (err) lua_error(L);
+	return lua_gettop(L) - top;
+}
+
+//////// Lua API
+
+static int newMailbox(lua_State* L) {
+	void* ud;
+	lua_Alloc allocFn = lua_getallocf(L, &ud);
+	Mailbox* mb = (Mailbox*)allocFn(ud, NULL, 0, sizeof(Mailbox));
+	if (!mb) return luaL_error(L, "Out of memory allocating mailbox");
+	memset(mb, 0, sizeof(Mailbox));
+	mb->refCount = 1;
+	mb->allocFn = allocFn;
+	mb->allocUd = ud;
+	pushMailbox(L, mb);
+	return 1;
+}
+
+static int handle(lua_State* L) {
+	Mailbox* mb = checkMailbox(L, 1);
+	sync_add(&mb->refCount, 1);
+	lua_pushlightuserdata(L, mb);
+	return 1;
+}
+
+static int openMailbox(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	Mailbox* mb = (Mailbox*)lua_touserdata(L, 1);
+	// The handle's reference stays with the handle, until releaseHandle()
+	sync_add(&mb->refCount, 1);
+	pushMailbox(L, mb);
+	return 1;
+}
+
+static int releaseHandle(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	releaseMailbox((Mailbox*)lua_touserdata(L, 1));
+	return 0;
+}
+
+static int sendMsg(lua_State* L) {
+	Mailbox* mb = checkMailbox(L, 1);
+	const int n = lua_gettop(L);
+	Encoder e = { .L = L, .buf = NULL, .pos = 0 };
+	for (int i = 2; i <= n; i++) {
+		encode(&e, i, 0);
+	}
+	const uint32 size = sizeof(Message) + e.pos;
+	Message* msg = (Message*)mb->allocFn(mb->allocUd, NULL, 0, size);
+	if (!msg) return luaL_error(L, "Out of memory allocating %d byte message", size);
+	msg->size = size;
+	msg->numValues = n - 1;
+	e.buf = msg->data;
+	e.pos = 0;
+	for (int i = 2; i <= n; i++) {
+		encode(&e, i, 0);
+	}
+	pushMessage(mb, msg);
+	return 0;
+}
+
+static int receive(lua_State* L) {
+	Mailbox* mb = checkMailbox(L, 1);
+	Message* msg = popMessage(mb, true);
+	return pushMessageValues(L, mb, msg);
+}
+
+static int tryReceive(lua_State* L) {
+	Mailbox* mb = checkMailbox(L, 1);
+	Message* msg = popMessage(mb, false);
+	lua_pushboolean(L, msg != NULL);
+	if (!msg) return 1;
+	return 1 + pushMessageValues(L, mb, msg);
+}
+
+static int count(lua_State* L) {
+	Mailbox* mb = checkMailbox(L, 1);
+	lua_pushinteger(L, *(volatile uint32*)&mb->count.count);
+	return 1;
+}
+
+static int closeMailbox(lua_State* L) {
+	Mailbox** ref = (Mailbox**)luaL_checkudata(L, 1, MailboxMetatable);
+	if (*ref) {
+		releaseMailbox(*ref);
+		*ref = NULL;
+	}
+	return 0;
+}
+
+static int tostring(lua_State* L) {
+	Mailbox** ref = (Mailbox**)luaL_checkudata(L, 1, MailboxMetatable);
+	lua_pushfstring(L, "Mailbox %p", *ref);
+	return 1;
+}
+
+int init_module_mailbox(lua_State* L) {
+	luaL_Reg fns[] = {
+		{ "new", newMailbox },
+		{ "open", openMailbox },
+		{ "release", releaseHandle },
+		{ NULL, NULL }
+	};
+	luaL_setfuncs(L, fns, 0);
+
+	luaL_newmetatable(L, MailboxMetatable);
+	luaL_Reg mbFns[] = {
+		{ "handle", handle },
+		{ "send", sendMsg },
+		{ "receive", receive },
+		{ "tryReceive", tryReceive },
+		{ "count", count },
+		{ "close", closeMailbox },
+		{ "__gc", closeMailbox },
+		{ "__tostring", tostring },
+		{ NULL, NULL }
+	};
+	luaL_setfuncs(L, mbFns, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_setfield(L, -2, "Mailbox");
+	return 0;
+}
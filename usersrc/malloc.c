@@ -1809,13 +1809,17 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
 #else
 #if USE_LOCKS > 1
 /* -----------------------  User-defined locks ------------------------ */
-/* Define your own lock implementation here */
-/* #define INITIAL_LOCK(lk)  ... */
-/* #define DESTROY_LOCK(lk)  ... */
-/* #define ACQUIRE_LOCK(lk)  ... */
-/* #define RELEASE_LOCK(lk)  ... */
-/* #define TRY_LOCK(lk) ... */
-/* static MLOCK_T malloc_global_mutex = ... */
+/* LuPi: threads in a process share the heap. The futex-based Mutex blocks
+   rather than spinning, so a high priority thread can't starve a lower
+   priority one that holds the lock. */
+#include <lupi/sync.h>
+#define MLOCK_T               Mutex
+#define INITIAL_LOCK(lk)      ((lk)->state = 0, 0)
+#define DESTROY_LOCK(lk)      (0)
+#define ACQUIRE_LOCK(lk)      (mutex_lock(lk), 0)
+#define RELEASE_LOCK(lk)      mutex_unlock(lk)
+#define TRY_LOCK(lk)          mutex_tryLock(lk)
+static MLOCK_T malloc_global_mutex = { 0 };
 
 #elif USE_SPIN_LOCKS
 
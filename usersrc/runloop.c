@@ -5,6 +5,7 @@
 #include <lauxlib.h>
 
 extern int exec_waitForAnyRequest();
+extern int exec_waitForAnyRequestTimeout(int ms);
 
 #define AsyncRequestMetatable "LupiAsyncRequestMt"
 
@@ -59,7 +60,12 @@ void runloop_newIndirectAsyncRequest(lua_State* L, AsyncRequest* req) {
 }
 
 static int wfar(lua_State* L) {
-	int numRequests = exec_waitForAnyRequest();
+	int numRequests;
+	if (lua_isnoneornil(L, 2)) {
+		numRequests = exec_waitForAnyRequest();
+	} else {
+		numRequests = exec_waitForAnyRequestTimeout(luaL_checkint(L, 2));
+	}
 	lua_pushinteger(L, numRequests);
 	return 1;
 }
@@ -0,0 +1,173 @@
+#include <stddef.h>
+#include <lupi/sync.h>
+
+#define KWakeAll 0x7FFFFFFF
+
+/**
+Atomically compares `*ptr` with `expected` and if they are equal sets `*ptr` to
+`newVal`. Returns the value that was previously at `ptr`, so the swap happened
+if and only if the return value equals `expected`.
+
+On ARMv6 this is a restartable atomic sequence rather than using LDREX/STREX:
+if the thread is preempted anywhere between `sync_rasStart` and `sync_rasEnd`,
+the kernel restarts it from `sync_rasStart` (see restartAtomicSequence() in
+k/scheduler_arm.c). Nothing else may be added to the sequence without checking
+that it is still safe to rerun from the start.
+*/
+uint32 NAKED sync_cmpxchg(uint32* ptr, uint32 expected, uint32 newVal) {
+#if defined(AARCH64)
+	asm("1:");
+	asm("LDAXR w3, [x0]");
+	asm("CMP w3, w1");
+	asm("B.NE 2f");
+	asm("STLXR w4, w2, [x0]");
+	asm("CBNZ w4, 1b");
+	asm("MOV w0, w3");
+	asm("RET");
+	asm("2:");
+	asm("CLREX");
+	asm("MOV w0, w3");
+	asm("RET");
+#elif defined(THUMB2)
+	asm("1:");
+	asm("LDREX r3, [r0]");
+	asm("CMP r3, r1");
+	asm("BNE 2f");
+	asm("STREX r12, r2, [r0]");
+	asm("CMP r12, #0");
+	asm("BNE 1b");
+	asm("MOV r0, r3");
+	asm("BX lr");
+	asm("2:");
+	asm("CLREX");
+	asm("MOV r0, r3");
+	asm("BX lr");
+#else
+	asm(".global sync_rasStart");
+	asm("sync_rasStart:");
+	asm("LDR r3, [r0]");
+	asm("CMP r3, r1");
+	asm("STREQ r2, [r0]");
+	asm(".global sync_rasEnd");
+	asm("sync_rasEnd:");
+	asm("MOV r0, r3");
+	asm("BX lr");
+#endif
+}
+
+/**
+Atomically sets `*ptr` to `newVal` and returns the previous value.
+*/
+uint32 sync_exchange(uint32* ptr, uint32 newVal) {
+	uint32 old = *(volatile uint32*)ptr;
+	for (;;) {
+		uint32 seen = sync_cmpxchg(ptr, old, newVal);
+		if (seen == old) return old;
+		old = seen;
+	}
+}
+
+/**
+Atomically adds `delta` to `*ptr` and returns the previous value.
+*/
+uint32 sync_add(uint32* ptr, int delta) {
+	uint32 old = *(volatile uint32*)ptr;
+	for (;;) {
+		uint32 seen = sync_cmpxchg(ptr, old, old + delta);
+		if (seen == old) return old;
+		old = seen;
+	}
+}
+
+/**
+This is the three-state mutex from Ulrich Drepper's "Futexes Are Tricky". An
+uncontended lock and unlock is one sync_cmpxchg() each. Once a thread has had
+to wait, the state stays at 2 until the mutex is next unlocked, so the unlocker
+knows it has to make the wake exec.
+*/
+void mutex_lock(Mutex* m) {
+	uint32 c = sync_cmpxchg(&m->state, 0, 1);
+	if (c == 0) return;
+
+	if (c != 2) c = sync_exchange(&m->state, 2);
+	while (c != 0) {
+		exec_futexWait(&m->state, 2);
+		c = sync_exchange(&m->state, 2);
+	}
+}
+
+bool mutex_tryLock(Mutex* m) {
+	return sync_cmpxchg(&m->state, 0, 1) == 0;
+}
+
+void mutex_unlock(Mutex* m) {
+	if (sync_exchange(&m->state, 0) == 2) {
+		exec_futexWake(&m->state, 1);
+	}
+}
+
+/**
+Must be called with `m` locked. Unlocks it, waits for condvar_signal() or
+condvar_broadcast() to be called, then relocks it before returning. As with
+pthreads, wakeups can be spurious so the caller should always recheck whatever
+condition it is waiting for.
+*/
+void condvar_wait(CondVar* cv, Mutex* m) {
+	sync_add(&cv->numWaiters, 1);
+	uint32 seq = *(volatile uint32*)&cv->seq;
+	mutex_unlock(m);
+	// If anyone signals after we read seq, this will return immediately
+	exec_futexWait(&cv->seq, seq);
+	sync_add(&cv->numWaiters, -1);
+
+	// We don't know if anyone else is waiting on m, so we have to assume they
+	// are and lock it in state 2
+	while (sync_exchange(&m->state, 2) != 0) {
+		exec_futexWait(&m->state, 2);
+	}
+}
+
+void condvar_signal(CondVar* cv) {
+	sync_add(&cv->seq, 1);
+	if (*(volatile uint32*)&cv->numWaiters) {
+		exec_futexWake(&cv->seq, 1);
+	}
+}
+
+void condvar_broadcast(CondVar* cv) {
+	sync_add(&cv->seq, 1);
+	if (*(volatile uint32*)&cv->numWaiters) {
+		exec_futexWake(&cv->seq, KWakeAll);
+	}
+}
+
+void semaphore_init(Semaphore* s, uint32 count) {
+	s->count = count;
+	s->numWaiters = 0;
+}
+
+bool semaphore_tryWait(Semaphore* s) {
+	uint32 c = *(volatile uint32*)&s->count;
+	while (c) {
+		uint32 seen = sync_cmpxchg(&s->count, c, c - 1);
+		if (seen == c) return true;
+		c = seen;
+	}
+	return false;
+}
+
+void semaphore_wait(Semaphore* s) {
+	while (!semaphore_tryWait(s)) {
+		sync_add(&s->numWaiters, 1);
+		// Returns immediately if count is no longer zero
+		exec_futexWait(&s->count, 0);
+		sync_add(&s->numWaiters, -1);
+	}
+}
+
+void semaphore_signal(Semaphore* s) {
+	sync_add(&s->count, 1);
+	if (*(volatile uint32*)&s->numWaiters) {
+		exec_futexWake(&s->count, 1);
+	}
+}
@@ -112,12 +112,20 @@ void NAKED exec_threadYield() {
 	SLOW_EXEC(KExecThreadYield);
 }
 
-int NAKED exec_threadCreate(void* newThreadState) {
-	SLOW_EXEC1(KExecThreadCreate);
+int NAKED exec_threadCreate(void* newThreadState, uint32 stackSize) {
+	SLOW_EXEC2(KExecThreadCreate);
 }
 
-uintptr NAKED exec_newSharedPage() {
-	SLOW_EXEC(KExecNewSharedPage);
+uintptr NAKED exec_newSharedPages(int numPages) {
+	SLOW_EXEC1(KExecNewSharedPage);
+}
+
+int NAKED exec_grantSharedPages(void* ipcPage, uintptr pagesAndCount) {
+	SLOW_EXEC2(KExecGrantSharedPages);
+}
+
+int NAKED exec_checkSharedPages(void* ipcPage, uintptr pagesAndCount) {
+	SLOW_EXEC2(KExecCheckSharedPages);
 }
 
 int NAKED exec_createServer(uint32 serverId) {
@@ -148,6 +156,38 @@ const char* NAKED exec_getString(ExecGettableValue val) {
 	SLOW_EXEC1(KExecGetString);
 }
 
+int NAKED exec_traceControl(bool enable) {
+	SLOW_EXEC1(KExecTraceControl);
+}
+
+int NAKED exec_profilerControl(ProfilerCommand cmd, uintptr arg) {
+	SLOW_EXEC2(KExecProfilerControl);
+}
+
+int NAKED exec_getCpuStats(ExecCpuStats* buf, int maxRecords) {
+	SLOW_EXEC2(KExecGetCpuStats);
+}
+
+int NAKED exec_futexWait(uint32* addr, uint32 expected) {
+	SLOW_EXEC2(KExecFutexWait);
+}
+
+int NAKED exec_futexWake(uint32* addr, int count) {
+	SLOW_EXEC2(KExecFutexWake);
+}
+
+int NAKED exec_setThreadPriority(int priority) {
+	SLOW_EXEC1(KExecSetThreadPriority);
+}
+
+void NAKED exec_sleep(int ms) {
+	SLOW_EXEC1(KExecSleep);
+}
+
+int NAKED exec_waitForAnyRequestTimeout(int ms) {
+	SLOW_EXEC1(KExecWaitForAnyRequestTimeout);
+}
+
 int NAKED exec_driverConnect(uint32 driverId) {
 	SLOW_EXEC1(KExecDriverConnect);
 }
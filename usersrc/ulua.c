@@ -41,13 +41,18 @@ void exec_reboot();
 int exec_getInt(ExecGettableValue val);
 const char* exec_getString(ExecGettableValue val);
 void exec_threadYield();
-int exec_threadCreate(void* newThreadState);
+int exec_threadCreate(void* newThreadState, uint32 stackSize);
 void exec_threadExit(int reason);
 int exec_driverConnect(uint32 driverId);
 int exec_driverCmd(uint32 driverHandle, uint32 arg1, uint32 arg2);
 void exec_supressKernelDebug(bool suppress);
 int exec_waitForAnyRequest();
 int exec_replaceProcess(const char* name);
+int exec_traceControl(bool enable);
+int exec_profilerControl(ProfilerCommand cmd, uintptr arg);
+int exec_getCpuStats(ExecCpuStats* buf, int maxRecords);
+int exec_setThreadPriority(int priority);
+void exec_sleep(int ms);
 
 uint32 user_ProcessPid;
 char user_ProcessName[32];
@@ -143,6 +148,8 @@ static const char* KGetIntEnums[] = {
 	"ScreenHeight",
 	"ScreenFormat",
 	"Version",
+	"MaxSchedulingLatency",
+	"MaxThreads",
 	NULL // Must be last
 };
 
@@ -178,6 +185,24 @@ static int yield_lua(lua_State* L) {
 	return 0;
 }
 
+// Returns the previous priority, or nothing if the platform doesn't do priorities
+static int setThreadPriority_lua(lua_State* L) {
+	int priority = luaL_checkint(L, 1);
+	int ret = exec_setThreadPriority(priority);
+	if (ret == KErrNotSupported) return 0;
+	if (ret < 0) {
+		return luaL_error(L, "Bad thread priority %d, must be %d-%d", priority,
+			KThreadPriorityLowest, KThreadPriorityHighest);
+	}
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+static int sleep_lua(lua_State* L) {
+	exec_sleep(luaL_checkint(L, 1));
+	return 0;
+}
+
 static int panicFn(lua_State* L) {
 	const char* str = lua_tostring(L, lua_gettop(L));
 	lupi_printstring("\nLua panic:\n");
@@ -227,7 +252,80 @@ static int stfu(lua_State* L) {
 	return 0;
 }
 
+static int setTraceEnabled(lua_State* L) {
+	int ret = exec_traceControl(lua_toboolean(L, 1));
+	if (ret < 0) {
+		return luaL_error(L, "Tracing not supported (err=%d)", ret);
+	}
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int profilerCommand(lua_State* L, ProfilerCommand cmd, uintptr arg) {
+	int ret = exec_profilerControl(cmd, arg);
+	if (ret < 0) {
+		return luaL_error(L, "Profiler command %d failed with %d", cmd, ret);
+	}
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+static int profilerStart(lua_State* L) {
+	return profilerCommand(L, EProfilerStart, luaL_optint(L, 1, 1));
+}
+
+static int profilerStop(lua_State* L) {
+	return profilerCommand(L, EProfilerStop, 0);
+}
+
+static int profilerDump(lua_State* L) {
+	return profilerCommand(L, EProfilerDump, 0);
+}
+
+#define SET_INT(L, name, val) lua_pushinteger(L, val); lua_setfield(L, -2, name);
+
+static int getCpuStats(lua_State* L) {
+	int maxRecords = 16;
+	ExecCpuStats* buf;
+	int n;
+	for (;;) {
+		buf = (ExecCpuStats*)lua_newuserdata(L, maxRecords * sizeof(ExecCpuStats));
+		n = exec_getCpuStats(buf, maxRecords);
+		if (n < 0) {
+			return luaL_error(L, "KExecGetCpuStats failed with %d", n);
+		}
+		if (n <= maxRecords) break;
+		// Leave some room in case more threads are created before we retry
+		lua_pop(L, 1);
+		maxRecords = n + 4;
+	}
+
+	lua_createtable(L, n, 0);
+	for (int i = 0; i < n; i++) {
+		const ExecCpuStats* rec = &buf[i];
+		lua_createtable(L, 0, 8);
+		lua_pushstring(L, rec->name);
+		lua_setfield(L, -2, "name");
+		if (rec->processIdx != KCpuStatsNoProcess) {
+			SET_INT(L, "process", rec->processIdx);
+			SET_INT(L, "pid", rec->pid);
+		}
+		if (rec->threadIdx != KCpuStatsProcessTotal) {
+			SET_INT(L, "thread", rec->threadIdx);
+			SET_INT(L, "state", rec->state);
+			SET_INT(L, "priority", rec->priority);
+		}
+		// Lua integers are only 32 bits, so use ms (good for 24 days)
+		SET_INT(L, "runTime", (lua_Integer)(rec->runTime / 1000));
+		SET_INT(L, "switches", rec->numSwitches);
+		SET_INT(L, "svcs", rec->numSvcs);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
 static int threadCreate_lua(lua_State* L);
+static int threadCreateWithStackSize_lua(lua_State* L);
 void ulua_openLibs(lua_State* L);
 void ulua_setupGlobals(lua_State* L);
 
@@ -235,8 +333,6 @@ lua_State* newLuaStateForModule(const char* moduleName, lua_State* L);
 int traceback_lua(lua_State* L);
 int memStats_lua(lua_State* L);
 
-#define SET_INT(L, name, val) lua_pushinteger(L, val); lua_setfield(L, -2, name);
-
 int newProcessEntryPoint() {
 
 	//uint32 superPage = *(uint32*)0xF802E000; // This should fail with far=F802E000
@@ -304,15 +400,23 @@ void ulua_setupGlobals(lua_State* L) {
 		{ "createProcess", createProcess },
 		{ "replaceProcess", replaceProcess },
 		{ "createThread", threadCreate_lua },
+		{ "createThreadWithStackSize", threadCreateWithStackSize_lua },
 		{ "getUptime", getUptime },
 		{ "getInt", getInt },
 		{ "getString", getString },
 		{ "yield", yield_lua },
+		{ "setThreadPriority", setThreadPriority_lua },
+		{ "sleep", sleep_lua },
 		{ "getch_async", getch_async },
 		{ "memStats", memStats_lua },
 		{ "driverConnect", driverConnect_lua },
 		{ "driverCmd", driverCmd_lua },
 		{ "suppressPrints", stfu },
+		{ "setTraceEnabled", setTraceEnabled },
+		{ "profilerStart", profilerStart },
+		{ "profilerStop", profilerStop },
+		{ "profilerDump", profilerDump },
+		{ "getCpuStats", getCpuStats },
 		{ NULL, NULL }
 	};
 	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
@@ -335,24 +439,51 @@ void ulua_setupGlobals(lua_State* L) {
 
 static void copyArg(lua_State* oldL, int arg, lua_State* newL);
 
-static int threadCreate_lua(lua_State* L) {
-	// Create a new state sharing the same malloc but nothing else and pass it
-	// to the thread create - it will be passed back to newThreadEntryPoint
+static int createThread(lua_State* L, int fnIdx, uint32 stackSize) {
+	// Create a new state sharing the same heap but nothing else and pass it
+	// to the thread create - it will be passed back to newThreadEntryPoint.
+	// Both malloc and uluaHeap lock themselves, so the threads can use the
+	// heap concurrently.
 
 	// Args are a single function (which must have no upvalues) and any number
 	// of arguments, which will be deep copied into the new Lua state
-	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_checktype(L, fnIdx, LUA_TFUNCTION);
 
+#ifdef MALLOC_AVAILABLE
 	lua_State* newL = newLuaStateForModule(NULL, NULL);
+#else
+	void* ud;
+	lua_Alloc allocFn = lua_getallocf(L, &ud);
+	lua_State* newL = lua_newstate(allocFn, ud);
+	if (!newL) return luaL_error(L, "Out of memory creating thread");
+	ulua_openLibs(newL);
+	lua_atpanic(newL, panicFn);
+	newLuaStateForModule(NULL, newL);
+#endif
 
 	const int n = lua_gettop(L);
-	for (int i = 1; i <= n; i++) {
+	for (int i = fnIdx; i <= n; i++) {
 		copyArg(L, i, newL);
 	}
-	exec_threadCreate(newL);
+	int err = exec_threadCreate(newL, stackSize);
+	if (err) {
+		lua_close(newL);
+		return luaL_error(L, "Error %d creating thread", err);
+	}
 	return 0;
 }
 
+static int threadCreate_lua(lua_State* L) {
+	return createThread(L, 1, 0);
+}
+
+// lupi.createThreadWithStackSize(stackSize, fn, ...)
+static int threadCreateWithStackSize_lua(lua_State* L) {
+	lua_Integer stackSize = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, stackSize > 0, 1, "stackSize must be positive");
+	return createThread(L, 2, (uint32)stackSize);
+}
+
 static int dumpToBuf(lua_State* oldL, const void* p, size_t sz, void* ud) {
 	luaL_addlstring((luaL_Buffer*)ud, (const char*)p, sz);
 	return 0;
@@ -401,7 +532,7 @@ static void copyArg(lua_State* oldL, int arg, lua_State* newL) {
 		}
 		case LUA_TFUNCTION: {
 			// We expect exactly one upvalue, being _ENV
-			const char* upvalueName = lua_getupvalue(oldL, 1, 2);
+			const char* upvalueName = lua_getupvalue(oldL, arg, 2);
 			if (upvalueName) {
 				luaL_error(oldL, "function passed to threadCreate cannot have any upvalues (except _ENV), like '%s'", upvalueName);
 			}
@@ -26,6 +26,9 @@ kernel.
 
 The free list is kept in address order, so that free cells can be coelesced
 whenever a cell is freed.
+
+Every thread's `lua_State` in a process uses the same heap, so the public
+functions hold `h->lock` for as long as they're looking at the free list.
 */
 
 
@@ -77,6 +80,28 @@ ASSERT_COMPILE(sizeof(FreeCell) == 8);
 #define setLen(fc, len) (fc)->__len = (len)
 #define getLen(fc) ((fc)->__len)
 
+// Caller must hold h->lock
+static void doStats(Heap* h, HeapStats* stats) {
+	memset(stats, 0, sizeof(HeapStats));
+	stats->totalAllocs = h->totalAllocs;
+	stats->totalFrees = h->totalFrees;
+	for (FreeCell* fc = h->freeList; fc != NULL; fc = getNext(fc)) {
+		stats->freeSpace += getLen(fc);
+		stats->numFreeCells++;
+		if (getLen(fc) > stats->largestFreeCell) stats->largestFreeCell = getLen(fc);
+	}
+	stats->used = (uintptr)sbrk(0) - (uintptr)h;
+	stats->alloced = stats->used - stats->freeSpace - sizeof(Heap);
+}
+
+#define MEMSTAT_PRINT(fmt, args...) printf(fmt "\n", args)
+
+static void printStats(const HeapStats* stats) {
+	MEMSTAT_PRINT("total counts: allocs = %d frees = %d", stats->totalAllocs, stats->totalFrees);
+	MEMSTAT_PRINT("free: cells = %d space = %d largestCell = %d", stats->numFreeCells, stats->freeSpace, stats->largestFreeCell);
+	MEMSTAT_PRINT("used: alloced = %d total = %d", stats->alloced, stats->used);
+}
+
 #ifdef DEBUG_LOGGING
 static void dumpFreeList(Heap* h) {
 	for (FreeCell* fc = h->freeList; fc != NULL; fc = getNext(fc)) {
@@ -109,6 +134,7 @@ void* uluaHeap_init() {
 	setLen(h->topCell, (uintptr)h + 4096 - (uintptr)h->topCell);
 	h->freeList = h->topCell;
 	h->luaState = NULL;
+	h->lock.state = 0;
 
 	DBG(h, "Heap init %p\n", h);
 	return h;
@@ -155,12 +181,11 @@ static void addToFreeList(Heap* h, FreeCell* cell) {
 	}
 }
 
-void* uluaHeap_allocFn(void *ud, void *ptr, size_t osize, size_t nsize) {
+static void* doAlloc(Heap* h, void *ptr, size_t osize, size_t nsize) {
 	// We always return 8-byte aligned pointers and sizes whatever Lua thinks internally
 	nsize = (nsize + 7) & ~7;
 	osize = (osize + 7) & ~7;
 
-	Heap* h = (Heap*)ud;
 	if (nsize == 0) {
 		if (ptr) {
 			DBGV(h, "Freeing %p len %ld\n", ptr, osize);
@@ -185,10 +210,10 @@ void* uluaHeap_allocFn(void *ud, void *ptr, size_t osize, size_t nsize) {
 			return ptr;
 		} else {
 			// Grow - for now assume we can never do in place
-			void* newCell = uluaHeap_allocFn(h, NULL, 0, nsize); // alloc
+			void* newCell = doAlloc(h, NULL, 0, nsize); // alloc
 			if (newCell) {
 				memcpy(newCell, ptr, osize);
-				uluaHeap_allocFn(h, ptr, osize, 0); // free
+				doAlloc(h, ptr, osize, 0); // free
 				return newCell;
 			} else {
 				return NULL;
@@ -259,15 +284,17 @@ void* uluaHeap_allocFn(void *ud, void *ptr, size_t osize, size_t nsize) {
 #ifdef DEBUG_LOGGING
 		// OOM - dump some stats
 		DBG(h, "Failed alloc for %ld\n", nsize);
-		// The lua_State arg is not used if DEBUG_LOGGING, so can be NULL
-		memStats_lua(NULL);
+		// We already hold h->lock, so don't go via uluaHeap_stats()
+		HeapStats stats;
+		doStats(h, &stats);
+		printStats(&stats);
 		// dumpFreeList(h); // Full dump of freelist
 		// Enable this to stop at a particularly large alloc
 #if 0
 		if ((uintptr)h->luaState > 1 && nsize > 1000) {
 			lua_State* L = *(lua_State**)((uintptr)h->luaState & ~1);
 			// Free it to get some space for the traceback
-			uluaHeap_allocFn(h, h->luaState, 1024, 0);
+			doAlloc(h, h->luaState, 1024, 0);
 			h->luaState = NULL;
 			// Try and get a stacktrace
 			luaL_traceback(L, L, NULL, 1);
@@ -306,18 +333,18 @@ void* uluaHeap_allocFn(void *ud, void *ptr, size_t osize, size_t nsize) {
 	return result;
 }
 
+void* uluaHeap_allocFn(void *ud, void *ptr, size_t osize, size_t nsize) {
+	Heap* h = (Heap*)ud;
+	mutex_lock(&h->lock);
+	void* result = doAlloc(h, ptr, osize, nsize);
+	mutex_unlock(&h->lock);
+	return result;
+}
+
 void uluaHeap_stats(Heap* h, HeapStats* stats) {
-	memset(stats, 0, sizeof(HeapStats));
-	stats->totalAllocs = h->totalAllocs;
-	stats->totalFrees = h->totalFrees;
-	for (FreeCell* fc = h->freeList; fc != NULL; fc = getNext(fc)) {
-		stats->freeSpace += getLen(fc);
-		stats->numFreeCells++;
-		if (getLen(fc) > stats->largestFreeCell) stats->largestFreeCell = getLen(fc);
-	}
-	uintptr top = (uintptr)sbrk(0);
-	stats->used = top - (uintptr)h;
-	stats->alloced = stats->used - stats->freeSpace - sizeof(Heap);
+	mutex_lock(&h->lock);
+	doStats(h, stats);
+	mutex_unlock(&h->lock);
 }
 
 void uluaHeap_reset(Heap* h) {
@@ -332,17 +359,12 @@ void uluaHeap_reset(Heap* h) {
 	DBG(h, "Heap reset %p\n", h);
 }
 
-#define MEMSTAT_PRINT(fmt, args...) printf(fmt "\n", args)
-
 int memStats_lua(lua_State* L) {
 	Heap* h = (Heap*)0x20070000;
 
 	HeapStats stats;
 	uluaHeap_stats(h, &stats);
-
-	MEMSTAT_PRINT("total counts: allocs = %d frees = %d", stats.totalAllocs, stats.totalFrees);
-	MEMSTAT_PRINT("free: cells = %d space = %d largestCell = %d", stats.numFreeCells, stats.freeSpace, stats.largestFreeCell);
-	MEMSTAT_PRINT("used: alloced = %d total = %d", stats.alloced, stats.used);
+	printStats(&stats);
 	if (L) {
 		int luaAlloced = lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
 		MEMSTAT_PRINT("Lua: alloced = %d", luaAlloced);